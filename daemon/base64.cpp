@@ -0,0 +1,181 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the base64 encoding.
+ *
+ * The communicatord messages are text. Small files sent inline in an
+ * RFS_FILE_CHANGED message are encoded using the standard base64
+ * alphabet (RFC 4648) with padding.
+ */
+
+// self
+//
+#include    "base64.h"
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+namespace
+{
+
+
+char const g_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+int decode_char(char c)
+{
+    if(c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if(c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0' + 52;
+    }
+    if(c == '+')
+    {
+        return 62;
+    }
+    if(c == '/')
+    {
+        return 63;
+    }
+    return -1;
+}
+
+
+} // no name namespace
+
+
+
+std::string base64_encode(std::string const & data)
+{
+    std::string result;
+    result.reserve((data.length() + 2) / 3 * 4);
+
+    std::size_t const max(data.length());
+    for(std::size_t i(0); i < max; i += 3)
+    {
+        std::uint32_t v(static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[i])) << 16);
+        if(i + 1 < max)
+        {
+            v |= static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[i + 1])) << 8;
+        }
+        if(i + 2 < max)
+        {
+            v |= static_cast<std::uint8_t>(data[i + 2]);
+        }
+        result += g_alphabet[(v >> 18) & 0x3F];
+        result += g_alphabet[(v >> 12) & 0x3F];
+        result += i + 1 < max ? g_alphabet[(v >> 6) & 0x3F] : '=';
+        result += i + 2 < max ? g_alphabet[v & 0x3F] : '=';
+    }
+
+    return result;
+}
+
+
+/** \brief Decode a base64 string.
+ *
+ * \param[in] encoded  The base64 string, including the padding.
+ * \param[out] data  The decoded data.
+ *
+ * \return false if \p encoded is not valid base64.
+ */
+bool base64_decode(std::string const & encoded, std::string & data)
+{
+    data.clear();
+    if(encoded.length() % 4 != 0)
+    {
+        return false;
+    }
+    data.reserve(encoded.length() / 4 * 3);
+
+    std::size_t const max(encoded.length());
+    for(std::size_t i(0); i < max; i += 4)
+    {
+        int const a(decode_char(encoded[i]));
+        int const b(decode_char(encoded[i + 1]));
+        if(a < 0 || b < 0)
+        {
+            return false;
+        }
+        bool const last(i + 4 == max);
+        int c(0);
+        int d(0);
+        std::size_t count(3);
+        if(last && encoded[i + 2] == '=')
+        {
+            if(encoded[i + 3] != '=')
+            {
+                return false;
+            }
+            count = 1;
+        }
+        else
+        {
+            c = decode_char(encoded[i + 2]);
+            if(c < 0)
+            {
+                return false;
+            }
+            if(last && encoded[i + 3] == '=')
+            {
+                count = 2;
+            }
+            else
+            {
+                d = decode_char(encoded[i + 3]);
+                if(d < 0)
+                {
+                    return false;
+                }
+            }
+        }
+        std::uint32_t const v(static_cast<std::uint32_t>((a << 18) | (b << 12) | (c << 6) | d));
+        data += static_cast<char>(v >> 16);
+        if(count > 1)
+        {
+            data += static_cast<char>((v >> 8) & 0xFF);
+        }
+        if(count > 2)
+        {
+            data += static_cast<char>(v & 0xFF);
+        }
+    }
+
+    return true;
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
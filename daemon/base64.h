@@ -0,0 +1,41 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief Base64 encoding of binary data sent in messages.
+ */
+
+// C++
+//
+#include    <string>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+std::string             base64_encode(std::string const & data);
+bool                    base64_decode(std::string const & encoded, std::string & data);
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
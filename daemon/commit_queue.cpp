@@ -0,0 +1,684 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the commit queue.
+ *
+ * Once a file was fully received, it gets committed. The commit verifies
+ * the murmur3 hash, applies the metadata, makes the data durable as
+ * required by the path `durability=...` parameter, and finally publishes
+ * the file under its final name.
+ *
+ * All of that work happens in a small pool of worker threads. Once a job
+ * is done, the worker signals the event loop (see commit_done) which then
+ * refreshes the server's view of the files.
+ *
+ * Files with a durability of "none" get committed immediately. Other
+ * files are queued for a short amount of time (group_commit_ms) so that
+ * when many small files arrive at once, a single syncfs(2) can be used
+ * instead of one fsync(2) per file. Also, the directories of files with
+ * "full" durability get synced once per batch.
+ *
+ * The order is important: the data is synced before the file gets linked
+ * under its final name. After a crash, the destination is either the old
+ * file or the complete new file, never an empty or partial file.
+ */
+
+// self
+//
+#include    "commit_queue.h"
+
+#include    "server.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/pathinfo.h>
+
+
+// cppthread
+//
+#include    <cppthread/guard.h>
+
+
+// C++
+//
+#include    <map>
+
+
+// C
+//
+#include    <sys/stat.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+commit_job::commit_job(
+          file_vector_t const & files
+        , privileged_helper::pointer_t helper)
+    : f_files(files)
+    , f_privileged_helper(helper)
+{
+}
+
+
+/** \brief Create a job running a function instead of committing files.
+ *
+ * The \p task function runs in a worker thread. Once done, the \p done
+ * function is called from the event loop.
+ *
+ * \param[in] task  The function to run in a worker thread.
+ * \param[in] done  The function to call once the task is done.
+ */
+commit_job::commit_job(task_t task, task_t done)
+    : f_task(task)
+    , f_task_done(done)
+{
+}
+
+
+/** \brief Commit the files of this job.
+ *
+ * This function runs in a worker thread. It verifies, syncs, and
+ * publishes the files, or runs the task of this job.
+ */
+void commit_job::run()
+{
+    snapdev::timespec_ex const start(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC));
+
+    if(f_task)
+    {
+        f_task();
+        f_duration = (snapdev::timespec_ex::gettime(CLOCK_MONOTONIC) - start).to_usec();
+        return;
+    }
+
+    verify();
+    sync();
+    publish();
+
+    f_duration = (snapdev::timespec_ex::gettime(CLOCK_MONOTONIC) - start).to_usec();
+}
+
+
+bool commit_job::is_task() const
+{
+    return static_cast<bool>(f_task);
+}
+
+
+void commit_job::task_done()
+{
+    if(f_task_done)
+    {
+        f_task_done();
+    }
+}
+
+
+commit_job::file_vector_t const & commit_job::get_files() const
+{
+    return f_files;
+}
+
+
+bool commit_job::succeeded(received_file::pointer_t file) const
+{
+    return !f_failed.contains(file);
+}
+
+
+/** \brief Get the number of sync calls done for one durability mode.
+ *
+ * A syncfs(2) call which committed files of several modes is counted
+ * once for each of those modes. Use get_total_sync_calls() to get the
+ * number of calls actually made.
+ *
+ * \param[in] durability  The durability mode.
+ *
+ * \return The number of sync calls made for files of that mode.
+ */
+std::uint64_t commit_job::get_sync_calls(durability_t durability) const
+{
+    return f_sync_calls[static_cast<int>(durability)];
+}
+
+
+std::uint64_t commit_job::get_total_sync_calls() const
+{
+    return f_total_sync_calls;
+}
+
+
+std::int64_t commit_job::get_duration() const
+{
+    return f_duration;
+}
+
+
+void commit_job::verify()
+{
+    for(auto const & f : f_files)
+    {
+        if(!f->verify())
+        {
+            f_failed.insert(f);
+        }
+    }
+}
+
+
+void commit_job::sync()
+{
+    // apply the metadata first so the sync of a "full" file also
+    // saves the inode changes; the privileged helper does that for the
+    // whole batch in one go
+    //
+    file_vector_t files;
+    publish_batch_t batch;
+    for(auto const & f : f_files)
+    {
+        if(!f_failed.contains(f))
+        {
+            files.push_back(f);
+            batch.push_back(f->get_publish_order());
+        }
+    }
+    std::vector<int> const errors(f_privileged_helper->set_metadata(batch));
+
+    std::map<dev_t, file_vector_t> devices;
+    for(std::size_t idx(0); idx < files.size(); ++idx)
+    {
+        received_file::pointer_t f(files[idx]);
+        if(errors[idx] != 0)
+        {
+            // continue in this case, although the file may not be readable
+            // by the service owning this file as a result...
+            //
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "could not change the ownership, mode, or modification time of output file \""
+                << f->get_filename()
+                << "\" (errno: "
+                << errors[idx]
+                << ", "
+                << strerror(errors[idx])
+                << ")."
+                << SNAP_LOG_SEND;
+        }
+
+        if(f->get_durability() != durability_t::DURABILITY_NONE)
+        {
+            struct stat st;
+            if(fstat(f->get_fd(), &st) != 0)
+            {
+                st.st_dev = 0;
+            }
+            devices[st.st_dev].push_back(f);
+        }
+    }
+
+    // with many files on the same file system, one syncfs(2) is
+    // much cheaper than one fsync(2) per file
+    //
+    for(auto const & d : devices)
+    {
+        if(d.second.size() >= SYNCFS_THRESHOLD)
+        {
+            // the one call commits the files of all the modes found in
+            // this batch, count it once for each of those modes
+            //
+            std::set<durability_t> modes;
+            for(auto const & f : d.second)
+            {
+                modes.insert(f->get_durability());
+            }
+            for(auto const & m : modes)
+            {
+                ++f_sync_calls[static_cast<int>(m)];
+            }
+            ++f_total_sync_calls;
+            if(syncfs(d.second[0]->get_fd()) != 0)
+            {
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "syncfs() failed while committing "
+                    << d.second.size()
+                    << " files (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+                f_failed.insert(d.second.begin(), d.second.end());
+            }
+            continue;
+        }
+
+        for(auto const & f : d.second)
+        {
+            ++f_sync_calls[static_cast<int>(f->get_durability())];
+            ++f_total_sync_calls;
+            int const r(f->get_durability() == durability_t::DURABILITY_DATA
+                            ? fdatasync(f->get_fd())
+                            : fsync(f->get_fd()));
+            if(r != 0)
+            {
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "could not sync data of received file \""
+                    << f->get_filename()
+                    << "\" (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+                f_failed.insert(f);
+            }
+        }
+    }
+}
+
+
+void commit_job::publish()
+{
+    // the data is safe, give the files their final name
+    //
+    file_vector_t files;
+    publish_batch_t batch;
+    for(auto const & f : f_files)
+    {
+        if(f_failed.contains(f))
+        {
+            f->discard();
+            continue;
+        }
+        files.push_back(f);
+        batch.push_back(f->get_publish_order());
+    }
+    std::vector<int> const errors(f_privileged_helper->publish(batch));
+
+    for(std::size_t idx(0); idx < files.size(); ++idx)
+    {
+        received_file::pointer_t f(files[idx]);
+        if(errors[idx] != 0)
+        {
+            SNAP_LOG_ERROR
+                << "publishing of received file \""
+                << f->get_filename()
+                << "\" failed with error: "
+                << errors[idx]
+                << ", "
+                << strerror(errors[idx])
+                << "."
+                << SNAP_LOG_SEND;
+            f->discard();
+            f_failed.insert(f);
+            continue;
+        }
+        f->published();
+        if(f->get_durability() == durability_t::DURABILITY_FULL)
+        {
+            f_directories.insert(snapdev::pathinfo::dirname(f->get_filename()));
+        }
+    }
+
+    std::vector<snapdev::raii_fd_t> directories;
+    for(auto const & dir : f_directories)
+    {
+        snapdev::raii_fd_t fd;
+        int const e(f_privileged_helper->open_directory(dir, fd));
+        if(e != 0)
+        {
+            SNAP_LOG_ERROR
+                << "could not open directory \""
+                << dir
+                << "\" to sync it (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+        directories.push_back(std::move(fd));
+    }
+
+    // and make sure the new directory entries are durable
+    //
+    for(auto const & fd : directories)
+    {
+        ++f_sync_calls[static_cast<int>(durability_t::DURABILITY_FULL)];
+        ++f_total_sync_calls;
+        if(fsync(fd.get()) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not sync a directory (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+        }
+    }
+}
+
+
+
+
+
+
+commit_done::commit_done(commit_queue * queue)
+    : f_commit_queue(queue)
+{
+    set_name("commit_done");
+}
+
+
+/** \brief Save a job which a worker thread just completed.
+ *
+ * This function is called by the worker threads. It saves the job in
+ * a list and wakes up the event loop which then calls
+ * commit_queue::job_committed() for each job.
+ *
+ * \param[in] job  The job that was just completed.
+ */
+void commit_done::job_done(commit_job::pointer_t job)
+{
+    {
+        cppthread::guard lock(f_mutex);
+        f_done_jobs.push_back(job);
+    }
+    thread_done();
+}
+
+
+void commit_done::process_done_jobs()
+{
+    std::vector<commit_job::pointer_t> jobs;
+    {
+        cppthread::guard lock(f_mutex);
+        jobs.swap(f_done_jobs);
+    }
+    for(auto const & j : jobs)
+    {
+        f_commit_queue->job_committed(j);
+    }
+}
+
+
+void commit_done::process_read()
+{
+    thread_done_signal::process_read();
+
+    process_done_jobs();
+}
+
+
+
+
+
+
+commit_worker::commit_worker(
+          std::string const & name
+        , std::size_t position
+        , cppthread::fifo<commit_job::pointer_t>::pointer_t in
+        , cppthread::fifo<commit_job::pointer_t>::pointer_t out
+        , commit_done::pointer_t done)
+    : worker<commit_job::pointer_t>(name, position, in, out)
+    , f_done(done)
+{
+}
+
+
+bool commit_worker::do_work()
+{
+    f_workload->run();
+    f_done->job_done(f_workload);
+
+    // the job is returned through f_done, no need for an output fifo
+    //
+    return false;
+}
+
+
+
+
+
+
+commit_queue::commit_queue(
+          server * s
+        , std::int64_t group_commit_msec
+        , std::size_t commit_threads)
+    : timer(-1)
+    , f_server(s)
+    , f_group_commit_usec(std::max(static_cast<std::int64_t>(0), group_commit_msec) * 1'000)
+    , f_done(std::make_shared<commit_done>(this))
+{
+    set_name("commit_queue");
+
+    f_pool = std::make_shared<commit_pool_t>(
+              "commit_pool"
+            , std::max(static_cast<std::size_t>(1), commit_threads)
+            , std::make_shared<commit_pool_t::worker_fifo_t>()
+            , std::make_shared<commit_pool_t::worker_fifo_t>()
+            , f_done);
+}
+
+
+/** \brief Get the connection used by the workers to wake up the loop.
+ *
+ * The server has to add this connection to the communicator for the
+ * committed files to be acknowledged.
+ *
+ * \return The commit_done connection.
+ */
+commit_done::pointer_t commit_queue::get_done_signal() const
+{
+    return f_done;
+}
+
+
+/** \brief Add a file to be committed.
+ *
+ * If the file durability is "none", then it gets committed immediately.
+ * Otherwise it gets added to the list of pending files which will be
+ * committed at once within group_commit_ms.
+ *
+ * \param[in] file  The file to commit.
+ */
+void commit_queue::add_file(received_file::pointer_t file)
+{
+    if(file->get_durability() == durability_t::DURABILITY_NONE
+    || f_group_commit_usec == 0)
+    {
+        start_job({ file });
+        return;
+    }
+
+    f_pending.push_back(file);
+    if(f_pending.size() == 1)
+    {
+        set_timeout_date(snapdev::timespec_ex::gettime().to_usec() + f_group_commit_usec);
+    }
+}
+
+
+/** \brief Run a function in one of the worker threads.
+ *
+ * This is used for other slow disk work which should not block the
+ * event loop. The \p done function is called from the event loop once
+ * \p task returned. If the queue is stopped, nothing happens.
+ *
+ * \param[in] task  The function to run in a worker thread.
+ * \param[in] done  The function to call once the task is done.
+ */
+void commit_queue::run_task(commit_job::task_t task, commit_job::task_t done)
+{
+    if(f_pool == nullptr)
+    {
+        return;
+    }
+
+    f_pool->push_back(std::make_shared<commit_job>(task, done));
+}
+
+
+/** \brief Commit all the pending files now.
+ *
+ * This function is called when the timer times out. It is also called
+ * when we are stopping so the files received so far do not get lost.
+ */
+void commit_queue::flush()
+{
+    set_timeout_date(-1);
+
+    if(f_pending.empty())
+    {
+        return;
+    }
+
+    commit_job::file_vector_t files;
+    files.swap(f_pending);
+    start_job(files);
+}
+
+
+/** \brief Stop the worker threads.
+ *
+ * This function commits the pending files, waits for the workers to be
+ * done with all the jobs, and then acknowledges those jobs.
+ */
+void commit_queue::stop()
+{
+    flush();
+
+    if(f_pool != nullptr)
+    {
+        f_pool->stop(false);
+        f_pool->wait();
+        f_pool.reset();
+    }
+
+    f_done->process_done_jobs();
+}
+
+
+void commit_queue::job_committed(commit_job::pointer_t job)
+{
+    if(job->is_task())
+    {
+        job->task_done();
+        return;
+    }
+
+    commit_job::file_vector_t const & files(job->get_files());
+    std::int64_t const per_file(job->get_duration() / static_cast<std::int64_t>(files.size()));
+    std::set<durability_t> modes;
+    std::size_t failures(0);
+    for(auto const & f : files)
+    {
+        commit_statistics & stats(f_statistics[static_cast<int>(f->get_durability())]);
+        ++stats.f_files;
+        stats.f_total_usec += per_file;
+        modes.insert(f->get_durability());
+
+        if(job->succeeded(f))
+        {
+            f_server->refresh_file(f->get_filename(), f->get_expected_hash());
+        }
+        else
+        {
+            ++stats.f_failures;
+            ++failures;
+            f_server->commit_failed(f->get_filename());
+        }
+    }
+    for(auto const & m : modes)
+    {
+        commit_statistics & stats(f_statistics[static_cast<int>(m)]);
+        ++stats.f_batches;
+        stats.f_sync_calls += job->get_sync_calls(m);
+    }
+    std::uint64_t const sync_calls(job->get_total_sync_calls());
+
+    SNAP_LOG_DEBUG
+        << "committed "
+        << files.size()
+        << " file"
+        << (files.size() == 1 ? "" : "s")
+        << " ("
+        << failures
+        << " failed) with "
+        << sync_calls
+        << " sync call"
+        << (sync_calls == 1 ? "" : "s")
+        << " in "
+        << job->get_duration()
+        << " usec ("
+        << per_file
+        << " usec per file)."
+        << SNAP_LOG_SEND;
+}
+
+
+commit_statistics const & commit_queue::get_statistics(durability_t durability) const
+{
+    return f_statistics[static_cast<int>(durability)];
+}
+
+
+void commit_queue::process_timeout()
+{
+    flush();
+}
+
+
+void commit_queue::start_job(commit_job::file_vector_t const & files)
+{
+    if(f_pool == nullptr)
+    {
+        // we are stopped, the files get released
+        //
+        return;
+    }
+
+    f_pool->push_back(std::make_shared<commit_job>(
+              files
+            , f_server->get_privileged_helper()));
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
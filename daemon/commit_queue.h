@@ -0,0 +1,224 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the commit_queue class.
+ *
+ * The commit_queue is used to verify and publish received files. Files
+ * which require some level of durability are grouped so one sync can be
+ * used for many files.
+ *
+ * The work itself happens in a small pool of worker threads so the
+ * event loop never waits on the disk. Other slow disk work (i.e. hashing
+ * a file before announcing it) can be run by the same threads.
+ */
+
+// self
+//
+#include    "received_file.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/thread_done_signal.h>
+#include    <eventdispatcher/timer.h>
+
+
+// cppthread
+//
+#include    <cppthread/item_with_predicate.h>
+#include    <cppthread/mutex.h>
+#include    <cppthread/pool.h>
+#include    <cppthread/worker.h>
+
+
+// C++
+//
+#include    <functional>
+#include    <set>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class server;
+
+
+struct commit_statistics
+{
+    std::uint64_t       f_files = 0;
+    std::uint64_t       f_batches = 0;
+    std::uint64_t       f_sync_calls = 0;
+    std::uint64_t       f_failures = 0;
+    std::int64_t        f_total_usec = 0;           // time spent in verify, sync & publish functions
+};
+
+
+class commit_job
+    : public cppthread::item_with_predicate
+{
+public:
+    typedef std::shared_ptr<commit_job>     pointer_t;
+    typedef std::vector<received_file::pointer_t>
+                                            file_vector_t;
+    typedef std::function<void()>           task_t;
+
+    static constexpr std::size_t const      SYNCFS_THRESHOLD = 4;
+
+                        commit_job(
+                              file_vector_t const & files
+                            , privileged_helper::pointer_t helper);
+                        commit_job(task_t task, task_t done);
+
+    void                run();
+    bool                is_task() const;
+    void                task_done();
+    file_vector_t const &
+                        get_files() const;
+    bool                succeeded(received_file::pointer_t file) const;
+    std::uint64_t       get_sync_calls(durability_t durability) const;
+    std::uint64_t       get_total_sync_calls() const;
+    std::int64_t        get_duration() const;
+
+private:
+    void                verify();
+    void                sync();
+    void                publish();
+
+    file_vector_t       f_files = file_vector_t();
+    privileged_helper::pointer_t
+                        f_privileged_helper = privileged_helper::pointer_t();
+    std::set<received_file::pointer_t>
+                        f_failed = std::set<received_file::pointer_t>();
+    std::set<std::string>
+                        f_directories = std::set<std::string>();
+    std::uint64_t       f_sync_calls[3] = {};
+    std::uint64_t       f_total_sync_calls = 0;
+    std::int64_t        f_duration = 0;
+    task_t              f_task = task_t();              // run in a worker thread
+    task_t              f_task_done = task_t();         // run in the event loop
+};
+
+
+class commit_queue;
+
+
+class commit_done
+    : public ed::thread_done_signal
+{
+public:
+    typedef std::shared_ptr<commit_done>    pointer_t;
+
+                        commit_done(commit_queue * queue);
+                        commit_done(commit_done const &) = delete;
+    commit_done &       operator = (commit_done const &) = delete;
+
+    void                job_done(commit_job::pointer_t job);
+    void                process_done_jobs();
+
+    // thread_done_signal implementation
+    //
+    virtual void        process_read() override;
+
+private:
+    commit_queue *      f_commit_queue = nullptr;
+    cppthread::mutex    f_mutex = cppthread::mutex();
+    std::vector<commit_job::pointer_t>
+                        f_done_jobs = std::vector<commit_job::pointer_t>();
+};
+
+
+class commit_worker
+    : public cppthread::worker<commit_job::pointer_t>
+{
+public:
+                        commit_worker(
+                              std::string const & name
+                            , std::size_t position
+                            , cppthread::fifo<commit_job::pointer_t>::pointer_t in
+                            , cppthread::fifo<commit_job::pointer_t>::pointer_t out
+                            , commit_done::pointer_t done);
+                        commit_worker(commit_worker const &) = delete;
+    commit_worker &     operator = (commit_worker const &) = delete;
+
+    // worker implementation
+    //
+    virtual bool        do_work() override;
+
+private:
+    commit_done::pointer_t
+                        f_done = commit_done::pointer_t();
+};
+
+
+typedef cppthread::pool<commit_worker, commit_done::pointer_t>
+                        commit_pool_t;
+
+
+class commit_queue
+    : public ed::timer
+{
+public:
+    typedef std::shared_ptr<commit_queue>   pointer_t;
+
+    static constexpr std::int64_t const     DEFAULT_GROUP_COMMIT_MSEC = 50;
+    static constexpr std::size_t const      DEFAULT_COMMIT_THREADS = 2;
+
+                        commit_queue(
+                              server * s
+                            , std::int64_t group_commit_msec
+                            , std::size_t commit_threads);
+                        commit_queue(commit_queue const &) = delete;
+    commit_queue &      operator = (commit_queue const &) = delete;
+
+    commit_done::pointer_t
+                        get_done_signal() const;
+    void                add_file(received_file::pointer_t file);
+    void                run_task(commit_job::task_t task, commit_job::task_t done);
+    void                flush();
+    void                stop();
+    void                job_committed(commit_job::pointer_t job);
+    commit_statistics const &
+                        get_statistics(durability_t durability) const;
+
+    // timer implementation
+    //
+    virtual void        process_timeout() override;
+
+private:
+    void                start_job(commit_job::file_vector_t const & files);
+
+    server *            f_server = nullptr;
+    std::int64_t        f_group_commit_usec = DEFAULT_GROUP_COMMIT_MSEC * 1'000;
+    commit_job::file_vector_t
+                        f_pending = commit_job::file_vector_t();
+    commit_done::pointer_t
+                        f_done = commit_done::pointer_t();
+    std::shared_ptr<commit_pool_t>
+                        f_pool = std::shared_ptr<commit_pool_t>();
+    commit_statistics   f_statistics[3] = {};
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,436 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the connect race ("happy eyeballs").
+ *
+ * A source may advertise several addresses (IPv4 and IPv6, several
+ * network cards). If one path is broken, trying the addresses one after
+ * the other costs a full connect timeout before the next one is tried.
+ *
+ * The connect race starts a non-blocking connection to the first address
+ * (the addresses are sorted by measured latency by the caller). If it
+ * did not succeed after the stagger delay, or as soon as it fails, the
+ * next address is tried in parallel, and so on. The first connection to
+ * succeed wins and the other attempts are cancelled.
+ *
+ * The data_receiver creates its own connection (the eventdispatcher TCP
+ * client connects in its constructor), so the race only determines which
+ * address to use. That second connection goes over a path known to work
+ * and costs one round trip. It is still created in a worker thread (see
+ * server::connect_client()) since that path may break in between.
+ *
+ * Each attempt result is recorded in the peer_health table, which gives
+ * us the latencies used to sort the addresses next time.
+ *
+ * The race is also used before pushing files so the eventdispatcher
+ * connection is only created once the receiver is known to answer.
+ */
+
+// self
+//
+#include    "connect_race.h"
+
+#include    "receive_scheduler.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/communicator.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C
+//
+#include    <sys/socket.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+connect_attempt::connect_attempt(
+          connect_race * race
+        , std::size_t index
+        , addr::addr const & address)
+    : f_race(race)
+    , f_index(index)
+    , f_address(address)
+{
+    set_name("connect_attempt");
+}
+
+
+/** \brief Start the non-blocking connection.
+ *
+ * \return false if the connection failed immediately.
+ */
+bool connect_attempt::start()
+{
+    f_started = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec();
+    f_socket.reset(f_address.create_socket(
+                  addr::addr::SOCKET_FLAG_NONBLOCK
+                | addr::addr::SOCKET_FLAG_CLOEXEC));
+    if(f_socket == nullptr)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create a socket to connect to "
+            << f_address
+            << " (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    if(f_address.connect(f_socket.get()) != 0
+    && errno != EINPROGRESS)
+    {
+        int const e(errno);
+        SNAP_LOG_VERBOSE
+            << "could not connect to "
+            << f_address
+            << " (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        f_socket.reset();
+        return false;
+    }
+
+    // the socket becomes writable once the connection succeeded or failed
+    //
+    return true;
+}
+
+
+void connect_attempt::cancel()
+{
+    if(f_done)
+    {
+        return;
+    }
+    f_done = true;
+    remove_from_communicator();
+    f_socket.reset();
+}
+
+
+int connect_attempt::get_socket() const
+{
+    return f_socket.get();
+}
+
+
+bool connect_attempt::valid_socket() const
+{
+    return f_socket != nullptr;
+}
+
+
+bool connect_attempt::is_writer() const
+{
+    return !f_done && f_socket != nullptr;
+}
+
+
+void connect_attempt::process_write()
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    int error(0);
+    socklen_t len(sizeof(error));
+    if(getsockopt(f_socket.get(), SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+    {
+        error = errno;
+    }
+    if(error != 0)
+    {
+        SNAP_LOG_VERBOSE
+            << "connection to "
+            << f_address
+            << " failed (errno: "
+            << error
+            << ", "
+            << strerror(error)
+            << ")."
+            << SNAP_LOG_SEND;
+        failed();
+        return;
+    }
+
+    // the race may release us while we are still running
+    //
+    pointer_t self(std::dynamic_pointer_cast<connect_attempt>(shared_from_this()));
+
+    std::int64_t const latency(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec() - f_started);
+    f_done = true;
+    remove_from_communicator();
+    f_socket.reset();
+    f_race->attempt_succeeded(f_index, latency);
+}
+
+
+void connect_attempt::process_error()
+{
+    failed();
+}
+
+
+void connect_attempt::process_hup()
+{
+    failed();
+}
+
+
+void connect_attempt::process_invalid()
+{
+    failed();
+}
+
+
+void connect_attempt::failed()
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    // the race may release us while we are still running
+    //
+    pointer_t self(std::dynamic_pointer_cast<connect_attempt>(shared_from_this()));
+
+    f_done = true;
+    remove_from_communicator();
+    f_socket.reset();
+    f_race->attempt_failed(f_index);
+}
+
+
+
+
+
+
+connect_race::connect_race(
+          receive_scheduler * scheduler
+        , peer_health::pointer_t health
+        , std::string const & filename
+        , addr::addr::vector_t const & addresses
+        , std::int64_t stagger_msec
+        , std::int64_t timeout_msec)
+    : timer(-1)
+    , f_scheduler(scheduler)
+    , f_peer_health(health)
+    , f_filename(filename)
+    , f_addresses(addresses)
+    , f_stagger_usec(std::max(static_cast<std::int64_t>(0), stagger_msec) * 1'000)
+{
+    set_name("connect_race");
+
+    f_deadline = snapdev::timespec_ex::gettime().to_usec()
+               + std::max(static_cast<std::int64_t>(1), timeout_msec) * 1'000;
+}
+
+
+/** \brief Replace the receive_scheduler::race_done() call.
+ *
+ * By default, the result of the race is sent to the receive_scheduler.
+ * Other users (i.e. the push of files) get the result with this callback
+ * instead.
+ *
+ * \param[in] callback  The function called with the index of the address
+ * which answered first, or -1.
+ */
+void connect_race::set_done_callback(done_callback_t callback)
+{
+    f_done_callback = callback;
+}
+
+
+/** \brief Start the race.
+ *
+ * The race must already be added to the communicator.
+ */
+void connect_race::start()
+{
+    start_next_attempt();
+}
+
+
+/** \brief Stop the race without reporting a result.
+ *
+ * This is used when the server stops.
+ */
+void connect_race::cancel()
+{
+    f_done = true;
+    for(auto & a : f_attempts)
+    {
+        a->cancel();
+    }
+    set_timeout_date(-1);
+    remove_from_communicator();
+}
+
+
+void connect_race::attempt_succeeded(std::size_t index, std::int64_t latency_usec)
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    std::string const peer(f_addresses[index].to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    if(f_peer_health->connect_succeeded(peer, latency_usec))
+    {
+        f_scheduler->peer_recovered(peer);
+    }
+    finish(index);
+}
+
+
+void connect_race::attempt_failed(std::size_t index)
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    f_peer_health->connect_failed(f_addresses[index].to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    ++f_failed;
+    if(f_failed >= f_addresses.size())
+    {
+        finish(-1);
+        return;
+    }
+
+    // do not wait for the stagger delay, try the next address now
+    //
+    start_next_attempt();
+}
+
+
+void connect_race::process_timeout()
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    if(snapdev::timespec_ex::gettime().to_usec() >= f_deadline)
+    {
+        for(std::size_t idx(0); idx < f_attempts.size(); ++idx)
+        {
+            if(f_attempts[idx]->is_writer())
+            {
+                f_peer_health->connect_failed(f_addresses[idx].to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+            }
+        }
+        finish(-1);
+        return;
+    }
+
+    start_next_attempt();
+}
+
+
+void connect_race::start_next_attempt()
+{
+    ed::communicator::pointer_t communicator(ed::communicator::instance());
+    while(f_attempts.size() < f_addresses.size())
+    {
+        std::size_t const index(f_attempts.size());
+        connect_attempt::pointer_t attempt(std::make_shared<connect_attempt>(
+                  this
+                , index
+                , f_addresses[index]));
+        f_attempts.push_back(attempt);
+        f_peer_health->connect_started(f_addresses[index].to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+        if(attempt->start()
+        && communicator->add_connection(attempt))
+        {
+            break;
+        }
+
+        attempt->cancel();
+        f_peer_health->connect_failed(f_addresses[index].to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+        ++f_failed;
+    }
+
+    if(f_failed >= f_addresses.size())
+    {
+        finish(-1);
+        return;
+    }
+
+    std::int64_t date(f_deadline);
+    if(f_attempts.size() < f_addresses.size())
+    {
+        date = std::min(date, snapdev::timespec_ex::gettime().to_usec() + f_stagger_usec);
+    }
+    set_timeout_date(date);
+}
+
+
+void connect_race::finish(int index)
+{
+    // the scheduler releases its reference in race_done()
+    //
+    pointer_t self(std::dynamic_pointer_cast<connect_race>(shared_from_this()));
+
+    f_done = true;
+    for(auto & a : f_attempts)
+    {
+        a->cancel();
+    }
+    set_timeout_date(-1);
+    remove_from_communicator();
+
+    if(f_done_callback)
+    {
+        f_done_callback(index);
+    }
+    else
+    {
+        f_scheduler->race_done(f_filename, index);
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,153 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the connect_race class.
+ *
+ * The connect race attempts to connect to several addresses of the same
+ * source in parallel (staggered) and keeps the first one that answers.
+ */
+
+// self
+//
+#include    "peer_health.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/timer.h>
+
+
+// libaddr
+//
+#include    <libaddr/addr.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <functional>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class connect_race;
+class receive_scheduler;
+
+
+class connect_attempt
+    : public ed::connection
+{
+public:
+    typedef std::shared_ptr<connect_attempt>    pointer_t;
+
+                        connect_attempt(
+                              connect_race * race
+                            , std::size_t index
+                            , addr::addr const & address);
+                        connect_attempt(connect_attempt const &) = delete;
+    connect_attempt &   operator = (connect_attempt const &) = delete;
+
+    bool                start();
+    void                cancel();
+
+    // connection implementation
+    //
+    virtual int         get_socket() const override;
+    virtual bool        valid_socket() const override;
+    virtual bool        is_writer() const override;
+    virtual void        process_write() override;
+    virtual void        process_error() override;
+    virtual void        process_hup() override;
+    virtual void        process_invalid() override;
+
+private:
+    void                failed();
+
+    connect_race *      f_race = nullptr;
+    std::size_t         f_index = 0;
+    addr::addr          f_address = addr::addr();
+    snapdev::raii_fd_t  f_socket = snapdev::raii_fd_t();
+    std::int64_t        f_started = 0;
+    bool                f_done = false;
+};
+
+
+class connect_race
+    : public ed::timer
+{
+public:
+    typedef std::shared_ptr<connect_race>       pointer_t;
+    typedef std::function<void(int index)>      done_callback_t;
+
+    static constexpr std::int64_t const     DEFAULT_STAGGER_MSEC = 250;
+    static constexpr std::int64_t const     DEFAULT_TIMEOUT_MSEC = 10'000;
+
+                        connect_race(
+                              receive_scheduler * scheduler
+                            , peer_health::pointer_t health
+                            , std::string const & filename
+                            , addr::addr::vector_t const & addresses
+                            , std::int64_t stagger_msec
+                            , std::int64_t timeout_msec);
+                        connect_race(connect_race const &) = delete;
+    connect_race &      operator = (connect_race const &) = delete;
+
+    void                set_done_callback(done_callback_t callback);
+    void                start();
+    void                cancel();
+    void                attempt_succeeded(std::size_t index, std::int64_t latency_usec);
+    void                attempt_failed(std::size_t index);
+
+    // timer implementation
+    //
+    virtual void        process_timeout() override;
+
+private:
+    void                start_next_attempt();
+    void                finish(int index);
+
+    receive_scheduler * f_scheduler = nullptr;
+    peer_health::pointer_t
+                        f_peer_health = peer_health::pointer_t();
+    std::string         f_filename = std::string();
+    addr::addr::vector_t
+                        f_addresses = addr::addr::vector_t();
+    std::int64_t        f_stagger_usec = DEFAULT_STAGGER_MSEC * 1'000;
+    std::int64_t        f_deadline = 0;
+    std::vector<connect_attempt::pointer_t>
+                        f_attempts = std::vector<connect_attempt::pointer_t>();
+    std::size_t         f_failed = 0;
+    done_callback_t     f_done_callback = done_callback_t();
+    bool                f_done = false;
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
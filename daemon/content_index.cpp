@@ -0,0 +1,195 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the content index.
+ *
+ * The same contents often get replicated under several paths (i.e. the
+ * same certificate bundle in several service directories, identical
+ * artifacts across versions). When a file is announced with the hash of
+ * its contents and a local file has the same hash, the data can be
+ * copied locally (a reflink when the file system supports it) instead
+ * of being downloaded again.
+ *
+ * The index is fed with the files we share (their hash is computed when
+ * they get announced) and the files we receive (their hash was verified
+ * when they got committed). It is not saved; it gets rebuilt as files
+ * get shared and received.
+ *
+ * A local file may change after it was indexed. Each entry remembers the
+ * device, inode, size and modification time of the file at the time it
+ * was indexed and find() ignores (and removes) entries which do not match
+ * anymore. The copy is also verified against the hash before it gets
+ * published, like a downloaded file.
+ */
+
+// self
+//
+#include    "content_index.h"
+
+
+// C
+//
+#include    <sys/stat.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+content_index::content_index()
+{
+}
+
+
+/** \brief Add a local file to the index.
+ *
+ * The current stats of the file are saved along its hash. If the file
+ * was already indexed, the previous entry is replaced.
+ *
+ * \param[in] filename  The full path to the local file.
+ * \param[in] hash  The hash of the contents of that file.
+ */
+void content_index::add(std::string const & filename, std::string const & hash)
+{
+    remove(filename);
+
+    struct stat s;
+    if(stat(filename.c_str(), &s) != 0
+    || !S_ISREG(s.st_mode))
+    {
+        return;
+    }
+
+    entry e;
+    e.f_hash = hash;
+    e.f_device = s.st_dev;
+    e.f_inode = s.st_ino;
+    e.f_size = s.st_size;
+    e.f_mtime = s.st_mtim;
+    f_files[filename] = e;
+    f_hashes.emplace(hash, filename);
+}
+
+
+void content_index::remove(std::string const & filename)
+{
+    auto const it(f_files.find(filename));
+    if(it == f_files.end())
+    {
+        return;
+    }
+
+    auto range(f_hashes.equal_range(it->second.f_hash));
+    for(auto h(range.first); h != range.second; ++h)
+    {
+        if(h->second == filename)
+        {
+            f_hashes.erase(h);
+            break;
+        }
+    }
+    f_files.erase(it);
+}
+
+
+/** \brief Search for a local file with the specified contents.
+ *
+ * \param[in] hash  The hash of the contents.
+ * \param[in] size  The size of the contents.
+ *
+ * \return The full path to a local file with that contents, or an empty
+ * string if there are none.
+ */
+std::string content_index::find(std::string const & hash, std::uint64_t size)
+{
+    for(;;)
+    {
+        auto const h(f_hashes.find(hash));
+        if(h == f_hashes.end())
+        {
+            return std::string();
+        }
+
+        std::string const filename(h->second);
+        entry const & e(f_files[filename]);
+        struct stat s;
+        if(stat(filename.c_str(), &s) == 0
+        && s.st_dev == e.f_device
+        && s.st_ino == e.f_inode
+        && s.st_size == e.f_size
+        && snapdev::timespec_ex(s.st_mtim) == e.f_mtime
+        && static_cast<std::uint64_t>(s.st_size) == size)
+        {
+            return filename;
+        }
+
+        // the file changed or is gone
+        //
+        remove(filename);
+    }
+}
+
+
+/** \brief Get the hash of a local file.
+ *
+ * \param[in] filename  The full path to the local file.
+ *
+ * \return The hash of the file if it did not change since it was indexed,
+ * an empty string otherwise.
+ */
+std::string content_index::get_hash(std::string const & filename)
+{
+    auto const it(f_files.find(filename));
+    if(it == f_files.end())
+    {
+        return std::string();
+    }
+
+    entry const & e(it->second);
+    struct stat s;
+    if(stat(filename.c_str(), &s) != 0
+    || s.st_dev != e.f_device
+    || s.st_ino != e.f_inode
+    || s.st_size != e.f_size
+    || snapdev::timespec_ex(s.st_mtim) != e.f_mtime)
+    {
+        remove(filename);
+        return std::string();
+    }
+
+    return e.f_hash;
+}
+
+
+std::size_t content_index::size() const
+{
+    return f_files.size();
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
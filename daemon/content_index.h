@@ -0,0 +1,86 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the content_index class.
+ *
+ * The content index remembers the hash of the contents of local files
+ * so a file announced with the same contents can be copied locally
+ * instead of being downloaded.
+ */
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <memory>
+#include    <string>
+
+
+// C
+//
+#include    <sys/stat.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class content_index
+{
+public:
+    typedef std::shared_ptr<content_index>      pointer_t;
+
+                        content_index();
+                        content_index(content_index const &) = delete;
+    content_index &     operator = (content_index const &) = delete;
+
+    void                add(std::string const & filename, std::string const & hash);
+    void                remove(std::string const & filename);
+    std::string         find(std::string const & hash, std::uint64_t size);
+    std::string         get_hash(std::string const & filename);
+    std::size_t         size() const;
+
+private:
+    struct entry
+    {
+        std::string     f_hash = std::string();
+        dev_t           f_device = 0;
+        ino_t           f_inode = 0;
+        off_t           f_size = 0;
+        snapdev::timespec_ex
+                        f_mtime = snapdev::timespec_ex();
+    };
+
+    std::map<std::string, entry>
+                        f_files = std::map<std::string, entry>();
+    std::multimap<std::string, std::string>
+                        f_hashes = std::multimap<std::string, std::string>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -35,16 +35,9 @@
 #include    <snaplogger/message.h>
 
 
-// snapdev
+// C++
 //
-#include    <snapdev/as_root.h>
-#include    <snapdev/chownnm.h>
-#include    <snapdev/pathinfo.h>
-
-
-// C
-//
-#include    <fcntl.h>
+#include    <charconv>
 
 
 // last include
@@ -55,21 +48,33 @@
 
 namespace rfs_daemon
 {
+
+
 namespace
 {
-int         g_identifier = 0;
+
+
+bool parse_id(std::string const & value, std::uint32_t & id)
+{
+    char const * end(value.data() + value.length());
+    std::from_chars_result const r(std::from_chars(value.data(), end, id));
+    return !value.empty()
+        && r.ec == std::errc()
+        && r.ptr == end;
 }
 
 
+} // no name namespace
+
+
 
 data_receiver::data_receiver(
           server * s
         , std::string const & filename
         , std::uint32_t id
         , std::string const & temp_path
-        , addr::addr const & address
-        , ed::mode_t mode)
-    : tcp_client_connection(address, mode)
+        , ed::tcp_bio_client::pointer_t client)
+    : tcp_server_client_connection(client)
     , f_server(s)
     , f_filename(filename)
     , f_id(id)
@@ -77,6 +82,8 @@ data_receiver::data_receiver(
 {
     set_name("data_receiver");
 
+    f_started = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec();
+
     non_blocking();
 
     if(f_filename.empty())
@@ -99,12 +106,40 @@ data_receiver::data_receiver(
     //
     file_request request;
     request.f_id = f_id;
+    request.f_identity_domain = f_server->get_identity_domain();
+    if(request.f_identity_domain != 0)
+    {
+        request.f_flags |= FILE_REQUEST_FLAG_IDENTITY_DOMAIN;
+    }
 
     char const * d(reinterpret_cast<char const *>(&request));
     f_request.insert(f_request.end(), d, d + sizeof(request));
 }
 
 
+/** \brief Receive a file pushed by its source.
+ *
+ * The source connected to our push listener. The name of the file is
+ * not known until the push_header is received.
+ *
+ * \param[in] s  The server.
+ * \param[in] client  The accepted connection.
+ */
+data_receiver::data_receiver(
+          server * s
+        , ed::tcp_bio_client::pointer_t client)
+    : tcp_server_client_connection(client)
+    , f_server(s)
+    , f_push(true)
+{
+    set_name("data_receiver");
+
+    f_started = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec();
+
+    non_blocking();
+}
+
+
 void data_receiver::set_login_info(std::string const & login_name, std::string const & password)
 {
     f_login_name = login_name;
@@ -112,6 +147,107 @@ void data_receiver::set_login_info(std::string const & login_name, std::string c
 }
 
 
+void data_receiver::set_durability(durability_t durability)
+{
+    f_durability = durability;
+}
+
+
+/** \brief Tune the socket of this connection.
+ *
+ * The connection is already established so the receive buffer size
+ * does not change the window scale negotiated with the sender; the
+ * kernel bases it on the net.ipv4.tcp_rmem maximum.
+ *
+ * \param[in] profile  The socket profile to apply.
+ * \param[in] link_class  The class of the link to the sender.
+ */
+void data_receiver::set_socket_profile(
+      socket_profile const & profile
+    , link_class_t link_class)
+{
+    f_socket_settings = profile.apply(get_socket(), link_class);
+}
+
+
+/** \brief Setup the progress watchdog.
+ *
+ * The receiver checks its progress every second. If, over the last
+ * \p stall_usec microseconds, it received less than \p min_bytes_per_sec
+ * bytes per second on average, the transfer is considered stalled. It
+ * gets aborted and the scheduler resumes it from another source.
+ *
+ * \param[in] stall_usec  The size of the measurement window; 0 turns
+ * off the watchdog.
+ * \param[in] min_bytes_per_sec  The minimum average throughput.
+ */
+void data_receiver::set_watchdog(
+      std::int64_t stall_usec
+    , std::uint64_t min_bytes_per_sec)
+{
+    f_stall_usec = stall_usec;
+    f_min_bytes_per_sec = min_bytes_per_sec;
+    if(f_stall_usec > 0)
+    {
+        f_window_start = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec();
+        f_window_bytes = 0;
+        set_timeout_delay(1'000'000);
+    }
+    else
+    {
+        set_timeout_delay(-1);
+    }
+}
+
+
+/** \brief Send the original 8 byte request.
+ *
+ * Sources which do not advertise the "extended_request" capability only
+ * understand the 'FILE' request without flags. The identity domain is
+ * then not sent (names are used instead of numeric identifiers) and
+ * transfers cannot be resumed.
+ */
+void data_receiver::set_legacy_request()
+{
+    file_request * request(reinterpret_cast<file_request *>(f_request.data()));
+    request->f_magic[3] = 'E';
+    f_request.resize(FILE_REQUEST_BASE_SIZE);
+}
+
+
+/** \brief Resume a transfer which stalled.
+ *
+ * The \p partial file holds the beginning of the file as received from
+ * another source. The request sent to this source asks for the data
+ * starting at the end of that partial file.
+ *
+ * \param[in] partial  The partially received file.
+ */
+void data_receiver::set_resume(received_file::pointer_t partial)
+{
+    f_file = partial;
+    f_offset = partial->get_size();
+
+    file_request * request(reinterpret_cast<file_request *>(f_request.data()));
+    request->f_flags |= FILE_REQUEST_FLAG_RESUME;
+    request->f_offset = f_offset;
+}
+
+
+/** \brief Mark the transfer as speculative.
+ *
+ * The source is still writing the file. The data received is given back
+ * to the server which keeps it until the final version gets announced
+ * instead of being committed.
+ *
+ * \param[in] speculative  Whether the transfer is speculative.
+ */
+void data_receiver::set_speculative(bool speculative)
+{
+    f_speculative = speculative;
+}
+
+
 ssize_t data_receiver::write(void const * data, std::size_t length)
 {
     if(get_socket() == -1)
@@ -151,7 +287,7 @@ void data_receiver::process_read()
 
         ~on_exit()
         {
-            f_receiver->tcp_client_connection::process_read();
+            f_receiver->tcp_server_client_connection::process_read();
         }
 
     private:
@@ -164,6 +300,12 @@ void data_receiver::process_read()
         return;
     }
 
+    if(f_push
+    && !read_push_header())
+    {
+        return;
+    }
+
     // read the header
     //
     int r(0);
@@ -171,7 +313,7 @@ void data_receiver::process_read()
     {
         while(f_received_bytes < sizeof(f_header))
         {
-            r = read(&f_header + f_received_bytes, sizeof(f_header) - f_received_bytes);
+            r = read(reinterpret_cast<char *>(&f_header) + f_received_bytes, sizeof(f_header) - f_received_bytes);
             if(r == -1)
             {
                 SNAP_LOG_ERROR
@@ -185,6 +327,29 @@ void data_receiver::process_read()
                 return;
             }
             f_received_bytes += r;
+            f_window_bytes += r;
+
+            // the sender may be too busy, in which case it sends a
+            // BUSY packet instead of the header and closes the connection
+            //
+            if(f_received_bytes >= sizeof(data_busy)
+            && f_header.f_magic[0] == 'B'
+            && f_header.f_magic[1] == 'U'
+            && f_header.f_magic[2] == 'S'
+            && f_header.f_magic[3] == 'Y')
+            {
+                data_busy const * busy(reinterpret_cast<data_busy const *>(&f_header));
+                SNAP_LOG_TRACE
+                    << "source of \""
+                    << f_filename
+                    << "\" is busy; retry in "
+                    << busy->f_retry_after_msec
+                    << "ms."
+                    << SNAP_LOG_SEND;
+                f_server->receive_busy(f_filename, busy->f_retry_after_msec);
+                remove_from_communicator();
+                return;
+            }
         }
 
         if(f_header.f_magic[0] != 'D'
@@ -211,16 +376,39 @@ void data_receiver::process_read()
             return;
         }
 
-        // while receiving, use a temporary file
-        //
-        // the f_path_part has an ending '/' (see constructor)
-        //
-        ++g_identifier;
-        f_receiving_filename = f_path_part;
-        f_receiving_filename += snapdev::pathinfo::basename(f_filename);
-        f_receiving_filename += '-';
-        f_receiving_filename += std::to_string(g_identifier);
-        f_receiving_filename += ".tmp";
+        snapdev::timespec_ex const mtime(f_header.f_mtime_sec, f_header.f_mtime_nsec);
+        if(f_file != nullptr)
+        {
+            // resuming, make sure this source has the same version and
+            // that it did skip the part we already have
+            //
+            if((f_header.f_flags & DATA_FLAG_RESUMED) == 0
+            || f_file->get_mtime() != mtime
+            || f_header.f_size < f_offset)
+            {
+                SNAP_LOG_ERROR
+                    << "source cannot resume \""
+                    << f_filename
+                    << "\" at offset "
+                    << f_offset
+                    << " (different version or not supported)."
+                    << SNAP_LOG_SEND;
+                process_error();
+                return;
+            }
+        }
+        else
+        {
+            // while receiving, use an anonymous or temporary file
+            //
+            f_file = std::make_shared<received_file>(
+                          f_filename
+                        , f_path_part
+                        , f_server->get_privileged_helper());
+            f_file->set_durability(f_durability);
+            f_file->set_mtime(mtime);
+        }
+        f_data_size = f_header.f_size - f_offset;
 
         // we need to also read the user & group names
         //
@@ -258,6 +446,7 @@ void data_receiver::process_read()
                 return;
             }
             f_received_bytes += r;
+            f_window_bytes += r;
         }
 
         // verify the login/password
@@ -278,23 +467,37 @@ void data_receiver::process_read()
             }
         }
 
-        // note: we receive the file as the snaprfs user
-        //
-        f_output.open(
-                  f_receiving_filename
-                , std::ios_base::trunc | std::ios_base::binary | std::ios_base::ate);
-        if(!f_output.is_open())
+        std::string const username(f_names.data(), f_header.f_username_length);
+        std::string const groupname(f_names.data() + f_header.f_username_length, f_header.f_groupname_length);
+        if((f_header.f_flags & DATA_FLAG_NUMERIC_IDS) != 0)
+        {
+            // we are in the same identity domain as the sender, the
+            // names are the numeric uid/gid
+            //
+            std::uint32_t uid(0);
+            std::uint32_t gid(0);
+            if(f_server->get_identity_domain() == 0
+            || !parse_id(username, uid)
+            || !parse_id(groupname, gid))
+            {
+                SNAP_LOG_ERROR
+                    << "sender sent unexpected or invalid numeric user/group identifiers for \""
+                    << f_filename
+                    << "\"."
+                    << SNAP_LOG_SEND;
+                process_error();
+                return;
+            }
+            f_file->set_owner_ids(uid, gid);
+        }
+        else
+        {
+            f_file->set_owner(username, groupname);
+        }
+
+        if(!f_file->is_open()
+        && !f_file->open())
         {
-            int const e(errno);
-            SNAP_LOG_ERROR
-                << "could not open output file \""
-                << f_receiving_filename
-                << "\" for writing (errno: "
-                << e
-                << ", "
-                << strerror(e)
-                << ")."
-                << SNAP_LOG_SEND;
             process_error();
             return;
         }
@@ -302,10 +505,10 @@ void data_receiver::process_read()
 
     // read the file contents
     //
-    while(f_received_bytes < f_header_size + f_header.f_size)
+    while(f_received_bytes < f_header_size + f_data_size)
     {
         std::uint8_t buf[1024 * 4];
-        std::size_t const size_left(f_header_size + f_header.f_size - f_received_bytes);
+        std::size_t const size_left(f_header_size + f_data_size - f_received_bytes);
         r = read(buf, std::min(size_left, sizeof(buf)));
         if(r == -1)
         {
@@ -321,19 +524,23 @@ void data_receiver::process_read()
         {
             return;
         }
-        f_murmur3.add_data(buf, r);
-        f_output.write(reinterpret_cast<char const *>(buf), r);
+        if(!f_file->write(buf, r))
+        {
+            process_error();
+            return;
+        }
         f_received_bytes += r;
+        f_window_bytes += r;
     }
 
     // read the footer
     //
-    if(f_received_bytes < f_header_size + f_header.f_size + sizeof(f_footer))
+    if(f_received_bytes < f_header_size + f_data_size + sizeof(f_footer))
     {
-        while(f_received_bytes < f_header_size + f_header.f_size + sizeof(f_footer))
+        while(f_received_bytes < f_header_size + f_data_size + sizeof(f_footer))
         {
-            std::size_t const bytes_read(f_received_bytes - f_header_size - f_header.f_size);
-            r = read(&f_footer + bytes_read, sizeof(f_footer) - bytes_read);
+            std::size_t const bytes_read(f_received_bytes - f_header_size - f_data_size);
+            r = read(reinterpret_cast<char *>(&f_footer) + bytes_read, sizeof(f_footer) - bytes_read);
             if(r == -1)
             {
                 SNAP_LOG_ERROR
@@ -347,10 +554,9 @@ void data_receiver::process_read()
                 return;
             }
             f_received_bytes += r;
+            f_window_bytes += r;
         }
 
-        f_output.close();
-
         if(f_footer.f_end[0] != 'E'
         || f_footer.f_end[1] != 'N'
         || f_footer.f_end[2] != 'D'
@@ -363,119 +569,46 @@ void data_receiver::process_read()
             return;
         }
 
-        murmur3::hash const h(f_murmur3.flush());
-        murmur3::hash received;
-        received.set(f_footer.f_murmur3);
-        if(h != received)
-        {
-            SNAP_LOG_ERROR
-                << "murmur3 hashes do not match (received: "
-                << received.to_string()
-                << ", computed: "
-                << h.to_string()
-                << ")."
-                << SNAP_LOG_SEND;
-            process_error();
-            return;
-        }
-
-        // we may not own the file (we are "snaprfs", after all), so we become
-        // root and change the ownership and mode, and finally rename the
-        // file so it gets copied to a new location; we can then
-        // drop back as "snaprfs"
-        //
-        snapdev::as_root safe_root;
-
-        // TODO: I think that the user/group names should be changed
-        //       just before the rename (just before the utimensat()
-        //       actually) since the file is considered invalid until
-        //       verified otherwise by the murmur3 checksum
+        // the commit queue verifies the murmur3 hash in a worker thread
+        // (reading the data back from disk), has the privileged helper
+        // change the ownership and mode, makes the data durable as
+        // required, and finally has the helper link the file under its
+        // final name
         //
-        std::string const username(f_names.data(), f_header.f_username_length);
-        std::string const groupname(f_names.data() + f_header.f_username_length, f_header.f_groupname_length);
-        if(snapdev::chownnm(f_receiving_filename, username, groupname) != 0)
-        {
-            int const e(errno);
-            SNAP_LOG_RECOVERABLE_ERROR
-                << "could not change user and/or group name of output file \""
-                << f_receiving_filename
-                << "\" (errno: "
-                << e
-                << ", "
-                << strerror(e)
-                << ")."
-                << SNAP_LOG_SEND;
-            // continue in this case, although the file may not be readable
-            // by the service owning this file as a result...
-        }
-
-        if(chmod(f_receiving_filename.c_str(), f_header.f_mode) != 0)
+        murmur3::hash expected;
+        expected.set(f_footer.f_murmur3);
+        f_file->set_expected_hash(expected);
+        f_file->set_mode(f_header.f_mode);
+        if(f_speculative)
         {
-            int const e(errno);
-            SNAP_LOG_RECOVERABLE_ERROR
-                << "could not change mode (chmod) of output file \""
-                << f_receiving_filename
-                << "\" (errno: "
-                << e
-                << ", "
-                << strerror(e)
-                << ")."
-                << SNAP_LOG_SEND;
-            // continue in this case, although the file may not be readable
-            // by the service owning this file as a result...
+            f_server->stage_file(f_file);
         }
-
-        timespec times[2] = {
-            // atime
-            {
-                .tv_sec = 0,
-                .tv_nsec = UTIME_OMIT,
-            },
-            // mtime
-            {
-                .tv_sec = static_cast<time_t>(f_header.f_mtime_sec),
-                .tv_nsec = static_cast<long int>(f_header.f_mtime_nsec),
-            },
-        };
-        if(utimensat(AT_FDCWD, f_receiving_filename.c_str(), times, 0) != 0)
+        else
         {
-            int const e(errno);
-            SNAP_LOG_MAJOR
-                << "could not change modification time of output file \""
-                << f_receiving_filename
-                << "\" (errno: "
-                << e
-                << ", "
-                << strerror(e)
-                << ")."
-                << SNAP_LOG_SEND;
-            // continue in this case, although the file may not be readable
-            // by the service owning this file as a result...
+            f_server->commit_file(f_file);
+            f_committed = true;
         }
+        f_file.reset();
 
-        // rename(2) is atomic and does not require us to first delete
-        // the destination file
+        // passive throughput estimate used to rank this source next time
         //
-        r = rename(f_receiving_filename.c_str(), f_filename.c_str());
-        if(r != 0)
-        {
-            int const e(errno);
-            SNAP_LOG_ERROR
-                << "renaming of received file \""
-                << f_receiving_filename
-                << "\" to \""
-                << f_filename
-                << "\" failed with error: "
-                << e
-                << ", "
-                << strerror(e)
-                << "."
-                << SNAP_LOG_SEND;
-            process_error();
-            return;
-        }
-
-        f_server->refresh_file(f_filename);
+        std::int64_t const duration(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec() - f_started);
+        f_server->get_peer_health()->transfer_done(
+                  get_remote_address().to_ipv4or6_string(addr::STRING_IP_ADDRESS)
+                , f_data_size
+                , duration);
+
+        SNAP_LOG_DEBUG
+            << "received \""
+            << f_filename
+            << "\" ("
+            << f_data_size
+            << " bytes in "
+            << duration / 1'000
+            << "ms; "
+            << f_socket_settings
+            << ")."
+            << SNAP_LOG_SEND;
 
         remove_from_communicator();
     }
@@ -487,7 +620,7 @@ void data_receiver::process_write()
     if(get_socket() != -1)
     {
         errno = 0;
-        ssize_t const r(tcp_client_connection::write(&f_request[f_position], f_request.size() - f_position));
+        ssize_t const r(tcp_server_client_connection::write(&f_request[f_position], f_request.size() - f_position));
         if(r > 0)
         {
             // some data was written
@@ -520,32 +653,201 @@ void data_receiver::process_write()
     }
 
     // process next level too
-    tcp_client_connection::process_write();
+    tcp_server_client_connection::process_write();
+}
+
+
+/** \brief Check the progress of the transfer.
+ *
+ * This is called every second while the watchdog is active.
+ */
+void data_receiver::process_timeout()
+{
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    std::int64_t const elapsed(now - f_window_start);
+    if(elapsed < f_stall_usec)
+    {
+        return;
+    }
+
+    if(f_window_bytes * 1'000'000 / static_cast<std::uint64_t>(elapsed) < f_min_bytes_per_sec)
+    {
+        stalled();
+        return;
+    }
+
+    f_window_start = now;
+    f_window_bytes = 0;
+}
+
+
+/** \brief The transfer stalled, abort it.
+ *
+ * The data received so far is kept and handed to the scheduler which
+ * resumes the transfer from another source if possible.
+ */
+void data_receiver::stalled()
+{
+    SNAP_LOG_WARNING
+        << "transfer of \""
+        << f_filename
+        << "\" from "
+        << get_remote_address()
+        << " stalled after "
+        << (f_file == nullptr ? 0 : f_file->get_size())
+        << " bytes; aborting."
+        << SNAP_LOG_SEND;
+
+    if(f_push)
+    {
+        // the announcement of that file (if any) is used to download it
+        //
+        if(f_file != nullptr)
+        {
+            f_file->discard();
+            f_file.reset();
+        }
+        remove_from_communicator();
+        return;
+    }
+
+    received_file::pointer_t partial;
+    if(f_file != nullptr
+    && f_file->is_open()
+    && f_file->get_size() > 0)
+    {
+        partial = f_file;
+    }
+    f_file.reset();
+
+    f_server->receive_stalled(f_filename, partial);
+    remove_from_communicator();
 }
 
 
 void data_receiver::process_error()
 {
-    if(!f_receiving_filename.empty())
+    if(f_file != nullptr)
     {
-        int const r(unlink(f_receiving_filename.c_str()));
-        if(r != 0
-        && errno != ENOENT)
+        f_file->discard();
+        f_file.reset();
+    }
+
+    tcp_server_client_connection::process_error();
+}
+
+
+/** \brief Read the push_header and the filename.
+ *
+ * Once the whole header was received, the server decides whether we
+ * want that file. If not, the connection is closed and the source stops
+ * sending.
+ *
+ * \return true once the push was accepted.
+ */
+bool data_receiver::read_push_header()
+{
+    if(!f_filename.empty())
+    {
+        return true;
+    }
+
+    while(f_push_received < sizeof(f_push_header))
+    {
+        int const r(read(reinterpret_cast<char *>(&f_push_header) + f_push_received, sizeof(f_push_header) - f_push_received));
+        if(r == -1)
         {
-            int const e(errno);
-            SNAP_LOG_RECOVERABLE_ERROR
-                << "an error occurred trying to delete \""
-                << f_receiving_filename
-                << "\" (errno: "
-                << e
-                << " -- "
-                << strerror(e)
-                << ")."
+            SNAP_LOG_ERROR
+                << "an I/O error occurred while reading push header."
+                << SNAP_LOG_SEND;
+            process_error();
+            return false;
+        }
+        if(r == 0)
+        {
+            return false;
+        }
+        f_push_received += r;
+        f_window_bytes += r;
+        if(f_push_received >= sizeof(f_push_header))
+        {
+            if(f_push_header.f_magic[0] != 'P'
+            || f_push_header.f_magic[1] != 'U'
+            || f_push_header.f_magic[2] != 'S'
+            || f_push_header.f_magic[3] != 'H'
+            || f_push_header.f_filename_length == 0)
+            {
+                SNAP_LOG_ERROR
+                    << "push header magic is not 'PUSH' or the filename is empty."
+                    << SNAP_LOG_SEND;
+                process_error();
+                return false;
+            }
+            f_push_filename.resize(f_push_header.f_filename_length);
+        }
+    }
+
+    std::size_t const total(sizeof(f_push_header) + f_push_filename.length());
+    while(f_push_received < total)
+    {
+        std::size_t const offset(f_push_received - sizeof(f_push_header));
+        int const r(read(f_push_filename.data() + offset, total - f_push_received));
+        if(r == -1)
+        {
+            SNAP_LOG_ERROR
+                << "an I/O error occurred while reading push filename."
                 << SNAP_LOG_SEND;
+            process_error();
+            return false;
+        }
+        if(r == 0)
+        {
+            return false;
+        }
+        f_push_received += r;
+        f_window_bytes += r;
+    }
+
+    snapdev::timespec_ex const mtime(f_push_header.f_mtime_sec, f_push_header.f_mtime_nsec);
+    if(!f_server->accept_push(get_remote_address(), f_push_filename, mtime, f_path_part, f_durability))
+    {
+        // we already have that version (or a newer one), we are
+        // receiving it from another connection, or the source is not
+        // allowed to push files to us
+        //
+        remove_from_communicator();
+        return false;
+    }
+    f_filename = f_push_filename;
+    f_id = f_push_header.f_id;
+    if(f_path_part.back() != '/')
+    {
+        f_path_part += '/';
+    }
+
+    return true;
+}
+
+
+/** \brief The receiver was removed from the communicator.
+ *
+ * Whether the transfer succeeded or failed, the receiver is done. Let
+ * the server know so the next queued transfer can start.
+ */
+void data_receiver::connection_removed()
+{
+    tcp_server_client_connection::connection_removed();
+
+    if(f_push)
+    {
+        if(!f_filename.empty())
+        {
+            f_server->push_done(f_filename, f_committed);
         }
+        return;
     }
 
-    tcp_client_connection::process_error();
+    f_server->receive_done(f_filename);
 }
 
 
@@ -21,11 +21,12 @@
 // self
 //
 #include    "data_sender.h"
+#include    "received_file.h"
 
 
 // eventdispatcher
 //
-#include    <eventdispatcher/tcp_client_connection.h>
+#include    <eventdispatcher/tcp_server_client_connection.h>
 
 
 
@@ -39,7 +40,7 @@ class server;
 
 
 class data_receiver
-    : public ed::tcp_client_connection
+    : public ed::tcp_server_client_connection
 {
 public:
     typedef std::shared_ptr<data_receiver>    pointer_t;
@@ -49,37 +50,68 @@ public:
                             , std::string const & filename
                             , std::uint32_t id
                             , std::string const & path_part
-                            , addr::addr const & address
-                            , ed::mode_t mode = ed::mode_t::MODE_PLAIN);
+                            , ed::tcp_bio_client::pointer_t client);
+                        data_receiver(
+                              server * s
+                            , ed::tcp_bio_client::pointer_t client);
                         data_receiver(data_receiver const &) = delete;
     data_receiver       operator = (data_receiver const &) = delete;
 
     void                set_login_info(std::string const & login_name, std::string const & password);
-
-    // tcp_client_connection implementation
+    void                set_durability(durability_t durability);
+    void                set_watchdog(
+                              std::int64_t stall_usec
+                            , std::uint64_t min_bytes_per_sec);
+    void                set_legacy_request();
+    void                set_resume(received_file::pointer_t partial);
+    void                set_speculative(bool speculative);
+    void                set_socket_profile(
+                              socket_profile const & profile
+                            , link_class_t link_class);
+
+    // tcp_server_client_connection implementation
     virtual ssize_t     write(void const * data, size_t length) override;
     virtual bool        is_writer() const override;
     virtual void        process_read() override;
     virtual void        process_write() override;
     virtual void        process_error() override;
+    virtual void        process_timeout() override;
+    virtual void        connection_removed() override;
 
 private:
+    void                stalled();
+    bool                read_push_header();
+
     server *            f_server = nullptr;
     std::string         f_login_name = std::string();
     std::string         f_password = std::string();
     std::string         f_filename = std::string();
-    std::string         f_receiving_filename = std::string();
     std::vector<char>   f_request = std::vector<char>();
     std::vector<char>   f_names = std::vector<char>(1024);
     std::uint32_t       f_id = 0;
     std::string         f_path_part = std::string();
+    durability_t        f_durability = durability_t::DURABILITY_NONE;
     std::size_t         f_received_bytes = 0;
     std::size_t         f_position = 0;
     std::size_t         f_header_size = 0;
+    std::uint64_t       f_offset = 0;
+    std::uint64_t       f_data_size = 0;
+    std::int64_t        f_started = 0;
+    std::int64_t        f_stall_usec = 0;
+    std::uint64_t       f_min_bytes_per_sec = 0;
+    std::int64_t        f_window_start = 0;
+    std::uint64_t       f_window_bytes = 0;
+    std::string         f_socket_settings = std::string();
+    bool                f_push = false;
+    bool                f_committed = false;
+    bool                f_speculative = false;      // stage the data, the source is still writing the file
+    push_header         f_push_header = {};
+    std::size_t         f_push_received = 0;
+    std::string         f_push_filename = std::string();
     data_header         f_header = {};
     data_footer         f_footer = {};
-    std::ofstream       f_output = std::ofstream();
-    murmur3::stream     f_murmur3 = murmur3::stream(DATA_SEED_H1, DATA_SEED_H2);
+    received_file::pointer_t
+                        f_file = received_file::pointer_t();
 };
 
 
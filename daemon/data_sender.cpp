@@ -34,10 +34,14 @@
 #include    <snaplogger/message.h>
 
 
+// C++
+//
+#include    <limits>
+
+
 // C
 //
-#include    <grp.h>
-#include    <pwd.h>
+#include    <sys/stat.h>
 
 
 // last include
@@ -70,6 +74,20 @@ void data_sender::set_login_info(std::string const & login_name, std::string con
 }
 
 
+/** \brief Tune the socket of this connection.
+ *
+ * \param[in] profile  The socket profile to apply.
+ * \param[in] link_class  The class of the link to the receiver.
+ */
+void data_sender::set_socket_profile(
+      socket_profile const & profile
+    , link_class_t link_class)
+{
+    f_socket_settings = profile.apply(get_socket(), link_class);
+    f_cork = profile.get_cork();
+}
+
+
 bool data_sender::open()
 {
     if(f_input.is_open())
@@ -82,8 +100,19 @@ bool data_sender::open()
         return false;
     }
 
+    // a file which keeps changing is shared from a snapshot, in which
+    // case the stats are those of the file when the snapshot was taken
+    //
+    std::string source(f_filename);
     struct stat s;
-    if(stat(f_filename.c_str(), &s) != 0)
+    shared_file::pointer_t file(f_server->get_file(f_file_request.f_id));
+    if(file != nullptr
+    && !file->get_snapshot().empty())
+    {
+        source = file->get_snapshot();
+        s = file->get_stat();
+    }
+    else if(stat(f_filename.c_str(), &s) != 0)
     {
         int const e(errno);
         SNAP_LOG_ERROR
@@ -97,42 +126,47 @@ bool data_sender::open()
             << SNAP_LOG_SEND;
         return false;
     }
-    passwd * pw(getpwuid(s.st_uid));
-    if(pw == nullptr)
+    // when the receiver is in the same identity domain, the uid/gid are
+    // the same on both sides so we can skip the name lookups entirely
+    //
+    bool const numeric_ids((f_file_request.f_flags & FILE_REQUEST_FLAG_IDENTITY_DOMAIN) != 0
+                        && f_file_request.f_identity_domain != 0
+                        && f_file_request.f_identity_domain == f_server->get_identity_domain());
+    std::string user_name;
+    std::string group_name;
+    if(numeric_ids)
     {
-        int const e(errno);
-        SNAP_LOG_ERROR
-            << "could not get user name from uid "
-            << s.st_uid
-            << " of file \""
-            << f_filename
-            << "\"; errno: "
-            << e
-            << ", "
-            << strerror(e)
-            << "."
-            << SNAP_LOG_SEND;
-        return false;
+        user_name = std::to_string(s.st_uid);
+        group_name = std::to_string(s.st_gid);
     }
-    group * gr(getgrgid(s.st_gid));
-    if(gr == nullptr)
+    else
     {
-        int const e(errno);
-        SNAP_LOG_ERROR
-            << "could not get group name from gid "
-            << s.st_gid
-            << " of file \""
-            << f_filename
-            << "\"; errno: "
-            << e
-            << ", "
-            << strerror(e)
-            << "."
-            << SNAP_LOG_SEND;
-        return false;
+        id_cache::pointer_t ids(f_server->get_id_cache());
+        if(!ids->get_user_name(s.st_uid, user_name))
+        {
+            SNAP_LOG_ERROR
+                << "could not get user name from uid "
+                << s.st_uid
+                << " of file \""
+                << f_filename
+                << "\"."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        if(!ids->get_group_name(s.st_gid, group_name))
+        {
+            SNAP_LOG_ERROR
+                << "could not get group name from gid "
+                << s.st_gid
+                << " of file \""
+                << f_filename
+                << "\"."
+                << SNAP_LOG_SEND;
+            return false;
+        }
     }
-    std::size_t const pw_len(strlen(pw->pw_name));
-    std::size_t const gr_len(strlen(gr->gr_name));
+    std::size_t const pw_len(user_name.length());
+    std::size_t const gr_len(group_name.length());
     if(pw_len == 0 || pw_len > 255
     || gr_len == 0 || gr_len > 255)
     {
@@ -163,13 +197,13 @@ bool data_sender::open()
         return false;
     }
 
-    f_input.open(f_filename);
+    f_input.open(source);
     if(!f_input.is_open())
     {
         int const e(errno);
         SNAP_LOG_ERROR
             << "error occurred trying to open \""
-            << f_filename
+            << source
             << "\"; errno: "
             << e
             << ", "
@@ -192,9 +226,10 @@ bool data_sender::open()
     header->f_groupname_length = gr_len;
     header->f_login_name_length = f_login_name.length();
     header->f_password_length = f_password.length();
+    header->f_flags = numeric_ids ? DATA_FLAG_NUMERIC_IDS : 0;
     memset(header->f_padding, 0, sizeof(header->f_padding));
-    memcpy(header + 1, pw->pw_name, pw_len);
-    memcpy(reinterpret_cast<char *>(header + 1) + pw_len, gr->gr_name, gr_len);
+    memcpy(header + 1, user_name.c_str(), pw_len);
+    memcpy(reinterpret_cast<char *>(header + 1) + pw_len, group_name.c_str(), gr_len);
     if(!f_login_name.empty())
     {
         memcpy(reinterpret_cast<char *>(header + 1) + pw_len + gr_len, f_login_name.c_str(), f_login_name.length());
@@ -208,10 +243,174 @@ bool data_sender::open()
     header->f_size = f_input.tellg();
     f_input.seekg(0, std::ios_base::beg);
 
+    // a file which keeps growing is sent as announced (the following
+    // data is part of the next announcement), this way the hashes of
+    // the appended and speculative modes match what the receivers have
+    //
+    if(file != nullptr)
+    {
+        std::uint64_t const announced(file->get_append_size());
+        if(announced > 0
+        && announced < header->f_size)
+        {
+            header->f_size = announced;
+        }
+    }
+
+    if((f_file_request.f_flags & FILE_REQUEST_FLAG_RESUME) != 0)
+    {
+        // the receiver already has the beginning of the file (another
+        // source stalled or copy_mode=append); the footer hash still
+        // covers the whole file so we have to hash the part we skip,
+        // which is done a little at a time by process_write() so a
+        // large prefix does not block the event loop
+        //
+        if(f_file_request.f_offset > header->f_size)
+        {
+            f_size = 0;
+            SNAP_LOG_ERROR
+                << "cannot resume \""
+                << f_filename
+                << "\" at offset "
+                << f_file_request.f_offset
+                << ", the file is only "
+                << header->f_size
+                << " bytes."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        std::uint64_t left(f_file_request.f_offset);
+        if(file != nullptr
+        && file->get_append_prefix(f_file_request.f_offset, f_murmur3))
+        {
+            // appended file, we kept the hash state at that offset so
+            // the beginning of the file does not have to be read again
+            //
+            f_input.seekg(f_file_request.f_offset, std::ios_base::beg);
+            left = 0;
+        }
+        f_prefix_left = left;
+        header->f_flags |= DATA_FLAG_RESUMED;
+        f_data_left = header->f_size - f_file_request.f_offset;
+    }
+    else
+    {
+        f_data_left = header->f_size;
+    }
+
+    // only send full segments until the footer is written
+    //
+    if(f_cork)
+    {
+        socket_profile::set_cork(get_socket(), true);
+    }
+
+    return true;
+}
+
+
+/** \brief Push a file to a receiver.
+ *
+ * In push mode, the source connects to the receiver and starts sending
+ * immediately. The data is preceded by a push_header with the name of
+ * the file so the receiver knows what it is getting. The receiver closes
+ * the connection if it does not want that file (i.e. it already has that
+ * version or a newer one).
+ *
+ * The admission control applies to pushes too. If we are busy, the push
+ * is skipped and the receiver gets the file once it handles the
+ * announcement.
+ *
+ * \param[in] file  The file to push.
+ *
+ * \return true if the push can start.
+ */
+bool data_sender::push(std::shared_ptr<shared_file> file)
+{
+    f_push = true;
+    f_file_request.f_id = file->get_id();
+    f_filename = file->get_filename();
+
+    std::string const peer(get_remote_address().to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    std::uint32_t retry_after_msec(0);
+    if(!f_server->get_send_admission()->admit(peer, retry_after_msec))
+    {
+        return false;
+    }
+    f_peer = peer;
+
+    if(f_filename.length() > std::numeric_limits<std::uint16_t>::max()
+    || !open())
+    {
+        f_server->get_send_admission()->release(f_peer);
+        f_peer.clear();
+        return false;
+    }
+
+    data_header const * header(reinterpret_cast<data_header const *>(f_buffer));
+    push_header push;
+    push.f_id = header->f_id;
+    push.f_mtime_sec = header->f_mtime_sec;
+    push.f_mtime_nsec = header->f_mtime_nsec;
+    push.f_filename_length = f_filename.length();
+    char const * p(reinterpret_cast<char const *>(&push));
+    f_preamble.insert(f_preamble.end(), p, p + sizeof(push));
+    f_preamble.insert(f_preamble.end(), f_filename.begin(), f_filename.end());
+
     return true;
 }
 
 
+/** \brief Check whether we can serve this request now.
+ *
+ * If too many files are being sent already, a BUSY packet is sent back
+ * to the receiver instead of the data. That packet includes the number
+ * of milliseconds after which the receiver should try again.
+ *
+ * \return true if the request can be served now.
+ */
+bool data_sender::admit()
+{
+    std::string const peer(get_remote_address().to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    std::uint32_t retry_after_msec(0);
+    if(f_server->get_send_admission()->admit(peer, retry_after_msec))
+    {
+        f_peer = peer;
+        return true;
+    }
+
+    SNAP_LOG_TRACE
+        << "too busy to send \""
+        << f_filename
+        << "\" to "
+        << peer
+        << "; asking to retry in "
+        << retry_after_msec
+        << "ms."
+        << SNAP_LOG_SEND;
+
+    data_busy busy;
+    busy.f_retry_after_msec = retry_after_msec;
+    memcpy(f_buffer, &busy, sizeof(busy));
+    f_size = sizeof(busy);
+    f_busy = true;
+
+    return false;
+}
+
+
+void data_sender::connection_removed()
+{
+    if(!f_peer.empty())
+    {
+        f_server->get_send_admission()->release(f_peer);
+        f_peer.clear();
+    }
+
+    tcp_server_client_connection::connection_removed();
+}
+
+
 bool data_sender::is_writer() const
 {
     return get_socket() != -1 && f_size > 0;
@@ -245,6 +444,13 @@ void data_sender::process_read()
         return;
     }
 
+    if(f_push)
+    {
+        // the receiver of a push does not send anything
+        //
+        return;
+    }
+
     if(f_input.is_open())
     {
         SNAP_LOG_ERROR
@@ -256,9 +462,9 @@ void data_sender::process_read()
     }
 
     int r(0);
-    if(f_received_bytes < sizeof(f_file_request))
+    if(f_received_bytes < f_request_size)
     {
-        r = read(&f_file_request + f_received_bytes, sizeof(f_file_request) - f_received_bytes);
+        r = read(reinterpret_cast<char *>(&f_file_request) + f_received_bytes, f_request_size - f_received_bytes);
         if(r == -1)
         {
             SNAP_LOG_ERROR
@@ -272,19 +478,31 @@ void data_sender::process_read()
             return;
         }
         f_received_bytes += r;
-        if(f_received_bytes >= sizeof(f_file_request))
+        if(f_received_bytes == FILE_REQUEST_BASE_SIZE
+        && f_request_size == FILE_REQUEST_BASE_SIZE)
         {
+            // older receivers only send the base request ('FILE'), in
+            // which case the extended fields remain zero
+            //
             if(f_file_request.f_magic[0] != 'F'
             || f_file_request.f_magic[1] != 'I'
             || f_file_request.f_magic[2] != 'L'
-            || f_file_request.f_magic[3] != 'E')
+            || (f_file_request.f_magic[3] != 'E' && f_file_request.f_magic[3] != '2'))
             {
                 SNAP_LOG_ERROR
-                    << "file request magic is not 'FILE'."
+                    << "file request magic is not 'FILE' or 'FIL2'."
                     << SNAP_LOG_SEND;
                 process_error();
                 return;
             }
+            if(f_file_request.f_magic[3] == '2')
+            {
+                f_request_size = sizeof(f_file_request);
+                return;
+            }
+        }
+        if(f_received_bytes >= f_request_size)
+        {
             shared_file::pointer_t file(f_server->get_file(f_file_request.f_id));
             if(file == nullptr)
             {
@@ -297,29 +515,125 @@ void data_sender::process_read()
                 return;
             }
             f_filename = file->get_filename();
-            open();
+            if(admit()
+            && !open())
+            {
+                process_error();
+                return;
+            }
         }
     }
 }
 
 
+/** \brief Hash some of the data the receiver already has.
+ *
+ * When a transfer is resumed, the footer hash still covers the whole
+ * file. This function hashes up to PREFIX_HASH_SIZE bytes of the
+ * beginning of the file each time it gets called.
+ *
+ * \return false if an error occurred, in which case process_error() was
+ * called.
+ */
+bool data_sender::hash_prefix()
+{
+    std::uint64_t left(std::min(f_prefix_left, PREFIX_HASH_SIZE));
+    f_prefix_left -= left;
+    while(left > 0)
+    {
+        char buf[1024 * 64];
+        f_input.read(buf, std::min(left, static_cast<std::uint64_t>(sizeof(buf))));
+        std::streamsize const r(f_input.gcount());
+        if(r <= 0)
+        {
+            SNAP_LOG_ERROR
+                << "could not read \""
+                << f_filename
+                << "\" up to the resume offset."
+                << SNAP_LOG_SEND;
+            process_error();
+            return false;
+        }
+        f_murmur3.add_data(buf, r);
+        left -= r;
+    }
+    return true;
+}
+
+
 void data_sender::process_write()
 {
     int r(0);
 
+    if(f_busy)
+    {
+        while(f_position < f_size)
+        {
+            r = write(f_buffer + f_position, f_size - f_position);
+            if(r <= 0)
+            {
+                if(r == -1)
+                {
+                    process_error();
+                }
+                return;
+            }
+            f_position += r;
+        }
+        remove_from_communicator();
+        return;
+    }
+
     if(!f_input.is_open())
     {
         throw rfs::logic_error("data_sender::process_write() expects f_input to be open. Did you call open() before adding it to the communicator?");
     }
 
+    if(f_prefix_left > 0)
+    {
+        // the socket remains writable so we get called again once the
+        // other connections had their turn
+        //
+        hash_prefix();
+        return;
+    }
+
+    while(f_preamble_position < f_preamble.size())
+    {
+        r = write(f_preamble.data() + f_preamble_position, f_preamble.size() - f_preamble_position);
+        if(r == -1)
+        {
+            process_error();
+            return;
+        }
+        if(r == 0)
+        {
+            return;
+        }
+        f_preamble_position += r;
+    }
+
     for(;;)
     {
         while(f_position < f_size)
         {
-            r = write(f_buffer, f_size - f_position);
+            r = write(f_buffer + f_position, f_size - f_position);
             if(r == -1)
             {
                 int const e(errno);
+                if(f_push
+                && (e == EPIPE || e == ECONNRESET))
+                {
+                    // the receiver declined the file
+                    //
+                    SNAP_LOG_DEBUG
+                        << "receiver declined the push of \""
+                        << f_filename
+                        << "\"."
+                        << SNAP_LOG_SEND;
+                    remove_from_communicator();
+                    return;
+                }
                 SNAP_LOG_ERROR
                     << "error occurred writing data; errno: "
                     << e
@@ -341,17 +655,29 @@ void data_sender::process_write()
         f_position = 0;
         f_size = 0;
 
-        if(f_input.eof())
+        if(f_input.eof()
+        || f_data_left == 0)
         {
             if(f_sent_footer)
             {
+                if(f_cork)
+                {
+                    socket_profile::set_cork(get_socket(), false);
+                }
+                SNAP_LOG_DEBUG
+                    << "sent \""
+                    << f_filename
+                    << "\" ("
+                    << f_socket_settings
+                    << ")."
+                    << SNAP_LOG_SEND;
                 remove_from_communicator();
                 return;
             }
         }
         else
         {
-            f_input.read(reinterpret_cast<char *>(f_buffer), sizeof(f_buffer));
+            f_input.read(reinterpret_cast<char *>(f_buffer), std::min(f_data_left, sizeof(f_buffer)));
             if(f_input.bad())
             {
                 int const e(errno);
@@ -372,6 +698,7 @@ void data_sender::process_write()
             {
                 f_murmur3.add_data(f_buffer, r);
                 f_size = r;
+                f_data_left -= r;
             }
         }
 
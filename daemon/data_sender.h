@@ -20,6 +20,7 @@
 // self
 //
 #include    "file_listener.h"
+#include    "socket_profile.h"
 
 
 
@@ -35,6 +36,7 @@
 
 // C++
 //
+#include    <cstddef>
 #include    <fstream>
 #include    <set>
 
@@ -49,6 +51,13 @@ constexpr murmur3::seed_t const  DATA_SEED_H1 = 0x0e2e6c7ea1639275ULL;
 constexpr murmur3::seed_t const  DATA_SEED_H2 = 0x1811764757f36729ULL;
 
 
+constexpr std::uint8_t const    DATA_FLAG_NUMERIC_IDS = 0x01;                   // user/group names are decimal uid/gid
+constexpr std::uint8_t const    DATA_FLAG_RESUMED = 0x02;                       // data starts at the requested offset
+
+constexpr std::uint8_t const    FILE_REQUEST_FLAG_IDENTITY_DOMAIN = 0x01;       // f_identity_domain is valid
+constexpr std::uint8_t const    FILE_REQUEST_FLAG_RESUME = 0x02;                // f_offset is valid
+
+
 struct data_header
 {
     std::uint8_t        f_magic[4] = { 'D', 'A', 'T', 'A' };
@@ -61,7 +70,8 @@ struct data_header
     std::uint8_t        f_groupname_length = 0;
     std::uint8_t        f_login_name_length = 0;
     std::uint8_t        f_password_length = 0;
-    std::uint8_t        f_padding[6] = {};          // uint64 means we need a multiple of 8 bytes
+    std::uint8_t        f_flags = 0;                // DATA_FLAG_...
+    std::uint8_t        f_padding[5] = {};          // uint64 means we need a multiple of 8 bytes
 };
 
 
@@ -72,14 +82,48 @@ struct data_footer
 };
 
 
+// the original request only has the magic and the identifier (8 bytes,
+// magic 'FILE'); the extended request uses the magic 'FIL2' and is only
+// sent to sources advertising the "extended_request" capability
+//
 struct file_request
 {
-    std::uint8_t        f_magic[4] = { 'F', 'I', 'L', 'E' };
+    std::uint8_t        f_magic[4] = { 'F', 'I', 'L', '2' };
+    std::uint32_t       f_id = 0;
+    std::uint8_t        f_flags = 0;                // FILE_REQUEST_FLAG_... (extended request only)
+    std::uint8_t        f_padding[3] = {};
+    std::uint32_t       f_identity_domain = 0;      // hash of the receiver identity domain
+    std::uint64_t       f_offset = 0;               // resume the transfer at this offset
+};
+
+constexpr std::size_t const     FILE_REQUEST_BASE_SIZE = offsetof(file_request, f_flags);
+
+
+// sent by the source before the data_header when it pushes a file, the
+// filename follows
+//
+struct push_header
+{
+    std::uint8_t        f_magic[4] = { 'P', 'U', 'S', 'H' };
     std::uint32_t       f_id = 0;
+    std::uint64_t       f_mtime_sec = 0;
+    std::uint64_t       f_mtime_nsec = 0;
+    std::uint16_t       f_filename_length = 0;
+    std::uint8_t        f_padding[6] = {};
+};
+
+
+// sent instead of a data_header when the sender cannot serve the request now
+//
+struct data_busy
+{
+    std::uint8_t        f_magic[4] = { 'B', 'U', 'S', 'Y' };
+    std::uint32_t       f_retry_after_msec = 0;
 };
 
 
 class server;
+class shared_file;
 
 
 class data_sender
@@ -95,7 +139,11 @@ public:
     data_sender &       operator = (data_sender const &) = delete;
 
     void                set_login_info(std::string const & login_name, std::string const & password);
+    void                set_socket_profile(
+                              socket_profile const & profile
+                            , link_class_t link_class);
     bool                open();
+    bool                push(std::shared_ptr<shared_file> file);
 
     // tcp_client_connection implementation
     //
@@ -103,7 +151,19 @@ public:
     virtual void        process_write() override;
     void                process_read() override;
 
+    // connection implementation
+    //
+    virtual void        connection_removed() override;
+
 private:
+    // bytes of a resumed transfer's prefix hashed per process_write() call
+    //
+    static constexpr std::uint64_t const
+                        PREFIX_HASH_SIZE = 1024 * 1024;
+
+    bool                admit();
+    bool                hash_prefix();
+
     server *            f_server = nullptr;
     std::string         f_login_name = std::string();
     std::string         f_password = std::string();
@@ -112,10 +172,20 @@ private:
     file_request        f_file_request = file_request();
     std::string         f_filename = std::string();
     std::size_t         f_received_bytes = 0;
+    std::size_t         f_request_size = FILE_REQUEST_BASE_SIZE;
     std::uint8_t        f_buffer[1024 * 4] = {};
     std::size_t         f_size = 0;
     std::size_t         f_position = 0;
+    std::size_t         f_data_left = 0;        // bytes of the file still to be sent
+    std::uint64_t       f_prefix_left = 0;      // resumed transfer: skipped bytes still to be hashed
     bool                f_sent_footer = false;
+    bool                f_busy = false;
+    std::string         f_peer = std::string();     // set once admitted
+    std::string         f_socket_settings = std::string();
+    bool                f_cork = false;
+    bool                f_push = false;
+    std::vector<char>   f_preamble = std::vector<char>();   // push_header + filename
+    std::size_t         f_preamble_position = 0;
 };
 
 
@@ -22,6 +22,7 @@
 #include    "data_server.h"
 
 #include    "data_receiver.h"
+#include    "server.h"
 
 
 // advgetopt
@@ -73,6 +74,7 @@ data_server::data_server(
             , reuse_addr)
     , f_server(s)
     , f_communicator(ed::communicator::instance())
+    , f_secure(mode == ed::mode_t::MODE_SECURE)
 {
     set_name("data_server");
 
@@ -99,6 +101,23 @@ void data_server::process_accept()
         return;
     }
 
+    if(f_push)
+    {
+        data_receiver::pointer_t receiver(std::make_shared<data_receiver>(
+                      f_server
+                    , new_client));
+        link_class_t const link_class(f_server->get_link_class(receiver->get_remote_address(), false));
+        receiver->set_socket_profile(f_server->get_socket_profile(link_class), link_class);
+        f_server->setup_push_receiver(receiver);
+        if(!f_communicator->add_connection(receiver))
+        {
+            SNAP_LOG_ERROR
+                << "new data_receiver connection could not be added to the ed::communicator."
+                << SNAP_LOG_SEND;
+        }
+        return;
+    }
+
     data_sender::pointer_t service(std::make_shared<data_sender>(
                   f_server
                 , new_client));
@@ -111,6 +130,8 @@ void data_server::process_accept()
     else
     {
         service->set_login_info(f_login_name, f_password);
+        link_class_t const link_class(f_server->get_link_class(service->get_remote_address(), f_secure));
+        service->set_socket_profile(f_server->get_socket_profile(link_class), link_class);
     }
 }
 
@@ -122,6 +143,12 @@ void data_server::set_login_info(std::string const & login_name, std::string con
 }
 
 
+void data_server::set_push(bool push)
+{
+    f_push = push;
+}
+
+
 
 } // namespace rfs_daemon
 // vim: ts=4 sw=4 et
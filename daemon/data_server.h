@@ -55,6 +55,7 @@ public:
     virtual void        process_accept() override;
 
     void                set_login_info(std::string const & login_name, std::string const & password);
+    void                set_push(bool push);
 
 private:
     server *            f_server = nullptr;
@@ -62,6 +63,8 @@ private:
                         f_communicator = ed::communicator::pointer_t();
     std::string         f_login_name = std::string();
     std::string         f_password = std::string();
+    bool                f_secure = false;
+    bool                f_push = false;             // accept pushed files instead of file requests
 };
 
 
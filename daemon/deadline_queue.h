@@ -0,0 +1,161 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the deadline_queue template.
+ *
+ * The deadline queue keeps items sorted by the time at which they become
+ * due. Adding, moving, and removing an item is O(log n) and the next
+ * deadline is available in O(1) so a timer can be set to wake up exactly
+ * when the first item is due instead of scanning all the items on every
+ * tick.
+ *
+ * The queue does not read any clock. The current time is always passed
+ * by the caller which makes it easy to test with a fake clock.
+ */
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <set>
+#include    <utility>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+template<typename T>
+class deadline_queue
+{
+public:
+    typedef std::vector<T>      items_t;
+
+    /** \brief Add an item or move its deadline.
+     *
+     * If the item is already in the queue, its previous deadline is
+     * replaced, whether the new one is earlier or later.
+     *
+     * \param[in] item  The item to add.
+     * \param[in] deadline  When the item becomes due.
+     */
+    void set(T const & item, snapdev::timespec_ex const & deadline)
+    {
+        auto const it(f_items.find(item));
+        if(it != f_items.end())
+        {
+            if(it->second == deadline)
+            {
+                return;
+            }
+            f_deadlines.erase(std::make_pair(it->second, item));
+            it->second = deadline;
+        }
+        else
+        {
+            f_items.emplace(item, deadline);
+        }
+        f_deadlines.emplace(deadline, item);
+    }
+
+    bool erase(T const & item)
+    {
+        auto const it(f_items.find(item));
+        if(it == f_items.end())
+        {
+            return false;
+        }
+        f_deadlines.erase(std::make_pair(it->second, item));
+        f_items.erase(it);
+        return true;
+    }
+
+    bool contains(T const & item) const
+    {
+        return f_items.find(item) != f_items.end();
+    }
+
+    bool empty() const
+    {
+        return f_items.empty();
+    }
+
+    std::size_t size() const
+    {
+        return f_items.size();
+    }
+
+    void clear()
+    {
+        f_deadlines.clear();
+        f_items.clear();
+    }
+
+    /** \brief Get the deadline of the first item.
+     *
+     * \return The earliest deadline or an empty timespec_ex if the
+     * queue is empty.
+     */
+    snapdev::timespec_ex next_deadline() const
+    {
+        if(f_deadlines.empty())
+        {
+            return snapdev::timespec_ex();
+        }
+        return f_deadlines.begin()->first;
+    }
+
+    /** \brief Remove the items which are due.
+     *
+     * \param[in] now  The current time.
+     *
+     * \return The items with a deadline at or before \p now, earliest first.
+     */
+    items_t pop_expired(snapdev::timespec_ex const & now)
+    {
+        items_t result;
+        while(!f_deadlines.empty()
+           && f_deadlines.begin()->first <= now)
+        {
+            result.push_back(f_deadlines.begin()->second);
+            f_items.erase(f_deadlines.begin()->second);
+            f_deadlines.erase(f_deadlines.begin());
+        }
+        return result;
+    }
+
+private:
+    std::set<std::pair<snapdev::timespec_ex, T>>
+                        f_deadlines = std::set<std::pair<snapdev::timespec_ex, T>>();
+    std::map<T, snapdev::timespec_ex>
+                        f_items = std::map<T, snapdev::timespec_ex>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,497 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the fanotify file listener.
+ *
+ * The inotify implementation (see file_listener) requires one watch per
+ * directory. With very many directories, the system runs out of watches
+ * (see /proc/sys/fs/inotify/max_user_watches) and adding them all at
+ * startup is slow.
+ *
+ * This listener instead puts one fanotify mark on each filesystem where
+ * one of the watched directories lives. The kernel then reports the
+ * changes made anywhere on that filesystem with the handle of the parent
+ * directory and the name of the file (FAN_REPORT_DFID_NAME). The handles
+ * of the watched directories are computed once at startup, so an event
+ * is filtered by looking up its directory handle in a map; events in
+ * other directories are ignored.
+ *
+ * The filesystem marks require the CAP_SYS_ADMIN capability and a kernel
+ * 5.9 or newer. The server creates the listener and its marks before it
+ * drops its root privileges; the file descriptor keeps working once the
+ * daemon runs as the unprivileged user. If the listener cannot be setup,
+ * the server falls back to inotify.
+ *
+ * The queue is bounded (the default of 16384 events) instead of using
+ * FAN_UNLIMITED_QUEUE: the marks see every write on the filesystem and
+ * a busy filesystem could make the kernel queue grow without limit.
+ * When the queue overflows, the kernel sends FAN_Q_OVERFLOW and all the
+ * watched directories get listed again.
+ */
+
+// self
+//
+#include    "fanotify_listener.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/pathinfo.h>
+
+
+// C
+//
+#include    <dirent.h>
+#include    <fcntl.h>
+#include    <fnmatch.h>
+#include    <sys/fanotify.h>
+#include    <sys/stat.h>
+#include    <sys/statfs.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Convert the events to listen to into a fanotify mask.
+ *
+ * The marks cover whole filesystems, so any event requested here gets
+ * reported for all the files of those filesystems. Only ask for the
+ * events at least one watched path uses.
+ *
+ * \param[in] events  The SNAP_FILE_CHANGED_EVENT_... of all the watches.
+ *
+ * \return The fanotify events to mark the filesystems with.
+ */
+std::uint64_t fanotify_events(ed::file_event_mask_t events)
+{
+    std::uint64_t mask(0);
+    if((events & ed::SNAP_FILE_CHANGED_EVENT_UPDATED) != 0)
+    {
+        mask |= FAN_CLOSE_WRITE;
+    }
+    if((events & ed::SNAP_FILE_CHANGED_EVENT_WRITE) != 0)
+    {
+        mask |= FAN_MODIFY;
+    }
+    if((events & ed::SNAP_FILE_CHANGED_EVENT_CREATED) != 0)
+    {
+        mask |= FAN_CREATE | FAN_MOVED_TO;
+    }
+    if((events & ed::SNAP_FILE_CHANGED_EVENT_DELETED) != 0)
+    {
+        mask |= FAN_DELETE | FAN_MOVED_FROM;
+    }
+    return mask;
+}
+
+
+struct dir_deleter
+{
+    void operator () (DIR * d) const
+    {
+        closedir(d);
+    }
+};
+
+
+/** \brief Generate the key used to find a watched directory.
+ *
+ * A file handle is only unique within its filesystem so the key includes
+ * the filesystem identifier.
+ *
+ * \param[in] fsid  The filesystem identifier (8 bytes).
+ * \param[in] handle  The handle of the directory.
+ *
+ * \return A binary string to use as a key.
+ */
+std::string handle_key(void const * fsid, file_handle const * handle)
+{
+    static_assert(sizeof(fsid_t) == sizeof(__kernel_fsid_t));
+
+    std::string key(reinterpret_cast<char const *>(fsid), sizeof(fsid_t));
+    key.append(reinterpret_cast<char const *>(&handle->handle_type), sizeof(handle->handle_type));
+    key.append(reinterpret_cast<char const *>(handle->f_handle), handle->handle_bytes);
+    return key;
+}
+
+
+
+} // no name namespace
+
+
+
+fanotify_listener::fanotify_listener(file_listener * listener)
+    : f_file_listener(listener)
+    , f_fanotify(fanotify_init(
+              FAN_CLASS_NOTIF
+            | FAN_REPORT_DFID_NAME
+            | FAN_CLOEXEC
+            | FAN_NONBLOCK
+        , O_RDONLY | O_LARGEFILE))
+{
+    set_name("fanotify_listener");
+
+    if(f_fanotify == nullptr)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "fanotify_init() failed (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << "); the fanotify watcher requires Linux 5.9+ and the CAP_SYS_ADMIN capability."
+            << SNAP_LOG_SEND;
+    }
+}
+
+
+/** \brief Mark the filesystems of all the watched paths.
+ *
+ * This function must be called while the daemon still has its root
+ * privileges. The events are only read once the listener gets added to
+ * the communicator, at which point list_existing_files() reports the
+ * files which already exist as the inotify implementation does.
+ *
+ * \return true if all the paths are being watched, false otherwise in
+ * which case the caller is expected to use inotify instead.
+ */
+bool fanotify_listener::watch()
+{
+    if(f_fanotify == nullptr)
+    {
+        return false;
+    }
+
+    ed::file_event_mask_t events(ed::SNAP_FILE_CHANGED_EVENT_NO_EVENTS);
+    for(auto const & w : f_file_listener->get_watches())
+    {
+        events |= w.second;
+    }
+    f_events = fanotify_events(events);
+
+    for(auto const & w : f_file_listener->get_watches())
+    {
+        if(!add_watch(w.first, w.second))
+        {
+            return false;
+        }
+    }
+
+    SNAP_LOG_CONFIGURATION
+        << "fanotify watching "
+        << f_directories.size()
+        << " path"
+        << (f_directories.size() == 1 ? "" : "s")
+        << " with "
+        << f_filesystems.size()
+        << " filesystem mark"
+        << (f_filesystems.size() == 1 ? "" : "s")
+        << "."
+        << SNAP_LOG_SEND;
+
+    return true;
+}
+
+
+/** \brief Add one watched path.
+ *
+ * The path is a directory or a pattern (or file name) in a directory.
+ * The handle of that directory is saved to recognize its events and its
+ * filesystem gets marked unless it already was.
+ *
+ * \param[in] path  The path as found in the watch-dirs configuration.
+ * \param[in] events  The SNAP_FILE_CHANGED_EVENT_... to report.
+ *
+ * \return true if the path is now being watched.
+ */
+bool fanotify_listener::add_watch(std::string const & path, ed::file_event_mask_t events)
+{
+    watched_dir dir;
+    dir.f_path = path;
+    dir.f_events = events;
+    struct stat s;
+    if(stat(path.c_str(), &s) != 0
+    || !S_ISDIR(s.st_mode))
+    {
+        dir.f_path = snapdev::pathinfo::dirname(path);
+        dir.f_pattern = snapdev::pathinfo::basename(path);
+    }
+
+    std::vector<char> buffer(sizeof(file_handle) + MAX_HANDLE_SZ);
+    file_handle * handle(reinterpret_cast<file_handle *>(buffer.data()));
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mount_id(0);
+    struct statfs fs;
+    if(name_to_handle_at(AT_FDCWD, dir.f_path.c_str(), handle, &mount_id, 0) != 0
+    || statfs(dir.f_path.c_str(), &fs) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not get a handle for directory \""
+            << dir.f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    std::string const fsid(reinterpret_cast<char const *>(&fs.f_fsid), sizeof(fs.f_fsid));
+    if(f_filesystems.insert(fsid).second)
+    {
+        if(fanotify_mark(
+                  f_fanotify.get()
+                , FAN_MARK_ADD | FAN_MARK_FILESYSTEM
+                , f_events
+                , AT_FDCWD
+                , dir.f_path.c_str()) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not mark the filesystem of \""
+                << dir.f_path
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+    }
+
+    f_directories.emplace(handle_key(&fs.f_fsid, handle), dir);
+    return true;
+}
+
+
+/** \brief Report the files found in the watched directories.
+ *
+ * This is done once the marks are in place and again if the fanotify
+ * queue overflows since events may have been lost.
+ */
+void fanotify_listener::list_existing_files()
+{
+    for(auto const & d : f_directories)
+    {
+        watched_dir const & dir(d.second);
+        if((dir.f_events & ed::SNAP_FILE_CHANGED_EVENT_EXISTS) == 0)
+        {
+            continue;
+        }
+        std::unique_ptr<DIR, dir_deleter> entries(opendir(dir.f_path.c_str()));
+        if(entries == nullptr)
+        {
+            continue;
+        }
+        for(;;)
+        {
+            struct dirent const * entry(readdir(entries.get()));
+            if(entry == nullptr)
+            {
+                break;
+            }
+            if(entry->d_type == DT_DIR)
+            {
+                continue;
+            }
+            if(!dir.f_pattern.empty()
+            && fnmatch(dir.f_pattern.c_str(), entry->d_name, FNM_EXTMATCH) != 0)
+            {
+                continue;
+            }
+            f_file_listener->process_change(dir.f_path, entry->d_name, ed::SNAP_FILE_CHANGED_EVENT_EXISTS);
+        }
+    }
+}
+
+
+int fanotify_listener::get_socket() const
+{
+    return f_fanotify.get();
+}
+
+
+bool fanotify_listener::valid_socket() const
+{
+    return f_fanotify != nullptr;
+}
+
+
+bool fanotify_listener::is_reader() const
+{
+    return true;
+}
+
+
+void fanotify_listener::process_read()
+{
+    for(;;)
+    {
+        ssize_t size(read(f_fanotify.get(), f_buffer.data(), f_buffer.size()));
+        if(size <= 0)
+        {
+            if(size < 0
+            && errno != EAGAIN
+            && errno != EINTR)
+            {
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "could not read fanotify events (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+            }
+            return;
+        }
+
+        fanotify_event_metadata const * metadata(reinterpret_cast<fanotify_event_metadata const *>(f_buffer.data()));
+        for(; FAN_EVENT_OK(metadata, size); metadata = FAN_EVENT_NEXT(metadata, size))
+        {
+            if(metadata->vers != FANOTIFY_METADATA_VERSION)
+            {
+                SNAP_LOG_ERROR
+                    << "unsupported fanotify metadata version "
+                    << static_cast<int>(metadata->vers)
+                    << "."
+                    << SNAP_LOG_SEND;
+                return;
+            }
+
+            if((metadata->mask & FAN_Q_OVERFLOW) != 0)
+            {
+                SNAP_LOG_WARNING
+                    << "the fanotify queue overflowed; checking all the watched directories again."
+                    << SNAP_LOG_SEND;
+                list_existing_files();
+                continue;
+            }
+
+            // with FAN_REPORT_DFID_NAME, the directory handle and the
+            // file name follow the metadata
+            //
+            char const * info(reinterpret_cast<char const *>(metadata) + metadata->metadata_len);
+            char const * const end(reinterpret_cast<char const *>(metadata) + metadata->event_len);
+            while(info + sizeof(fanotify_event_info_header) <= end)
+            {
+                fanotify_event_info_header const * header(reinterpret_cast<fanotify_event_info_header const *>(info));
+                if(header->len == 0)
+                {
+                    break;
+                }
+                if(header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+                {
+                    fanotify_event_info_fid const * fid(reinterpret_cast<fanotify_event_info_fid const *>(info));
+                    file_handle const * handle(reinterpret_cast<file_handle const *>(fid->handle));
+                    char const * name(reinterpret_cast<char const *>(handle->f_handle) + handle->handle_bytes);
+                    process_change(handle_key(&fid->fsid, handle), name, metadata->mask);
+                }
+                info += header->len;
+            }
+        }
+    }
+}
+
+
+/** \brief Convert one fanotify event.
+ *
+ * The events of directories which are not watched are ignored. The
+ * others are converted to the inotify events and handled by the
+ * file_listener.
+ *
+ * \param[in] handle  The key of the directory (see handle_key()).
+ * \param[in] filename  The name of the file which changed.
+ * \param[in] mask  The fanotify events.
+ */
+void fanotify_listener::process_change(
+      std::string const & handle
+    , std::string const & filename
+    , std::uint64_t mask)
+{
+    auto const range(f_directories.equal_range(handle));
+    if(range.first == range.second)
+    {
+        return;
+    }
+
+    ed::file_event_mask_t events(ed::SNAP_FILE_CHANGED_EVENT_NO_EVENTS);
+    if((mask & FAN_CLOSE_WRITE) != 0)
+    {
+        events |= ed::SNAP_FILE_CHANGED_EVENT_UPDATED;
+    }
+    if((mask & FAN_MODIFY) != 0)
+    {
+        events |= ed::SNAP_FILE_CHANGED_EVENT_WRITE;
+    }
+    if((mask & (FAN_CREATE | FAN_MOVED_TO)) != 0)
+    {
+        events |= ed::SNAP_FILE_CHANGED_EVENT_CREATED;
+    }
+    if((mask & (FAN_DELETE | FAN_MOVED_FROM)) != 0)
+    {
+        events |= ed::SNAP_FILE_CHANGED_EVENT_DELETED;
+    }
+
+    // the same directory may be watched with several patterns
+    //
+    ed::file_event_mask_t wanted(ed::SNAP_FILE_CHANGED_EVENT_NO_EVENTS);
+    std::string path;
+    for(auto it(range.first); it != range.second; ++it)
+    {
+        watched_dir const & dir(it->second);
+        if(!dir.f_pattern.empty()
+        && fnmatch(dir.f_pattern.c_str(), filename.c_str(), FNM_EXTMATCH) != 0)
+        {
+            continue;
+        }
+        wanted |= events & dir.f_events;
+        path = dir.f_path;
+    }
+    if(wanted != ed::SNAP_FILE_CHANGED_EVENT_NO_EVENTS)
+    {
+        f_file_listener->process_change(path, filename, wanted);
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,102 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the fanotify_listener class.
+ *
+ * The fanotify listener is an alternative to the inotify implementation
+ * of the file_listener which covers whole filesystems with one mark each.
+ */
+
+// self
+//
+#include    "file_listener.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/connection.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <map>
+#include    <set>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class fanotify_listener
+    : public ed::connection
+{
+public:
+    typedef std::shared_ptr<fanotify_listener>  pointer_t;
+
+                        fanotify_listener(file_listener * listener);
+                        fanotify_listener(fanotify_listener const &) = delete;
+    fanotify_listener & operator = (fanotify_listener const &) = delete;
+
+    bool                watch();
+    void                list_existing_files();
+
+    // connection implementation
+    //
+    virtual int         get_socket() const override;
+    virtual bool        valid_socket() const override;
+    virtual bool        is_reader() const override;
+    virtual void        process_read() override;
+
+private:
+    struct watched_dir
+    {
+        std::string             f_path = std::string();
+        std::string             f_pattern = std::string();      // empty when all the files are watched
+        ed::file_event_mask_t   f_events = ed::SNAP_FILE_CHANGED_EVENT_NO_EVENTS;
+    };
+    typedef std::multimap<std::string, watched_dir>     watched_dir_map_t;
+
+    bool                add_watch(std::string const & path, ed::file_event_mask_t events);
+    void                process_change(
+                              std::string const & handle
+                            , std::string const & filename
+                            , std::uint64_t mask);
+
+    file_listener *     f_file_listener = nullptr;
+    snapdev::raii_fd_t  f_fanotify = snapdev::raii_fd_t();
+    std::uint64_t       f_events = 0;           // the FAN_... events the filesystems are marked with
+    std::vector<char>   f_buffer = std::vector<char>(64 * 1024);
+    watched_dir_map_t   f_directories = watched_dir_map_t();   // file system ID + handle to the watched directory
+    std::set<std::string>
+                        f_filesystems = std::set<std::string>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -21,6 +21,7 @@
 //
 #include    "file_listener.h"
 
+#include    "received_file.h"
 #include    "server.h"
 
 
@@ -33,6 +34,7 @@
 //
 #include    <advgetopt/conf_file.h>
 #include    <advgetopt/exception.h>
+#include    <advgetopt/validator_integer.h>
 
 
 // snaplogger
@@ -156,6 +158,66 @@ std::string const & path_info::get_path_part() const
 }
 
 
+void path_info::set_durability(durability_t durability)
+{
+    f_durability = durability;
+}
+
+
+durability_t path_info::get_durability() const
+{
+    return f_durability;
+}
+
+
+void path_info::set_replicas(std::size_t replicas)
+{
+    f_replicas = replicas;
+}
+
+
+std::size_t path_info::get_replicas() const
+{
+    return f_replicas;
+}
+
+
+void path_info::set_transfer_mode(transfer_mode_t mode)
+{
+    f_transfer_mode = mode;
+}
+
+
+transfer_mode_t path_info::get_transfer_mode() const
+{
+    return f_transfer_mode;
+}
+
+
+void path_info::set_copy_mode(copy_mode_t mode)
+{
+    f_copy_mode = mode;
+}
+
+
+copy_mode_t path_info::get_copy_mode() const
+{
+    return f_copy_mode;
+}
+
+
+void path_info::set_speculative_sec(std::int64_t seconds)
+{
+    f_speculative_sec = seconds;
+}
+
+
+std::int64_t path_info::get_speculative_sec() const
+{
+    return f_speculative_sec;
+}
+
+
 bool path_info::operator < (path_info const & rhs) const
 {
     return f_path < rhs.f_path;
@@ -341,6 +403,126 @@ void file_listener::load_setup(std::string const & dir)
                 new_path_info.set_path_part(settings->get_parameter(path_part_name));
             }
 
+            std::string const durability_name(s + "::durability");
+            if(settings->has_parameter(durability_name))
+            {
+                std::string const durability(settings->get_parameter(durability_name));
+                if(durability.empty()
+                || durability == "none")
+                {
+                    new_path_info.set_durability(durability_t::DURABILITY_NONE);
+                }
+                else if(durability == "data")
+                {
+                    new_path_info.set_durability(durability_t::DURABILITY_DATA);
+                }
+                else if(durability == "full")
+                {
+                    new_path_info.set_durability(durability_t::DURABILITY_FULL);
+                }
+                else
+                {
+                    SNAP_LOG_RECOVERABLE_ERROR
+                        << "unrecognized durability \""
+                        << durability
+                        << "\" ignored."
+                        << SNAP_LOG_SEND;
+                    continue;
+                }
+            }
+
+            std::string const replicas_name(s + "::replicas");
+            if(settings->has_parameter(replicas_name))
+            {
+                std::string const replicas(settings->get_parameter(replicas_name));
+                std::int64_t count(0);
+                if(replicas.empty()
+                || replicas == "all")
+                {
+                    new_path_info.set_replicas(0);
+                }
+                else if(advgetopt::validator_integer::convert_string(replicas, count)
+                     && count > 0)
+                {
+                    new_path_info.set_replicas(count);
+                }
+                else
+                {
+                    SNAP_LOG_RECOVERABLE_ERROR
+                        << "unrecognized number of replicas \""
+                        << replicas
+                        << "\" ignored."
+                        << SNAP_LOG_SEND;
+                    continue;
+                }
+            }
+
+            std::string const transfer_name(s + "::transfer_mode");
+            if(settings->has_parameter(transfer_name))
+            {
+                std::string const transfer_mode(settings->get_parameter(transfer_name));
+                if(transfer_mode.empty()
+                || transfer_mode == "pull")
+                {
+                    new_path_info.set_transfer_mode(transfer_mode_t::TRANSFER_MODE_PULL);
+                }
+                else if(transfer_mode == "push")
+                {
+                    new_path_info.set_transfer_mode(transfer_mode_t::TRANSFER_MODE_PUSH);
+                }
+                else
+                {
+                    SNAP_LOG_RECOVERABLE_ERROR
+                        << "unrecognized transfer mode \""
+                        << transfer_mode
+                        << "\" ignored."
+                        << SNAP_LOG_SEND;
+                    continue;
+                }
+            }
+
+            std::string const copy_name(s + "::copy_mode");
+            if(settings->has_parameter(copy_name))
+            {
+                std::string const copy_mode(settings->get_parameter(copy_name));
+                if(copy_mode.empty()
+                || copy_mode == "full")
+                {
+                    new_path_info.set_copy_mode(copy_mode_t::COPY_MODE_FULL);
+                }
+                else if(copy_mode == "append")
+                {
+                    new_path_info.set_copy_mode(copy_mode_t::COPY_MODE_APPEND);
+                }
+                else
+                {
+                    SNAP_LOG_RECOVERABLE_ERROR
+                        << "unrecognized copy mode \""
+                        << copy_mode
+                        << "\" ignored."
+                        << SNAP_LOG_SEND;
+                    continue;
+                }
+            }
+
+            std::string const speculative_name(s + "::speculative_sec");
+            if(settings->has_parameter(speculative_name))
+            {
+                std::string const speculative(settings->get_parameter(speculative_name));
+                std::int64_t seconds(0);
+                if(!advgetopt::validator_integer::convert_string(speculative, seconds)
+                || seconds < 0)
+                {
+                    SNAP_LOG_RECOVERABLE_ERROR
+                        << "unrecognized number of seconds \""
+                        << speculative
+                        << "\" for speculative_sec ignored."
+                        << SNAP_LOG_SEND;
+                    continue;
+                }
+                new_path_info.set_speculative_sec(seconds);
+            }
+
             auto const inserted(f_path_info.insert(new_path_info));
             if(!inserted.second)
             {
@@ -360,13 +542,10 @@ void file_listener::load_setup(std::string const & dir)
                 //
                 // the UPDATED is used because that tells us the
                 // file was opened, updated (write/truncate) and
-                // then closed--at the moment we do not deal with
-                // files that get and stay opened (i.e. logs like
-                // files will not work well with snaprfs)
-                //
-                // TODO: listen for WRITE events and react after a
-                //       small amount of time (i.e. after say 5 sec.
-                //       still emit a copy event)
+                // then closed; files that get and stay opened (i.e.
+                // logs) are caught by the WRITE events and shared
+                // after transfer_after_sec or max_delay_sec; with
+                // copy_mode=append only their new data is sent
                 //
                 ed::file_event_mask_t flags(
                           ed::SNAP_FILE_CHANGED_EVENT_UPDATED
@@ -377,7 +556,7 @@ void file_listener::load_setup(std::string const & dir)
                 {
                     flags |= ed::SNAP_FILE_CHANGED_EVENT_DELETED;
                 }
-                watch_files(new_path_info.get_path(), flags);
+                f_watches[new_path_info.get_path()] = flags;
                 ++f_count_listens;
             }
             ++f_count_paths;
@@ -411,6 +590,74 @@ path_info const * file_listener::find_path_info(std::string const & path) const
 }
 
 
+/** \brief Get the paths where we accept changes from other computers.
+ *
+ * These are the paths where files can be received or where deletions
+ * get applied. The other snaprfs instances only send us announcements
+ * about files under one of these paths.
+ *
+ * \return The list of paths, possibly empty.
+ */
+advgetopt::string_list_t file_listener::get_interest_paths() const
+{
+    advgetopt::string_list_t result;
+    for(auto const & p : f_path_info)
+    {
+        if(p.get_path_mode() != path_mode_t::PATH_MODE_SEND_ONLY
+        || p.get_delete_mode() == delete_mode_t::DELETE_MODE_APPLY)
+        {
+            result.push_back(p.get_path());
+        }
+    }
+    return result;
+}
+
+
+/** \brief Check whether files get pushed to the other computers.
+ *
+ * \return true if at least one path uses transfer_mode=push.
+ */
+bool file_listener::has_push_paths() const
+{
+    for(auto const & p : f_path_info)
+    {
+        if(p.get_transfer_mode() == transfer_mode_t::TRANSFER_MODE_PUSH)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief Get the paths to listen to for changes.
+ *
+ * The key is the path as defined in the configuration, including the
+ * pattern if any. The value is the set of events to listen to.
+ *
+ * \return The paths of all the sections which are not receive-only.
+ */
+file_listener::watch_map_t const & file_listener::get_watches() const
+{
+    return f_watches;
+}
+
+
+/** \brief Start listening for changes using inotify.
+ *
+ * The inotify implementation requires one watch per directory. With
+ * many directories, the fanotify_listener can be used instead, in which
+ * case this function does not get called.
+ */
+void file_listener::watch()
+{
+    for(auto const & w : f_watches)
+    {
+        watch_files(w.first, w.second);
+    }
+}
+
+
 void file_listener::process_event(ed::file_event const & watch_event)
 {
 //std::cerr << "--- received event: " << watch_event.get_watched_path()
@@ -418,9 +665,36 @@ void file_listener::process_event(ed::file_event const & watch_event)
 //<< " -- " << watch_event.get_filename()
 //<< "\n";
 
-    std::string const fullpath(snapdev::pathinfo::canonicalize(
-                                      watch_event.get_watched_path()
-                                    , watch_event.get_filename()));
+    process_change(
+          watch_event.get_watched_path()
+        , watch_event.get_filename()
+        , watch_event.get_events());
+}
+
+
+/** \brief Handle a change to a file in one of the watched directories.
+ *
+ * This function is called by process_event() with the inotify events
+ * and by the fanotify_listener with the same events once converted.
+ *
+ * \param[in] path  The watched directory.
+ * \param[in] filename  The name of the file which changed.
+ * \param[in] events  The SNAP_FILE_CHANGED_EVENT_... flags.
+ */
+void file_listener::process_change(
+      std::string const & path
+    , std::string const & filename
+    , ed::file_event_mask_t events)
+{
+    if(received_file::is_temporary_name(filename))
+    {
+        // this is a file we are publishing, the final name will appear
+        // momentarily (see received_file::publish())
+        //
+        return;
+    }
+
+    std::string const fullpath(snapdev::pathinfo::canonicalize(path, filename));
 
     struct stat s;
     if(stat(fullpath.c_str(), &s) == 0)
@@ -434,9 +708,9 @@ void file_listener::process_event(ed::file_event const & watch_event)
         case S_IFLNK:
             SNAP_LOG_TODO
                 << "a directory or symbolic link \""
-                << watch_event.get_filename()
+                << filename
                 << "\" in directory \""
-                << watch_event.get_watched_path()
+                << path
                 << "\" changed, but we do not yet support those."
                 << SNAP_LOG_SEND;
             return;
@@ -449,9 +723,9 @@ void file_listener::process_event(ed::file_event const & watch_event)
             //
             SNAP_LOG_WARNING
                 << "found a non-regular file, directory, or symbolic link \""
-                << watch_event.get_filename()
+                << filename
                 << "\" in directory \""
-                << watch_event.get_watched_path()
+                << path
                 << "\" which is snaprfs cannot handle (type: "
                 << std::oct << (s.st_mode & (S_IFMT))
                 << " in octal)."
@@ -461,15 +735,15 @@ void file_listener::process_event(ed::file_event const & watch_event)
         }
     }
 
-    bool const updated((watch_event.get_events() & ed::SNAP_FILE_CHANGED_EVENT_UPDATED) != 0);
-    bool const modified((watch_event.get_events() & (ed::SNAP_FILE_CHANGED_EVENT_WRITE | ed::SNAP_FILE_CHANGED_EVENT_CREATED)) != 0);
-    bool const exists((watch_event.get_events() & ed::SNAP_FILE_CHANGED_EVENT_EXISTS) != 0);
+    bool const updated((events & ed::SNAP_FILE_CHANGED_EVENT_UPDATED) != 0);
+    bool const modified((events & (ed::SNAP_FILE_CHANGED_EVENT_WRITE | ed::SNAP_FILE_CHANGED_EVENT_CREATED)) != 0);
+    bool const exists((events & ed::SNAP_FILE_CHANGED_EVENT_EXISTS) != 0);
     if(updated || modified || exists)
     {
         f_server->updated_file(fullpath, updated);
     }
 
-    if((watch_event.get_events() & ed::SNAP_FILE_CHANGED_EVENT_DELETED) != 0)
+    if((events & ed::SNAP_FILE_CHANGED_EVENT_DELETED) != 0)
     {
         f_server->deleted_file(fullpath);
     }
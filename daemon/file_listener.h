@@ -23,8 +23,14 @@
 #include    <eventdispatcher/file_changed.h>
 
 
+// advgetopt
+//
+#include    <advgetopt/utils.h>
+
+
 // C++
 //
+#include    <map>
 #include    <set>
 
 
@@ -49,6 +55,28 @@ enum class delete_mode_t
 };
 
 
+enum class durability_t
+{
+    DURABILITY_NONE,            // rely on the OS to eventually flush the data (default)
+    DURABILITY_DATA,            // flush the file data before publishing it
+    DURABILITY_FULL,            // flush the file data, inode, and directory entry
+};
+
+
+enum class transfer_mode_t
+{
+    TRANSFER_MODE_PULL,         // announce the file, receivers connect to get it (default)
+    TRANSFER_MODE_PUSH,         // also connect to the receivers and stream the file immediately
+};
+
+
+enum class copy_mode_t
+{
+    COPY_MODE_FULL,             // send the whole file on each change (default)
+    COPY_MODE_APPEND,           // files only grow, send the new data only
+};
+
+
 class server;
 
 
@@ -67,6 +95,16 @@ public:
     delete_mode_t       get_delete_mode() const;
     void                set_path_part(std::string const & mode);
     std::string const & get_path_part() const;
+    void                set_durability(durability_t durability);
+    durability_t        get_durability() const;
+    void                set_replicas(std::size_t replicas);
+    std::size_t         get_replicas() const;
+    void                set_transfer_mode(transfer_mode_t mode);
+    transfer_mode_t     get_transfer_mode() const;
+    void                set_copy_mode(copy_mode_t mode);
+    copy_mode_t         get_copy_mode() const;
+    void                set_speculative_sec(std::int64_t seconds);
+    std::int64_t        get_speculative_sec() const;
 
     bool                operator < (path_info const & rhs) const;
 
@@ -75,6 +113,11 @@ private:
     path_mode_t         f_path_mode = path_mode_t::PATH_MODE_SEND_ONLY;
     delete_mode_t       f_delete_mode = delete_mode_t::DELETE_MODE_IGNORE;
     std::string         f_path_part = std::string();
+    durability_t        f_durability = durability_t::DURABILITY_NONE;
+    std::size_t         f_replicas = 0;     // 0 means all the interested computers
+    transfer_mode_t     f_transfer_mode = transfer_mode_t::TRANSFER_MODE_PULL;
+    copy_mode_t         f_copy_mode = copy_mode_t::COPY_MODE_FULL;
+    std::int64_t        f_speculative_sec = 0;  // 0 means files are only sent once written
 };
 
 
@@ -83,6 +126,8 @@ class file_listener
 {
 public:
     typedef std::shared_ptr<file_listener>  pointer_t;
+    typedef std::map<std::string, ed::file_event_mask_t>
+                                            watch_map_t;
 
                         file_listener(
                               server * s
@@ -92,6 +137,15 @@ public:
                         operator = (file_listener const &) = delete;
 
     path_info const *   find_path_info(std::string const & path) const;
+    advgetopt::string_list_t
+                        get_interest_paths() const;
+    watch_map_t const & get_watches() const;
+    bool                has_push_paths() const;
+    void                watch();
+    void                process_change(
+                              std::string const & path
+                            , std::string const & filename
+                            , ed::file_event_mask_t events);
 
     // file_changed implementation
     //
@@ -102,6 +156,7 @@ private:
 
     server *            f_server = nullptr;
     path_info::set_t    f_path_info = path_info::set_t();
+    watch_map_t         f_watches = watch_map_t();      // path (and pattern) to the events to listen to
     std::size_t         f_count_paths = 0;
     std::size_t         f_count_listens = 0;
 };
@@ -0,0 +1,356 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the gossip dissemination layer.
+ *
+ * With announce=gossip, the RFS_FILE_CHANGED and RFS_FILE_DELETED
+ * announcements are not sent to the other computers. Instead, each
+ * change is recorded in a log and the logs are exchanged between peers.
+ *
+ * Each change gets a sequence number from its origin (the snaprfs where
+ * the file changed). A version vector (origin -> highest sequence known)
+ * summarizes what a computer knows. Only the latest change of each file
+ * is kept so the log of an origin never grows larger than the number of
+ * files it shares.
+ *
+ * Every interval, each computer sends its version vector to a few random
+ * peers (the fanout) in an RFS_GOSSIP message:
+ *
+ * \li stage 0 (digest): the receiver replies with the changes the sender
+ * lacks and its own version vector;
+ * \li stage 1 (reply): the receiver applies the changes and sends back
+ * the changes the other side lacks;
+ * \li stage 2 (final): the receiver applies the changes.
+ *
+ * The changes are sent in sequence order and batches are limited to
+ * gossip_log::MAX_BATCH entries; what does not fit goes in the next round. This
+ * anti-entropy exchange repairs anything a computer missed (i.e. it was
+ * down or a message was lost) and the cost per computer stays the same
+ * whatever the size of the cluster. A change reaches all the computers
+ * in a number of rounds proportional to the logarithm of the number of
+ * computers.
+ *
+ * The messages still go through communicatord, but always to one
+ * specific computer; there are no more broadcasts.
+ */
+
+// self
+//
+#include    "gossip.h"
+
+#include    "server.h"
+
+
+// snaprfs
+//
+#include    <snaprfs/names.h>
+
+
+// communicatord
+//
+#include    <communicatord/names.h>
+
+
+// advgetopt
+//
+#include    <advgetopt/utils.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+namespace
+{
+
+
+
+constexpr int const             GOSSIP_STAGE_DIGEST = 0;
+constexpr int const             GOSSIP_STAGE_REPLY = 1;
+constexpr int const             GOSSIP_STAGE_FINAL = 2;
+
+constexpr std::int64_t const    ORIGIN_EXPIRE_USEC = peer_directory::EXPIRE_USEC;
+
+
+
+} // no name namespace
+
+
+
+gossip::gossip(
+          server * s
+        , std::int64_t interval_msec
+        , std::size_t fanout)
+    : timer(std::max(static_cast<std::int64_t>(100), interval_msec) * 1'000)
+    , f_server(s)
+    , f_fanout(std::max(static_cast<std::size_t>(1), fanout))
+{
+    set_name("gossip");
+}
+
+
+/** \brief Record a local change.
+ *
+ * The change reaches the other computers in the next rounds.
+ *
+ * \param[in] filename  The file that changed or was deleted.
+ * \param[in] id  The identifier of the file (used by the data sender).
+ * \param[in] mtime  The modification time of the file.
+ * \param[in] deleted  Whether the file was deleted.
+ */
+void gossip::add_change(
+      std::string const & filename
+    , std::uint32_t id
+    , snapdev::timespec_ex const & mtime
+    , bool deleted)
+{
+    f_log.add_change(
+              f_server->get_peer_id()
+            , filename
+            , id
+            , mtime
+            , deleted
+            , snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+}
+
+
+/** \brief Start a gossip round.
+ *
+ * Our version vector is sent to a few random peers which support gossip.
+ */
+void gossip::process_timeout()
+{
+    expire_origins();
+
+    std::vector<std::string> peers(f_server->get_peer_directory()->capable_servers("gossip"));
+    std::shuffle(peers.begin(), peers.end(), f_random);
+    if(peers.size() > f_fanout)
+    {
+        peers.resize(f_fanout);
+    }
+    for(auto const & name : peers)
+    {
+        send_gossip(name, GOSSIP_STAGE_DIGEST, gossip_change::vector_t());
+    }
+}
+
+
+/** \brief Handle an RFS_GOSSIP message.
+ *
+ * \param[in] msg  The RFS_GOSSIP message.
+ */
+void gossip::process_gossip(ed::message & msg)
+{
+    if(!msg.has_parameter(snaprfs::g_name_snaprfs_param_stage))
+    {
+        SNAP_LOG_ERROR
+            << "received RFS_GOSSIP message without a stage: \""
+            << msg
+            << "\"."
+            << SNAP_LOG_SEND;
+        return;
+    }
+    int const stage(msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_stage));
+
+    bool secure_only(false);
+    if(msg.has_parameter(communicatord::g_name_communicatord_param_secure_remote))
+    {
+        secure_only = advgetopt::is_true(msg.get_parameter(communicatord::g_name_communicatord_param_secure_remote));
+    }
+
+    std::string sender_peer_id;
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_peer))
+    {
+        sender_peer_id = msg.get_parameter(snaprfs::g_name_snaprfs_param_peer);
+    }
+
+    gossip_change::vector_t changes;
+    std::int64_t count(0);
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_changes))
+    {
+        count = msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_changes);
+    }
+    for(std::int64_t idx(0); idx < count; ++idx)
+    {
+        std::string const name(snaprfs::g_name_snaprfs_param_change + std::to_string(idx));
+        if(!msg.has_parameter(name))
+        {
+            break;
+        }
+        gossip_change c;
+        if(!c.from_string(msg.get_parameter(name)))
+        {
+            SNAP_LOG_WARNING
+                << "ignoring invalid gossip change \""
+                << msg.get_parameter(name)
+                << "\"."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+        if(c.f_server_name.empty()
+        && c.f_origin == sender_peer_id)
+        {
+            // the origin does not know its own communicatord name
+            //
+            c.f_server_name = msg.get_sent_from_server();
+        }
+        changes.push_back(c);
+    }
+    merge(changes, secure_only);
+
+    switch(stage)
+    {
+    case GOSSIP_STAGE_DIGEST:
+        // the sender wants what it is missing and our vector
+        //
+        if(msg.has_parameter(snaprfs::g_name_snaprfs_param_vector))
+        {
+            gossip_log::version_vector_t const remote(gossip_log::decode_vector(msg.get_parameter(snaprfs::g_name_snaprfs_param_vector)));
+            send_gossip(msg.get_sent_from_server(), GOSSIP_STAGE_REPLY, f_log.missing_changes(remote));
+        }
+        break;
+
+    case GOSSIP_STAGE_REPLY:
+        // send the changes the other side is missing, if any
+        //
+        if(msg.has_parameter(snaprfs::g_name_snaprfs_param_vector))
+        {
+            gossip_log::version_vector_t const remote(gossip_log::decode_vector(msg.get_parameter(snaprfs::g_name_snaprfs_param_vector)));
+            if(f_log.lacks_changes(remote))
+            {
+                send_gossip(msg.get_sent_from_server(), GOSSIP_STAGE_FINAL, f_log.missing_changes(remote));
+            }
+        }
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+
+/** \brief Apply the changes we did not know about.
+ *
+ * \param[in] changes  The changes received from a peer.
+ * \param[in] secure_only  Whether the message went through a secure
+ * connection, in which case the file must be transferred securely.
+ */
+void gossip::merge(gossip_change::vector_t const & changes, bool secure_only)
+{
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    for(auto const & c : changes)
+    {
+        if(c.f_origin == f_server->get_peer_id())
+        {
+            continue;
+        }
+
+        if(!f_log.merge(c, now))
+        {
+            // already known
+            //
+            continue;
+        }
+
+        if(c.f_deleted)
+        {
+            f_server->delete_local_file(c.f_filename);
+        }
+        else
+        {
+            receive_request request;
+            request.f_filename = c.f_filename;
+            request.f_mtime = c.f_mtime;
+            request.f_id = c.f_id;
+            f_server->file_announced(request, c.f_origin, c.f_server_name, secure_only);
+        }
+    }
+}
+
+
+void gossip::send_gossip(
+      std::string const & server_name
+    , int stage
+    , gossip_change::vector_t const & changes)
+{
+    ed::message msg;
+    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_gossip);
+    msg.set_server(server_name);
+    msg.set_service(snaprfs::g_name_snaprfs_param_service);
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_peer, f_server->get_peer_id());
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_stage, stage);
+    if(stage != GOSSIP_STAGE_FINAL)
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_vector, f_log.encode_vector());
+    }
+    if(!changes.empty())
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_changes, static_cast<std::uint64_t>(changes.size()));
+        for(std::size_t idx(0); idx < changes.size(); ++idx)
+        {
+            msg.add_parameter(
+                      snaprfs::g_name_snaprfs_param_change + std::to_string(idx)
+                    , changes[idx].to_string());
+        }
+    }
+    f_server->get_messenger()->send_message(msg);
+}
+
+
+/** \brief Forget about origins which are gone.
+ *
+ * An origin which restarted has a new peer identifier. The log of the
+ * old identifier is dropped once that peer left the peer directory and
+ * nothing new came from it for a while.
+ */
+void gossip::expire_origins()
+{
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    peer_directory::pointer_t directory(f_server->get_peer_directory());
+    for(auto const & origin : f_log.idle_origins(now, ORIGIN_EXPIRE_USEC))
+    {
+        if(origin != f_server->get_peer_id()
+        && directory->find(origin) == nullptr)
+        {
+            f_log.erase_origin(origin);
+        }
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,108 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the gossip class.
+ *
+ * The gossip agent disseminates the file change announcements between
+ * the snaprfs instances using periodic anti-entropy exchanges with a few
+ * random peers instead of cluster wide broadcasts.
+ */
+
+// self
+//
+#include    "gossip_log.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/message.h>
+#include    <eventdispatcher/timer.h>
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <memory>
+#include    <random>
+#include    <string>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class server;
+
+
+class gossip
+    : public ed::timer
+{
+public:
+    typedef std::shared_ptr<gossip>         pointer_t;
+
+    static constexpr std::int64_t const     DEFAULT_INTERVAL_MSEC = 1'000;
+    static constexpr std::size_t const      DEFAULT_FANOUT = 3;
+
+                        gossip(
+                              server * s
+                            , std::int64_t interval_msec
+                            , std::size_t fanout);
+                        gossip(gossip const &) = delete;
+    gossip &            operator = (gossip const &) = delete;
+
+    void                add_change(
+                              std::string const & filename
+                            , std::uint32_t id
+                            , snapdev::timespec_ex const & mtime
+                            , bool deleted);
+    void                process_gossip(ed::message & msg);
+
+    // timer implementation
+    //
+    virtual void        process_timeout() override;
+
+private:
+    void                merge(
+                              gossip_change::vector_t const & changes
+                            , bool secure_only);
+    void                send_gossip(
+                              std::string const & server_name
+                            , int stage
+                            , gossip_change::vector_t const & changes);
+    void                expire_origins();
+
+    server *            f_server = nullptr;
+    std::size_t         f_fanout = DEFAULT_FANOUT;
+    gossip_log          f_log = gossip_log();
+    std::minstd_rand    f_random = std::minstd_rand(std::random_device()());
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,318 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the gossip log.
+ *
+ * The log keeps, for each origin, the highest sequence number known and
+ * the latest change of each of its files. It does not send or receive
+ * anything; the gossip class uses it to build and apply the RFS_GOSSIP
+ * messages. All the times are monotonic microseconds given by the caller.
+ */
+
+// self
+//
+#include    "gossip_log.h"
+
+
+// advgetopt
+//
+#include    <advgetopt/utils.h>
+#include    <advgetopt/validator_integer.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <sstream>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+/** \brief Serialize a change.
+ *
+ * The format is:
+ *
+ * \code
+ *     <origin>:<sequence>:<id>:<mtime>:<deleted>:<server name>:<filename>
+ * \endcode
+ *
+ * The filename is last since it may include colons.
+ *
+ * \return The change as a string.
+ */
+std::string gossip_change::to_string() const
+{
+    std::stringstream ss;
+    ss << f_origin
+       << ':' << f_sequence
+       << ':' << f_id
+       << ':' << f_mtime
+       << ':' << (f_deleted ? 1 : 0)
+       << ':' << f_server_name
+       << ':' << f_filename;
+    return ss.str();
+}
+
+
+/** \brief Parse a change.
+ *
+ * \param[in] change  The string created by to_string().
+ *
+ * \return true if the change is valid.
+ */
+bool gossip_change::from_string(std::string const & change)
+{
+    std::string::size_type pos(0);
+    std::string fields[6];
+    for(auto & f : fields)
+    {
+        std::string::size_type const end(change.find(':', pos));
+        if(end == std::string::npos)
+        {
+            return false;
+        }
+        f = change.substr(pos, end - pos);
+        pos = end + 1;
+    }
+
+    std::int64_t sequence(0);
+    std::int64_t id(0);
+    if(fields[0].empty()
+    || !advgetopt::validator_integer::convert_string(fields[1], sequence)
+    || sequence <= 0
+    || !advgetopt::validator_integer::convert_string(fields[2], id)
+    || (fields[4] != "0" && fields[4] != "1"))
+    {
+        return false;
+    }
+
+    f_origin = fields[0];
+    f_sequence = sequence;
+    f_id = static_cast<std::uint32_t>(id);
+    f_mtime = snapdev::timespec_ex(fields[3]);
+    f_deleted = fields[4] == "1";
+    f_server_name = fields[5];
+    f_filename = change.substr(pos);
+
+    return !f_filename.empty()
+        && f_filename[0] == '/';
+}
+
+
+/** \brief Record a local change.
+ *
+ * \param[in] origin  Our own peer identifier.
+ * \param[in] filename  The file that changed or was deleted.
+ * \param[in] id  The identifier of the file (used by the data sender).
+ * \param[in] mtime  The modification time of the file.
+ * \param[in] deleted  Whether the file was deleted.
+ * \param[in] now  The current time.
+ */
+void gossip_log::add_change(
+      std::string const & origin
+    , std::string const & filename
+    , std::uint32_t id
+    , snapdev::timespec_ex const & mtime
+    , bool deleted
+    , std::int64_t now)
+{
+    origin_state & o(f_origins[origin]);
+    ++o.f_sequence;
+    o.f_last_update = now;
+
+    gossip_change & c(o.f_files[filename]);
+    c.f_origin = origin;
+    c.f_sequence = o.f_sequence;
+    c.f_id = id;
+    c.f_mtime = mtime;
+    c.f_deleted = deleted;
+    c.f_filename = filename;
+}
+
+
+/** \brief Record a change received from a peer.
+ *
+ * \param[in] change  The change to record.
+ * \param[in] now  The current time.
+ *
+ * \return true if the change is new, false if it was already known.
+ */
+bool gossip_log::merge(gossip_change const & change, std::int64_t now)
+{
+    origin_state & o(f_origins[change.f_origin]);
+    if(change.f_sequence <= o.f_sequence)
+    {
+        return false;
+    }
+    o.f_sequence = change.f_sequence;
+    o.f_last_update = now;
+    o.f_files[change.f_filename] = change;
+    return true;
+}
+
+
+std::string gossip_log::encode_vector() const
+{
+    std::string result;
+    for(auto const & o : f_origins)
+    {
+        if(!result.empty())
+        {
+            result += ',';
+        }
+        result += o.first;
+        result += ':';
+        result += std::to_string(o.second.f_sequence);
+    }
+    return result;
+}
+
+
+gossip_log::version_vector_t gossip_log::decode_vector(std::string const & vector)
+{
+    version_vector_t result;
+
+    advgetopt::string_list_t entries;
+    advgetopt::split_string(vector, entries, { "," });
+    for(auto const & e : entries)
+    {
+        std::string::size_type const pos(e.find(':'));
+        std::int64_t sequence(0);
+        if(pos == std::string::npos
+        || pos == 0
+        || !advgetopt::validator_integer::convert_string(e.substr(pos + 1), sequence)
+        || sequence < 0)
+        {
+            continue;
+        }
+        result[e.substr(0, pos)] = sequence;
+    }
+
+    return result;
+}
+
+
+/** \brief Get the changes the remote computer does not have yet.
+ *
+ * The changes of each origin are sorted by sequence number so the
+ * remote computer can update its version vector even if the batch is
+ * truncated.
+ *
+ * \param[in] remote  The version vector of the remote computer.
+ *
+ * \return Up to MAX_BATCH changes.
+ */
+gossip_change::vector_t gossip_log::missing_changes(version_vector_t const & remote) const
+{
+    gossip_change::vector_t result;
+    for(auto const & o : f_origins)
+    {
+        std::uint64_t known(0);
+        auto const it(remote.find(o.first));
+        if(it != remote.end())
+        {
+            known = it->second;
+        }
+        if(o.second.f_sequence <= known)
+        {
+            continue;
+        }
+
+        gossip_change::vector_t changes;
+        for(auto const & f : o.second.f_files)
+        {
+            if(f.second.f_sequence > known)
+            {
+                changes.push_back(f.second);
+            }
+        }
+        std::sort(
+                  changes.begin()
+                , changes.end()
+                , [](auto const & a, auto const & b)
+                {
+                    return a.f_sequence < b.f_sequence;
+                });
+        for(auto const & c : changes)
+        {
+            if(result.size() >= MAX_BATCH)
+            {
+                return result;
+            }
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+
+bool gossip_log::lacks_changes(version_vector_t const & remote) const
+{
+    for(auto const & o : f_origins)
+    {
+        auto const it(remote.find(o.first));
+        if(it == remote.end()
+        || it->second < o.second.f_sequence)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief Get the origins which did not change for a while.
+ *
+ * \param[in] now  The current time.
+ * \param[in] max_idle_usec  How long an origin can stay idle.
+ *
+ * \return The peer identifiers of the idle origins.
+ */
+std::vector<std::string> gossip_log::idle_origins(std::int64_t now, std::int64_t max_idle_usec) const
+{
+    std::vector<std::string> result;
+    for(auto const & o : f_origins)
+    {
+        if(now - o.second.f_last_update > max_idle_usec)
+        {
+            result.push_back(o.first);
+        }
+    }
+    return result;
+}
+
+
+void gossip_log::erase_origin(std::string const & origin)
+{
+    f_origins.erase(origin);
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
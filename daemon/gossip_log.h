@@ -0,0 +1,105 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the gossip_log class.
+ *
+ * The gossip log holds the latest change of each file per origin and
+ * the version vector used by the gossip exchanges.
+ */
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <string>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+struct gossip_change
+{
+    typedef std::vector<gossip_change>      vector_t;
+
+    std::string         f_origin = std::string();       // peer id of the source
+    std::string         f_server_name = std::string();  // communicatord name of the source
+    std::uint64_t       f_sequence = 0;
+    std::uint32_t       f_id = 0;
+    snapdev::timespec_ex
+                        f_mtime = snapdev::timespec_ex();
+    bool                f_deleted = false;
+    std::string         f_filename = std::string();
+
+    std::string         to_string() const;
+    bool                from_string(std::string const & change);
+};
+
+
+class gossip_log
+{
+public:
+    typedef std::map<std::string, std::uint64_t>
+                                            version_vector_t;
+
+    static constexpr std::size_t const      MAX_BATCH = 100;
+
+    void                add_change(
+                              std::string const & origin
+                            , std::string const & filename
+                            , std::uint32_t id
+                            , snapdev::timespec_ex const & mtime
+                            , bool deleted
+                            , std::int64_t now);
+    bool                merge(gossip_change const & change, std::int64_t now);
+    std::string         encode_vector() const;
+    static version_vector_t
+                        decode_vector(std::string const & vector);
+    gossip_change::vector_t
+                        missing_changes(version_vector_t const & remote) const;
+    bool                lacks_changes(version_vector_t const & remote) const;
+    std::vector<std::string>
+                        idle_origins(std::int64_t now, std::int64_t max_idle_usec) const;
+    void                erase_origin(std::string const & origin);
+
+private:
+    struct origin_state
+    {
+        std::uint64_t   f_sequence = 0;
+        std::int64_t    f_last_update = 0;
+        std::map<std::string, gossip_change>
+                        f_files = std::map<std::string, gossip_change>();
+    };
+
+    std::map<std::string, origin_state>
+                        f_origins = std::map<std::string, origin_state>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,219 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the user and group cache.
+ *
+ * The getpwuid(3), getgrgid(3), getpwnam(3), and getgrnam(3) functions go
+ * through NSS. When NSS is setup to use LDAP or a similar service, each
+ * call may take milliseconds. Since the same few users and groups are
+ * used over and over again, we keep the results for a while (ttl).
+ *
+ * Failed lookups are cached too so a file owned by an unknown user does
+ * not generate a network request each time it gets transferred.
+ *
+ * The lookups themselves happen without holding the mutex so one slow
+ * lookup does not block the other threads.
+ */
+
+// self
+//
+#include    "id_cache.h"
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// cppthread
+//
+#include    <cppthread/guard.h>
+
+
+// C
+//
+#include    <grp.h>
+#include    <pwd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+id_cache::id_cache(std::int64_t ttl)
+    : f_ttl(ttl)
+{
+}
+
+
+bool id_cache::get_user_name(uid_t uid, std::string & name)
+{
+    bool found(false);
+    if(find(f_user_names, uid, name, found))
+    {
+        return found;
+    }
+
+    passwd pw;
+    passwd * result(nullptr);
+    char buf[1024 * 4];
+    found = getpwuid_r(uid, &pw, buf, sizeof(buf), &result) == 0
+         && result != nullptr;
+    name = found ? pw.pw_name : std::string();
+
+    save(f_user_names, uid, name, found);
+    return found;
+}
+
+
+bool id_cache::get_group_name(gid_t gid, std::string & name)
+{
+    bool found(false);
+    if(find(f_group_names, gid, name, found))
+    {
+        return found;
+    }
+
+    group gr;
+    group * result(nullptr);
+    char buf[1024 * 4];
+    found = getgrgid_r(gid, &gr, buf, sizeof(buf), &result) == 0
+         && result != nullptr;
+    name = found ? gr.gr_name : std::string();
+
+    save(f_group_names, gid, name, found);
+    return found;
+}
+
+
+bool id_cache::get_user_id(std::string const & name, uid_t & uid)
+{
+    bool found(false);
+    if(find(f_user_ids, name, uid, found))
+    {
+        return found;
+    }
+
+    passwd pw;
+    passwd * result(nullptr);
+    char buf[1024 * 4];
+    found = getpwnam_r(name.c_str(), &pw, buf, sizeof(buf), &result) == 0
+         && result != nullptr;
+    uid = found ? pw.pw_uid : static_cast<uid_t>(-1);
+
+    save(f_user_ids, name, uid, found);
+    return found;
+}
+
+
+bool id_cache::get_group_id(std::string const & name, gid_t & gid)
+{
+    bool found(false);
+    if(find(f_group_ids, name, gid, found))
+    {
+        return found;
+    }
+
+    group gr;
+    group * result(nullptr);
+    char buf[1024 * 4];
+    found = getgrnam_r(name.c_str(), &gr, buf, sizeof(buf), &result) == 0
+         && result != nullptr;
+    gid = found ? gr.gr_gid : static_cast<gid_t>(-1);
+
+    save(f_group_ids, name, gid, found);
+    return found;
+}
+
+
+/** \brief Forget all the cached entries.
+ *
+ * This can be used when the administrator knows that the users and
+ * groups were modified (i.e. on a RELOAD).
+ */
+void id_cache::clear()
+{
+    cppthread::guard lock(f_mutex);
+
+    f_user_names.clear();
+    f_group_names.clear();
+    f_user_ids.clear();
+    f_group_ids.clear();
+}
+
+
+std::int64_t id_cache::now() const
+{
+    return snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).tv_sec;
+}
+
+
+template<typename K, typename V>
+bool id_cache::find(
+      std::map<K, entry<V>> const & m
+    , K const & key
+    , V & value
+    , bool & found)
+{
+    cppthread::guard lock(f_mutex);
+
+    auto const it(m.find(key));
+    if(it == m.end()
+    || it->second.f_expire <= now())
+    {
+        return false;
+    }
+
+    value = it->second.f_value;
+    found = it->second.f_found;
+    return true;
+}
+
+
+template<typename K, typename V>
+void id_cache::save(
+      std::map<K, entry<V>> & m
+    , K const & key
+    , V const & value
+    , bool found)
+{
+    if(f_ttl <= 0)
+    {
+        return;
+    }
+
+    cppthread::guard lock(f_mutex);
+
+    entry<V> & e(m[key]);
+    e.f_value = value;
+    e.f_found = found;
+    e.f_expire = now() + f_ttl;
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,106 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the id_cache class.
+ *
+ * The id_cache remembers the user and group names and identifiers for a
+ * little while so we do not hit NSS (which may query an LDAP server) for
+ * each file we send or receive.
+ */
+
+// cppthread
+//
+#include    <cppthread/mutex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <memory>
+#include    <string>
+
+
+// C
+//
+#include    <sys/types.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class id_cache
+{
+public:
+    typedef std::shared_ptr<id_cache>   pointer_t;
+
+    static constexpr std::int64_t const DEFAULT_TTL = 300;     // in seconds
+
+                        id_cache(std::int64_t ttl = DEFAULT_TTL);
+                        id_cache(id_cache const &) = delete;
+    id_cache &          operator = (id_cache const &) = delete;
+
+    bool                get_user_name(uid_t uid, std::string & name);
+    bool                get_group_name(gid_t gid, std::string & name);
+    bool                get_user_id(std::string const & name, uid_t & uid);
+    bool                get_group_id(std::string const & name, gid_t & gid);
+    void                clear();
+
+private:
+    template<typename V>
+    struct entry
+    {
+        V               f_value = V();
+        bool            f_found = false;
+        std::int64_t    f_expire = 0;
+    };
+
+    std::int64_t        now() const;
+    template<typename K, typename V>
+    bool                find(
+                              std::map<K, entry<V>> const & m
+                            , K const & key
+                            , V & value
+                            , bool & found);
+    template<typename K, typename V>
+    void                save(
+                              std::map<K, entry<V>> & m
+                            , K const & key
+                            , V const & value
+                            , bool found);
+
+    cppthread::mutex    f_mutex = cppthread::mutex();
+    std::int64_t        f_ttl = DEFAULT_TTL;
+    std::map<uid_t, entry<std::string>>
+                        f_user_names = std::map<uid_t, entry<std::string>>();
+    std::map<gid_t, entry<std::string>>
+                        f_group_names = std::map<gid_t, entry<std::string>>();
+    std::map<std::string, entry<uid_t>>
+                        f_user_ids = std::map<std::string, entry<uid_t>>();
+    std::map<std::string, entry<gid_t>>
+                        f_group_ids = std::map<std::string, entry<gid_t>>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
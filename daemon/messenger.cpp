@@ -29,6 +29,7 @@
 //
 #include    "messenger.h"
 
+#include    "base64.h"
 #include    "server.h"
 
 
@@ -89,6 +90,10 @@ messenger::messenger(server * s, advgetopt::getopt & opts)
     f_dispatcher->add_matches({
         DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_file_changed, &messenger::msg_file_changed),
         DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_file_deleted, &messenger::msg_file_deleted),
+        DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_get_peer_info, &messenger::msg_get_peer_info),
+        DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_gossip, &messenger::msg_gossip),
+        DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_peer_info, &messenger::msg_peer_info),
+        DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_stat, &messenger::msg_stat),
 
         // the following are not yet implemented and maybe that was wrong
         // so I may not implement them (i.e. the copy of a specific set of
@@ -103,7 +108,6 @@ messenger::messenger(server * s, advgetopt::getopt & opts)
         //DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_configuration_filenames, &messenger::msg_configuration_filenames),
         //DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_list, &messenger::msg_list),
         //DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_ping, &messenger::msg_ping),
-        //DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_stat, &messenger::msg_stat),
         //DISPATCHER_MATCH(snaprfs::g_name_snaprfs_cmd_rfs_version, &messenger::msg_version),
     });
 
@@ -142,11 +146,12 @@ void messenger::msg_file_changed(ed::message & msg)
 {
     if(!msg.has_parameter(snaprfs::g_name_snaprfs_param_filename)
     || !msg.has_parameter(snaprfs::g_name_snaprfs_param_id)
-    || !msg.has_parameter(snaprfs::g_name_snaprfs_param_my_addresses)
+    || (!msg.has_parameter(snaprfs::g_name_snaprfs_param_peer)
+        && !msg.has_parameter(snaprfs::g_name_snaprfs_param_my_addresses))
     || !msg.has_parameter(snaprfs::g_name_snaprfs_param_mtime))
     {
         SNAP_LOG_ERROR
-            << "received RFS_FILE_CHANGED message without a filename, an id, and/or my_address: \""
+            << "received RFS_FILE_CHANGED message without a filename, an id, a peer, and/or an mtime: \""
             << msg
             << "\"."
             << SNAP_LOG_SEND;
@@ -154,14 +159,12 @@ void messenger::msg_file_changed(ed::message & msg)
     }
     std::string const filename(msg.get_parameter(snaprfs::g_name_snaprfs_param_filename));
     std::uint32_t const id(msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_id));
-    std::string const remote_addresses(msg.get_parameter(snaprfs::g_name_snaprfs_param_my_addresses));
     snapdev::timespec_ex const mtime(msg.get_parameter(snaprfs::g_name_snaprfs_param_mtime));
 
-    if(filename.empty()
-    || remote_addresses.empty())
+    if(filename.empty())
     {
         SNAP_LOG_ERROR
-            << "filename and remote_address in the RFS_FILE_CHANGED cannot be empty."
+            << "filename in the RFS_FILE_CHANGED cannot be empty."
             << SNAP_LOG_SEND;
         return;
     }
@@ -173,77 +176,109 @@ void messenger::msg_file_changed(ed::message & msg)
         return;
     }
 
-    advgetopt::string_list_t addresses;
-    advgetopt::split_string(remote_addresses, addresses, { "," });
+    bool secure_message(false);
+    if(msg.has_parameter(communicatord::g_name_communicatord_param_secure_remote))
+    {
+        secure_message = advgetopt::is_true(msg.get_parameter(communicatord::g_name_communicatord_param_secure_remote));
+    }
 
-    for(auto uri : addresses)
+    receive_request request;
+    request.f_filename = filename;
+    request.f_mtime = mtime;
+    request.f_id = id;
+
+    // the hash of the contents lets us copy a local file with the same
+    // contents instead of downloading it
+    //
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_hash)
+    && msg.has_parameter(snaprfs::g_name_snaprfs_param_size)
+    && msg.has_parameter(snaprfs::g_name_snaprfs_param_mode)
+    && msg.has_parameter(snaprfs::g_name_snaprfs_param_owner))
     {
-        edhttp::uri u;
-        if(!u.set_uri(uri, false, true))
+        std::string const owner(msg.get_parameter(snaprfs::g_name_snaprfs_param_owner));
+        std::string::size_type const pos(owner.find(':'));
+        if(pos != std::string::npos)
         {
-            SNAP_LOG_WARNING
-                << "the \"my_addresses=...\" parameter \""
-                << uri
-                << "\" includes an invalid URI: "
-                << u.get_last_error_message()
-                << "."
-                << SNAP_LOG_SEND;
-            continue;
+            request.f_hash = msg.get_parameter(snaprfs::g_name_snaprfs_param_hash);
+            request.f_size = msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_size);
+            request.f_mode = msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_mode);
+            request.f_user = owner.substr(0, pos);
+            request.f_group = owner.substr(pos + 1);
+
+            // data coming from another cluster must go through the
+            // rfss connection which checks the login and password
+            //
+            if(msg.has_parameter(snaprfs::g_name_snaprfs_param_data)
+            && !secure_message)
+            {
+                request.f_inline = base64_decode(msg.get_parameter(snaprfs::g_name_snaprfs_param_data), request.f_data)
+                                && request.f_data.length() == request.f_size;
+                if(!request.f_inline)
+                {
+                    SNAP_LOG_WARNING
+                        << "invalid inline data for \""
+                        << filename
+                        << "\"; it will be downloaded instead."
+                        << SNAP_LOG_SEND;
+                    request.f_data.clear();
+                }
+            }
         }
+    }
 
-        bool const plain(u.scheme() == snaprfs::g_name_snaprfs_scheme_rfs);
-        bool const secure(u.scheme() == snaprfs::g_name_snaprfs_scheme_rfss);
-        if(!plain && !secure)
-        {
-            SNAP_LOG_WARNING
-                << "the \"my_addresses=...\" parameter \""
-                << uri
-                << "\" includes a URI with an unsupported scheme."
-                << SNAP_LOG_SEND;
-            continue;
-        }
+    // the file only grew since its previous version
+    //
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_append_offset)
+    && msg.has_parameter(snaprfs::g_name_snaprfs_param_prefix_hash))
+    {
+        request.f_append_offset = msg.get_integer_parameter(snaprfs::g_name_snaprfs_param_append_offset);
+        request.f_prefix_hash = msg.get_parameter(snaprfs::g_name_snaprfs_param_prefix_hash);
+    }
 
-        addr::addr_range::vector_t const & ranges(u.address_ranges());
-        if(ranges.size() != 1
-        || !ranges[0].has_from()
-        || ranges[0].has_to())
-        {
-            SNAP_LOG_WARNING
-                << "the \"my_addresses=...\" parameter must have one valid IP address with the scheme set to \"rfs\" or \"rfss\". \""
-                << uri
-                << "\" is not supported."
-                << SNAP_LOG_SEND;
-            continue;
-        }
+    // the source is still writing the file
+    //
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_speculative))
+    {
+        request.f_speculative = advgetopt::is_true(msg.get_parameter(snaprfs::g_name_snaprfs_param_speculative));
+    }
 
-        if(!secure)
-        {
-            bool secure_message(false);
-            if(msg.has_parameter(communicatord::g_name_communicatord_param_secure_remote))
-            {
-                secure_message = advgetopt::is_true(msg.get_parameter(communicatord::g_name_communicatord_param_secure_remote));
-            }
-            if(secure_message)
-            {
-                // the message went through a TLS encrypted pipe, so we do
-                // not want to send a file through a plain connection,
-                // ignore this address
-                //
-                SNAP_LOG_MINOR
-                    << "the file request transfer was sent through a secure communicator daemon, it has to have a secure URI to transfer the file."
-                    << SNAP_LOG_SEND;
-                continue;
-            }
-        }
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_peer))
+    {
+        f_server->file_announced(
+                  request
+                , msg.get_parameter(snaprfs::g_name_snaprfs_param_peer)
+                , msg.get_sent_from_server()
+                , secure_message);
+        return;
+    }
 
-        addr::addr const a(ranges[0].get_from());
-        if(f_server->receive_file(filename, mtime, id, a, secure))
-        {
-            // we were able to connect to that address so we're done here
-            //
-            break;
-        }
+    // an older snaprfs sends its endpoints with each announcement
+    //
+    if(secure_message
+    && f_server->relayed_by_gateway())
+    {
+        return;
     }
+    peer_info info;
+    peer_directory::parse_endpoints(
+              msg.get_parameter(snaprfs::g_name_snaprfs_param_my_addresses)
+            , info.f_sources);
+
+    peer_directory::select_sources(info, secure_message, request);
+    if(request.f_sources.empty())
+    {
+        SNAP_LOG_ERROR
+            << "no valid address found in the RFS_FILE_CHANGED message for \""
+            << filename
+            << "\"."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    // the scheduler ranks the sources (topology, latency, throughput) and
+    // tries them until one connection works
+    //
+    f_server->schedule_receive(request);
 }
 
 
@@ -280,6 +315,206 @@ void messenger::msg_file_deleted(ed::message & msg)
 }
 
 
+void messenger::msg_gossip(ed::message & msg)
+{
+    gossip::pointer_t g(f_server->get_gossip());
+    if(g == nullptr)
+    {
+        // announce=gossip is not turned on here; the peers should not
+        // send us such messages since we do not advertise that capability
+        //
+        return;
+    }
+    g->process_gossip(msg);
+}
+
+
+void messenger::msg_get_peer_info(ed::message & msg)
+{
+    f_server->send_peer_info(&msg);
+}
+
+
+/** \brief Save the information about another snaprfs instance.
+ *
+ * The announcements which were waiting for this information are
+ * scheduled now.
+ *
+ * \param[in] msg  The RFS_PEER_INFO message.
+ */
+void messenger::msg_peer_info(ed::message & msg)
+{
+    if(!msg.has_parameter(snaprfs::g_name_snaprfs_param_peer)
+    || !msg.has_parameter(snaprfs::g_name_snaprfs_param_my_addresses))
+    {
+        SNAP_LOG_ERROR
+            << "received RFS_PEER_INFO message without a peer and/or my_addresses: \""
+            << msg
+            << "\"."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    peer_info::pointer_t info(std::make_shared<peer_info>());
+    info->f_peer_id = msg.get_parameter(snaprfs::g_name_snaprfs_param_peer);
+    if(info->f_peer_id.empty()
+    || info->f_peer_id == f_server->get_peer_id())
+    {
+        return;
+    }
+    info->f_server_name = msg.get_sent_from_server();
+    if(msg.has_parameter(communicatord::g_name_communicatord_param_secure_remote))
+    {
+        // the message went through the secure link between two clusters
+        //
+        info->f_remote_cluster = advgetopt::is_true(msg.get_parameter(communicatord::g_name_communicatord_param_secure_remote));
+    }
+
+    if(!peer_directory::parse_endpoints(
+              msg.get_parameter(snaprfs::g_name_snaprfs_param_my_addresses)
+            , info->f_sources))
+    {
+        SNAP_LOG_ERROR
+            << "no valid address found in the RFS_PEER_INFO message of peer \""
+            << info->f_peer_id
+            << "\"."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    std::string rack;
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_rack))
+    {
+        rack = msg.get_parameter(snaprfs::g_name_snaprfs_param_rack);
+    }
+    std::string datacenter;
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_datacenter))
+    {
+        datacenter = msg.get_parameter(snaprfs::g_name_snaprfs_param_datacenter);
+    }
+    for(auto & s : info->f_sources)
+    {
+        s.f_rack = rack;
+        s.f_datacenter = datacenter;
+    }
+
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_push_addresses))
+    {
+        peer_directory::parse_endpoints(
+                  msg.get_parameter(snaprfs::g_name_snaprfs_param_push_addresses)
+                , info->f_push_sources);
+    }
+
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_capabilities))
+    {
+        advgetopt::string_list_t capabilities;
+        advgetopt::split_string(
+                  msg.get_parameter(snaprfs::g_name_snaprfs_param_capabilities)
+                , capabilities
+                , { "," });
+        info->f_capabilities.insert(capabilities.begin(), capabilities.end());
+    }
+
+    if(msg.has_parameter(snaprfs::g_name_snaprfs_param_interests))
+    {
+        info->f_has_interests = true;
+        advgetopt::split_string(
+                  msg.get_parameter(snaprfs::g_name_snaprfs_param_interests)
+                , info->f_interests
+                , { ":" });
+    }
+
+    // a peer we did not know yet does not know us either (it just
+    // started or we did), tell it about us so it can send us its
+    // announcements
+    //
+    peer_directory::pointer_t directory(f_server->get_peer_directory());
+    bool const is_new(directory->find(info->f_peer_id) == nullptr);
+
+    pending_announcement::vector_t pending(directory->update(info));
+    for(auto & p : pending)
+    {
+        f_server->file_announced(p.f_request, info->f_peer_id, info->f_server_name, p.f_secure_only);
+    }
+
+    if(is_new)
+    {
+        f_server->send_peer_info(&msg);
+        f_server->peers_changed();
+    }
+}
+
+
+/** \brief Reply with our statistics.
+ *
+ * The reply includes the state of the receive scheduler: the number of
+ * active transfers, the queue depth, and the time spent waiting in the
+ * queue.
+ *
+ * It also includes the commit queue counters for each durability level
+ * (none, data, full) so the cost of the sync calls can be measured.
+ *
+ * \param[in] msg  The RFS_STAT message.
+ */
+void messenger::msg_stat(ed::message & msg)
+{
+    receive_scheduler::pointer_t scheduler(f_server->get_receive_scheduler());
+    receive_statistics const & stats(scheduler->get_statistics());
+
+    ed::message reply;
+    reply.reply_to(msg);
+    reply.set_command(snaprfs::g_name_snaprfs_cmd_rfs_stat_reply);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_active, static_cast<std::uint64_t>(scheduler->get_active()));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_queued, static_cast<std::uint64_t>(scheduler->get_queue_depth()));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_started, stats.f_started);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_delayed, stats.f_delayed);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_superseded, stats.f_superseded);
+    reply.add_parameter(
+              snaprfs::g_name_snaprfs_param_receive_wait_avg_usec
+            , stats.f_started == 0
+                    ? static_cast<std::int64_t>(0)
+                    : stats.f_total_wait_usec / static_cast<std::int64_t>(stats.f_started));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_wait_max_usec, stats.f_max_wait_usec);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_wait_oldest_usec, scheduler->get_oldest_wait());
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_busy, stats.f_busy);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_stalled, stats.f_stalled);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_receive_deferred, stats.f_deferred);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_peers_down, static_cast<std::uint64_t>(f_server->get_peer_health()->get_tripped()));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_peers_known, static_cast<std::uint64_t>(f_server->get_peer_directory()->size()));
+
+    send_admission::pointer_t admission(f_server->get_send_admission());
+    send_statistics const & send_stats(admission->get_statistics());
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_send_active, static_cast<std::uint64_t>(admission->get_active()));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_send_waiting, static_cast<std::uint64_t>(admission->get_waiting()));
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_send_admitted, send_stats.f_admitted);
+    reply.add_parameter(snaprfs::g_name_snaprfs_param_send_rejected, send_stats.f_rejected);
+
+    commit_queue::pointer_t queue(f_server->get_commit_queue());
+    if(queue != nullptr)
+    {
+        commit_statistics const & none_stats(queue->get_statistics(durability_t::DURABILITY_NONE));
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_none_files, none_stats.f_files);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_none_batches, none_stats.f_batches);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_none_sync_calls, none_stats.f_sync_calls);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_none_failures, none_stats.f_failures);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_none_usec, none_stats.f_total_usec);
+        commit_statistics const & data_stats(queue->get_statistics(durability_t::DURABILITY_DATA));
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_data_files, data_stats.f_files);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_data_batches, data_stats.f_batches);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_data_sync_calls, data_stats.f_sync_calls);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_data_failures, data_stats.f_failures);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_data_usec, data_stats.f_total_usec);
+        commit_statistics const & full_stats(queue->get_statistics(durability_t::DURABILITY_FULL));
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_full_files, full_stats.f_files);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_full_batches, full_stats.f_batches);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_full_sync_calls, full_stats.f_sync_calls);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_full_failures, full_stats.f_failures);
+        reply.add_parameter(snaprfs::g_name_snaprfs_param_commit_full_usec, full_stats.f_total_usec);
+    }
+    send_message(reply);
+}
+
+
 //void messenger::msg_configuration_filenames(ed::message & msg)
 //{
 //    snapdev::NOT_USED(msg);
@@ -322,12 +557,6 @@ void messenger::msg_file_deleted(ed::message & msg)
 //}
 //
 //
-//void messenger::msg_stat(ed::message & msg)
-//{
-//    snapdev::NOT_USED(msg);
-//}
-//
-//
 //void messenger::msg_version(ed::message & msg)
 //{
 //    snapdev::NOT_USED(msg);
@@ -71,6 +71,10 @@ public:
 
     void                msg_file_changed(ed::message & msg);
     void                msg_file_deleted(ed::message & msg);
+    void                msg_get_peer_info(ed::message & msg);
+    void                msg_gossip(ed::message & msg);
+    void                msg_peer_info(ed::message & msg);
+    void                msg_stat(ed::message & msg);
 
     //void                msg_configuration_filenames(ed::message & msg);
     //void                msg_copy(ed::message & msg);
@@ -79,7 +83,6 @@ public:
     //void                msg_move(ed::message & msg);
     //void                msg_ping(ed::message & msg);
     //void                msg_remove(ed::message & msg);
-    //void                msg_stat(ed::message & msg);
     //void                msg_version(ed::message & msg);
 
 private:
@@ -0,0 +1,612 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the peer directory.
+ *
+ * Each snaprfs instance publishes its endpoints (the rfs:// and rfss://
+ * URIs of its data servers), topology labels, and capabilities once, in
+ * an RFS_PEER_INFO message. The RFS_FILE_CHANGED announcements then only
+ * include the peer id of the source.
+ *
+ * The peer id is random and generated each time the daemon starts. Since
+ * the endpoints can only change on a restart, a new id means new
+ * information and a cached entry never needs to be refreshed otherwise.
+ * When a computer publishes a new id, its old entry is dropped.
+ *
+ * When an announcement comes from a peer we do not know yet (i.e. we
+ * started after it did), the announcement is kept aside and we ask that
+ * peer for its information with an RFS_GET_PEER_INFO. The pending
+ * announcements are released once the RFS_PEER_INFO reply arrives. Only
+ * the latest announcement of each file is kept.
+ *
+ * The RFS_PEER_INFO also includes the list of paths under which that
+ * peer accepts files (its interests). Announcements are only sent to the
+ * peers interested in the file instead of being broadcast to the whole
+ * cluster. A peer which does not send such a list is considered to be
+ * interested in everything.
+ *
+ * A path can be limited to a number of replicas. In that case, the
+ * announcement only goes to that many of the interested peers. They are
+ * selected with rendezvous (highest random weight) hashing: each peer
+ * gets a score computed from the hash of the filename and the peer's
+ * name, and the peers with the highest scores hold the file. When a
+ * peer joins or leaves, only the files for which that peer is (or was)
+ * among the top scores move.
+ *
+ * Each instance sends its RFS_PEER_INFO again every minute. A peer we
+ * did not hear from for three minutes is removed from the directory.
+ *
+ * An RFS_PEER_INFO which went through a secure communicatord link comes
+ * from another cluster. This is how a gateway and the computers of its
+ * cluster know which announcements cross the WAN.
+ */
+
+// self
+//
+#include    "peer_directory.h"
+
+
+// snaprfs
+//
+#include    <snaprfs/names.h>
+
+
+// edhttp
+//
+#include    <edhttp/uri.h>
+
+
+// advgetopt
+//
+#include    <advgetopt/utils.h>
+
+
+// murmur3
+//
+#include    <murmur3/stream.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstring>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+namespace
+{
+
+
+
+constexpr murmur3::seed_t const     PLACEMENT_SEED_H1 = 0x5b0e8ad1c7f43a69ULL;
+constexpr murmur3::seed_t const     PLACEMENT_SEED_H2 = 0x2d94e1f03a6b7c85ULL;
+
+
+/** \brief Compute the rendezvous score of a peer for a file.
+ *
+ * \param[in] filename  The file being placed.
+ * \param[in] server_name  The name of the peer.
+ *
+ * \return A pseudo-random score; the highest scores hold the file.
+ */
+std::uint64_t placement_score(
+      std::string const & filename
+    , std::string const & server_name)
+{
+    murmur3::stream stream(PLACEMENT_SEED_H1, PLACEMENT_SEED_H2);
+    stream.add_data(filename.c_str(), filename.length() + 1);   // include the '\0' as a separator
+    stream.add_data(server_name.c_str(), server_name.length());
+    murmur3::hash const h(stream.flush());
+    std::uint64_t score(0);
+    memcpy(&score, h.get(), sizeof(score));
+    return score;
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Check whether the peer wants to hear about a file.
+ *
+ * The file has to be in one of the interest paths or one of their
+ * sub-directories.
+ *
+ * \param[in] filename  The full path of the file.
+ *
+ * \return true if the peer is interested in that file.
+ */
+bool peer_info::is_interested(std::string const & filename) const
+{
+    if(!f_has_interests)
+    {
+        return true;
+    }
+
+    for(auto const & path : f_interests)
+    {
+        if(filename.length() > path.length()
+        && filename.compare(0, path.length(), path) == 0
+        && (path.back() == '/' || filename[path.length()] == '/'))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+
+
+
+peer_directory::peer_directory()
+{
+}
+
+
+/** \brief Parse a list of endpoints.
+ *
+ * The \p endpoints parameter is a comma separated list of rfs:// and
+ * rfss:// URIs, each with exactly one IP address and a port.
+ *
+ * Invalid entries are logged and ignored.
+ *
+ * \param[in] endpoints  The list of URIs to parse.
+ * \param[out] sources  The sources found in \p endpoints are appended here.
+ *
+ * \return true if at least one valid source was found.
+ */
+bool peer_directory::parse_endpoints(
+      std::string const & endpoints
+    , receive_request::source_vector_t & sources)
+{
+    advgetopt::string_list_t addresses;
+    advgetopt::split_string(endpoints, addresses, { "," });
+
+    bool found(false);
+    for(auto const & uri : addresses)
+    {
+        edhttp::uri u;
+        if(!u.set_uri(uri, false, true))
+        {
+            SNAP_LOG_WARNING
+                << "the \"my_addresses=...\" parameter \""
+                << uri
+                << "\" includes an invalid URI: "
+                << u.get_last_error_message()
+                << "."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+
+        bool const plain(u.scheme() == snaprfs::g_name_snaprfs_scheme_rfs);
+        bool const secure(u.scheme() == snaprfs::g_name_snaprfs_scheme_rfss);
+        if(!plain && !secure)
+        {
+            SNAP_LOG_WARNING
+                << "the \"my_addresses=...\" parameter \""
+                << uri
+                << "\" includes a URI with an unsupported scheme."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+
+        addr::addr_range::vector_t const & ranges(u.address_ranges());
+        if(ranges.size() != 1
+        || !ranges[0].has_from()
+        || ranges[0].has_to())
+        {
+            SNAP_LOG_WARNING
+                << "the \"my_addresses=...\" parameter must have one valid IP address with the scheme set to \"rfs\" or \"rfss\". \""
+                << uri
+                << "\" is not supported."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+
+        receive_source source;
+        source.f_address = ranges[0].get_from();
+        source.f_secure = secure;
+        sources.push_back(source);
+        found = true;
+    }
+
+    return found;
+}
+
+
+/** \brief Copy the sources of a peer to a request.
+ *
+ * When the announcement went through a secure communicatord connection,
+ * the file must not be transferred through a plain connection so only
+ * the secure endpoints are copied.
+ *
+ * \param[in] info  The peer information.
+ * \param[in] secure_only  Whether only secure endpoints can be used.
+ * \param[in,out] request  The request receiving the sources.
+ */
+void peer_directory::select_sources(
+      peer_info const & info
+    , bool secure_only
+    , receive_request & request)
+{
+    for(auto const & s : info.f_sources)
+    {
+        if(secure_only && !s.f_secure)
+        {
+            SNAP_LOG_MINOR
+                << "the file request transfer was sent through a secure communicator daemon, it has to have a secure URI to transfer the file."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+        request.f_sources.push_back(s);
+        request.f_sources.back().f_extended_request = info.f_capabilities.count("extended_request") != 0;
+    }
+}
+
+
+/** \brief Search a peer.
+ *
+ * \param[in] peer_id  The identifier of the peer.
+ *
+ * \return The peer information or a null pointer if unknown.
+ */
+peer_info::pointer_t peer_directory::find(std::string const & peer_id) const
+{
+    auto const it(f_peers.find(peer_id));
+    if(it == f_peers.end())
+    {
+        return peer_info::pointer_t();
+    }
+    return it->second;
+}
+
+
+/** \brief Search a peer by the communicatord name of its computer.
+ *
+ * \param[in] server_name  The name of the computer.
+ *
+ * \return The peer information or a null pointer if unknown.
+ */
+peer_info::pointer_t peer_directory::find_server(std::string const & server_name) const
+{
+    auto const it(f_server_peer.find(server_name));
+    if(it == f_server_peer.end())
+    {
+        return peer_info::pointer_t();
+    }
+    return find(it->second);
+}
+
+
+/** \brief Search a peer by one of its IP addresses.
+ *
+ * The port is ignored since \p address is generally the address of a
+ * connection the peer established with us.
+ *
+ * \param[in] address  The address to search.
+ *
+ * \return The peer information or a null pointer if no peer advertised
+ * that IP address.
+ */
+peer_info::pointer_t peer_directory::find_address(addr::addr const & address) const
+{
+    std::string const ip(address.to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    for(auto const & p : f_peers)
+    {
+        for(auto const * sources : { &p.second->f_sources, &p.second->f_push_sources })
+        {
+            for(auto const & s : *sources)
+            {
+                if(s.f_address.to_ipv4or6_string(addr::STRING_IP_ADDRESS) == ip)
+                {
+                    return p.second;
+                }
+            }
+        }
+    }
+    return peer_info::pointer_t();
+}
+
+
+/** \brief Keep an announcement until we know the peer.
+ *
+ * An announcement for a file replaces the previous announcement of
+ * the same file.
+ *
+ * \param[in] peer_id  The identifier of the unknown peer.
+ * \param[in] request  The request, without sources.
+ * \param[in] secure_only  Whether only secure endpoints can be used.
+ *
+ * \return true if the caller has to send an RFS_GET_PEER_INFO to that
+ * peer (first time or previous request not answered in time).
+ */
+bool peer_directory::add_pending(
+      std::string const & peer_id
+    , receive_request const & request
+    , bool secure_only)
+{
+    pending_peer & pending(f_pending[peer_id]);
+
+    pending_announcement & announcement(pending.f_announcements[request.f_filename]);
+    announcement.f_request = request;
+    announcement.f_secure_only = secure_only;
+
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    if(pending.f_requested != 0
+    && now - pending.f_requested < REQUEST_RETRY_USEC)
+    {
+        return false;
+    }
+    pending.f_requested = now;
+    return true;
+}
+
+
+/** \brief Add or replace a peer.
+ *
+ * If the same computer had another peer id, that entry is removed since
+ * it is from a previous run.
+ *
+ * \param[in] info  The information about the peer.
+ *
+ * \return The announcements which were waiting for this peer.
+ */
+pending_announcement::vector_t peer_directory::update(peer_info::pointer_t info)
+{
+    if(!info->f_server_name.empty())
+    {
+        auto const it(f_server_peer.find(info->f_server_name));
+        if(it != f_server_peer.end()
+        && it->second != info->f_peer_id)
+        {
+            SNAP_LOG_VERBOSE
+                << "snaprfs on \""
+                << info->f_server_name
+                << "\" restarted; replacing peer \""
+                << it->second
+                << "\" with \""
+                << info->f_peer_id
+                << "\"."
+                << SNAP_LOG_SEND;
+            f_peers.erase(it->second);
+            f_pending.erase(it->second);
+        }
+        f_server_peer[info->f_server_name] = info->f_peer_id;
+    }
+    info->f_last_seen = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec();
+    f_peers[info->f_peer_id] = info;
+
+    pending_announcement::vector_t result;
+    auto const it(f_pending.find(info->f_peer_id));
+    if(it != f_pending.end())
+    {
+        for(auto & a : it->second.f_announcements)
+        {
+            result.push_back(std::move(a.second));
+        }
+        f_pending.erase(it);
+    }
+    return result;
+}
+
+
+/** \brief Get the name of the computers interested in a file.
+ *
+ * \param[in] filename  The full path of the file.
+ *
+ * \return The communicatord names of the computers to send the
+ * announcement to.
+ */
+std::vector<std::string> peer_directory::interested_servers(
+      std::string const & filename
+    , std::size_t replicas) const
+{
+    std::vector<std::string> result;
+    for(auto const & p : f_peers)
+    {
+        if(!p.second->f_server_name.empty()
+        && p.second->is_interested(filename))
+        {
+            result.push_back(p.second->f_server_name);
+        }
+    }
+
+    if(replicas > 0
+    && result.size() > replicas)
+    {
+        std::vector<std::pair<std::uint64_t, std::string>> scores;
+        scores.reserve(result.size());
+        for(auto const & name : result)
+        {
+            scores.emplace_back(placement_score(filename, name), name);
+        }
+        std::partial_sort(
+                  scores.begin()
+                , scores.begin() + replicas
+                , scores.end()
+                , [](auto const & a, auto const & b)
+                {
+                    return a.first > b.first;
+                });
+        result.clear();
+        for(std::size_t idx(0); idx < replicas; ++idx)
+        {
+            result.push_back(scores[idx].second);
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Get the name of the computers supporting a feature.
+ *
+ * \param[in] capability  The name of the capability (i.e. "gossip").
+ *
+ * \return The communicatord names of those computers.
+ */
+std::vector<std::string> peer_directory::capable_servers(std::string const & capability) const
+{
+    std::vector<std::string> result;
+    for(auto const & p : f_peers)
+    {
+        if(!p.second->f_server_name.empty()
+        && p.second->f_capabilities.count(capability) != 0)
+        {
+            result.push_back(p.second->f_server_name);
+        }
+    }
+    return result;
+}
+
+
+/** \brief Get the computers of our cluster interested in a file.
+ *
+ * This is used by a gateway to announce the files it received from
+ * the other cluster.
+ *
+ * \param[in] filename  The full path of the file.
+ *
+ * \return The communicatord names of those computers.
+ */
+std::vector<std::string> peer_directory::local_servers(std::string const & filename) const
+{
+    std::vector<std::string> result;
+    for(auto const & p : f_peers)
+    {
+        if(!p.second->f_server_name.empty()
+        && !p.second->f_remote_cluster
+        && p.second->is_interested(filename))
+        {
+            result.push_back(p.second->f_server_name);
+        }
+    }
+    return result;
+}
+
+
+/** \brief Check whether our cluster has a gateway.
+ *
+ * \return true if a peer of our cluster advertises the gateway capability.
+ */
+bool peer_directory::has_local_gateway() const
+{
+    for(auto const & p : f_peers)
+    {
+        if(!p.second->f_remote_cluster
+        && p.second->f_capabilities.count("gateway") != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief Remove the peers we did not hear from in a while.
+ *
+ * The announcements of unknown peers which did not answer our
+ * RFS_GET_PEER_INFO requests for several retry periods are dropped too.
+ * The peer is likely gone and if not, it announces its files again
+ * once it replies.
+ *
+ * \param[in] max_age_usec  The maximum time since the last RFS_PEER_INFO.
+ *
+ * \return The number of peers removed (pending peers are not counted).
+ */
+std::size_t peer_directory::expire(std::int64_t max_age_usec)
+{
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    std::size_t count(0);
+    for(auto it(f_peers.begin()); it != f_peers.end(); )
+    {
+        if(now - it->second->f_last_seen > max_age_usec)
+        {
+            SNAP_LOG_VERBOSE
+                << "peer \""
+                << it->first
+                << "\" on \""
+                << it->second->f_server_name
+                << "\" did not send its information in a while; removing it."
+                << SNAP_LOG_SEND;
+            f_server_peer.erase(it->second->f_server_name);
+            it = f_peers.erase(it);
+            ++count;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for(auto it(f_pending.begin()); it != f_pending.end(); )
+    {
+        if(now - it->second.f_requested > PENDING_EXPIRE_USEC)
+        {
+            SNAP_LOG_VERBOSE
+                << "peer \""
+                << it->first
+                << "\" never sent its information; dropping its "
+                << it->second.f_announcements.size()
+                << " pending announcement(s)."
+                << SNAP_LOG_SEND;
+            it = f_pending.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    return count;
+}
+
+
+std::size_t peer_directory::size() const
+{
+    return f_peers.size();
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,143 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the peer_directory class.
+ *
+ * The peer directory caches the endpoints and capabilities of the other
+ * snaprfs instances so file announcements only need to carry a peer id.
+ */
+
+// self
+//
+#include    "receive_scheduler.h"
+
+
+// C++
+//
+#include    <map>
+#include    <memory>
+#include    <set>
+#include    <string>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+struct peer_info
+{
+    typedef std::shared_ptr<peer_info>      pointer_t;
+
+    std::string         f_peer_id = std::string();
+    std::string         f_server_name = std::string();  // communicatord name of the computer
+    receive_request::source_vector_t
+                        f_sources = receive_request::source_vector_t();
+    receive_request::source_vector_t
+                        f_push_sources = receive_request::source_vector_t();   // where to push files
+    std::set<std::string>
+                        f_capabilities = std::set<std::string>();
+    std::int64_t        f_last_seen = 0;                // last RFS_PEER_INFO (monotonic usec)
+    bool                f_remote_cluster = false;       // RFS_PEER_INFO came through a secure link
+    bool                f_has_interests = false;        // false: interested in everything
+    std::vector<std::string>
+                        f_interests = std::vector<std::string>();
+
+    bool                is_interested(std::string const & filename) const;
+};
+
+
+struct pending_announcement
+{
+    typedef std::vector<pending_announcement>   vector_t;
+
+    receive_request     f_request = receive_request();
+    bool                f_secure_only = false;
+};
+
+
+class peer_directory
+{
+public:
+    typedef std::shared_ptr<peer_directory>     pointer_t;
+
+    static constexpr std::int64_t const     REQUEST_RETRY_USEC = 5'000'000;
+    static constexpr std::int64_t const     PENDING_EXPIRE_USEC = REQUEST_RETRY_USEC * 6;
+    static constexpr std::int64_t const     HEARTBEAT_USEC = 60'000'000;
+    static constexpr std::int64_t const     EXPIRE_USEC = HEARTBEAT_USEC * 3;
+
+                        peer_directory();
+                        peer_directory(peer_directory const &) = delete;
+    peer_directory &    operator = (peer_directory const &) = delete;
+
+    static bool         parse_endpoints(
+                              std::string const & endpoints
+                            , receive_request::source_vector_t & sources);
+    static void         select_sources(
+                              peer_info const & info
+                            , bool secure_only
+                            , receive_request & request);
+
+    peer_info::pointer_t
+                        find(std::string const & peer_id) const;
+    peer_info::pointer_t
+                        find_server(std::string const & server_name) const;
+    peer_info::pointer_t
+                        find_address(addr::addr const & address) const;
+    bool                add_pending(
+                              std::string const & peer_id
+                            , receive_request const & request
+                            , bool secure_only);
+    pending_announcement::vector_t
+                        update(peer_info::pointer_t info);
+    std::vector<std::string>
+                        interested_servers(
+                              std::string const & filename
+                            , std::size_t replicas = 0) const;
+    std::vector<std::string>
+                        capable_servers(std::string const & capability) const;
+    std::vector<std::string>
+                        local_servers(std::string const & filename) const;
+    bool                has_local_gateway() const;
+    std::size_t         expire(std::int64_t max_age_usec);
+    std::size_t         size() const;
+
+private:
+    struct pending_peer
+    {
+        std::int64_t    f_requested = 0;
+        std::map<std::string, pending_announcement>
+                        f_announcements = std::map<std::string, pending_announcement>();
+    };
+
+    std::map<std::string, peer_info::pointer_t>
+                        f_peers = std::map<std::string, peer_info::pointer_t>();
+    std::map<std::string, std::string>
+                        f_server_peer = std::map<std::string, std::string>();
+    std::map<std::string, pending_peer>
+                        f_pending = std::map<std::string, pending_peer>();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,333 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the peer health table.
+ *
+ * Connecting to a peer which is down costs a connect timeout. Without
+ * tracking, we would pay that price for each file that peer announces.
+ *
+ * After a failed connection, a peer is not contacted again before a
+ * backoff delay which doubles with each consecutive failure (with some
+ * jitter), from backoff_min_msec up to backoff_max_msec.
+ *
+ * After failure_threshold consecutive failures, the circuit breaker of
+ * that peer opens. Once the backoff delay is over, a single probe
+ * connection is allowed (half-open state). If it succeeds, the breaker
+ * closes again and all the deferred transfers are retried at once.
+ *
+ * The table also keeps passive estimates of each peer: the connect time
+ * (a good approximation of the round trip time) and the throughput of
+ * the transfers from that peer. The receive_scheduler uses these to rank
+ * the sources of a file.
+ *
+ * Peers are identified by their IP address (without port) since the
+ * plain and secure data servers use different ports.
+ */
+
+// self
+//
+#include    "peer_health.h"
+
+
+// libaddr
+//
+#include    <libaddr/iface.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+peer_health::peer_health(
+          std::uint32_t failure_threshold
+        , std::int64_t backoff_min_msec
+        , std::int64_t backoff_max_msec)
+    : f_failure_threshold(std::max(static_cast<std::uint32_t>(1), failure_threshold))
+    , f_backoff_min_msec(std::max(static_cast<std::int64_t>(1), backoff_min_msec))
+    , f_backoff_max_msec(std::max(f_backoff_min_msec, backoff_max_msec))
+{
+}
+
+
+/** \brief Check whether we can connect to that peer now.
+ *
+ * \param[in] peer  The IP address of the peer.
+ * \param[in] now  The current time.
+ *
+ * \return true if a connection can be attempted.
+ */
+bool peer_health::is_available(
+      std::string const & peer
+    , snapdev::timespec_ex const & now) const
+{
+    auto const it(f_peers.find(peer));
+    if(it == f_peers.end())
+    {
+        return true;
+    }
+
+    switch(it->second.f_state)
+    {
+    case breaker_state_t::BREAKER_STATE_CLOSED:
+    case breaker_state_t::BREAKER_STATE_OPEN:
+        return it->second.f_retry_at <= now;
+
+    case breaker_state_t::BREAKER_STATE_HALF_OPEN:
+        // a probe is already in progress
+        //
+        return false;
+
+    }
+
+    return false;
+}
+
+
+/** \brief Get the time after which the peer can be contacted again.
+ *
+ * \param[in] peer  The IP address of the peer.
+ *
+ * \return The retry time, zero if the peer never failed.
+ */
+snapdev::timespec_ex peer_health::get_retry_at(std::string const & peer) const
+{
+    auto const it(f_peers.find(peer));
+    if(it == f_peers.end())
+    {
+        return snapdev::timespec_ex();
+    }
+    return it->second.f_retry_at;
+}
+
+
+/** \brief Get the average connect latency of a peer.
+ *
+ * \param[in] peer  The IP address of the peer.
+ *
+ * \return The latency in microseconds, 0 if unknown.
+ */
+std::int64_t peer_health::get_latency(std::string const & peer) const
+{
+    auto const it(f_peers.find(peer));
+    if(it == f_peers.end())
+    {
+        return 0;
+    }
+    return it->second.f_latency_usec;
+}
+
+
+/** \brief Get the average throughput of the transfers from a peer.
+ *
+ * \param[in] peer  The IP address of the peer.
+ *
+ * \return The throughput in bytes per second, 0 if unknown.
+ */
+std::uint64_t peer_health::get_throughput(std::string const & peer) const
+{
+    auto const it(f_peers.find(peer));
+    if(it == f_peers.end())
+    {
+        return 0;
+    }
+    return it->second.f_throughput;
+}
+
+
+/** \brief Check whether a peer is on one of our local networks.
+ *
+ * The result is cached since it requires a scan of our interfaces.
+ *
+ * \param[in] peer  The IP address of the peer.
+ * \param[in] address  The same address as an addr object.
+ *
+ * \return true if the peer is directly reachable through one of our
+ * interfaces (i.e. not through the default gateway).
+ */
+bool peer_health::is_local_network(std::string const & peer, addr::addr const & address)
+{
+    peer_status & status(f_peers[peer]);
+    if(status.f_local_network == -1)
+    {
+        status.f_local_network = addr::find_addr_interface(address, false) != nullptr ? 1 : 0;
+    }
+    return status.f_local_network == 1;
+}
+
+
+/** \brief A connection to that peer is about to be attempted.
+ *
+ * If the breaker of that peer is open, this connection is the probe.
+ *
+ * \param[in] peer  The IP address of the peer.
+ */
+void peer_health::connect_started(std::string const & peer)
+{
+    auto it(f_peers.find(peer));
+    if(it != f_peers.end()
+    && it->second.f_state == breaker_state_t::BREAKER_STATE_OPEN)
+    {
+        it->second.f_state = breaker_state_t::BREAKER_STATE_HALF_OPEN;
+    }
+}
+
+
+/** \brief A connection to that peer succeeded.
+ *
+ * \param[in] peer  The IP address of the peer.
+ * \param[in] latency_usec  The time it took to connect.
+ *
+ * \return true if the peer just recovered from a failure.
+ */
+bool peer_health::connect_succeeded(std::string const & peer, std::int64_t latency_usec)
+{
+    peer_status & status(f_peers[peer]);
+    bool const recovered(status.f_failures > 0);
+    if(status.f_state != breaker_state_t::BREAKER_STATE_CLOSED)
+    {
+        SNAP_LOG_INFO
+            << "peer "
+            << peer
+            << " is reachable again after "
+            << status.f_failures
+            << " failed connection attempts."
+            << SNAP_LOG_SEND;
+    }
+
+    status.f_state = breaker_state_t::BREAKER_STATE_CLOSED;
+    status.f_failures = 0;
+    status.f_retry_at = snapdev::timespec_ex();
+    status.f_last_success = snapdev::timespec_ex::gettime();
+    ++status.f_total_connects;
+    status.f_latency_usec = status.f_latency_usec == 0
+                                ? latency_usec
+                                : (status.f_latency_usec * 7 + latency_usec) / 8;
+
+    return recovered;
+}
+
+
+/** \brief A connection to that peer failed.
+ *
+ * \param[in] peer  The IP address of the peer.
+ */
+void peer_health::connect_failed(std::string const & peer)
+{
+    peer_status & status(f_peers[peer]);
+    ++status.f_failures;
+    ++status.f_total_failures;
+    status.f_last_failure = snapdev::timespec_ex::gettime();
+
+    if(status.f_state == breaker_state_t::BREAKER_STATE_HALF_OPEN
+    || status.f_failures >= f_failure_threshold)
+    {
+        if(status.f_state == breaker_state_t::BREAKER_STATE_CLOSED)
+        {
+            SNAP_LOG_WARNING
+                << "peer "
+                << peer
+                << " failed "
+                << status.f_failures
+                << " times in a row; deferring transfers from that peer."
+                << SNAP_LOG_SEND;
+        }
+        status.f_state = breaker_state_t::BREAKER_STATE_OPEN;
+    }
+
+    std::int64_t delay(f_backoff_max_msec);
+    if(status.f_failures <= 32)
+    {
+        delay = std::min(f_backoff_max_msec, f_backoff_min_msec << (status.f_failures - 1));
+    }
+    std::uniform_int_distribution<std::int64_t> jitter(delay * 3 / 4, delay * 5 / 4);
+    std::int64_t const msec(jitter(f_random));
+    status.f_retry_at = status.f_last_failure
+                      + snapdev::timespec_ex(msec / 1'000, (msec % 1'000) * 1'000'000);
+}
+
+
+/** \brief A transfer from that peer is complete.
+ *
+ * Small transfers are ignored since their duration is mainly latency.
+ *
+ * \param[in] peer  The IP address of the peer.
+ * \param[in] bytes  The number of bytes received.
+ * \param[in] duration_usec  The duration of the transfer.
+ */
+void peer_health::transfer_done(
+      std::string const & peer
+    , std::uint64_t bytes
+    , std::int64_t duration_usec)
+{
+    if(bytes < MIN_THROUGHPUT_SAMPLE
+    || duration_usec <= 0)
+    {
+        return;
+    }
+
+    peer_status & status(f_peers[peer]);
+    std::uint64_t const throughput(bytes * 1'000'000 / duration_usec);
+    status.f_throughput = status.f_throughput == 0
+                                ? throughput
+                                : (status.f_throughput * 7 + throughput) / 8;
+}
+
+
+/** \brief Get the number of peers with an open circuit breaker.
+ *
+ * \return The number of peers currently considered down.
+ */
+std::size_t peer_health::get_tripped() const
+{
+    return std::count_if(
+              f_peers.begin()
+            , f_peers.end()
+            , [](auto const & p)
+            {
+                return p.second.f_state != breaker_state_t::BREAKER_STATE_CLOSED;
+            });
+}
+
+
+peer_health::map_t const & peer_health::get_peers() const
+{
+    return f_peers;
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,125 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the peer_health class.
+ *
+ * The peer health table records the result of our connections to each
+ * peer and decides whether a peer should be contacted at all.
+ */
+
+// libaddr
+//
+#include    <libaddr/addr.h>
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <map>
+#include    <memory>
+#include    <random>
+#include    <string>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+enum class breaker_state_t
+{
+    BREAKER_STATE_CLOSED,           // peer is healthy
+    BREAKER_STATE_OPEN,             // peer failed too many times, wait for f_retry_at
+    BREAKER_STATE_HALF_OPEN,        // one probe connection is being attempted
+};
+
+
+struct peer_status
+{
+    breaker_state_t     f_state = breaker_state_t::BREAKER_STATE_CLOSED;
+    std::uint32_t       f_failures = 0;             // consecutive failures
+    std::uint64_t       f_total_connects = 0;
+    std::uint64_t       f_total_failures = 0;
+    std::int64_t        f_latency_usec = 0;         // moving average of the connect time
+    std::uint64_t       f_throughput = 0;           // moving average in bytes per second
+    int                 f_local_network = -1;       // -1 unknown, 0 no, 1 yes
+    snapdev::timespec_ex
+                        f_last_success = snapdev::timespec_ex();
+    snapdev::timespec_ex
+                        f_last_failure = snapdev::timespec_ex();
+    snapdev::timespec_ex
+                        f_retry_at = snapdev::timespec_ex();
+};
+
+
+class peer_health
+{
+public:
+    typedef std::shared_ptr<peer_health>        pointer_t;
+    typedef std::map<std::string, peer_status>  map_t;
+
+    static constexpr std::uint32_t const    DEFAULT_FAILURE_THRESHOLD = 3;
+    static constexpr std::int64_t const     DEFAULT_BACKOFF_MIN_MSEC = 1'000;
+    static constexpr std::int64_t const     DEFAULT_BACKOFF_MAX_MSEC = 300'000;
+    static constexpr std::uint64_t const    MIN_THROUGHPUT_SAMPLE = 64 * 1024;
+
+                        peer_health(
+                              std::uint32_t failure_threshold
+                            , std::int64_t backoff_min_msec
+                            , std::int64_t backoff_max_msec);
+                        peer_health(peer_health const &) = delete;
+    peer_health &       operator = (peer_health const &) = delete;
+
+    bool                is_available(
+                              std::string const & peer
+                            , snapdev::timespec_ex const & now) const;
+    snapdev::timespec_ex
+                        get_retry_at(std::string const & peer) const;
+    std::int64_t        get_latency(std::string const & peer) const;
+    std::uint64_t       get_throughput(std::string const & peer) const;
+    bool                is_local_network(std::string const & peer, addr::addr const & address);
+    void                connect_started(std::string const & peer);
+    bool                connect_succeeded(std::string const & peer, std::int64_t latency_usec);
+    void                connect_failed(std::string const & peer);
+    void                transfer_done(
+                              std::string const & peer
+                            , std::uint64_t bytes
+                            , std::int64_t duration_usec);
+
+    std::size_t         get_tripped() const;
+    map_t const &       get_peers() const;
+
+private:
+    std::uint32_t       f_failure_threshold = DEFAULT_FAILURE_THRESHOLD;
+    std::int64_t        f_backoff_min_msec = DEFAULT_BACKOFF_MIN_MSEC;
+    std::int64_t        f_backoff_max_msec = DEFAULT_BACKOFF_MAX_MSEC;
+    map_t               f_peers = map_t();
+    std::minstd_rand    f_random = std::minstd_rand(std::random_device()());
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,1277 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the privileged helper.
+ *
+ * The snaprfs binary is installed setuid root because the files it
+ * receives have to be created in directories owned by other users and
+ * given to those users. Instead of switching the effective user of the
+ * whole daemon back and forth for each file, we fork a small helper at
+ * startup which keeps the root privileges, then the daemon permanently
+ * drops them.
+ *
+ * The daemon and the helper communicate through a SOCK_SEQPACKET socket
+ * pair. Each request is one packet with a header, a list of orders, and
+ * the file descriptors the orders apply to (SCM_RIGHTS). The reply is
+ * one packet with one errno per order, possibly with a file descriptor
+ * (when the helper opened a file on our behalf).
+ *
+ * The helper never logs anything. It is single threaded, closes all the
+ * file descriptors it inherited, and exits as soon as the daemon closes
+ * its end of the socket.
+ *
+ * When the daemon is not started with root privileges (i.e. the service
+ * has NoNewPrivileges=true), there is no point in having a helper and
+ * the exact same functions run in process instead.
+ *
+ * The helper does not trust the daemon. It only accepts paths beneath
+ * the directories it was given on startup (the directories where files
+ * are received and the temporary directories), opens those directories
+ * without following symbolic links, and then works relative to the
+ * directory file descriptors. The file descriptors sent along orders
+ * must be regular files, not hard linked elsewhere, found in one of
+ * those directories. The setuid and setgid bits are never applied.
+ */
+
+// self
+//
+#include    "privileged_helper.h"
+
+#include    "received_file.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/pathinfo.h>
+
+
+// cppthread
+//
+#include    <cppthread/guard.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <atomic>
+#include    <climits>
+#include    <cstring>
+
+
+// C
+//
+#include    <fcntl.h>
+#include    <grp.h>
+#include    <linux/openat2.h>
+#include    <signal.h>
+#include    <sys/prctl.h>
+#include    <sys/socket.h>
+#include    <sys/stat.h>
+#include    <sys/syscall.h>
+#include    <sys/wait.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+namespace
+{
+
+
+enum helper_command_t : std::uint8_t
+{
+    HELPER_COMMAND_OPEN_TEMPORARY = 1,
+    HELPER_COMMAND_OPEN_DIRECTORY = 2,
+    HELPER_COMMAND_SET_METADATA = 3,
+    HELPER_COMMAND_PUBLISH = 4,
+    HELPER_COMMAND_UNLINK = 5,
+};
+
+
+struct helper_header
+{
+    char                f_magic[4] = { 'P', 'R', 'I', 'V' };
+    std::uint8_t        f_command = 0;
+    std::uint8_t        f_count = 0;
+    std::uint8_t        f_padding[2] = {};
+};
+
+
+struct helper_order
+{
+    std::int64_t        f_mtime_sec = 0;
+    std::uint32_t       f_mtime_nsec = 0;
+    std::uint32_t       f_mode = 0;
+    std::uint32_t       f_uid = 0;
+    std::uint32_t       f_gid = 0;
+    std::uint16_t       f_user_length = 0;
+    std::uint16_t       f_group_length = 0;
+    std::uint16_t       f_filename_length = 0;
+    std::uint16_t       f_temp_filename_length = 0;
+};
+
+
+/** \brief The file descriptor of the socket in the helper process.
+ *
+ * The helper moves its end of the socket to this file descriptor and
+ * closes everything above it.
+ */
+constexpr int const         g_helper_socket = 3;
+
+std::atomic<int>            g_identifier = 0;
+
+
+/** \brief Check a path sent to the helper.
+ *
+ * The helper only accepts absolute paths without any ".." segment.
+ *
+ * \param[in] path  The path to check.
+ *
+ * \return true if the path is acceptable.
+ */
+bool is_valid_path(std::string const & path)
+{
+    if(path.empty()
+    || path[0] != '/'
+    || path.find('\0') != std::string::npos)
+    {
+        return false;
+    }
+
+    for(std::string::size_type pos(path.find("/.."));
+        pos != std::string::npos;
+        pos = path.find("/..", pos + 1))
+    {
+        if(pos + 3 == path.length()
+        || path[pos + 3] == '/')
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/** \brief Find the root directory of a path.
+ *
+ * \param[in] roots  The directories the helper works in.
+ * \param[in] path  The path to check.
+ * \param[out] relative  The path relative to the root, "." for the root.
+ *
+ * \return The root directory or nullptr if \p path is not beneath any.
+ */
+std::string const * find_root(
+      std::vector<std::string> const & roots
+    , std::string const & path
+    , std::string & relative)
+{
+    if(!is_valid_path(path))
+    {
+        return nullptr;
+    }
+
+    for(auto const & r : roots)
+    {
+        if(path == r)
+        {
+            relative = ".";
+            return &r;
+        }
+        if(path.length() > r.length()
+        && path[r.length()] == '/'
+        && path.compare(0, r.length(), r) == 0)
+        {
+            relative = path.substr(r.length() + 1);
+            return &r;
+        }
+    }
+
+    return nullptr;
+}
+
+
+/** \brief Open a directory found beneath one of the roots.
+ *
+ * The root is opened with O_NOFOLLOW and the rest of the path is
+ * resolved with RESOLVE_BENEATH and RESOLVE_NO_SYMLINKS so a symbolic
+ * link cannot send us outside of that root. On kernels without
+ * openat2(2), the path is walked one segment at a time with O_NOFOLLOW.
+ *
+ * \param[in] roots  The directories the helper works in.
+ * \param[in] dir  The directory to open.
+ * \param[out] fd  The directory, opened O_RDONLY so it can be synced.
+ *
+ * \return 0 on success, an errno otherwise.
+ */
+int open_directory_beneath(
+      std::vector<std::string> const & roots
+    , std::string const & dir
+    , snapdev::raii_fd_t & fd)
+{
+    std::string relative;
+    std::string const * root(find_root(roots, dir, relative));
+    if(root == nullptr)
+    {
+        return EPERM;
+    }
+
+    snapdev::raii_fd_t current(open(root->c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if(current == nullptr)
+    {
+        return errno;
+    }
+
+    open_how how = {};
+    how.flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    fd.reset(static_cast<int>(syscall(SYS_openat2, current.get(), relative.c_str(), &how, sizeof(how))));
+    if(fd != nullptr)
+    {
+        return 0;
+    }
+    if(errno != ENOSYS)
+    {
+        return errno;
+    }
+
+    std::string::size_type start(0);
+    while(start < relative.length())
+    {
+        std::string::size_type end(relative.find('/', start));
+        if(end == std::string::npos)
+        {
+            end = relative.length();
+        }
+        std::string const segment(relative.substr(start, end - start));
+        start = end + 1;
+        if(segment.empty()
+        || segment == ".")
+        {
+            continue;
+        }
+        snapdev::raii_fd_t next(openat(current.get(), segment.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if(next == nullptr)
+        {
+            return errno;
+        }
+        current = std::move(next);
+    }
+
+    fd.reset(openat(current.get(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    return fd == nullptr ? errno : 0;
+}
+
+
+/** \brief Check a file descriptor sent by the daemon.
+ *
+ * The file must be a regular file, without other hard links, created in
+ * one of the roots (anonymous files are found in their destination
+ * directory, named ones in a temporary directory).
+ *
+ * The daemon must have opened the file for writing, and the file must
+ * be one of ours: either an anonymous file (created by the helper with
+ * O_TMPFILE, so it has no link at all) or a named temporary file owned
+ * by the daemon user. Otherwise the daemon could get any existing file
+ * it can read changed to its own user.
+ *
+ * \param[in] roots  The directories the helper works in.
+ * \param[in] fd  The file descriptor to check.
+ *
+ * \return 0 if the file can be worked on, an errno otherwise.
+ */
+int check_file(std::vector<std::string> const & roots, int fd)
+{
+    int const flags(fcntl(fd, F_GETFL));
+    if(flags == -1)
+    {
+        return errno;
+    }
+    if((flags & O_ACCMODE) != O_WRONLY
+    && (flags & O_ACCMODE) != O_RDWR)
+    {
+        return EPERM;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        return errno;
+    }
+    if(!S_ISREG(st.st_mode)
+    || (st.st_nlink != 0 && st.st_uid != getuid())
+    || st.st_nlink > 1)
+    {
+        return EPERM;
+    }
+
+    char buf[PATH_MAX];
+    std::string const proc("/proc/self/fd/" + std::to_string(fd));
+    ssize_t const l(readlink(proc.c_str(), buf, sizeof(buf)));
+    if(l < 0)
+    {
+        return errno;
+    }
+    std::string path(buf, l);
+    std::string const deleted(" (deleted)");
+    if(path.length() > deleted.length()
+    && path.compare(path.length() - deleted.length(), deleted.length(), deleted) == 0)
+    {
+        path.resize(path.length() - deleted.length());
+    }
+
+    std::string relative;
+    return find_root(roots, snapdev::pathinfo::dirname(path), relative) == nullptr ? EPERM : 0;
+}
+
+
+int do_open(
+      std::vector<std::string> const & roots
+    , std::string const & path
+    , bool temporary
+    , snapdev::raii_fd_t & fd)
+{
+    snapdev::raii_fd_t dirfd;
+    int const e(open_directory_beneath(roots, path, dirfd));
+    if(e != 0)
+    {
+        return e;
+    }
+
+    if(!temporary)
+    {
+        fd = std::move(dirfd);
+        return 0;
+    }
+
+    fd.reset(openat(dirfd.get(), ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600));
+    return fd == nullptr ? errno : 0;
+}
+
+
+int do_set_metadata(
+      std::vector<std::string> const & roots
+    , publish_order const & order
+    , id_cache & ids)
+{
+    int result(check_file(roots, order.f_fd));
+    if(result != 0)
+    {
+        return result;
+    }
+
+    // numeric identifiers are sent when both sides share the same
+    // identity domain, otherwise resolve the names
+    //
+    uid_t uid(order.f_uid);
+    gid_t gid(order.f_gid);
+    if((uid == NO_UID && !ids.get_user_id(order.f_user, uid))
+    || (gid == NO_GID && !ids.get_group_id(order.f_group, gid)))
+    {
+        result = ENOENT;
+    }
+    if(fchown(order.f_fd, uid, gid) != 0
+    && result == 0)
+    {
+        result = errno;
+    }
+
+    // never create setuid or setgid files
+    //
+    if(fchmod(order.f_fd, order.f_mode & ~(S_ISUID | S_ISGID) & 07777) != 0
+    && result == 0)
+    {
+        result = errno;
+    }
+
+    timespec times[2] = {
+        // atime
+        {
+            .tv_sec = 0,
+            .tv_nsec = UTIME_OMIT,
+        },
+        // mtime
+        order.f_mtime,
+    };
+    if(futimens(order.f_fd, times) != 0
+    && result == 0)
+    {
+        result = errno;
+    }
+
+    return result;
+}
+
+
+int do_publish(std::vector<std::string> const & roots, publish_order const & order)
+{
+    snapdev::raii_fd_t dirfd;
+    int e(open_directory_beneath(roots, snapdev::pathinfo::dirname(order.f_filename), dirfd));
+    if(e != 0)
+    {
+        return e;
+    }
+    std::string const basename(snapdev::pathinfo::basename(order.f_filename));
+
+    if(!order.f_temp_filename.empty())
+    {
+        // rename(2) is atomic and does not require us to first delete
+        // the destination file
+        //
+        snapdev::raii_fd_t tempfd;
+        e = open_directory_beneath(roots, snapdev::pathinfo::dirname(order.f_temp_filename), tempfd);
+        if(e != 0)
+        {
+            return e;
+        }
+        std::string const temp_basename(snapdev::pathinfo::basename(order.f_temp_filename));
+        struct stat st;
+        if(fstatat(tempfd.get(), temp_basename.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            return errno;
+        }
+        if(!S_ISREG(st.st_mode)
+        || st.st_nlink > 1)
+        {
+            return EPERM;
+        }
+        return renameat(tempfd.get(), temp_basename.c_str(), dirfd.get(), basename.c_str()) == 0 ? 0 : errno;
+    }
+
+    e = check_file(roots, order.f_fd);
+    if(e != 0)
+    {
+        return e;
+    }
+
+    // linking through /proc does not require CAP_DAC_READ_SEARCH like
+    // the AT_EMPTY_PATH flag does
+    //
+    std::string const source("/proc/self/fd/" + std::to_string(order.f_fd));
+    if(linkat(AT_FDCWD, source.c_str(), dirfd.get(), basename.c_str(), AT_SYMLINK_FOLLOW) == 0)
+    {
+        return 0;
+    }
+    if(errno != EEXIST)
+    {
+        return errno;
+    }
+
+    // linkat(2) does not overwrite an existing file, so we link under a
+    // hidden name and then rename(2) over the existing file, which is atomic
+    //
+    std::string hidden(".");
+    hidden += basename;
+    hidden += received_file::TEMPORARY_INTRODUCER;
+    hidden += std::to_string(getpid());
+    hidden += '-';
+    hidden += std::to_string(++g_identifier);
+    if(linkat(AT_FDCWD, source.c_str(), dirfd.get(), hidden.c_str(), AT_SYMLINK_FOLLOW) != 0)
+    {
+        return errno;
+    }
+
+    if(renameat(dirfd.get(), hidden.c_str(), dirfd.get(), basename.c_str()) != 0)
+    {
+        e = errno;
+        unlinkat(dirfd.get(), hidden.c_str(), 0);
+        return e;
+    }
+
+    return 0;
+}
+
+
+int do_unlink(std::vector<std::string> const & roots, std::string const & filename)
+{
+    snapdev::raii_fd_t dirfd;
+    int const e(open_directory_beneath(roots, snapdev::pathinfo::dirname(filename), dirfd));
+    if(e != 0)
+    {
+        return e;
+    }
+
+    std::string const basename(snapdev::pathinfo::basename(filename));
+    return unlinkat(dirfd.get(), basename.c_str(), 0) == 0 ? 0 : errno;
+}
+
+
+/** \brief Execute a privileged command.
+ *
+ * This function runs in the helper process. When no helper is running,
+ * it runs in the daemon itself.
+ *
+ * \param[in] command  The command to execute.
+ * \param[in] batch  The orders of this command.
+ * \param[out] fd  The file opened by one of the open commands.
+ * \param[in] ids  The cache used to resolve user and group names.
+ * \param[in] roots  The directories the helper is allowed to work in.
+ *
+ * \return One errno per order, 0 on success.
+ */
+std::vector<int> execute(
+      int command
+    , publish_batch_t const & batch
+    , snapdev::raii_fd_t * fd
+    , id_cache & ids
+    , std::vector<std::string> const & roots)
+{
+    std::vector<int> results;
+    results.reserve(batch.size());
+
+    switch(command)
+    {
+    case HELPER_COMMAND_OPEN_TEMPORARY:
+    case HELPER_COMMAND_OPEN_DIRECTORY:
+        if(batch.size() != 1
+        || fd == nullptr)
+        {
+            results.assign(batch.size(), EINVAL);
+            break;
+        }
+        results.push_back(do_open(
+                  roots
+                , batch[0].f_filename
+                , command == HELPER_COMMAND_OPEN_TEMPORARY
+                , *fd));
+        break;
+
+    case HELPER_COMMAND_SET_METADATA:
+        for(auto const & order : batch)
+        {
+            results.push_back(do_set_metadata(roots, order, ids));
+        }
+        break;
+
+    case HELPER_COMMAND_PUBLISH:
+        for(auto const & order : batch)
+        {
+            results.push_back(do_publish(roots, order));
+        }
+        break;
+
+    case HELPER_COMMAND_UNLINK:
+        for(auto const & order : batch)
+        {
+            results.push_back(do_unlink(roots, order.f_filename));
+        }
+        break;
+
+    default:
+        results.assign(batch.size(), EINVAL);
+        break;
+
+    }
+
+    return results;
+}
+
+
+bool has_file_descriptors(int command)
+{
+    return command == HELPER_COMMAND_SET_METADATA
+        || command == HELPER_COMMAND_PUBLISH;
+}
+
+
+std::size_t order_size(publish_order const & order)
+{
+    return sizeof(helper_order)
+         + order.f_user.length()
+         + order.f_group.length()
+         + order.f_filename.length()
+         + order.f_temp_filename.length();
+}
+
+
+bool serialize(
+      int command
+    , publish_batch_t const & batch
+    , std::vector<char> & message)
+{
+    helper_header header;
+    header.f_command = command;
+    header.f_count = batch.size();
+
+    message.clear();
+    message.insert(
+              message.end()
+            , reinterpret_cast<char const *>(&header)
+            , reinterpret_cast<char const *>(&header + 1));
+
+    for(auto const & order : batch)
+    {
+        if(order.f_user.length() > 0xFFFF
+        || order.f_group.length() > 0xFFFF
+        || order.f_filename.length() > 0xFFFF
+        || order.f_temp_filename.length() > 0xFFFF)
+        {
+            return false;
+        }
+
+        helper_order o;
+        o.f_mtime_sec = order.f_mtime.tv_sec;
+        o.f_mtime_nsec = order.f_mtime.tv_nsec;
+        o.f_mode = order.f_mode;
+        o.f_uid = order.f_uid;
+        o.f_gid = order.f_gid;
+        o.f_user_length = order.f_user.length();
+        o.f_group_length = order.f_group.length();
+        o.f_filename_length = order.f_filename.length();
+        o.f_temp_filename_length = order.f_temp_filename.length();
+        message.insert(
+                  message.end()
+                , reinterpret_cast<char const *>(&o)
+                , reinterpret_cast<char const *>(&o + 1));
+        message.insert(message.end(), order.f_user.begin(), order.f_user.end());
+        message.insert(message.end(), order.f_group.begin(), order.f_group.end());
+        message.insert(message.end(), order.f_filename.begin(), order.f_filename.end());
+        message.insert(message.end(), order.f_temp_filename.begin(), order.f_temp_filename.end());
+    }
+
+    return message.size() <= privileged_helper::MAX_MESSAGE_SIZE;
+}
+
+
+bool unserialize(
+      char const * data
+    , std::size_t size
+    , int & command
+    , publish_batch_t & batch)
+{
+    helper_header header;
+    if(size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if(header.f_magic[0] != 'P'
+    || header.f_magic[1] != 'R'
+    || header.f_magic[2] != 'I'
+    || header.f_magic[3] != 'V'
+    || header.f_count == 0
+    || header.f_count > privileged_helper::MAX_BATCH_SIZE)
+    {
+        return false;
+    }
+    command = header.f_command;
+
+    std::size_t pos(sizeof(header));
+    batch.resize(header.f_count);
+    for(auto & order : batch)
+    {
+        helper_order o;
+        if(pos + sizeof(o) > size)
+        {
+            return false;
+        }
+        memcpy(&o, data + pos, sizeof(o));
+        pos += sizeof(o);
+        if(pos
+            + o.f_user_length
+            + o.f_group_length
+            + o.f_filename_length
+            + o.f_temp_filename_length > size)
+        {
+            return false;
+        }
+        order.f_mtime = snapdev::timespec_ex(o.f_mtime_sec, o.f_mtime_nsec);
+        order.f_mode = o.f_mode;
+        order.f_uid = o.f_uid;
+        order.f_gid = o.f_gid;
+        order.f_user.assign(data + pos, o.f_user_length);
+        pos += o.f_user_length;
+        order.f_group.assign(data + pos, o.f_group_length);
+        pos += o.f_group_length;
+        order.f_filename.assign(data + pos, o.f_filename_length);
+        pos += o.f_filename_length;
+        order.f_temp_filename.assign(data + pos, o.f_temp_filename_length);
+        pos += o.f_temp_filename_length;
+    }
+
+    return pos == size;
+}
+
+
+/** \brief Send a packet with optional file descriptors.
+ *
+ * \param[in] s  The socket.
+ * \param[in] data  The data to send.
+ * \param[in] size  The size of \p data.
+ * \param[in] fds  The file descriptors to attach to the packet.
+ *
+ * \return 0 on success, an errno otherwise.
+ */
+int send_packet(
+      int s
+    , void const * data
+    , std::size_t size
+    , std::vector<int> const & fds)
+{
+    iovec iov = {
+        .iov_base = const_cast<void *>(data),
+        .iov_len = size,
+    };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * privileged_helper::MAX_BATCH_SIZE)];
+    if(!fds.empty())
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr * c(CMSG_FIRSTHDR(&msg));
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+    }
+
+    for(;;)
+    {
+        if(sendmsg(s, &msg, MSG_NOSIGNAL) >= 0)
+        {
+            return 0;
+        }
+        if(errno != EINTR)
+        {
+            return errno;
+        }
+    }
+}
+
+
+/** \brief Receive a packet and its file descriptors.
+ *
+ * \param[in] s  The socket.
+ * \param[out] data  The buffer receiving the packet.
+ * \param[out] fds  The file descriptors attached to the packet.
+ *
+ * \return The size of the packet, 0 if the other side closed the socket,
+ * -1 on errors.
+ */
+ssize_t receive_packet(
+      int s
+    , std::vector<char> & data
+    , std::vector<snapdev::raii_fd_t> & fds)
+{
+    iovec iov = {
+        .iov_base = data.data(),
+        .iov_len = data.size(),
+    };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * privileged_helper::MAX_BATCH_SIZE)];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t r(-1);
+    for(;;)
+    {
+        r = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+        if(r >= 0
+        || errno != EINTR)
+        {
+            break;
+        }
+    }
+    if(r <= 0)
+    {
+        return r;
+    }
+
+    for(cmsghdr * c(CMSG_FIRSTHDR(&msg)); c != nullptr; c = CMSG_NXTHDR(&msg, c))
+    {
+        if(c->cmsg_level == SOL_SOCKET
+        && c->cmsg_type == SCM_RIGHTS)
+        {
+            std::size_t const count((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for(std::size_t idx(0); idx < count; ++idx)
+            {
+                int fd(-1);
+                memcpy(&fd, CMSG_DATA(c) + idx * sizeof(int), sizeof(fd));
+                fds.emplace_back(fd);
+            }
+        }
+    }
+
+    if((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return r;
+}
+
+
+} // no name namespace
+
+
+
+privileged_helper::privileged_helper(id_cache::pointer_t ids)
+    : f_id_cache(ids)
+{
+}
+
+
+/** \brief Stop the helper.
+ *
+ * Closing our end of the socket tells the helper to exit. We then wait
+ * for it so it does not stay around as a zombie.
+ */
+privileged_helper::~privileged_helper()
+{
+    f_socket.reset();
+    if(f_child > 0)
+    {
+        waitpid(f_child, nullptr, 0);
+    }
+}
+
+
+/** \brief Fork the privileged helper.
+ *
+ * This function must be called before any thread gets created since the
+ * child process only gets a copy of the calling thread.
+ *
+ * If the daemon does not run as root, no helper is created and the
+ * privileged functions run in process (and most certainly fail for
+ * files owned by other users).
+ *
+ * The \p roots are the only directories the helper accepts to work in.
+ * They are saved before the fork() so the daemon cannot change them
+ * later. A path which is not an existing directory (i.e. a path with a
+ * pattern) is replaced by its parent directory. The root directory (/)
+ * is never accepted.
+ *
+ * \param[in] roots  The receive and temporary directories.
+ */
+void privileged_helper::start(std::vector<std::string> const & roots)
+{
+    if(f_socket != nullptr)
+    {
+        return;
+    }
+
+    f_roots.clear();
+    for(auto const & r : roots)
+    {
+        std::string root(r);
+        while(root.length() > 1 && root.back() == '/')
+        {
+            root.pop_back();
+        }
+        struct stat st;
+        if(stat(root.c_str(), &st) != 0
+        || !S_ISDIR(st.st_mode))
+        {
+            root = snapdev::pathinfo::dirname(root);
+        }
+        if(is_valid_path(root)
+        && root != "/"
+        && std::find(f_roots.begin(), f_roots.end(), root) == f_roots.end())
+        {
+            f_roots.push_back(root);
+        }
+    }
+
+    if(geteuid() != 0)
+    {
+        SNAP_LOG_INFO
+            << "snaprfs does not run as root; no privileged helper started."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    int s[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, s) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create the socket pair of the privileged helper (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    pid_t const pid(fork());
+    if(pid < 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not fork the privileged helper (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        close(s[0]);
+        close(s[1]);
+        return;
+    }
+
+    if(pid == 0)
+    {
+        close(s[0]);
+        f_socket.reset(s[1]);
+        run_helper();
+    }
+
+    close(s[1]);
+    f_socket.reset(s[0]);
+    f_child = pid;
+}
+
+
+/** \brief Permanently drop the root privileges of the daemon.
+ *
+ * Once the helper is running, the daemon does not need to be root
+ * anymore. This function switches all the user and group identifiers
+ * to the real ones (i.e. the "snaprfs" user).
+ *
+ * If the helper is not running, the privileges are kept.
+ */
+void privileged_helper::drop_privileges()
+{
+    if(f_socket == nullptr
+    || geteuid() != 0)
+    {
+        return;
+    }
+
+    uid_t const uid(getuid());
+    gid_t const gid(getgid());
+    if(uid == 0)
+    {
+        SNAP_LOG_WARNING
+            << "snaprfs was started by root; it keeps its root privileges."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    if(setgroups(1, &gid) != 0
+    || setresgid(gid, gid, gid) != 0
+    || setresuid(uid, uid, uid) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not drop the root privileges (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    SNAP_LOG_VERBOSE
+        << "snaprfs dropped its root privileges; privileged operations go through helper process "
+        << f_child
+        << "."
+        << SNAP_LOG_SEND;
+}
+
+
+bool privileged_helper::is_running() const
+{
+    return f_socket != nullptr;
+}
+
+
+/** \brief Create an anonymous file in \p directory.
+ *
+ * The file is created with O_TMPFILE so it has no name until published.
+ *
+ * \param[in] directory  The directory where the file gets created.
+ * \param[out] fd  The file descriptor of the new file.
+ *
+ * \return 0 on success, an errno otherwise.
+ */
+int privileged_helper::open_temporary(
+      std::string const & directory
+    , snapdev::raii_fd_t & fd)
+{
+    publish_batch_t batch(1);
+    batch[0].f_filename = directory;
+    return transact(HELPER_COMMAND_OPEN_TEMPORARY, batch, &fd)[0];
+}
+
+
+/** \brief Open a directory so it can be synced.
+ *
+ * \param[in] directory  The directory to open.
+ * \param[out] fd  The file descriptor of the directory.
+ *
+ * \return 0 on success, an errno otherwise.
+ */
+int privileged_helper::open_directory(
+      std::string const & directory
+    , snapdev::raii_fd_t & fd)
+{
+    publish_batch_t batch(1);
+    batch[0].f_filename = directory;
+    return transact(HELPER_COMMAND_OPEN_DIRECTORY, batch, &fd)[0];
+}
+
+
+/** \brief Apply the owner, group, mode, and mtime to a batch of files.
+ *
+ * \param[in] batch  The files to update.
+ *
+ * \return One errno per order, 0 on success.
+ */
+std::vector<int> privileged_helper::set_metadata(publish_batch_t const & batch)
+{
+    return send_batch(HELPER_COMMAND_SET_METADATA, batch);
+}
+
+
+/** \brief Give a batch of files their final name.
+ *
+ * Anonymous files get linked in their destination directory. Named
+ * temporary files get renamed.
+ *
+ * \param[in] batch  The files to publish.
+ *
+ * \return One errno per order, 0 on success.
+ */
+std::vector<int> privileged_helper::publish(publish_batch_t const & batch)
+{
+    return send_batch(HELPER_COMMAND_PUBLISH, batch);
+}
+
+
+int privileged_helper::unlink(std::string const & filename)
+{
+    publish_batch_t batch(1);
+    batch[0].f_filename = filename;
+    return transact(HELPER_COMMAND_UNLINK, batch, nullptr)[0];
+}
+
+
+std::vector<int> privileged_helper::send_batch(
+      int command
+    , publish_batch_t const & batch)
+{
+    // split the batch so each packet is small enough
+    //
+    std::vector<int> results;
+    results.reserve(batch.size());
+    publish_batch_t part;
+    std::size_t size(sizeof(helper_header));
+    for(auto const & order : batch)
+    {
+        std::size_t const s(order_size(order));
+        if(!part.empty()
+        && (part.size() >= MAX_BATCH_SIZE
+            || size + s > MAX_MESSAGE_SIZE))
+        {
+            std::vector<int> const r(transact(command, part, nullptr));
+            results.insert(results.end(), r.begin(), r.end());
+            part.clear();
+            size = sizeof(helper_header);
+        }
+        part.push_back(order);
+        size += s;
+    }
+    if(!part.empty())
+    {
+        std::vector<int> const r(transact(command, part, nullptr));
+        results.insert(results.end(), r.begin(), r.end());
+    }
+
+    return results;
+}
+
+
+std::vector<int> privileged_helper::transact(
+      int command
+    , publish_batch_t const & batch
+    , snapdev::raii_fd_t * fd)
+{
+    if(f_socket == nullptr)
+    {
+        return execute(command, batch, fd, *f_id_cache, f_roots);
+    }
+
+    std::vector<char> message;
+    if(!serialize(command, batch, message))
+    {
+        return std::vector<int>(batch.size(), ENAMETOOLONG);
+    }
+
+    std::vector<int> fds;
+    if(has_file_descriptors(command))
+    {
+        for(auto const & order : batch)
+        {
+            fds.push_back(order.f_fd);
+        }
+    }
+
+    // the helper handles one request at a time
+    //
+    cppthread::guard lock(f_mutex);
+
+    int const e(send_packet(f_socket.get(), message.data(), message.size(), fds));
+    if(e != 0)
+    {
+        SNAP_LOG_ERROR
+            << "could not send request to the privileged helper (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return std::vector<int>(batch.size(), e);
+    }
+
+    std::vector<char> reply(sizeof(std::int32_t) * MAX_BATCH_SIZE);
+    std::vector<snapdev::raii_fd_t> reply_fds;
+    ssize_t const r(receive_packet(f_socket.get(), reply, reply_fds));
+    if(r != static_cast<ssize_t>(sizeof(std::int32_t) * batch.size()))
+    {
+        int const re(r < 0 ? errno : EPROTO);
+        SNAP_LOG_ERROR
+            << "invalid reply from the privileged helper (errno: "
+            << re
+            << ", "
+            << strerror(re)
+            << ")."
+            << SNAP_LOG_SEND;
+        return std::vector<int>(batch.size(), re);
+    }
+
+    std::vector<int> results(batch.size());
+    for(std::size_t idx(0); idx < batch.size(); ++idx)
+    {
+        std::int32_t v(0);
+        memcpy(&v, reply.data() + idx * sizeof(v), sizeof(v));
+        results[idx] = v;
+    }
+
+    if(fd != nullptr
+    && !reply_fds.empty())
+    {
+        *fd = std::move(reply_fds[0]);
+    }
+
+    return results;
+}
+
+
+/** \brief The helper process main loop.
+ *
+ * This function runs in the child process. It reads one request at a
+ * time, executes it, and sends the reply. It exits when the daemon
+ * closes its end of the socket or dies.
+ */
+void privileged_helper::run_helper()
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    // the daemon handles the signals; we exit when it closes the socket
+    //
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    // keep stdin/stdout/stderr and our socket, close anything else
+    //
+    if(f_socket.get() != g_helper_socket)
+    {
+        dup2(f_socket.get(), g_helper_socket);
+        f_socket.reset();
+    }
+    close_range(g_helper_socket + 1, ~0U, 0);
+
+    std::vector<char> request(MAX_MESSAGE_SIZE);
+    for(;;)
+    {
+        std::vector<snapdev::raii_fd_t> fds;
+        ssize_t const r(receive_packet(g_helper_socket, request, fds));
+        if(r == 0)
+        {
+            _exit(0);
+        }
+
+        int command(0);
+        publish_batch_t batch;
+        if(r < 0
+        || !unserialize(request.data(), r, command, batch)
+        || (has_file_descriptors(command) && fds.size() != batch.size()))
+        {
+            // the daemon and helper are out of sync, stop now
+            //
+            _exit(1);
+        }
+
+        if(has_file_descriptors(command))
+        {
+            for(std::size_t idx(0); idx < batch.size(); ++idx)
+            {
+                batch[idx].f_fd = fds[idx].get();
+            }
+        }
+
+        snapdev::raii_fd_t fd;
+        std::vector<int> const results(execute(command, batch, &fd, *f_id_cache, f_roots));
+
+        std::vector<std::int32_t> reply(results.begin(), results.end());
+        std::vector<int> reply_fds;
+        if(fd != nullptr)
+        {
+            reply_fds.push_back(fd.get());
+        }
+        if(send_packet(
+                  g_helper_socket
+                , reply.data()
+                , reply.size() * sizeof(std::int32_t)
+                , reply_fds) != 0)
+        {
+            _exit(1);
+        }
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,134 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the privileged_helper class.
+ *
+ * The privileged helper is a small child process which keeps the root
+ * privileges while the daemon itself drops them. The daemon sends
+ * batches of orders (file descriptor, owner, group, mode, mtime,
+ * destination) to the helper over a Unix socket.
+ *
+ * The helper only works on files found under the directories it was
+ * given when started (the receive and temporary directories).
+ */
+
+// self
+//
+#include    "id_cache.h"
+
+
+// cppthread
+//
+#include    <cppthread/mutex.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <memory>
+#include    <string>
+#include    <vector>
+
+
+// C
+//
+#include    <sys/types.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+constexpr uid_t const       NO_UID = static_cast<uid_t>(-1);
+constexpr gid_t const       NO_GID = static_cast<gid_t>(-1);
+
+
+struct publish_order
+{
+    int                     f_fd = -1;
+    std::string             f_user = std::string();
+    std::string             f_group = std::string();
+    uid_t                   f_uid = NO_UID;                     // if not NO_UID, use instead of f_user
+    gid_t                   f_gid = NO_GID;                     // if not NO_GID, use instead of f_group
+    mode_t                  f_mode = 0;
+    snapdev::timespec_ex    f_mtime = snapdev::timespec_ex();
+    std::string             f_filename = std::string();         // destination
+    std::string             f_temp_filename = std::string();    // empty for an O_TMPFILE
+};
+
+typedef std::vector<publish_order>      publish_batch_t;
+
+
+class privileged_helper
+{
+public:
+    typedef std::shared_ptr<privileged_helper>  pointer_t;
+
+    static constexpr std::size_t const      MAX_BATCH_SIZE = 16;
+    static constexpr std::size_t const      MAX_MESSAGE_SIZE = 64 * 1024;
+
+                            privileged_helper(id_cache::pointer_t ids);
+                            privileged_helper(privileged_helper const &) = delete;
+                            ~privileged_helper();
+    privileged_helper &     operator = (privileged_helper const &) = delete;
+
+    void                    start(std::vector<std::string> const & roots);
+    void                    drop_privileges();
+    bool                    is_running() const;
+
+    int                     open_temporary(
+                                  std::string const & directory
+                                , snapdev::raii_fd_t & fd);
+    int                     open_directory(
+                                  std::string const & directory
+                                , snapdev::raii_fd_t & fd);
+    std::vector<int>        set_metadata(publish_batch_t const & batch);
+    std::vector<int>        publish(publish_batch_t const & batch);
+    int                     unlink(std::string const & filename);
+
+private:
+    std::vector<int>        send_batch(
+                                  int command
+                                , publish_batch_t const & batch);
+    std::vector<int>        transact(
+                                  int command
+                                , publish_batch_t const & batch
+                                , snapdev::raii_fd_t * fd);
+    [[noreturn]] void       run_helper();
+
+    id_cache::pointer_t     f_id_cache = id_cache::pointer_t();
+    std::vector<std::string>
+                            f_roots = std::vector<std::string>();     // the helper only works beneath these directories
+    cppthread::mutex        f_mutex = cppthread::mutex();
+    snapdev::raii_fd_t      f_socket = snapdev::raii_fd_t();
+    pid_t                   f_child = -1;
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,982 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the receive scheduler.
+ *
+ * When many files change at once (i.e. a deployment), we receive a storm
+ * of RFS_FILE_CHANGED messages. Starting one data_receiver per message
+ * would open as many connections and temporary files, thrashing the disk
+ * and possibly exhausting the file descriptors.
+ *
+ * Instead, the scheduler starts at most max_receives transfers at once
+ * and at most max_receives_per_source from the same source computer.
+ * The other announcements wait in a queue.
+ *
+ * The queue is keyed by filename. If a newer announcement for the same
+ * file arrives while the previous one is still waiting, it replaces it
+ * (the older version would be overwritten anyway). The request keeps
+ * its place in the queue.
+ *
+ * A file is never received twice simultaneously. A newer announcement
+ * for a file currently being received waits for that transfer to end.
+ *
+ * A source may reply BUSY with a retry delay (see send_admission). In
+ * that case, the request goes back to the front of the queue with that
+ * source moved last. If another computer also announced that version of
+ * the file, it is tried immediately. Otherwise the request waits for the
+ * retry delay plus or minus 25% of jitter so all the receivers turned
+ * away at the same time do not come back at the same time.
+ *
+ * A transfer which stalls (see data_receiver::set_watchdog()) is handled
+ * the same way, except that the data received so far is kept with the
+ * request so the next source only sends the remainder of the file.
+ *
+ * Sources which recently failed to connect are skipped (see peer_health)
+ * and the reachable sources are tried by increasing connect latency. If
+ * none of the sources of a request is reachable, the request is deferred
+ * until the earliest time one of them can be retried. Once a peer
+ * recovers, all the requests waiting on it are retried at once.
+ *
+ * When more than one source address can be contacted, a connect_race
+ * determines which one answers first instead of trying them one after
+ * the other.
+ */
+
+// self
+//
+#include    "receive_scheduler.h"
+
+#include    "server.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/communicator.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+receive_scheduler::receive_scheduler(
+          server * s
+        , std::size_t max_receives
+        , std::size_t max_receives_per_source)
+    : timer(-1)
+    , f_server(s)
+    , f_max_receives(std::max(static_cast<std::size_t>(1), max_receives))
+    , f_max_receives_per_source(std::max(static_cast<std::size_t>(1), max_receives_per_source))
+{
+}
+
+
+/** \brief Add a request to receive a file.
+ *
+ * If the limits allow it, the transfer starts immediately. Otherwise
+ * the request is queued. If a request for the same file is already
+ * queued, the one with the newest mtime is kept.
+ *
+ * \param[in] request  The file to receive and where to get it from.
+ */
+void receive_scheduler::add_request(receive_request const & request)
+{
+    if(request.f_sources.empty())
+    {
+        return;
+    }
+
+    auto a(f_active.find(request.f_filename));
+    if(a != f_active.end()
+    && a->second.f_request.f_mtime == request.f_mtime
+    && (!a->second.f_request.f_speculative || request.f_speculative))
+    {
+        // same version from another source, remember it in case the
+        // current source is busy
+        //
+        merge_sources(a->second.f_request, request);
+        return;
+    }
+
+    auto it(f_queued.find(request.f_filename));
+    if(it != f_queued.end())
+    {
+        if(it->second.f_mtime == request.f_mtime
+        && (!it->second.f_speculative || request.f_speculative))
+        {
+            merge_sources(it->second, request);
+            return;
+        }
+        if(it->second.f_mtime > request.f_mtime)
+        {
+            // we already have that version (or a newer one) queued
+            //
+            return;
+        }
+
+        // replace with the newer announcement, keep the queue position
+        // and the time when the file was first queued
+        //
+        snapdev::timespec_ex const queued(it->second.f_queued);
+        it->second = request;
+        it->second.f_queued = queued;
+        ++f_statistics.f_superseded;
+        return;
+    }
+
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+    receive_request r(request);
+    r.f_queued = now;
+    r.f_not_before = deferred_until(r, now);
+    if(can_start(r, now))
+    {
+        start(r);
+        return;
+    }
+
+    f_queued[request.f_filename] = r;
+    f_order.push_back(request.f_filename);
+    if(r.f_not_before > now)
+    {
+        ++f_statistics.f_deferred;
+        wake_up_at(r.f_not_before);
+    }
+
+    SNAP_LOG_TRACE
+        << "queued reception of \""
+        << request.f_filename
+        << "\" ("
+        << f_active.size()
+        << " active, "
+        << f_queued.size()
+        << " queued)."
+        << SNAP_LOG_SEND;
+}
+
+
+/** \brief Signal that the source of a transfer is busy.
+ *
+ * The data_receiver calls this function when the source replies BUSY
+ * instead of sending the file. The data_receiver then gets removed and
+ * receive_done() requeues the request.
+ *
+ * \param[in] filename  The name of the file which was being received.
+ * \param[in] retry_after_msec  The delay requested by the source.
+ */
+void receive_scheduler::receive_busy(std::string const & filename, std::uint32_t retry_after_msec)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+    it->second.f_retry_after_msec = retry_after_msec;
+    ++f_statistics.f_busy;
+}
+
+
+/** \brief Signal that the connection to the source failed.
+ *
+ * The server calls this function when it could not connect to the
+ * source chosen by the scheduler. The server then calls receive_done()
+ * and the request gets retried right away, with another source if
+ * there is one. The peer health table knows that this source failed.
+ *
+ * \param[in] filename  The name of the file which was to be received.
+ */
+void receive_scheduler::receive_failed(std::string const & filename)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+    it->second.f_retry_after_msec = 0;
+}
+
+
+/** \brief Signal that a transfer stalled.
+ *
+ * The data_receiver calls this function when its watchdog detects that
+ * the transfer is too slow. The request gets retried, preferably with
+ * another source, starting where the stalled transfer stopped.
+ *
+ * \param[in] filename  The name of the file which was being received.
+ * \param[in] partial  The data received so far, may be nullptr.
+ */
+void receive_scheduler::receive_stalled(std::string const & filename, received_file::pointer_t partial)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+    it->second.f_retry_after_msec = STALL_RETRY_MSEC;
+    it->second.f_request.f_partial = partial;
+    ++f_statistics.f_stalled;
+}
+
+
+/** \brief Signal that a transfer is over.
+ *
+ * This function is called once the data_receiver of \p filename is
+ * removed from the communicator, whether the transfer succeeded or not.
+ * It releases the slot and starts the next queued transfers.
+ *
+ * \param[in] filename  The name of the file which was being received.
+ */
+void receive_scheduler::receive_done(std::string const & filename)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+
+    active_receive const active(it->second);
+    release_slot(filename);
+
+    if(active.f_retry_after_msec >= 0)
+    {
+        requeue(active);
+    }
+
+    start_next();
+}
+
+
+/** \brief A peer which was failing is reachable again.
+ *
+ * All the requests waiting on that peer get retried immediately.
+ *
+ * \param[in] peer  The IP address of the peer.
+ */
+void receive_scheduler::peer_recovered(std::string const & peer)
+{
+    bool found(false);
+    for(auto & q : f_queued)
+    {
+        for(auto const & source : q.second.f_sources)
+        {
+            if(peer_key(source) == peer)
+            {
+                q.second.f_not_before = snapdev::timespec_ex();
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if(found)
+    {
+        // this may be called from within start_next(), so wake up from
+        // the timer instead of starting the requests recursively
+        //
+        set_timeout_date(snapdev::timespec_ex::gettime().to_usec());
+    }
+}
+
+
+/** \brief A connect race is over.
+ *
+ * The receiver gets started with the address which answered first. If
+ * no address answered, the request gets deferred.
+ *
+ * \param[in] filename  The name of the file to receive.
+ * \param[in] index  The index of the source which answered first, or -1.
+ */
+void receive_scheduler::race_done(std::string const & filename, int index)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+    it->second.f_race.reset();
+
+    if(index < 0)
+    {
+        receive_request const request(it->second.f_request);
+        release_slot(filename);
+        defer(request);
+    }
+    else
+    {
+        receive_from(filename, index, 1);
+    }
+
+    if(!f_active.contains(filename))
+    {
+        // the slot was released, this may be called from within
+        // start_next() so wake up from the timer
+        //
+        set_timeout_date(snapdev::timespec_ex::gettime().to_usec());
+    }
+}
+
+
+/** \brief Setup the connect race parameters.
+ *
+ * \param[in] stagger_msec  The delay before trying the next address.
+ * \param[in] timeout_msec  The maximum time to wait for a connection.
+ */
+void receive_scheduler::set_connect_race(std::int64_t stagger_msec, std::int64_t timeout_msec)
+{
+    f_connect_stagger_msec = stagger_msec;
+    f_connect_timeout_msec = timeout_msec;
+}
+
+
+/** \brief Forget about all the queued requests.
+ *
+ * This is used when the server stops.
+ */
+void receive_scheduler::clear()
+{
+    for(auto & a : f_active)
+    {
+        if(a.second.f_race != nullptr)
+        {
+            a.second.f_race->cancel();
+            a.second.f_race.reset();
+        }
+    }
+    f_queued.clear();
+    f_order.clear();
+    set_timeout_date(-1);
+}
+
+
+/** \brief Check whether a file is being received or waits to be.
+ *
+ * \param[in] filename  The name of the file.
+ *
+ * \return true if the file is queued or active.
+ */
+bool receive_scheduler::has_request(std::string const & filename) const
+{
+    return f_active.find(filename) != f_active.end()
+        || f_queued.find(filename) != f_queued.end();
+}
+
+
+std::size_t receive_scheduler::get_active() const
+{
+    return f_active.size();
+}
+
+
+std::size_t receive_scheduler::get_queue_depth() const
+{
+    return f_queued.size();
+}
+
+
+/** \brief Get the time the oldest queued request has been waiting.
+ *
+ * \return The wait time in microseconds, 0 if the queue is empty.
+ */
+std::int64_t receive_scheduler::get_oldest_wait() const
+{
+    if(f_order.empty())
+    {
+        return 0;
+    }
+    auto it(f_queued.find(f_order.front()));
+    if(it == f_queued.end())
+    {
+        return 0;
+    }
+    return (snapdev::timespec_ex::gettime() - it->second.f_queued).to_usec();
+}
+
+
+receive_statistics const & receive_scheduler::get_statistics() const
+{
+    return f_statistics;
+}
+
+
+/** \brief A busy request may be ready to retry.
+ *
+ * The timer is set to the earliest retry time of the requests which
+ * were turned away by a busy source.
+ */
+void receive_scheduler::process_timeout()
+{
+    set_timeout_date(-1);
+    start_next();
+}
+
+
+std::string receive_scheduler::peer_key(receive_source const & source)
+{
+    // the port differs between plain and secure, we want the computer
+    //
+    return source.f_address.to_ipv4or6_string(addr::STRING_IP_ADDRESS);
+}
+
+
+std::string receive_scheduler::source_key(receive_request const & request)
+{
+    return peer_key(request.f_sources[0]);
+}
+
+
+/** \brief Compute the cost of receiving from a source.
+ *
+ * The cost depends on where the source is compared to us:
+ *
+ * \li 0 -- same rack (in the same datacenter)
+ * \li 1 -- same datacenter, or on one of our local networks when the
+ *           labels are not known
+ * \li 2 -- unknown
+ * \li 3 -- another datacenter
+ *
+ * \param[in] source  The source to check.
+ *
+ * \return The cost of that source, lower is better.
+ */
+int receive_scheduler::topology_cost(receive_source const & source) const
+{
+    std::string const & rack(f_server->get_rack());
+    std::string const & datacenter(f_server->get_datacenter());
+
+    bool const same_datacenter(source.f_datacenter == datacenter);
+    if(!source.f_datacenter.empty()
+    && !datacenter.empty()
+    && !same_datacenter)
+    {
+        return 3;
+    }
+    if(same_datacenter
+    && !rack.empty()
+    && source.f_rack == rack)
+    {
+        return 0;
+    }
+    if(!datacenter.empty()
+    && same_datacenter)
+    {
+        return 1;
+    }
+    if(f_server->get_peer_health()->is_local_network(peer_key(source), source.f_address))
+    {
+        return 1;
+    }
+    return 2;
+}
+
+
+/** \brief Sort the sources by preference.
+ *
+ * The sources which can be contacted now come first. Then the sources
+ * are sorted by topology cost (same rack, same datacenter, ...), then by
+ * measured round trip time and finally by measured throughput.
+ *
+ * \param[in,out] request  The request of which the sources get sorted.
+ * \param[in] now  The current time.
+ */
+void receive_scheduler::order_sources(
+      receive_request & request
+    , snapdev::timespec_ex const & now) const
+{
+    if(request.f_sources.size() < 2)
+    {
+        return;
+    }
+
+    struct rank
+    {
+        bool                f_available = false;
+        int                 f_cost = 0;
+        std::int64_t        f_latency = 0;
+        std::uint64_t       f_throughput = 0;
+        receive_source      f_source = receive_source();
+    };
+
+    peer_health::pointer_t health(f_server->get_peer_health());
+    std::vector<rank> ranks;
+    ranks.reserve(request.f_sources.size());
+    for(auto const & s : request.f_sources)
+    {
+        std::string const key(peer_key(s));
+        rank r;
+        r.f_available = health->is_available(key, now);
+        r.f_cost = topology_cost(s);
+        r.f_latency = health->get_latency(key);
+        r.f_throughput = health->get_throughput(key);
+        r.f_source = s;
+        ranks.push_back(r);
+    }
+
+    std::stable_sort(
+              ranks.begin()
+            , ranks.end()
+            , [](rank const & a, rank const & b)
+            {
+                if(a.f_available != b.f_available)
+                {
+                    return a.f_available;
+                }
+                if(a.f_cost != b.f_cost)
+                {
+                    return a.f_cost < b.f_cost;
+                }
+                if(a.f_latency != b.f_latency)
+                {
+                    return a.f_latency < b.f_latency;
+                }
+                return a.f_throughput > b.f_throughput;
+            });
+
+    for(std::size_t idx(0); idx < ranks.size(); ++idx)
+    {
+        request.f_sources[idx] = ranks[idx].f_source;
+    }
+}
+
+
+/** \brief Check whether all the sources of a request are unreachable.
+ *
+ * \param[in] request  The request to check.
+ * \param[in] now  The current time.
+ *
+ * \return A zero timespec if at least one source can be contacted now,
+ * otherwise the earliest time at which one of them can be retried.
+ */
+snapdev::timespec_ex receive_scheduler::deferred_until(
+      receive_request const & request
+    , snapdev::timespec_ex const & now) const
+{
+    peer_health::pointer_t health(f_server->get_peer_health());
+    snapdev::timespec_ex earliest;
+    for(auto const & source : request.f_sources)
+    {
+        std::string const key(peer_key(source));
+        if(health->is_available(key, now))
+        {
+            return snapdev::timespec_ex();
+        }
+        snapdev::timespec_ex retry_at(health->get_retry_at(key));
+        if(retry_at <= now)
+        {
+            // a probe is in progress, check again a little later
+            //
+            retry_at = now + snapdev::timespec_ex(1, 0);
+        }
+        if(earliest == snapdev::timespec_ex()
+        || retry_at < earliest)
+        {
+            earliest = retry_at;
+        }
+    }
+    return earliest;
+}
+
+
+/** \brief Put back a request which could not connect to any source.
+ *
+ * \param[in] request  The request to defer.
+ */
+void receive_scheduler::defer(receive_request const & request)
+{
+    if(f_queued.contains(request.f_filename))
+    {
+        return;
+    }
+
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+    receive_request & r(f_queued[request.f_filename]);
+    r = request;
+    r.f_not_before = deferred_until(request, now);
+    if(r.f_not_before == snapdev::timespec_ex())
+    {
+        r.f_not_before = now + snapdev::timespec_ex(1, 0);
+    }
+    f_order.push_back(request.f_filename);
+    ++f_statistics.f_deferred;
+    wake_up_at(r.f_not_before);
+
+    SNAP_LOG_TRACE
+        << "deferred reception of \""
+        << request.f_filename
+        << "\", no source is reachable."
+        << SNAP_LOG_SEND;
+}
+
+
+void receive_scheduler::wake_up_at(snapdev::timespec_ex const & when)
+{
+    std::int64_t const usec(when.to_usec());
+    std::int64_t const date(get_timeout_date());
+    if(date == -1
+    || usec < date)
+    {
+        set_timeout_date(usec);
+    }
+}
+
+
+void receive_scheduler::merge_sources(receive_request & to, receive_request const & from)
+{
+    for(auto const & s : from.f_sources)
+    {
+        auto const it(std::find_if(
+                  to.f_sources.begin()
+                , to.f_sources.end()
+                , [&s](receive_source const & t)
+                {
+                    return t.f_address == s.f_address;
+                }));
+        if(it == to.f_sources.end())
+        {
+            to.f_sources.push_back(s);
+        }
+    }
+}
+
+
+bool receive_scheduler::can_start(
+      receive_request const & request
+    , snapdev::timespec_ex const & now) const
+{
+    if(f_active.size() >= f_max_receives
+    || f_active.contains(request.f_filename)
+    || request.f_not_before > now)
+    {
+        return false;
+    }
+
+    auto const it(f_active_per_source.find(source_key(request)));
+    return it == f_active_per_source.end()
+        || it->second < f_max_receives_per_source;
+}
+
+
+/** \brief Start receiving a file.
+ *
+ * The function tries each source in turn until one connection succeeds.
+ *
+ * \param[in] request  The request to start.
+ *
+ * \return true if a data_receiver was started.
+ */
+bool receive_scheduler::start(receive_request const & original)
+{
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+
+    receive_request request(original);
+    if(request.f_partial == nullptr
+    && request.f_append_offset > 0)
+    {
+        // only receive the data added since the version we have (or
+        // since the data received speculatively)
+        //
+        f_server->prepare_append(request);
+    }
+    order_sources(request, now);
+    peer_health::pointer_t health(f_server->get_peer_health());
+
+    // reserve the slot first, receive_file() may fail immediately
+    //
+    std::string const key(source_key(request));
+    active_receive & active(f_active[request.f_filename]);
+    active.f_source_key = key;
+    active.f_request = request;
+    active.f_retry_after_msec = -1;
+    active.f_race.reset();
+    ++f_active_per_source[key];
+
+    // with more than one reachable address, race them
+    //
+    addr::addr::vector_t addresses;
+    for(auto const & s : request.f_sources)
+    {
+        if(!health->is_available(peer_key(s), now))
+        {
+            break;
+        }
+        addresses.push_back(s.f_address);
+    }
+    if(addresses.size() > 1)
+    {
+        if(!f_server->wants_file(request.f_filename, request.f_mtime))
+        {
+            release_slot(request.f_filename);
+            return false;
+        }
+
+        connect_race::pointer_t race(std::make_shared<connect_race>(
+                  this
+                , health
+                , request.f_filename
+                , addresses
+                , f_connect_stagger_msec
+                , f_connect_timeout_msec));
+        if(ed::communicator::instance()->add_connection(race))
+        {
+            // note: the race may be over once start() returns
+            //
+            active.f_race = race;
+            race->start();
+            return true;
+        }
+    }
+
+    receive_from(request.f_filename, 0, request.f_sources.size());
+    return f_active.contains(request.f_filename);
+}
+
+
+/** \brief Start receiving from one of the sources of an active request.
+ *
+ * The function tries the sources from \p first, up to \p count of them,
+ * until one connection succeeds. If none does, the slot is released and
+ * the request deferred if the failure was a connection failure.
+ *
+ * \param[in] filename  The name of the file to receive.
+ * \param[in] first  The index of the first source to try.
+ * \param[in] count  The maximum number of sources to try.
+ */
+void receive_scheduler::receive_from(
+      std::string const & filename
+    , std::size_t first
+    , std::size_t count)
+{
+    auto a(f_active.find(filename));
+    if(a == f_active.end())
+    {
+        return;
+    }
+    receive_request const request(a->second.f_request);
+
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+    std::int64_t const wait((now - request.f_queued).to_usec());
+    peer_health::pointer_t health(f_server->get_peer_health());
+
+    bool failed(false);
+    std::size_t const last(std::min(first + count, request.f_sources.size()));
+    for(std::size_t idx(first); idx < last; ++idx)
+    {
+        receive_source const & s(request.f_sources[idx]);
+        if(!health->is_available(peer_key(s), now))
+        {
+            // sources are sorted, all the following ones are down too
+            //
+            failed = true;
+            break;
+        }
+
+        switch(f_server->receive_file(
+                      request.f_filename
+                    , request.f_mtime
+                    , request.f_id
+                    , s
+                    , request.f_partial
+                    , request.f_speculative))
+        {
+        case receive_status_t::RECEIVE_STATUS_STARTED:
+            ++f_statistics.f_started;
+            f_statistics.f_total_wait_usec += wait;
+            f_statistics.f_max_wait_usec = std::max(f_statistics.f_max_wait_usec, wait);
+            return;
+
+        case receive_status_t::RECEIVE_STATUS_IGNORED:
+            failed = false;
+            break;
+
+        case receive_status_t::RECEIVE_STATUS_FAILED:
+            // try with the next address
+            //
+            failed = true;
+            continue;
+
+        }
+        break;
+    }
+
+    // nothing started, release the slot
+    //
+    release_slot(filename);
+
+    if(failed)
+    {
+        // no source could be reached, try again once one of them may be
+        // back up
+        //
+        defer(request);
+    }
+}
+
+
+void receive_scheduler::release_slot(std::string const & filename)
+{
+    auto it(f_active.find(filename));
+    if(it == f_active.end())
+    {
+        return;
+    }
+
+    auto s(f_active_per_source.find(it->second.f_source_key));
+    if(s != f_active_per_source.end())
+    {
+        --s->second;
+        if(s->second == 0)
+        {
+            f_active_per_source.erase(s);
+        }
+    }
+    f_active.erase(it);
+}
+
+
+void receive_scheduler::start_next()
+{
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+    std::int64_t next_retry(-1);
+    auto it(f_order.begin());
+    while(it != f_order.end()
+       && f_active.size() < f_max_receives)
+    {
+        auto q(f_queued.find(*it));
+        if(q == f_queued.end())
+        {
+            it = f_order.erase(it);
+            continue;
+        }
+        snapdev::timespec_ex const deferred(deferred_until(q->second, now));
+        if(deferred > q->second.f_not_before)
+        {
+            q->second.f_not_before = deferred;
+        }
+        if(!can_start(q->second, now))
+        {
+            // that source is busy, try the next request
+            //
+            if(q->second.f_not_before > now)
+            {
+                std::int64_t const retry(q->second.f_not_before.to_usec());
+                if(next_retry == -1
+                || retry < next_retry)
+                {
+                    next_retry = retry;
+                }
+            }
+            ++it;
+            continue;
+        }
+
+        receive_request const request(q->second);
+        f_queued.erase(q);
+        it = f_order.erase(it);
+
+        ++f_statistics.f_delayed;
+        start(request);
+    }
+
+    if(next_retry != -1)
+    {
+        std::int64_t const date(get_timeout_date());
+        if(date == -1
+        || next_retry < date)
+        {
+            set_timeout_date(next_retry);
+        }
+    }
+}
+
+
+/** \brief Put back a request turned away by a busy source.
+ *
+ * The busy source is moved to the end of the list of sources. If the
+ * new first source is another computer, the request can be tried
+ * immediately. Otherwise it waits for the delay the source requested,
+ * with some jitter.
+ *
+ * The request goes back at the front of the queue so it does not lose
+ * its turn.
+ *
+ * \param[in] active  The transfer which was turned away.
+ */
+void receive_scheduler::requeue(active_receive const & active)
+{
+    receive_request request(active.f_request);
+    if(request.f_sources.size() > 1)
+    {
+        std::rotate(
+                  request.f_sources.begin()
+                , request.f_sources.begin() + 1
+                , request.f_sources.end());
+    }
+
+    if(source_key(request) == active.f_source_key)
+    {
+        std::int64_t const delay(active.f_retry_after_msec * 1'000);
+        std::uniform_int_distribution<std::int64_t> jitter(delay * 3 / 4, delay * 5 / 4);
+        std::int64_t const usec(jitter(f_random));
+        request.f_not_before = snapdev::timespec_ex::gettime()
+                             + snapdev::timespec_ex(usec / 1'000'000, (usec % 1'000'000) * 1'000);
+    }
+    else
+    {
+        request.f_not_before = snapdev::timespec_ex();
+    }
+
+    auto it(f_queued.find(request.f_filename));
+    if(it != f_queued.end())
+    {
+        // a newer announcement arrived in the meantime (the partial data,
+        // if any, is then useless and gets discarded with the request)
+        //
+        if(it->second.f_mtime == request.f_mtime)
+        {
+            merge_sources(it->second, request);
+            if(it->second.f_partial == nullptr)
+            {
+                it->second.f_partial = request.f_partial;
+            }
+        }
+        return;
+    }
+
+    f_queued[request.f_filename] = request;
+    f_order.push_front(request.f_filename);
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
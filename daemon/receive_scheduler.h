@@ -0,0 +1,218 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the receive_scheduler class.
+ *
+ * The receive scheduler limits the number of files we receive at once,
+ * globally and per source. Announcements over the limit wait in a queue.
+ */
+
+// self
+//
+#include    "connect_race.h"
+#include    "received_file.h"
+
+
+// libaddr
+//
+#include    <libaddr/addr.h>
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/timer.h>
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <list>
+#include    <map>
+#include    <memory>
+#include    <random>
+#include    <vector>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class server;
+
+
+enum class receive_status_t
+{
+    RECEIVE_STATUS_STARTED,         // a data_receiver was started
+    RECEIVE_STATUS_IGNORED,         // the file does not need to be received
+    RECEIVE_STATUS_FAILED,          // could not connect, try another source
+};
+
+
+struct receive_source
+{
+    addr::addr          f_address = addr::addr();
+    bool                f_secure = false;
+    std::string         f_rack = std::string();         // topology labels of the source
+    std::string         f_datacenter = std::string();
+    bool                f_extended_request = false;     // the source accepts the 'FIL2' request
+};
+
+
+struct receive_request
+{
+    typedef std::vector<receive_source>     source_vector_t;
+
+    std::string         f_filename = std::string();
+    snapdev::timespec_ex
+                        f_mtime = snapdev::timespec_ex();
+    std::uint32_t       f_id = 0;
+    source_vector_t     f_sources = source_vector_t();
+    snapdev::timespec_ex
+                        f_queued = snapdev::timespec_ex();
+    snapdev::timespec_ex
+                        f_not_before = snapdev::timespec_ex();  // set when a source said it was busy
+    received_file::pointer_t
+                        f_partial = received_file::pointer_t(); // data received before a source stalled
+    std::string         f_hash = std::string();                 // hash of the contents, if announced
+    std::uint64_t       f_size = 0;
+    mode_t              f_mode = 0;
+    std::string         f_user = std::string();
+    std::string         f_group = std::string();
+    bool                f_inline = false;                       // f_data is the whole file
+    std::string         f_data = std::string();
+    std::uint64_t       f_append_offset = 0;                    // copy_mode=append: size of the previous version
+    std::string         f_prefix_hash = std::string();          // hash of that previous version
+    bool                f_speculative = false;                  // the file is still being written, do not publish
+};
+
+
+struct receive_statistics
+{
+    std::uint64_t       f_started = 0;
+    std::uint64_t       f_delayed = 0;              // number of requests which had to wait in the queue
+    std::uint64_t       f_superseded = 0;           // queued requests replaced by a newer announcement
+    std::uint64_t       f_busy = 0;                 // number of BUSY replies received from sources
+    std::uint64_t       f_stalled = 0;              // number of transfers aborted by the watchdog
+    std::uint64_t       f_deferred = 0;             // requests deferred because no source was reachable
+    std::int64_t        f_total_wait_usec = 0;
+    std::int64_t        f_max_wait_usec = 0;
+};
+
+
+class receive_scheduler
+    : public ed::timer
+{
+public:
+    typedef std::shared_ptr<receive_scheduler>  pointer_t;
+
+    static constexpr std::size_t const      DEFAULT_MAX_RECEIVES = 16;
+    static constexpr std::size_t const      DEFAULT_MAX_RECEIVES_PER_SOURCE = 4;
+    static constexpr std::uint32_t const    STALL_RETRY_MSEC = 1'000;
+
+                        receive_scheduler(
+                              server * s
+                            , std::size_t max_receives
+                            , std::size_t max_receives_per_source);
+                        receive_scheduler(receive_scheduler const &) = delete;
+    receive_scheduler & operator = (receive_scheduler const &) = delete;
+
+    void                add_request(receive_request const & request);
+    void                receive_busy(std::string const & filename, std::uint32_t retry_after_msec);
+    void                receive_failed(std::string const & filename);
+    void                receive_stalled(std::string const & filename, received_file::pointer_t partial);
+    void                receive_done(std::string const & filename);
+    void                peer_recovered(std::string const & peer);
+    void                race_done(std::string const & filename, int index);
+    void                set_connect_race(std::int64_t stagger_msec, std::int64_t timeout_msec);
+    void                clear();
+
+    bool                has_request(std::string const & filename) const;
+    std::size_t         get_active() const;
+    std::size_t         get_queue_depth() const;
+    std::int64_t        get_oldest_wait() const;
+    receive_statistics const &
+                        get_statistics() const;
+
+    // timer implementation
+    //
+    virtual void        process_timeout() override;
+
+private:
+    struct active_receive
+    {
+        std::string         f_source_key = std::string();
+        receive_request     f_request = receive_request();
+        std::int64_t        f_retry_after_msec = -1;        // >= 0 once the source replied BUSY or stalled
+        connect_race::pointer_t
+                            f_race = connect_race::pointer_t();
+    };
+
+    static std::string  peer_key(receive_source const & source);
+    static std::string  source_key(receive_request const & request);
+    static void         merge_sources(receive_request & to, receive_request const & from);
+    int                 topology_cost(receive_source const & source) const;
+    void                order_sources(
+                              receive_request & request
+                            , snapdev::timespec_ex const & now) const;
+    snapdev::timespec_ex
+                        deferred_until(
+                              receive_request const & request
+                            , snapdev::timespec_ex const & now) const;
+    void                defer(receive_request const & request);
+    void                wake_up_at(snapdev::timespec_ex const & when);
+    bool                can_start(
+                              receive_request const & request
+                            , snapdev::timespec_ex const & now) const;
+    bool                start(receive_request const & request);
+    void                receive_from(
+                              std::string const & filename
+                            , std::size_t first
+                            , std::size_t count);
+    void                release_slot(std::string const & filename);
+    void                start_next();
+    void                requeue(active_receive const & active);
+
+    server *            f_server = nullptr;
+    std::size_t         f_max_receives = DEFAULT_MAX_RECEIVES;
+    std::size_t         f_max_receives_per_source = DEFAULT_MAX_RECEIVES_PER_SOURCE;
+    std::int64_t        f_connect_stagger_msec = connect_race::DEFAULT_STAGGER_MSEC;
+    std::int64_t        f_connect_timeout_msec = connect_race::DEFAULT_TIMEOUT_MSEC;
+    std::map<std::string, receive_request>
+                        f_queued = std::map<std::string, receive_request>();
+    std::list<std::string>
+                        f_order = std::list<std::string>();
+    std::map<std::string, active_receive>
+                        f_active = std::map<std::string, active_receive>();
+    std::map<std::string, std::size_t>
+                        f_active_per_source = std::map<std::string, std::size_t>();
+    receive_statistics  f_statistics = receive_statistics();
+    std::minstd_rand    f_random = std::minstd_rand(std::random_device()());
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
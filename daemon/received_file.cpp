@@ -0,0 +1,607 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the received_file class.
+ *
+ * When possible, a file being received is created with O_TMPFILE directly
+ * in its destination directory. Such a file has no name until we link it
+ * with linkat(2), which we do only once it was fully received and verified.
+ * If the daemon crashes or the transfer fails, the kernel releases the
+ * inode on close() and nothing is left behind.
+ *
+ * The ownership, mode, and modification time are applied to the file
+ * descriptor (fchown(2), fchmod(2), futimens(2)) so no path resolution
+ * happens for those. All the operations requiring root privileges go
+ * through the privileged helper.
+ *
+ * On file systems which do not support O_TMPFILE, we fallback to the
+ * old method: a named temporary file in one of the temporary directories
+ * which gets renamed once complete.
+ *
+ * The functions verifying, syncing, and publishing the file are called
+ * from the commit worker threads (see commit_queue).
+ */
+
+// self
+//
+#include    "received_file.h"
+
+#include    "data_sender.h"
+
+
+// snaprfs
+//
+#include    <snaprfs/exception.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/pathinfo.h>
+
+
+// C++
+//
+#include    <atomic>
+
+
+// C
+//
+#include    <fcntl.h>
+#include    <linux/fs.h>
+#include    <sys/ioctl.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+namespace
+{
+
+
+std::atomic<int>            g_identifier = 0;
+
+
+} // no name namespace
+
+
+
+received_file::received_file(
+          std::string const & filename
+        , std::string const & temp_path
+        , privileged_helper::pointer_t helper)
+    : f_filename(filename)
+    , f_temp_path(temp_path)
+    , f_privileged_helper(helper)
+{
+    if(f_filename.empty())
+    {
+        throw rfs::missing_parameter("filename cannot be empty in received_file");
+    }
+    if(!f_temp_path.empty()
+    && f_temp_path.back() != '/')
+    {
+        f_temp_path += '/';
+    }
+}
+
+
+received_file::~received_file()
+{
+    discard();
+}
+
+
+/** \brief Check whether a filename is one of our temporary filenames.
+ *
+ * When the destination file already exists, the received file is first
+ * linked under a hidden temporary name in the destination directory and
+ * then renamed over the existing file. The file_listener sees that name
+ * appear so it needs to be able to ignore it.
+ *
+ * \param[in] filename  The basename of the file to check.
+ *
+ * \return true if \p filename looks like one of our temporary names.
+ */
+bool received_file::is_temporary_name(std::string const & filename)
+{
+    return filename.length() > 1
+        && filename[0] == '.'
+        && filename.find(TEMPORARY_INTRODUCER) != std::string::npos;
+}
+
+
+/** \brief Open the file used to save the incoming data.
+ *
+ * This function first attempts to create an anonymous file in the
+ * destination directory (O_TMPFILE). If the file system does not support
+ * that feature, it creates a named file in the temporary directory instead.
+ *
+ * \return true if a file was opened.
+ */
+bool received_file::open()
+{
+    if(f_fd != nullptr)
+    {
+        return true;
+    }
+
+    if(open_anonymous())
+    {
+        return true;
+    }
+
+    return open_named();
+}
+
+
+bool received_file::open_anonymous()
+{
+    // the destination directory is most certainly not writable by the
+    // "snaprfs" user so the privileged helper creates the file for us
+    //
+    std::string const dir(snapdev::pathinfo::dirname(f_filename));
+    int const e(f_privileged_helper->open_temporary(dir, f_fd));
+    if(e != 0)
+    {
+        if(e == EOPNOTSUPP
+        || e == EISDIR
+        || e == EINVAL)
+        {
+            SNAP_LOG_DEBUG
+                << "file system of \""
+                << dir
+                << "\" does not support O_TMPFILE; using a named temporary file instead."
+                << SNAP_LOG_SEND;
+        }
+        else
+        {
+            SNAP_LOG_WARNING
+                << "could not create anonymous file in \""
+                << dir
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << "); using a named temporary file instead."
+                << SNAP_LOG_SEND;
+        }
+        f_fd.reset();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool received_file::open_named()
+{
+    if(f_temp_path.empty())
+    {
+        SNAP_LOG_ERROR
+            << "no temporary directory available to receive \""
+            << f_filename
+            << "\"."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    // the f_temp_path has an ending '/' (see constructor)
+    //
+    f_temp_filename = f_temp_path;
+    f_temp_filename += snapdev::pathinfo::basename(f_filename);
+    f_temp_filename += '-';
+    f_temp_filename += std::to_string(++g_identifier);
+    f_temp_filename += ".tmp";
+
+    // note: we receive the file as the snaprfs user
+    //
+    f_fd.reset(::open(
+              f_temp_filename.c_str()
+            , O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC
+            , 0600));
+    if(f_fd == nullptr)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not open output file \""
+            << f_temp_filename
+            << "\" for writing (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        f_temp_filename.clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool received_file::is_open() const
+{
+    return f_fd != nullptr;
+}
+
+
+bool received_file::is_anonymous() const
+{
+    return f_fd != nullptr && f_temp_filename.empty();
+}
+
+
+int received_file::get_fd() const
+{
+    return f_fd.get();
+}
+
+
+std::string const & received_file::get_filename() const
+{
+    return f_filename;
+}
+
+
+bool received_file::write(void const * data, std::size_t size)
+{
+    char const * d(reinterpret_cast<char const *>(data));
+    while(size > 0)
+    {
+        ssize_t const r(::write(f_fd.get(), d, size));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not write to the output file of \""
+                << f_filename
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        d += r;
+        size -= r;
+        f_size += r;
+    }
+
+    return true;
+}
+
+
+/** \brief Get the number of bytes written so far.
+ *
+ * When a transfer stalls, this is the offset from which another source
+ * can resume the transfer.
+ *
+ * \return The number of bytes written to the file.
+ */
+std::uint64_t received_file::get_size() const
+{
+    return f_size;
+}
+
+
+void received_file::set_owner(std::string const & user, std::string const & group)
+{
+    f_user = user;
+    f_group = group;
+}
+
+
+/** \brief Set the numeric owner of the file.
+ *
+ * When the sender and receiver are part of the same identity domain,
+ * the sender sends the uid/gid directly and no name resolution happens.
+ *
+ * \param[in] uid  The user identifier of the new owner.
+ * \param[in] gid  The group identifier of the new owner.
+ */
+void received_file::set_owner_ids(uid_t uid, gid_t gid)
+{
+    f_uid = uid;
+    f_gid = gid;
+}
+
+
+void received_file::set_mode(mode_t mode)
+{
+    f_mode = mode & 07777;
+}
+
+
+void received_file::set_mtime(snapdev::timespec_ex const & mtime)
+{
+    f_mtime = mtime;
+}
+
+
+snapdev::timespec_ex const & received_file::get_mtime() const
+{
+    return f_mtime;
+}
+
+
+void received_file::set_durability(durability_t durability)
+{
+    f_durability = durability;
+}
+
+
+durability_t received_file::get_durability() const
+{
+    return f_durability;
+}
+
+
+void received_file::set_expected_hash(murmur3::hash const & hash)
+{
+    f_expected_hash = hash;
+}
+
+
+murmur3::hash const & received_file::get_expected_hash() const
+{
+    return f_expected_hash;
+}
+
+
+/** \brief Verify the data we received.
+ *
+ * This function reads the data back and computes its murmur3 hash. The
+ * file was just written so the data is expected to still be in the page
+ * cache.
+ *
+ * \return true if the hash matches the one sent in the footer.
+ */
+bool received_file::verify()
+{
+    murmur3::stream stream(DATA_SEED_H1, DATA_SEED_H2);
+    off_t offset(0);
+    for(;;)
+    {
+        std::uint8_t buf[1024 * 64];
+        ssize_t const r(pread(f_fd.get(), buf, sizeof(buf), offset));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not read back received file \""
+                << f_filename
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        if(r == 0)
+        {
+            break;
+        }
+        stream.add_data(buf, r);
+        offset += r;
+    }
+
+    murmur3::hash const h(stream.flush());
+    if(h != f_expected_hash)
+    {
+        SNAP_LOG_ERROR
+            << "murmur3 hashes do not match for \""
+            << f_filename
+            << "\" (received: "
+            << f_expected_hash.to_string()
+            << ", computed: "
+            << h.to_string()
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    return true;
+}
+
+
+/** \brief Copy the contents of a local file.
+ *
+ * When a local file already has the contents of the file being received,
+ * the data is copied instead of downloaded. The copy is a reflink (the
+ * data blocks get shared) when both files are on the same file system
+ * and that file system supports it (btrfs, XFS). Otherwise the kernel
+ * copies the data with copy_file_range(2), which avoids going through
+ * user space and may still be accelerated (i.e. NFS server side copy).
+ *
+ * The file must be open and empty.
+ *
+ * \param[in] source  The full path to the local file to copy.
+ *
+ * \return true if the whole file was copied.
+ */
+bool received_file::copy_from(std::string const & source)
+{
+    snapdev::raii_fd_t in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if(in == nullptr)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not open \""
+            << source
+            << "\" to copy it as \""
+            << f_filename
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    struct stat s;
+    if(fstat(in.get(), &s) != 0)
+    {
+        return false;
+    }
+
+    if(ioctl(f_fd.get(), FICLONE, in.get()) == 0)
+    {
+        // the clone does not move the file offset, more data may be
+        // written after the copy (see server::prepare_append())
+        //
+        f_size = s.st_size;
+        return lseek(f_fd.get(), 0, SEEK_END) == s.st_size;
+    }
+
+    std::uint64_t left(s.st_size);
+    while(left > 0)
+    {
+        ssize_t const r(copy_file_range(in.get(), nullptr, f_fd.get(), nullptr, left, 0));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not copy \""
+                << source
+                << "\" as \""
+                << f_filename
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        if(r == 0)
+        {
+            // the source was truncated
+            //
+            return false;
+        }
+        left -= r;
+        f_size += r;
+    }
+
+    return true;
+}
+
+
+/** \brief Get the order used to publish this file.
+ *
+ * The privileged helper uses this order to apply the ownership, mode,
+ * and modification time to the file and then to give it its final name.
+ *
+ * \return The publish order of this file.
+ */
+publish_order received_file::get_publish_order() const
+{
+    if(f_fd == nullptr)
+    {
+        throw rfs::logic_error("received_file::get_publish_order() called without an open file.");
+    }
+
+    publish_order order;
+    order.f_fd = f_fd.get();
+    order.f_user = f_user;
+    order.f_group = f_group;
+    order.f_uid = f_uid;
+    order.f_gid = f_gid;
+    order.f_mode = f_mode;
+    order.f_mtime = f_mtime;
+    order.f_filename = f_filename;
+    order.f_temp_filename = f_temp_filename;
+    return order;
+}
+
+
+/** \brief Mark the file as published.
+ *
+ * Once the privileged helper gave the file its final name, there is
+ * nothing left to clean up. This function closes the file descriptor.
+ */
+void received_file::published()
+{
+    f_temp_filename.clear();
+    f_fd.reset();
+}
+
+
+/** \brief Forget about the received data.
+ *
+ * This function closes the output file. An anonymous file gets released
+ * by the kernel at that point. A named temporary file gets deleted.
+ */
+void received_file::discard()
+{
+    f_fd.reset();
+
+    if(!f_temp_filename.empty())
+    {
+        int const r(unlink(f_temp_filename.c_str()));
+        if(r != 0
+        && errno != ENOENT)
+        {
+            int const e(errno);
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "an error occurred trying to delete \""
+                << f_temp_filename
+                << "\" (errno: "
+                << e
+                << " -- "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+        }
+        f_temp_filename.clear();
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,123 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the received_file class.
+ *
+ * A received_file represents the local copy of a file being received
+ * from another snaprfs instance, up to the point where it gets published
+ * under its final name.
+ */
+
+// self
+//
+#include    "file_listener.h"
+#include    "privileged_helper.h"
+
+
+// murmur3
+//
+#include    <murmur3/stream.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <memory>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+class received_file
+{
+public:
+    typedef std::shared_ptr<received_file>  pointer_t;
+
+    static constexpr char const *           TEMPORARY_INTRODUCER = ".snaprfs-";
+
+                        received_file(
+                              std::string const & filename
+                            , std::string const & temp_path
+                            , privileged_helper::pointer_t helper);
+                        received_file(received_file const &) = delete;
+                        ~received_file();
+    received_file &     operator = (received_file const &) = delete;
+
+    static bool         is_temporary_name(std::string const & filename);
+
+    bool                open();
+    bool                is_open() const;
+    bool                is_anonymous() const;
+    int                 get_fd() const;
+    std::string const & get_filename() const;
+    bool                write(void const * data, std::size_t size);
+    bool                copy_from(std::string const & source);
+    std::uint64_t       get_size() const;
+
+    void                set_owner(std::string const & user, std::string const & group);
+    void                set_owner_ids(uid_t uid, gid_t gid);
+    void                set_mode(mode_t mode);
+    void                set_mtime(snapdev::timespec_ex const & mtime);
+    snapdev::timespec_ex const &
+                        get_mtime() const;
+    void                set_durability(durability_t durability);
+    durability_t        get_durability() const;
+    void                set_expected_hash(murmur3::hash const & hash);
+    murmur3::hash const &
+                        get_expected_hash() const;
+    bool                verify();
+    publish_order       get_publish_order() const;
+    void                published();
+    void                discard();
+
+private:
+    bool                open_anonymous();
+    bool                open_named();
+
+    std::string         f_filename = std::string();
+    std::string         f_temp_path = std::string();
+    privileged_helper::pointer_t
+                        f_privileged_helper = privileged_helper::pointer_t();
+    std::string         f_temp_filename = std::string();
+    snapdev::raii_fd_t  f_fd = snapdev::raii_fd_t();
+    std::uint64_t       f_size = 0;
+    std::string         f_user = std::string();
+    std::string         f_group = std::string();
+    uid_t               f_uid = NO_UID;
+    gid_t               f_gid = NO_GID;
+    mode_t              f_mode = 0;
+    snapdev::timespec_ex
+                        f_mtime = snapdev::timespec_ex();
+    durability_t        f_durability = durability_t::DURABILITY_NONE;
+    murmur3::hash       f_expected_hash = murmur3::hash();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,222 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the sender admission control.
+ *
+ * When a file changes, all the computers interested in that file connect
+ * to us at about the same time. Serving all of them at once saturates
+ * the disk and the network card. Instead, we serve at most max_sends
+ * requests at once (and at most max_sends_per_peer to the same peer).
+ *
+ * The other requests get a BUSY reply with the number of milliseconds
+ * after which the peer should try again. We do not keep those
+ * connections open; a stalled connection uses resources on both sides
+ * and ends up timing out anyway.
+ *
+ * To be fair, the peers we turn away are remembered in order. When a
+ * slot frees up, it is reserved for the peer that was turned away first.
+ * Other peers get BUSY until that peer comes back (or does not come back
+ * within its retry delay). The retry delay grows with the position of
+ * the peer in that list so they come back roughly in turn.
+ */
+
+// self
+//
+#include    "send_admission.h"
+
+
+// snapdev
+//
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+send_admission::send_admission(
+          std::size_t max_sends
+        , std::size_t max_sends_per_peer
+        , std::uint32_t retry_after_msec)
+    : f_max_sends(std::max(static_cast<std::size_t>(1), max_sends))
+    , f_max_sends_per_peer(std::max(static_cast<std::size_t>(1), max_sends_per_peer))
+    , f_retry_after_msec(std::clamp(retry_after_msec, static_cast<std::uint32_t>(1), MAX_RETRY_AFTER_MSEC))
+{
+}
+
+
+/** \brief Check whether a peer can be served now.
+ *
+ * If the function returns true, the caller must call release() once
+ * the transfer is over.
+ *
+ * \param[in] peer  The IP address of the peer requesting a file.
+ * \param[out] retry_after_msec  When the function returns false, the
+ * number of milliseconds after which the peer should try again.
+ *
+ * \return true if the peer can be served now.
+ */
+bool send_admission::admit(std::string const & peer, std::uint32_t & retry_after_msec)
+{
+    expire_waiting();
+
+    auto const it(f_active_per_peer.find(peer));
+    if(it != f_active_per_peer.end()
+    && it->second >= f_max_sends_per_peer)
+    {
+        // this peer already has its share; it does not enter the waiting
+        // list since it is not waiting for a global slot
+        //
+        ++f_statistics.f_rejected;
+        retry_after_msec = f_retry_after_msec;
+        return false;
+    }
+
+    auto const w(std::find(f_waiting.begin(), f_waiting.end(), peer));
+    std::size_t const position(w == f_waiting.end()
+                                    ? f_waiting.size()
+                                    : std::distance(f_waiting.begin(), w));
+    std::size_t const available(f_max_sends - std::min(f_active, f_max_sends));
+    if(position >= available)
+    {
+        // no slot, or the free slots are reserved for peers which were
+        // turned away before this one
+        //
+        retry_after_msec = wait_turn(peer, position);
+        return false;
+    }
+
+    if(w != f_waiting.end())
+    {
+        f_waiting.erase(w);
+        f_waiting_expire.erase(peer);
+    }
+    ++f_active;
+    ++f_active_per_peer[peer];
+    ++f_statistics.f_admitted;
+
+    return true;
+}
+
+
+/** \brief Release a slot.
+ *
+ * \param[in] peer  The peer which was admitted.
+ */
+void send_admission::release(std::string const & peer)
+{
+    auto it(f_active_per_peer.find(peer));
+    if(it == f_active_per_peer.end())
+    {
+        return;
+    }
+
+    --it->second;
+    if(it->second == 0)
+    {
+        f_active_per_peer.erase(it);
+    }
+    if(f_active > 0)
+    {
+        --f_active;
+    }
+}
+
+
+std::size_t send_admission::get_active() const
+{
+    return f_active;
+}
+
+
+std::size_t send_admission::get_waiting() const
+{
+    return f_waiting.size();
+}
+
+
+send_statistics const & send_admission::get_statistics() const
+{
+    return f_statistics;
+}
+
+
+std::uint32_t send_admission::wait_turn(std::string const & peer, std::size_t position)
+{
+    ++f_statistics.f_rejected;
+
+    if(position >= f_waiting.size())
+    {
+        f_waiting.push_back(peer);
+    }
+
+    // the further in the list, the longer the wait
+    //
+    std::uint64_t const retry(std::min(
+              static_cast<std::uint64_t>(f_retry_after_msec) * (position / f_max_sends + 1)
+            , static_cast<std::uint64_t>(MAX_RETRY_AFTER_MSEC)));
+
+    // if the peer does not come back within twice its delay, it loses
+    // its place
+    //
+    f_waiting_expire[peer] = snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec()
+                           + static_cast<std::int64_t>(retry) * 2'000;
+
+    return static_cast<std::uint32_t>(retry);
+}
+
+
+void send_admission::expire_waiting()
+{
+    std::int64_t const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC).to_usec());
+    for(auto it(f_waiting.begin()); it != f_waiting.end();)
+    {
+        auto const e(f_waiting_expire.find(*it));
+        if(e == f_waiting_expire.end()
+        || e->second < now)
+        {
+            if(e != f_waiting_expire.end())
+            {
+                f_waiting_expire.erase(e);
+            }
+            it = f_waiting.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,93 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the send_admission class.
+ *
+ * The send admission decides whether a file request from a peer can be
+ * served now or whether that peer has to come back later.
+ */
+
+// C++
+//
+#include    <list>
+#include    <map>
+#include    <memory>
+#include    <string>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+struct send_statistics
+{
+    std::uint64_t       f_admitted = 0;
+    std::uint64_t       f_rejected = 0;
+};
+
+
+class send_admission
+{
+public:
+    typedef std::shared_ptr<send_admission>     pointer_t;
+
+    static constexpr std::size_t const      DEFAULT_MAX_SENDS = 32;
+    static constexpr std::size_t const      DEFAULT_MAX_SENDS_PER_PEER = 4;
+    static constexpr std::uint32_t const    DEFAULT_RETRY_AFTER_MSEC = 500;
+    static constexpr std::uint32_t const    MAX_RETRY_AFTER_MSEC = 30'000;
+
+                        send_admission(
+                              std::size_t max_sends
+                            , std::size_t max_sends_per_peer
+                            , std::uint32_t retry_after_msec);
+                        send_admission(send_admission const &) = delete;
+    send_admission &    operator = (send_admission const &) = delete;
+
+    bool                admit(std::string const & peer, std::uint32_t & retry_after_msec);
+    void                release(std::string const & peer);
+
+    std::size_t         get_active() const;
+    std::size_t         get_waiting() const;
+    send_statistics const &
+                        get_statistics() const;
+
+private:
+    std::uint32_t       wait_turn(std::string const & peer, std::size_t position);
+    void                expire_waiting();
+
+    std::size_t         f_max_sends = DEFAULT_MAX_SENDS;
+    std::size_t         f_max_sends_per_peer = DEFAULT_MAX_SENDS_PER_PEER;
+    std::uint32_t       f_retry_after_msec = DEFAULT_RETRY_AFTER_MSEC;
+    std::size_t         f_active = 0;
+    std::map<std::string, std::size_t>
+                        f_active_per_peer = std::map<std::string, std::size_t>();
+    std::list<std::string>
+                        f_waiting = std::list<std::string>();
+    std::map<std::string, std::int64_t>
+                        f_waiting_expire = std::map<std::string, std::int64_t>();
+    send_statistics     f_statistics = send_statistics();
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
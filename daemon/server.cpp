@@ -76,9 +76,9 @@
  *   remote_receiver->sender [label = "connect"];
  *   --- [label = "start send loop"];
  *   sender->remote_receiver [label = "send file data"];
- *   remote_receiver=>remote_receiver [label = "save file (.part1)"];
+ *   remote_receiver=>remote_receiver [label = "save file (O_TMPFILE)"];
  *   --- [label = "end send loop"];
- *   remote_receiver=>remote_receiver [label = "rename file (remove .part1)"];
+ *   remote_receiver=>remote_receiver [label = "link file under final name"];
  * \endmsc
  */
 
@@ -86,7 +86,9 @@
 //
 #include    "server.h"
 
+#include    "base64.h"
 #include    "data_receiver.h"
+#include    "deadline_queue.h"
 
 
 // snaprfs
@@ -132,14 +134,21 @@
 
 // snapdev
 //
+#include    <snapdev/hexadecimal_string.h>
 #include    <snapdev/mounts.h>
+#include    <snapdev/not_used.h>
 #include    <snapdev/pathinfo.h>
+#include    <snapdev/raii_generic_deleter.h>
 #include    <snapdev/stringize.h>
 
 
 // C
 //
+#include    <fcntl.h>
+#include    <linux/fs.h>
+#include    <sys/ioctl.h>
 #include    <sys/random.h>
+#include    <unistd.h>
 
 
 // last include
@@ -157,6 +166,14 @@ namespace
 
 
 
+/** \brief The features this version supports.
+ *
+ * This list is sent to the other snaprfs instances in RFS_PEER_INFO.
+ */
+constexpr char const * const g_capabilities = "busy,extended_request,numeric_ids,resume";
+
+
+
 advgetopt::option const g_command_line_options[] =
 {
     // COMMANDS
@@ -164,6 +181,116 @@ advgetopt::option const g_command_line_options[] =
 
     // OPTIONS
     //
+    advgetopt::define_option(
+          advgetopt::Name("announce")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("\"subscribers\" to send file announcements only to the computers interested in that file, \"broadcast\" to send them to all the computers, or \"gossip\" to exchange them with a few random computers at a time.")
+        , advgetopt::DefaultValue("broadcast")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("commit-threads")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of threads used to verify, sync, and publish received files.")
+        , advgetopt::DefaultValue("2")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("socket-profile-lan")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("socket options used to transfer files with computers on our local networks.")
+        , advgetopt::DefaultValue("cork=true")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("socket-profile-loopback")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("socket options used to transfer files with this very computer.")
+        , advgetopt::DefaultValue("cork=true")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("socket-profile-wan")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("socket options used to transfer files with remote or secure computers.")
+        , advgetopt::DefaultValue("notsent_lowat=131072,cork=true,keepalive=60")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("gateway")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("whether this computer receives the files of other clusters on behalf of the computers of its cluster.")
+        , advgetopt::DefaultValue("false")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("gossip-fanout")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of computers contacted in each gossip round (announce=gossip).")
+        , advgetopt::DefaultValue("3")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("gossip-interval-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of milliseconds between two gossip rounds (announce=gossip).")
+        , advgetopt::DefaultValue("1000")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("group-commit-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of milliseconds to wait for more received files before syncing them in one go.")
+        , advgetopt::DefaultValue("50")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("dedup-max-size")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum size of the files announced with the hash of their contents; 0 turns off the deduplication.")
+        , advgetopt::DefaultValue("16777216")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("inline-max-size")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum size of the files sent within the RFS_FILE_CHANGED message; 0 turns off inline files.")
+        , advgetopt::DefaultValue("8192")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("id-cache-ttl")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of seconds user and group names and identifiers are cached.")
+        , advgetopt::DefaultValue("300")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("datacenter")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("name of the datacenter this computer is in; used to prefer sources in the same datacenter.")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("identity-domain")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("name of the domain in which all the computers share the same user and group identifiers.")
+    ),
     advgetopt::define_option(
           advgetopt::Name("listen")
         , advgetopt::Flags(advgetopt::all_flags<
@@ -185,6 +312,109 @@ advgetopt::option const g_command_line_options[] =
             , advgetopt::GETOPT_FLAG_REQUIRED>())
         , advgetopt::Help("list of directories where transferred files are saved temporarilly.")
     ),
+    advgetopt::define_option(
+          advgetopt::Name("max-receives")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum number of files received simultaneously.")
+        , advgetopt::DefaultValue("16")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("max-receives-per-source")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum number of files received simultaneously from the same computer.")
+        , advgetopt::DefaultValue("4")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("transfer-stall-sec")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of seconds over which the throughput of a transfer is measured; 0 turns off the watchdog.")
+        , advgetopt::DefaultValue("30")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("transfer-min-rate")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("minimum throughput, in bytes per second, under which a transfer is considered stalled.")
+        , advgetopt::DefaultValue("1024")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("max-sends")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum number of files sent simultaneously; other requests get a busy reply.")
+        , advgetopt::DefaultValue("32")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("max-sends-per-peer")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum number of files sent simultaneously to the same computer.")
+        , advgetopt::DefaultValue("4")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("busy-retry-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("base delay, in milliseconds, after which a peer which got a busy reply should retry.")
+        , advgetopt::DefaultValue("500")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("connect-stagger-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("delay, in milliseconds, before trying the next address of a source while the previous attempts are still pending.")
+        , advgetopt::DefaultValue("250")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("connect-timeout-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum time, in milliseconds, to wait for one of the addresses of a source to answer.")
+        , advgetopt::DefaultValue("10000")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("peer-failure-threshold")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of consecutive connection failures after which transfers from a peer get deferred until it recovers.")
+        , advgetopt::DefaultValue("3")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("peer-backoff-min-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("delay, in milliseconds, before trying to connect to a peer again after a failure; doubled on each consecutive failure.")
+        , advgetopt::DefaultValue("1000")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("peer-backoff-max-ms")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum delay, in milliseconds, before trying to connect to a failing peer again.")
+        , advgetopt::DefaultValue("300000")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("push-listen")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("URI (rfs://<ip>:<port>) to listen on for files pushed by their source.")
+    ),
     advgetopt::define_option(
           advgetopt::Name("private-key")
         , advgetopt::Flags(advgetopt::all_flags<
@@ -192,6 +422,13 @@ advgetopt::option const g_command_line_options[] =
             , advgetopt::GETOPT_FLAG_REQUIRED>())
         , advgetopt::Help("private key for the data server connection.")
     ),
+    advgetopt::define_option(
+          advgetopt::Name("rack")
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("name of the rack this computer is in; used to prefer sources in the same rack.")
+    ),
     advgetopt::define_option(
           advgetopt::Name("secure-listen")
         , advgetopt::Flags(advgetopt::all_flags<
@@ -199,6 +436,14 @@ advgetopt::option const g_command_line_options[] =
             , advgetopt::GETOPT_FLAG_REQUIRED>())
         , advgetopt::Help("URL to listen on with TLS for the snaprfs data channel.")
     ),
+    advgetopt::define_option(
+          advgetopt::Name("max-delay-sec")
+        , advgetopt::Flags(advgetopt::all_flags<
+              advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("maximum number of seconds a file which keeps being modified waits before it gets transferred; 0 means no maximum.")
+        , advgetopt::DefaultValue("60")
+    ),
     advgetopt::define_option(
           advgetopt::Name("transfer-after-sec")
         , advgetopt::Flags(advgetopt::all_flags<
@@ -215,6 +460,14 @@ advgetopt::option const g_command_line_options[] =
         , advgetopt::Help("one or more colon (:) separated directory names where configuration files are found.")
         , advgetopt::DefaultValue("/usr/share/snaprfs/watch-dirs:/var/lib/snaprfs/watch-dirs")
     ),
+    advgetopt::define_option(
+          advgetopt::Name("watcher")
+        , advgetopt::Flags(advgetopt::all_flags<
+              advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+            , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("\"inotify\" to watch each directory separately or \"fanotify\" to watch whole filesystems (requires CAP_SYS_ADMIN).")
+        , advgetopt::DefaultValue("inotify")
+    ),
 
     // END
     //
@@ -286,7 +539,10 @@ class modified_timer
 public:
     typedef std::shared_ptr<modified_timer> pointer_t;
 
-                                modified_timer(server * s, std::uint32_t transfer_after_sec);
+                                modified_timer(
+                                      server * s
+                                    , std::uint32_t transfer_after_sec
+                                    , std::uint32_t max_delay_sec);
                                 modified_timer(modified_timer const &) = delete;
     modified_timer &            operator = (modified_timer const &) = delete;
 
@@ -297,19 +553,77 @@ public:
     virtual void                process_timeout() override;
 
 private:
+    snapdev::timespec_ex        share_deadline(shared_file::pointer_t file) const;
+    snapdev::timespec_ex        deadline(shared_file::pointer_t file) const;
+    void                        forget(shared_file::pointer_t file);
+    void                        wake_up();
+
     server *                    f_server = nullptr;
-    shared_file::set_t          f_modified_files = shared_file::set_t();
+    deadline_queue<shared_file::pointer_t>
+                                f_modified_files = deadline_queue<shared_file::pointer_t>();
+    std::map<shared_file::pointer_t, snapdev::timespec_ex>
+                                f_dirty_since = std::map<shared_file::pointer_t, snapdev::timespec_ex>();
+    std::map<shared_file::pointer_t, snapdev::timespec_ex>
+                                f_speculated = std::map<shared_file::pointer_t, snapdev::timespec_ex>();   // last speculative announcement
     snapdev::timespec_ex        f_transfer_after_sec = snapdev::timespec_ex();
+    snapdev::timespec_ex        f_max_delay_sec = snapdev::timespec_ex();     // 0 when there is no maximum
 };
 
 
 modified_timer::pointer_t       g_modified_timer = modified_timer::pointer_t();
 
 
-modified_timer::modified_timer(server * s, std::uint32_t transfer_after_sec)
-    : timer(1'000'000LL)
+
+/** \brief Timer used to send our RFS_PEER_INFO periodically.
+ *
+ * The other snaprfs instances use it to know which computers are still
+ * around and remove the others from their peer directory.
+ */
+class peer_info_timer
+    : public ed::timer
+{
+public:
+    typedef std::shared_ptr<peer_info_timer> pointer_t;
+
+                                peer_info_timer(server * s);
+                                peer_info_timer(peer_info_timer const &) = delete;
+    peer_info_timer &           operator = (peer_info_timer const &) = delete;
+
+    // timer implementation
+    virtual void                process_timeout() override;
+
+private:
+    server *                    f_server = nullptr;
+};
+
+
+peer_info_timer::pointer_t      g_peer_info_timer = peer_info_timer::pointer_t();
+
+
+peer_info_timer::peer_info_timer(server * s)
+    : timer(peer_directory::HEARTBEAT_USEC)
+    , f_server(s)
+{
+    set_name("peer_info_timer");
+}
+
+
+void peer_info_timer::process_timeout()
+{
+    f_server->peer_heartbeat();
+}
+
+
+modified_timer::modified_timer(
+          server * s
+        , std::uint32_t transfer_after_sec
+        , std::uint32_t max_delay_sec)
+    : timer(-1)
     , f_server(s)
     , f_transfer_after_sec(std::max(3L, std::int64_t(transfer_after_sec)), 0) // minimum is 3 seconds
+    , f_max_delay_sec(max_delay_sec == 0
+                        ? 0L
+                        : std::max(std::int64_t(max_delay_sec), f_transfer_after_sec.tv_sec), 0)
 {
     set_name("modified_timer");
 }
@@ -317,89 +631,156 @@ modified_timer::modified_timer(server * s, std::uint32_t transfer_after_sec)
 
 void modified_timer::add_file(shared_file::pointer_t file)
 {
-    f_modified_files.insert(file);
-
-    set_enable(true);
+    // remember when the file became dirty, further changes do not move
+    // that time until the file gets shared
+    //
+    f_dirty_since.emplace(file, file->get_last_updated());
+    f_modified_files.set(file, deadline(file));
+    wake_up();
 }
 
 
 void modified_timer::remove_file(shared_file::pointer_t file)
 {
-    auto it(f_modified_files.find(file));
-    if(it == f_modified_files.end())
+    forget(file);
+    if(f_modified_files.erase(file))
     {
-        return;
+        wake_up();
     }
+}
 
-    f_modified_files.erase(it);
 
-    if(f_modified_files.empty())
+void modified_timer::forget(shared_file::pointer_t file)
+{
+    f_dirty_since.erase(file);
+    f_speculated.erase(file);
+}
+
+
+/** \brief Compute the time at which a modified file gets shared.
+ *
+ * A file gets shared once it was not modified for f_transfer_after_sec.
+ * A file which keeps changing would never get shared so it also gets
+ * shared f_max_delay_sec after it first became dirty.
+ *
+ * \param[in] file  The modified file.
+ *
+ * \return The earliest of the two deadlines.
+ */
+snapdev::timespec_ex modified_timer::share_deadline(shared_file::pointer_t file) const
+{
+    snapdev::timespec_ex const quiet(file->get_last_updated() + f_transfer_after_sec);
+    if(f_max_delay_sec.tv_sec == 0)
+    {
+        return quiet;
+    }
+    auto const it(f_dirty_since.find(file));
+    if(it == f_dirty_since.end())
+    {
+        return quiet;
+    }
+    return std::min(quiet, it->second + f_max_delay_sec);
+}
+
+
+/** \brief Compute the time at which the timer has to process a file.
+ *
+ * When the file directory defines a speculative_sec parameter, the data
+ * written so far gets sent to the other computers every that many
+ * seconds until the file gets shared for good.
+ *
+ * \param[in] file  The modified file.
+ *
+ * \return The earliest of the share and speculative deadlines.
+ */
+snapdev::timespec_ex modified_timer::deadline(shared_file::pointer_t file) const
+{
+    snapdev::timespec_ex const share(share_deadline(file));
+    std::int64_t const speculative_sec(f_server->get_speculative_sec(file->get_filename()));
+    if(speculative_sec <= 0)
+    {
+        return share;
+    }
+    auto it(f_speculated.find(file));
+    if(it == f_speculated.end())
     {
-        set_enable(false);
+        it = f_dirty_since.find(file);
+        if(it == f_dirty_since.end())
+        {
+            return share;
+        }
     }
+    return std::min(share, it->second + snapdev::timespec_ex(speculative_sec, 0));
 }
 
 
 void modified_timer::process_timeout()
 {
-    // we have two timestamp and a duration:
-    //   - when file was last updated (LU)
-    //   - now (N)
-    //   - transfer after seconds (TA)
-    //
-    // this is used as:
-    //
-    //   LU + TA <= N
-    //
-    // to avoid as much math as possible inside the loop, we compute
-    // a parameter called threshold (T) from the equation above:
-    //
-    //   LU <= N - TA
-    //
-    // so:
-    //
-    //   T = N - TA
-    //
-    // and as a result, the loop just does:
-    //
-    //   LU <= T
+    set_timeout_date(-1);
+
+    // a file is due once it was not modified for f_transfer_after_sec;
+    // if it was modified again since it was added, its deadline moves
+    // unless it reached f_max_delay_sec, in which case a snapshot of the
+    // file gets shared; further changes are shared in the next cycle
     //
-    snapdev::timespec_ex const threshold(snapdev::timespec_ex::gettime() - f_transfer_after_sec);
-    for(auto m(f_modified_files.begin()); m != f_modified_files.end(); )
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime());
+    for(auto const & file : f_modified_files.pop_expired(now))
     {
         // needs to be transferred at all?
         //
-        if((*m)->was_updated())
+        if(!file->was_updated())
         {
-            if((*m)->get_last_updated() <= threshold)
-            {
-                f_server->broadcast_file_changed(*m);
-                m = f_modified_files.erase(m);
-            }
-            else
-            {
-                // not time yet
-                //
-                // Note: this means if updated within f_transfer_after_sec,
-                //       it does not get transferred
-                //
-                //       this goes on until such changes stops for at least
-                //       f_transfer_after_sec
-                //
-                //       at some point we may want to consider adding a way
-                //       to share the file sooner if so many changes happen
-                //       so quickly (but then we may transfer a file which
-                //       changes as we transfer it...)
-                //
-                ++m;
-            }
+            // somehow it is not marked as updated, forget about it immediately
+            //
+            forget(file);
+            continue;
         }
-        else
+
+        snapdev::timespec_ex const due(deadline(file));
+        if(due > now)
         {
-            // somehow it is not marked as updated, forget about it immediately
+            f_modified_files.set(file, due);
+            continue;
+        }
+
+        if(share_deadline(file) > now)
+        {
+            // still being written, send what we have so far
             //
-            m = f_modified_files.erase(m);
+            f_server->speculate_file(file);
+            f_speculated[file] = now;
+            f_modified_files.set(file, deadline(file));
+            continue;
+        }
+
+        bool const snapshot(file->get_last_updated() + f_transfer_after_sec > now);
+        if(snapshot)
+        {
+            SNAP_LOG_VERBOSE
+                << "file \""
+                << file->get_filename()
+                << "\" keeps changing; sharing a snapshot after "
+                << f_max_delay_sec.tv_sec
+                << " seconds."
+                << SNAP_LOG_SEND;
         }
+        forget(file);
+        f_server->broadcast_file_changed(file, snapshot);
+    }
+
+    wake_up();
+}
+
+
+void modified_timer::wake_up()
+{
+    if(f_modified_files.empty())
+    {
+        set_timeout_date(-1);
+    }
+    else
+    {
+        set_timeout_date(f_modified_files.next_deadline().to_usec());
     }
 }
 
@@ -427,9 +808,153 @@ snapdev::mounts const & get_mounts()
 }
 
 
+/** \brief Compute the murmur3 hash of the contents of a file.
+ *
+ * This function may be called from the commit threads.
+ *
+ * \param[in] path  The file to hash.
+ *
+ * \return The hash as a hexadecimal string, or an empty string on error.
+ */
+std::string hash_file(std::string const & path)
+{
+    std::ifstream in(path);
+    if(!in.is_open())
+    {
+        return std::string();
+    }
+    murmur3::stream stream(DATA_SEED_H1, DATA_SEED_H2);
+    for(;;)
+    {
+        char buf[1024 * 64];
+        in.read(buf, sizeof(buf));
+        std::streamsize const r(in.gcount());
+        if(r <= 0)
+        {
+            break;
+        }
+        stream.add_data(buf, r);
+    }
+    if(in.bad())
+    {
+        return std::string();
+    }
+    return stream.flush().to_string();
+}
+
+
+/** \brief Check whether two stats represent the same version of a file.
+ *
+ * \param[in] a  The first stats.
+ * \param[in] b  The second stats.
+ *
+ * \return true if the device, inode, size, and mtime are equal.
+ */
+bool same_version(struct stat const & a, struct stat const & b)
+{
+    return a.st_dev == b.st_dev
+        && a.st_ino == b.st_ino
+        && a.st_size == b.st_size
+        && snapdev::timespec_ex(a.st_mtim) == snapdev::timespec_ex(b.st_mtim);
+}
+
+
+/** \brief Copy a file which keeps changing.
+ *
+ * This function runs in the commit threads. The copy is a reflink
+ * (FICLONE) when the file system supports it, otherwise it uses
+ * copy_file_range(2).
+ *
+ * If the file changes while being copied, the copy is attempted again a
+ * few times.
+ *
+ * \param[in] filename  The file to copy.
+ * \param[in] snapshot  The path of the copy.
+ * \param[out] st  The stats of the file as copied.
+ *
+ * \return true if the snapshot is consistent.
+ */
+bool take_snapshot(
+      std::string const & filename
+    , std::string const & snapshot
+    , struct stat & st)
+{
+    for(int attempt(0); attempt < 3; ++attempt)
+    {
+        snapdev::raii_fd_t in(::open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+        snapdev::raii_fd_t out(::open(snapshot.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if(in == nullptr
+        || out == nullptr)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not create snapshot \""
+                << snapshot
+                << "\" of \""
+                << filename
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            break;
+        }
+        struct stat before;
+        if(fstat(in.get(), &before) != 0)
+        {
+            break;
+        }
+
+        bool copied(ioctl(out.get(), FICLONE, in.get()) == 0);
+        if(!copied)
+        {
+            std::uint64_t left(before.st_size);
+            while(left > 0)
+            {
+                ssize_t const r(copy_file_range(in.get(), nullptr, out.get(), nullptr, left, 0));
+                if(r < 0
+                && errno == EINTR)
+                {
+                    continue;
+                }
+                if(r <= 0)
+                {
+                    break;
+                }
+                left -= r;
+            }
+            copied = left == 0;
+        }
+
+        // the copy is consistent only if the file did not change meanwhile
+        //
+        struct stat after;
+        if(copied
+        && fstat(in.get(), &after) == 0
+        && after.st_size == before.st_size
+        && snapdev::timespec_ex(after.st_mtim) == snapdev::timespec_ex(before.st_mtim))
+        {
+            st = before;
+            return true;
+        }
+    }
+
+    unlink(snapshot.c_str());
+
+    SNAP_LOG_WARNING
+        << "could not take a consistent snapshot of \""
+        << filename
+        << "\"; sharing the file as is."
+        << SNAP_LOG_SEND;
+
+    return false;
+}
+
+
+
+} // no name namespace
 
-} // no name namespace
-
 
 
 
@@ -567,6 +1092,76 @@ snapdev::timespec_ex shared_file::get_mtimespec() const
 }
 
 
+struct stat const & shared_file::get_stat() const
+{
+    return f_stat;
+}
+
+
+std::string const & shared_file::get_snapshot() const
+{
+    return f_snapshot;
+}
+
+
+/** \brief Get the path of the file to read to share this file.
+ *
+ * This is the snapshot if one was taken, the file itself otherwise.
+ *
+ * \return The path to the data to share.
+ */
+std::string const & shared_file::get_source() const
+{
+    return f_snapshot.empty() ? f_filename : f_snapshot;
+}
+
+
+/** \brief Get the hash state of an appended file at a given offset.
+ *
+ * With copy_mode=append, the hash of the file as shared by the previous
+ * announcement is kept. A receiver which has that version only requests
+ * the new data and the sender does not need to read the beginning of the
+ * file again to compute the hash of the whole file.
+ *
+ * \param[in] offset  The offset the receiver requested.
+ * \param[out] prefix  The hash state at that offset.
+ *
+ * \return true if \p prefix was set.
+ */
+bool shared_file::get_append_prefix(std::uint64_t offset, murmur3::stream & prefix) const
+{
+    if(f_append_offset == 0
+    || offset != f_append_offset
+    || f_append_inode != f_stat.st_ino)
+    {
+        return false;
+    }
+
+    prefix = f_append_prefix;
+    return true;
+}
+
+
+/** \brief Get the size of the file as last announced.
+ *
+ * With copy_mode=append or speculative_sec, the hash sent in the last
+ * announcement covers the file up to this size. The sender stops there
+ * even if the file grew since, the new data is part of the next
+ * announcement.
+ *
+ * \return The announced size, or 0 if unknown (i.e. the file was
+ * replaced since).
+ */
+std::uint64_t shared_file::get_append_size() const
+{
+    if(f_append_inode != f_stat.st_ino)
+    {
+        return 0;
+    }
+    return f_append_size;
+}
+
+
 
 
 
@@ -598,6 +1193,139 @@ server::server(int argc, char * argv[])
     {
         f_temp_dirs.push_back("/var/lib/snaprfs/tmp");
     }
+
+    f_id_cache = std::make_shared<id_cache>(f_opts.get_long("id-cache-ttl"));
+    f_receive_scheduler = std::make_shared<receive_scheduler>(
+              this
+            , f_opts.get_long("max-receives")
+            , f_opts.get_long("max-receives-per-source"));
+    f_receive_scheduler->set_connect_race(
+              f_opts.get_long("connect-stagger-ms")
+            , f_opts.get_long("connect-timeout-ms"));
+    f_peer_health = std::make_shared<peer_health>(
+              f_opts.get_long("peer-failure-threshold")
+            , f_opts.get_long("peer-backoff-min-ms")
+            , f_opts.get_long("peer-backoff-max-ms"));
+    f_peer_directory = std::make_shared<peer_directory>();
+    f_content_index = std::make_shared<content_index>();
+    f_dedup_max_size = f_opts.get_long("dedup-max-size");
+    f_inline_max_size = f_opts.get_long("inline-max-size");
+    f_send_admission = std::make_shared<send_admission>(
+              f_opts.get_long("max-sends")
+            , f_opts.get_long("max-sends-per-peer")
+            , f_opts.get_long("busy-retry-ms"));
+    std::string const announce(f_opts.get_string("announce"));
+    if(announce == "subscribers")
+    {
+        f_announce = announce_t::ANNOUNCE_SUBSCRIBERS;
+    }
+    else if(announce == "gossip")
+    {
+        f_announce = announce_t::ANNOUNCE_GOSSIP;
+        f_gossip = std::make_shared<gossip>(
+                  this
+                , f_opts.get_long("gossip-interval-ms")
+                , f_opts.get_long("gossip-fanout"));
+    }
+    else if(announce != "broadcast")
+    {
+        SNAP_LOG_RECOVERABLE_ERROR
+            << "unknown \"announce=...\" value \""
+            << announce
+            << "\"; using \"broadcast\"."
+            << SNAP_LOG_SEND;
+    }
+    f_gateway = advgetopt::is_true(f_opts.get_string("gateway"));
+    f_loopback_profile.parse(f_opts.get_string("socket-profile-loopback"));
+    f_lan_profile.parse(f_opts.get_string("socket-profile-lan"));
+    f_wan_profile.parse(f_opts.get_string("socket-profile-wan"));
+    if(f_opts.is_defined("rack"))
+    {
+        f_rack = f_opts.get_string("rack");
+    }
+    if(f_opts.is_defined("datacenter"))
+    {
+        f_datacenter = f_opts.get_string("datacenter");
+    }
+    if(f_opts.is_defined("identity-domain"))
+    {
+        std::string const domain(f_opts.get_string("identity-domain"));
+        if(!domain.empty())
+        {
+            murmur3::stream stream(DATA_SEED_H1, DATA_SEED_H2);
+            stream.add_data(domain.c_str(), domain.length());
+            murmur3::hash const h(stream.flush());
+            memcpy(&f_identity_domain, h.get(), sizeof(f_identity_domain));
+            if(f_identity_domain == 0)
+            {
+                // 0 means "no identity domain"
+                //
+                f_identity_domain = 1;
+            }
+        }
+    }
+
+    // a new peer identifier on each start tells the other snaprfs
+    // instances to refresh what they know about us
+    //
+    std::uint64_t peer_id(0);
+    if(getrandom(&peer_id, sizeof(peer_id), 0) != sizeof(peer_id))
+    {
+        throw rfs::no_random_data_available("no random data available for the peer identifier");
+    }
+    char const * const hex_digits("0123456789abcdef");
+    for(int shift(60); shift >= 0; shift -= 4)
+    {
+        f_peer_id += hex_digits[(peer_id >> shift) & 15];
+    }
+
+    // the helper needs to know which directories it can work in so we
+    // load the watch-dirs setup now; the listener gets added to the
+    // communicator in ready()
+    //
+    std::string const watch_dirs(f_opts.get_string("watch-dirs"));
+    f_file_listener = std::make_shared<file_listener>(this, watch_dirs);
+    std::vector<std::string> roots(f_temp_dirs.begin(), f_temp_dirs.end());
+    for(auto const & path : f_file_listener->get_interest_paths())
+    {
+        roots.push_back(path);
+        path_info const * p(f_file_listener->find_path_info(path));
+        if(p != nullptr
+        && !p->get_path_part().empty())
+        {
+            roots.push_back(p->get_path_part());
+        }
+    }
+
+    // fanotify requires CAP_SYS_ADMIN so its marks are added now
+    //
+    std::string const watcher(f_opts.get_string("watcher"));
+    if(watcher == "fanotify")
+    {
+        f_fanotify_listener = std::make_shared<fanotify_listener>(f_file_listener.get());
+        if(!f_fanotify_listener->watch())
+        {
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "could not setup the fanotify watcher; using inotify instead."
+                << SNAP_LOG_SEND;
+            f_fanotify_listener.reset();
+        }
+    }
+    else if(watcher != "inotify")
+    {
+        SNAP_LOG_RECOVERABLE_ERROR
+            << "unknown \"watcher=...\" value \""
+            << watcher
+            << "\"; using \"inotify\"."
+            << SNAP_LOG_SEND;
+    }
+
+    // the helper has to be started before any thread gets created;
+    // from here on, the daemon does not run as root anymore
+    //
+    f_privileged_helper = std::make_shared<privileged_helper>(f_id_cache);
+    f_privileged_helper->start(roots);
+    f_privileged_helper->drop_privileges();
 }
 
 
@@ -616,27 +1344,51 @@ void server::ready()
     //      connection to the communicatord service; then remove this
     //      test since we will then be able to reconnect
     //
-    if(g_modified_timer != nullptr
-    || f_file_listener != nullptr)
+    if(g_modified_timer != nullptr)
     {
         return;
     }
 
     std::uint32_t const transfer_after_sec(f_opts.get_long("transfer-after-sec"));
-    g_modified_timer = std::make_shared<modified_timer>(this, transfer_after_sec);
+    std::uint32_t const max_delay_sec(f_opts.get_long("max-delay-sec"));
+    g_modified_timer = std::make_shared<modified_timer>(this, transfer_after_sec, max_delay_sec);
     f_communicator->add_connection(g_modified_timer);
 
+    g_peer_info_timer = std::make_shared<peer_info_timer>(this);
+    f_communicator->add_connection(g_peer_info_timer);
+    if(f_gossip != nullptr)
+    {
+        f_communicator->add_connection(f_gossip);
+    }
+
+    f_commit_queue = std::make_shared<commit_queue>(
+              this
+            , f_opts.get_long("group-commit-ms")
+            , f_opts.get_long("commit-threads"));
+    f_communicator->add_connection(f_commit_queue);
+    f_communicator->add_connection(f_commit_queue->get_done_signal());
+    f_communicator->add_connection(f_receive_scheduler);
+
     // start listening for file changes only once we are connected
     // to the communicator daemon
     //
-    std::string const watch_dirs(f_opts.get_string("watch-dirs"));
-    f_file_listener = std::make_shared<file_listener>(this, watch_dirs);
-    if(f_file_listener->valid_socket())
+    if(f_fanotify_listener != nullptr)
     {
-        // only add if the socket is valid (i.e. we are listening for changes
-        // in at least one directory or file)
+        // the marks were added in the constructor (as root)
         //
-        f_communicator->add_connection(f_file_listener);
+        f_communicator->add_connection(f_fanotify_listener);
+        f_fanotify_listener->list_existing_files();
+    }
+    else
+    {
+        f_file_listener->watch();
+        if(f_file_listener->valid_socket())
+        {
+            // only add if the socket is valid (i.e. we are listening for
+            // changes in at least one directory or file)
+            //
+            f_communicator->add_connection(f_file_listener);
+        }
     }
 
     if(f_opts.is_defined("listen"))
@@ -802,6 +1554,54 @@ void server::ready()
         }
     }
 
+    // the push listener is optional, without it we only pull files
+    //
+    if(f_opts.is_defined("push-listen"))
+    {
+        edhttp::uri u;
+        if(!u.set_uri(f_opts.get_string("push-listen"), false, true)
+        || u.scheme() != snaprfs::g_name_snaprfs_scheme_rfs
+        || u.address_ranges().size() != 1
+        || !u.address_ranges()[0].has_from()
+        || u.address_ranges()[0].has_to())
+        {
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "the \"push_listen=...\" parameter \""
+                << f_opts.get_string("push-listen")
+                << "\" must be one address with the scheme set to \"rfs\"; files will not be pushed to this computer."
+                << SNAP_LOG_SEND;
+        }
+        else if(u.address_ranges()[0].get_from().get_network_type() == addr::network_type_t::NETWORK_TYPE_PUBLIC
+             || u.address_ranges()[0].get_from().get_network_type() == addr::network_type_t::NETWORK_TYPE_ANY)
+        {
+            // like listen=..., the connection is not encrypted
+            //
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "the \"push_listen=...\" parameter must be a local or private address. \""
+                << f_opts.get_string("push-listen")
+                << "\" is not supported; files will not be pushed to this computer."
+                << SNAP_LOG_SEND;
+        }
+        else
+        {
+            f_push_data_server = std::make_shared<data_server>(
+                                  this
+                                , u.address_ranges()[0].get_from()
+                                , std::string()
+                                , std::string()
+                                , ed::mode_t::MODE_PLAIN
+                                , -1
+                                , true);
+            f_push_data_server->set_push(true);
+            f_communicator->add_connection(f_push_data_server);
+
+            addr::addr const a(f_push_data_server->get_address());
+            f_push_endpoints = snaprfs::g_name_snaprfs_scheme_rfs;
+            f_push_endpoints += "://";
+            f_push_endpoints += a.to_ipv4or6_string(addr::STRING_IP_BRACKET_ADDRESS | addr::STRING_IP_PORT);
+        }
+    }
+
     if(f_data_server == nullptr
     && f_secure_data_server == nullptr)
     {
@@ -811,6 +1611,32 @@ void server::ready()
         stop(false);
         return;
     }
+
+    // our endpoints do not change until we restart, build the list once
+    //
+    if(f_data_server != nullptr)
+    {
+        addr::addr const a(f_data_server->get_address());
+        f_endpoints += snaprfs::g_name_snaprfs_scheme_rfs;
+        f_endpoints += "://";
+        f_endpoints += a.to_ipv4or6_string(addr::STRING_IP_BRACKET_ADDRESS | addr::STRING_IP_PORT);
+    }
+    if(f_secure_data_server != nullptr)
+    {
+        addr::addr const a(f_secure_data_server->get_address());
+        if(!f_endpoints.empty())
+        {
+            f_endpoints += ',';
+        }
+        f_endpoints += snaprfs::g_name_snaprfs_scheme_rfss;
+        f_endpoints += "://";
+        f_endpoints += a.to_ipv4or6_string(addr::STRING_IP_BRACKET_ADDRESS | addr::STRING_IP_PORT);
+    }
+
+    // let the other snaprfs instances know about us before we announce
+    // any file
+    //
+    send_peer_info(nullptr);
 }
 
 
@@ -833,14 +1659,49 @@ void server::stop(bool quitting)
         f_messenger->unregister_communicator(quitting);
     }
 
+    // do not start any more transfers
+    //
+    f_receive_scheduler->clear();
+    for(auto & r : f_push_races)
+    {
+        r.second.f_race->cancel();
+    }
+    f_push_races.clear();
+
     if(f_communicator != nullptr)
     {
         f_communicator->remove_connection(f_data_server);
         f_communicator->remove_connection(f_secure_data_server);
+        f_communicator->remove_connection(f_push_data_server);
         f_communicator->remove_connection(f_file_listener);
+        f_communicator->remove_connection(f_fanotify_listener);
         f_communicator->remove_connection(g_modified_timer);
+        f_communicator->remove_connection(g_peer_info_timer);
+        f_communicator->remove_connection(f_gossip);
+        f_communicator->remove_connection(f_receive_scheduler);
+        f_fanotify_listener.reset();
         f_file_listener.reset();
     }
+
+    for(auto const & f : f_files)
+    {
+        drop_snapshot(f.second);
+    }
+    for(auto const & f : f_staged)
+    {
+        f.second->discard();
+    }
+    f_staged.clear();
+
+    if(f_commit_queue != nullptr)
+    {
+        // do not lose the files we already received; this waits for
+        // the commit threads to be done
+        //
+        f_commit_queue->stop();
+        f_communicator->remove_connection(f_commit_queue->get_done_signal());
+        f_communicator->remove_connection(f_commit_queue);
+    }
 }
 
 
@@ -888,162 +1749,1453 @@ shared_file::pointer_t server::get_file(std::string const & filename)
 }
 
 
-void server::refresh_file(std::string const & filename)
+void server::refresh_file(
+      std::string const & filename
+    , murmur3::hash const & hash)
 {
     shared_file::pointer_t file(get_file(filename));
     file->refresh_stats();
-}
 
+    f_fallbacks.erase(filename);
+    f_content_index->add(filename, hash.to_string());
 
-void server::updated_file(
-      std::string const & fullpath
-    , bool updated)
-{
-    shared_file::pointer_t file(get_file(fullpath));
-    if(!file->set_last_updated())
+    auto const it(f_relay_files.find(filename));
+    if(it != f_relay_files.end())
     {
-        // file did not change, ignore the event
-        //
-        // Note: this especially happens when we just received the file
-        //
-        SNAP_LOG_DEBUG
-            << "file changed event for \""
-            << fullpath
-            << "\" ignored because the stat() did not change."
-            << SNAP_LOG_SEND;
-        return;
+        f_relay_files.erase(it);
+        relay_file(file);
     }
+}
 
-//auto it2 = f_files.find(file->get_id());
-//std::cerr << "------ " << (updated ? "updated" : "wrote to")
-//<< " a file... [" << fullpath
-//<< "] with ptr " << file.get() << " and ID: " << file->get_id()
-//<< " found: " << std::boolalpha << (it2 != f_files.end()) << "\n";
 
-    if(updated)
+/** \brief A received file could not be committed.
+ *
+ * If that file was a copy of a local file, the local file probably
+ * changed in between. If it was sent inline or pushed, the data did not
+ * match the hash. In all cases, download it instead, as announced.
+ *
+ * \param[in] filename  The name of the file which failed.
+ */
+void server::commit_failed(std::string const & filename)
+{
+    auto const it(f_fallbacks.find(filename));
+    if(it == f_fallbacks.end())
     {
-        // on an update, we start right away, otherwise the timer will
-        // call the start whenever the "last updated" is N seconds in
-        // the past
-        //
-        broadcast_file_changed(file);
+        return;
     }
-    else
+    receive_request request(it->second);
+    f_fallbacks.erase(it);
+
+    request.f_hash.clear();
+    request.f_inline = false;
+    request.f_data.clear();
+    if(!request.f_sources.empty())
     {
-        g_modified_timer->add_file(file);
+        schedule_receive(request);
     }
 }
 
 
-void server::deleted_file(std::string const & fullpath)
+void server::commit_file(received_file::pointer_t file)
 {
-    auto it(std::find_if(
-          f_files.begin()
-        , f_files.end()
-        , [fullpath](auto const & f)
-        {
-            return f.second->get_filename() == fullpath;
-        }));
+    f_commit_queue->add_file(file);
+}
+
+
+/** \brief Keep the data of a file received speculatively.
+ *
+ * The data is not published; it is kept until the source announces the
+ * final version of the file, at which point only the data added since
+ * gets received (see prepare_append()).
+ *
+ * \param[in] file  The received data.
+ */
+void server::stage_file(received_file::pointer_t file)
+{
+    auto it(f_staged.find(file->get_filename()));
+    if(it != f_staged.end())
+    {
+        if(it->second != file)
+        {
+            it->second->discard();
+        }
+        it->second = file;
+        return;
+    }
+    f_staged[file->get_filename()] = file;
+}
+
+
+privileged_helper::pointer_t server::get_privileged_helper() const
+{
+    return f_privileged_helper;
+}
+
+
+id_cache::pointer_t server::get_id_cache() const
+{
+    return f_id_cache;
+}
+
+
+/** \brief Get the hash of our identity domain.
+ *
+ * Computers sharing the same identity domain have the same user and
+ * group identifiers. Between such computers, the data header includes
+ * the numeric uid/gid instead of the names.
+ *
+ * \return The hash of the identity domain or 0 if none was defined.
+ */
+std::uint32_t server::get_identity_domain() const
+{
+    return f_identity_domain;
+}
+
+
+std::string const & server::get_rack() const
+{
+    return f_rack;
+}
+
+
+std::string const & server::get_datacenter() const
+{
+    return f_datacenter;
+}
+
+
+void server::updated_file(
+      std::string const & fullpath
+    , bool updated)
+{
+    shared_file::pointer_t file(get_file(fullpath));
+    if(!file->set_last_updated())
+    {
+        // file did not change, ignore the event
+        //
+        // Note: this especially happens when we just received the file
+        //
+        SNAP_LOG_DEBUG
+            << "file changed event for \""
+            << fullpath
+            << "\" ignored because the stat() did not change."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+//auto it2 = f_files.find(file->get_id());
+//std::cerr << "------ " << (updated ? "updated" : "wrote to")
+//<< " a file... [" << fullpath
+//<< "] with ptr " << file.get() << " and ID: " << file->get_id()
+//<< " found: " << std::boolalpha << (it2 != f_files.end()) << "\n";
+
+    if(updated)
+    {
+        // on an update, we start right away, otherwise the timer will
+        // call the start whenever the "last updated" is N seconds in
+        // the past
+        //
+        broadcast_file_changed(file);
+    }
+    else
+    {
+        g_modified_timer->add_file(file);
+    }
+}
+
+
+void server::deleted_file(std::string const & fullpath)
+{
+    auto it(std::find_if(
+          f_files.begin()
+        , f_files.end()
+        , [fullpath](auto const & f)
+        {
+            return f.second->get_filename() == fullpath;
+        }));
     if(it != f_files.end())
     {
-        // it exists in our list, remove it, it's gone now
-        //
-        f_files.erase(it);
+        // it exists in our list, remove it, it's gone now
+        //
+        drop_snapshot(it->second);
+        f_files.erase(it);
+    }
+
+    if(f_gossip != nullptr)
+    {
+        f_gossip->add_change(fullpath, 0, snapdev::timespec_ex::gettime(), true);
+        return;
+    }
+
+    ed::message msg;
+    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_file_deleted);
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_filename, fullpath);
+//std::cerr << "--- sending message [" << msg.get_command() << "]\n";
+    send_announcement(msg, fullpath);
+}
+
+
+void server::broadcast_file_changed(shared_file::pointer_t file, bool snapshot)
+{
+    drop_snapshot(file);
+    if(!file->set_start_sharing())
+    {
+        // if false, the file is not available anymore
+        //
+        return;
+    }
+
+    // taking a snapshot and hashing a large file take time, do it in the
+    // commit threads and announce the file once done
+    //
+    struct stat const s(file->f_stat);
+    std::string const snapshot_filename(snapshot ? snapshot_path(file) : std::string());
+    bool const hash(S_ISREG(s.st_mode)
+                 && s.st_size > f_inline_max_size
+                 && s.st_size <= f_dedup_max_size);
+    if(f_commit_queue == nullptr
+    || (snapshot_filename.empty()
+        && (!hash
+            || (!file->f_content_hash.empty() && same_version(file->f_hashed_stat, s)))))
+    {
+        announce_file(file);
+        return;
+    }
+
+    struct prepared_file
+    {
+        bool                f_snapshot = false;
+        struct stat         f_stat = {};
+        std::string         f_hash = std::string();
+    };
+    std::shared_ptr<prepared_file> prepared(std::make_shared<prepared_file>());
+    prepared->f_stat = s;
+    std::string const filename(file->get_filename());
+    std::string const previous_hash(file->f_content_hash);
+    struct stat const previous_stat(file->f_hashed_stat);
+    std::int64_t const inline_max_size(f_inline_max_size);
+    std::int64_t const dedup_max_size(f_dedup_max_size);
+    snapdev::timespec_ex const sharing(file->f_start_sharing);
+    f_commit_queue->run_task(
+              [prepared, filename, snapshot_filename, previous_hash, previous_stat, inline_max_size, dedup_max_size]()
+              {
+                  if(!snapshot_filename.empty())
+                  {
+                      prepared->f_snapshot = take_snapshot(filename, snapshot_filename, prepared->f_stat);
+                  }
+                  struct stat const & st(prepared->f_stat);
+                  if(S_ISREG(st.st_mode)
+                  && st.st_size > inline_max_size
+                  && st.st_size <= dedup_max_size
+                  && (previous_hash.empty() || !same_version(previous_stat, st)))
+                  {
+                      prepared->f_hash = hash_file(prepared->f_snapshot ? snapshot_filename : filename);
+                  }
+              }
+            , [this, file, sharing, prepared, snapshot_filename]()
+              {
+                  // ignore the result if we are stopping, the file was
+                  // deleted, or it is being shared again
+                  //
+                  if(f_file_listener == nullptr
+                  || get_file(file->get_id()) != file
+                  || file->f_start_sharing != sharing)
+                  {
+                      if(prepared->f_snapshot)
+                      {
+                          unlink(snapshot_filename.c_str());
+                      }
+                      return;
+                  }
+                  if(prepared->f_snapshot)
+                  {
+                      file->f_stat = prepared->f_stat;
+                      file->f_snapshot = snapshot_filename;
+                  }
+                  if(!prepared->f_hash.empty())
+                  {
+                      file->f_content_hash = prepared->f_hash;
+                      file->f_hashed_stat = prepared->f_stat;
+                      f_content_index->add(file->get_filename(), file->f_content_hash);
+                  }
+                  announce_file(file);
+              });
+}
+
+
+/** \brief Send the announcement of a file which is ready to be shared.
+ *
+ * \param[in] file  The file to announce.
+ */
+void server::announce_file(shared_file::pointer_t file)
+{
+    // broadcast to others about the fact that file was modified so they
+    // can download the file from us
+    //
+    ed::message msg(file_changed_message(file));
+//std::cerr << "--- sending message [" << msg.to_string() << "]\n";
+
+    // files in a path with a limited number of replicas only go to
+    // the computers selected to hold them
+    //
+    file->f_replicas = get_replicas(file->get_filename());
+    push_file(file);
+    if(file->f_replicas > 0)
+    {
+        file->f_holders = f_peer_directory->interested_servers(file->get_filename(), file->f_replicas);
+        msg.set_service(snaprfs::g_name_snaprfs_param_service);
+        for(auto const & name : file->f_holders)
+        {
+            msg.set_server(name);
+            f_messenger->send_message(msg);
+        }
+        return;
+    }
+
+    if(f_gossip != nullptr)
+    {
+        f_gossip->add_change(file->get_filename(), file->get_id(), file->get_mtimespec(), false);
+        return;
+    }
+
+    send_announcement(msg, file->get_filename());
+}
+
+
+/** \brief Announce the data written so far to a file still being written.
+ *
+ * The receivers download that data in a staging file which does not get
+ * published. When the file is finally shared, they only download the
+ * data appended since, assuming the beginning of the file did not change.
+ *
+ * The announcement is not gossiped nor pushed; the file is not yet
+ * considered shared so it gets announced again once written.
+ *
+ * \param[in] file  The file being written.
+ */
+void server::speculate_file(shared_file::pointer_t file)
+{
+    if(!file->refresh_stats())
+    {
+        return;
+    }
+
+    ed::message msg(file_changed_message(file, true));
+
+    file->f_replicas = get_replicas(file->get_filename());
+    if(file->f_replicas > 0)
+    {
+        file->f_holders = f_peer_directory->interested_servers(file->get_filename(), file->f_replicas);
+        msg.set_service(snaprfs::g_name_snaprfs_param_service);
+        for(auto const & name : file->f_holders)
+        {
+            msg.set_server(name);
+            f_messenger->send_message(msg);
+        }
+        return;
+    }
+
+    send_announcement(msg, file->get_filename());
+}
+
+
+ed::message server::file_changed_message(shared_file::pointer_t file, bool speculative)
+{
+    ed::message msg;
+    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_file_changed);
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_filename, file->get_filename());
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_id, file->get_id());
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_mtime, file->get_mtime());
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_peer, f_peer_id);
+
+    // with the hash, the receivers which already have the same contents
+    // under another name copy it locally; the ownership and mode are
+    // then required since there is no data_header
+    //
+    std::string const hash(f_dedup_max_size > 0 || f_inline_max_size > 0
+                                ? content_hash(file)
+                                : std::string());
+    std::string user_name;
+    std::string group_name;
+    if(!hash.empty()
+    && f_id_cache->get_user_name(file->f_stat.st_uid, user_name)
+    && f_id_cache->get_group_name(file->f_stat.st_gid, group_name))
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_hash, hash);
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_size, file->f_stat.st_size);
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_mode, file->f_stat.st_mode & 07777);
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_owner, user_name + ':' + group_name);
+
+        // small files are sent in the message itself so the receivers
+        // do not have to connect back to get the data; not when we
+        // accept rfss connections since the announcement may then reach
+        // other clusters which have to send the login and password
+        //
+        if(file->f_stat.st_size <= f_inline_max_size
+        && f_secure_data_server == nullptr)
+        {
+            std::ifstream in(file->get_source());
+            std::string data(file->f_stat.st_size, '\0');
+            in.read(data.data(), data.length());
+            if(in.gcount() == static_cast<std::streamsize>(data.length()))
+            {
+                msg.add_parameter(snaprfs::g_name_snaprfs_param_data, base64_encode(data));
+            }
+        }
+    }
+
+    // files which only grow are sent as the previous version plus the
+    // new data; receivers with that previous version only request the
+    // new data
+    //
+    std::string const prefix_hash(append_prefix_hash(file, speculative));
+    if(!prefix_hash.empty())
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_append_offset, file->f_append_offset);
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_prefix_hash, prefix_hash);
+    }
+    if(speculative)
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_speculative, "true");
+    }
+
+    return msg;
+}
+
+
+/** \brief Update the hash of a file which only grows.
+ *
+ * For paths with copy_mode=append, the murmur3 state of the data shared
+ * so far is kept. Each time the file gets announced, only the new data
+ * is read and added to that state. The state before the new data is
+ * saved as the prefix: its hash is announced so the receivers can check
+ * that their copy is that exact version.
+ *
+ * If the file was replaced or truncated (i.e. a log rotation), the state
+ * restarts from scratch and the next transfer is a full one.
+ *
+ * \warning
+ * The beginning of the file is not read again. A file modified anywhere
+ * but at its end would not be detected; only use this mode for files
+ * which are only appended to.
+ *
+ * \param[in] file  The announced file; its stats must be up to date.
+ * \param[in] speculative  Whether the file is still being written.
+ *
+ * \return The hash of the previous version of the file, or an empty
+ * string when the whole file has to be transferred.
+ */
+std::string server::append_prefix_hash(shared_file::pointer_t file, bool speculative)
+{
+    path_info const * p(f_file_listener == nullptr
+            ? nullptr
+            : f_file_listener->find_path_info(snapdev::pathinfo::dirname(file->get_filename())));
+    struct stat const & s(file->f_stat);
+    if(p == nullptr
+    || (p->get_copy_mode() != copy_mode_t::COPY_MODE_APPEND
+        && p->get_speculative_sec() == 0)
+    || !S_ISREG(s.st_mode))
+    {
+        return std::string();
+    }
+
+    if(file->f_append_inode != s.st_ino
+    || file->f_append_size > static_cast<std::uint64_t>(s.st_size))
+    {
+        file->f_append_inode = s.st_ino;
+        file->f_append_size = 0;
+        file->f_append_offset = 0;
+        file->f_append_stream = murmur3::stream(DATA_SEED_H1, DATA_SEED_H2);
+    }
+
+    std::ifstream in(file->get_source());
+
+    // a file sent while it was being written may have been modified
+    // anywhere since; once written, make sure the data we hashed did
+    // not change, otherwise send the whole file
+    //
+    bool const verify(!speculative
+                   && p->get_speculative_sec() > 0
+                   && file->f_append_size > 0);
+    if(verify)
+    {
+        murmur3::stream check(DATA_SEED_H1, DATA_SEED_H2);
+        std::uint64_t left(file->f_append_size);
+        while(left > 0)
+        {
+            char buf[1024 * 64];
+            in.read(buf, std::min(left, static_cast<std::uint64_t>(sizeof(buf))));
+            std::streamsize const r(in.gcount());
+            if(r <= 0)
+            {
+                break;
+            }
+            check.add_data(buf, r);
+            left -= r;
+        }
+        murmur3::stream current(file->f_append_stream);
+        if(left != 0
+        || check.flush() != current.flush())
+        {
+            SNAP_LOG_VERBOSE
+                << "\""
+                << file->get_filename()
+                << "\" was modified after it was sent speculatively; sending the whole file."
+                << SNAP_LOG_SEND;
+            file->f_append_size = 0;
+            file->f_append_offset = 0;
+            file->f_append_stream = murmur3::stream(DATA_SEED_H1, DATA_SEED_H2);
+        }
+    }
+
+    // only move forward when the file grew (or is now complete) so the
+    // same announcement can be generated again (i.e. for new holders)
+    //
+    if(file->f_append_size != static_cast<std::uint64_t>(s.st_size)
+    || verify)
+    {
+        file->f_append_offset = file->f_append_size;
+        file->f_append_prefix = file->f_append_stream;
+
+        in.clear();
+        in.seekg(file->f_append_size, std::ios_base::beg);
+        std::uint64_t left(s.st_size - file->f_append_size);
+        while(left > 0)
+        {
+            char buf[1024 * 64];
+            in.read(buf, std::min(left, static_cast<std::uint64_t>(sizeof(buf))));
+            std::streamsize const r(in.gcount());
+            if(r <= 0)
+            {
+                // could not read the new data, start over next time
+                //
+                file->f_append_inode = 0;
+                file->f_append_size = 0;
+                file->f_append_offset = 0;
+                return std::string();
+            }
+            file->f_append_stream.add_data(buf, r);
+            file->f_append_size += r;
+            left -= r;
+        }
+    }
+
+    if(file->f_append_offset == 0)
+    {
+        return std::string();
+    }
+
+    murmur3::stream prefix(file->f_append_prefix);
+    return prefix.flush().to_string();
+}
+
+
+/** \brief Compute the hash of the contents of a shared file.
+ *
+ * The hash is the same murmur3 hash as the one sent in the footer of a
+ * transfer. It is cached until the file changes and the file gets added
+ * to the content index so we can also copy it locally ourselves.
+ *
+ * Files larger than dedup_max_size do not get a hash since reading them
+ * takes too long. Files larger than inline_max_size are not hashed here
+ * since that would block the event loop; broadcast_file_changed() hashes
+ * them in the commit threads before announcing them. Until then (i.e.
+ * speculative announcements), they are announced without a hash.
+ *
+ * \param[in] file  The file to hash; its stats must be up to date.
+ *
+ * \return The hash as a hexadecimal string, or an empty string.
+ */
+std::string server::content_hash(shared_file::pointer_t file)
+{
+    struct stat const & s(file->f_stat);
+    if(!S_ISREG(s.st_mode)
+    || s.st_size > std::max(f_dedup_max_size, f_inline_max_size))
+    {
+        return std::string();
+    }
+
+    if(!file->f_content_hash.empty()
+    && same_version(file->f_hashed_stat, s))
+    {
+        return file->f_content_hash;
+    }
+
+    file->f_content_hash.clear();
+    if(s.st_size > f_inline_max_size)
+    {
+        return std::string();
+    }
+    file->f_content_hash = hash_file(file->get_source());
+    if(file->f_content_hash.empty())
+    {
+        return std::string();
+    }
+    file->f_hashed_stat = s;
+    f_content_index->add(file->get_filename(), file->f_content_hash);
+
+    return file->f_content_hash;
+}
+
+
+/** \brief Create a file without a data connection.
+ *
+ * Small files are sent inline in the announcement. The data is written
+ * directly to the new file.
+ *
+ * Otherwise, when the announcement includes the hash of the contents and
+ * a local file has the same hash, the data is copied from that file (a
+ * reflink whenever possible).
+ *
+ * In both cases, the file goes through the commit queue like a received
+ * file, including the hash verification. If that commit fails, the file
+ * gets downloaded from the sources of the announcement.
+ *
+ * \param[in] request  The announced file.
+ *
+ * \return true if the file is being created locally.
+ */
+bool server::receive_locally(receive_request const & request)
+{
+    if(request.f_hash.empty()
+    || request.f_speculative
+    || f_fallbacks.find(request.f_filename) != f_fallbacks.end()
+    || !wants_file(request.f_filename, request.f_mtime))
+    {
+        return false;
+    }
+
+    std::string source;
+    if(!request.f_inline)
+    {
+        source = f_content_index->find(request.f_hash, request.f_size);
+        if(source.empty()
+        || source == request.f_filename)
+        {
+            return false;
+        }
+    }
+
+    std::string const binary(snapdev::hex_to_bin(request.f_hash));
+    if(binary.length() != murmur3::HASH_SIZE)
+    {
+        return false;
+    }
+    murmur3::hash expected;
+    expected.set(reinterpret_cast<std::uint8_t const *>(binary.data()));
+
+    std::string const path(snapdev::pathinfo::dirname(request.f_filename));
+    path_info const * p(f_file_listener->find_path_info(path));
+    received_file::pointer_t file(std::make_shared<received_file>(
+                  request.f_filename
+                , get_temp_path(path, p)
+                , f_privileged_helper));
+    file->set_durability(p->get_durability());
+    file->set_mtime(request.f_mtime);
+    file->set_owner(request.f_user, request.f_group);
+    file->set_mode(request.f_mode);
+    file->set_expected_hash(expected);
+    if(!file->open()
+    || !(request.f_inline
+            ? file->write(request.f_data.data(), request.f_data.length())
+            : file->copy_from(source)))
+    {
+        file->discard();
+        return false;
+    }
+
+    if(request.f_inline)
+    {
+        SNAP_LOG_VERBOSE
+            << "\""
+            << request.f_filename
+            << "\" was received inline."
+            << SNAP_LOG_SEND;
+    }
+    else
+    {
+        SNAP_LOG_VERBOSE
+            << "\""
+            << request.f_filename
+            << "\" has the same contents as local file \""
+            << source
+            << "\"; copying it instead of downloading it."
+            << SNAP_LOG_SEND;
+    }
+
+    f_fallbacks[request.f_filename] = request;
+    commit_file(file);
+
+    return true;
+}
+
+
+/** \brief Get the name of the snapshot of a file which keeps changing.
+ *
+ * The snapshot is a copy of the file in one of the temporary directories
+ * (a reflink when the file system supports it). The senders read the
+ * snapshot instead of the file so all the receivers get the same data,
+ * matching the announced size, mtime, and hash.
+ *
+ * The copy itself is done by take_snapshot() in the commit threads. The
+ * name is unique for each time the file gets shared so a copy still in
+ * progress for a previous version does not interfere.
+ *
+ * \param[in] file  The file to snapshot; its stats must be up to date.
+ *
+ * \return The path of the snapshot, or an empty string if no snapshot
+ * can be taken.
+ */
+std::string server::snapshot_path(shared_file::pointer_t file)
+{
+    std::string const path(snapdev::pathinfo::dirname(file->get_filename()));
+    path_info const * p(f_file_listener == nullptr
+            ? nullptr
+            : f_file_listener->find_path_info(path));
+    if(p == nullptr
+    || !S_ISREG(file->f_stat.st_mode))
+    {
+        return std::string();
+    }
+    std::string snapshot(get_temp_path(path, p));
+    if(snapshot.empty())
+    {
+        return std::string();
+    }
+    if(snapshot.back() != '/')
+    {
+        snapshot += '/';
+    }
+    snapshot += "snapshot-";
+    snapshot += std::to_string(file->get_id());
+    snapshot += '-';
+    snapshot += std::to_string(file->f_start_sharing.to_usec());
+    return snapshot;
+}
+
+
+void server::drop_snapshot(shared_file::pointer_t file)
+{
+    if(file->f_snapshot.empty())
+    {
+        return;
+    }
+
+    // senders still reading the snapshot keep their file descriptor
+    //
+    unlink(file->f_snapshot.c_str());
+    file->f_snapshot.clear();
+}
+
+
+/** \brief Push a file to the computers accepting pushes.
+ *
+ * For paths with transfer_mode=push, the source does not wait for the
+ * receivers to handle the announcement and connect back. It connects to
+ * the push listener of each interested computer of our cluster and
+ * starts streaming the file right away. This saves the round trip of the
+ * announcement and file request.
+ *
+ * The connection is first established with a non-blocking connect_race
+ * so an unreachable computer does not block the service. While that race
+ * is running, other files pushed to the same computer are added to it
+ * and they all get sent once the race is won.
+ *
+ * The announcement is still sent. A receiver which gets the announcement
+ * while the push is in progress keeps it and downloads the file only if
+ * the push fails.
+ *
+ * \param[in] file  The file to push.
+ */
+void server::push_file(shared_file::pointer_t file)
+{
+    path_info const * p(f_file_listener == nullptr
+            ? nullptr
+            : f_file_listener->find_path_info(snapdev::pathinfo::dirname(file->get_filename())));
+    if(p == nullptr
+    || p->get_transfer_mode() != transfer_mode_t::TRANSFER_MODE_PUSH)
+    {
+        return;
+    }
+
+    snapdev::timespec_ex const now(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC));
+    std::vector<std::string> const servers(f_peer_directory->interested_servers(file->get_filename(), file->f_replicas));
+    for(auto const & name : servers)
+    {
+        auto it(f_push_races.find(name));
+        if(it != f_push_races.end())
+        {
+            // a connection to that computer is already being established
+            //
+            if(std::find(it->second.f_files.begin(), it->second.f_files.end(), file) == it->second.f_files.end())
+            {
+                it->second.f_files.push_back(file);
+            }
+            continue;
+        }
+
+        peer_info::pointer_t info(f_peer_directory->find_server(name));
+        if(info == nullptr
+        || info->f_remote_cluster)
+        {
+            continue;
+        }
+        addr::addr::vector_t addresses;
+        for(auto const & source : info->f_push_sources)
+        {
+            if(f_peer_health->is_available(source.f_address.to_ipv4or6_string(addr::STRING_IP_ADDRESS), now))
+            {
+                addresses.push_back(source.f_address);
+            }
+        }
+        if(addresses.empty())
+        {
+            continue;
+        }
+
+        connect_race::pointer_t race(std::make_shared<connect_race>(
+                  f_receive_scheduler.get()
+                , f_peer_health
+                , file->get_filename()
+                , addresses
+                , f_opts.get_long("connect-stagger-ms")
+                , f_opts.get_long("connect-timeout-ms")));
+        race->set_done_callback([this, name](int index) { push_race_done(name, index); });
+        if(!f_communicator->add_connection(race))
+        {
+            continue;
+        }
+        push_race & r(f_push_races[name]);
+        r.f_race = race;
+        r.f_addresses = addresses;
+        r.f_files.push_back(file);
+
+        // note: the race may be over once start() returns
+        //
+        race->start();
+    }
+}
+
+
+/** \brief The connect race to a computer accepting pushes is over.
+ *
+ * If one of the addresses answered, the files waiting on that computer
+ * are pushed to that address. That connection goes over a path known to
+ * work, so the connect of the eventdispatcher client does not stall.
+ *
+ * If no address answered, the files are not pushed. The receiver still
+ * gets the announcements and downloads the files.
+ *
+ * The eventdispatcher client connects in its constructor, so one
+ * connection per file is created in a worker thread with connect_client().
+ *
+ * \param[in] name  The name of the computer the files are pushed to.
+ * \param[in] index  The index of the address which answered, or -1.
+ */
+void server::push_race_done(std::string const & name, int index)
+{
+    auto const it(f_push_races.find(name));
+    if(it == f_push_races.end())
+    {
+        return;
+    }
+    push_race const race(it->second);
+    f_push_races.erase(it);
+
+    if(index < 0)
+    {
+        SNAP_LOG_VERBOSE
+            << "could not connect to \""
+            << name
+            << "\" to push "
+            << race.f_files.size()
+            << " file(s)."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    addr::addr const address(race.f_addresses[index]);
+    for(auto const & file : race.f_files)
+    {
+        connect_client(
+              address
+            , ed::mode_t::MODE_PLAIN
+            , [this, file, address](
+                      ed::tcp_bio_client::pointer_t client
+                    , std::int64_t latency_usec
+                    , std::string const & error)
+              {
+                  snapdev::NOT_USED(latency_usec);
+
+                  if(client == nullptr)
+                  {
+                      SNAP_LOG_VERBOSE
+                          << "could not push \""
+                          << file->get_filename()
+                          << "\" to \""
+                          << address
+                          << "\" ("
+                          << error
+                          << ")."
+                          << SNAP_LOG_SEND;
+                      f_peer_health->connect_failed(address.to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+                      return;
+                  }
+
+                  data_sender::pointer_t sender(std::make_shared<data_sender>(this, client));
+                  if(!sender->push(file))
+                  {
+                      // we are busy, the receiver gets the file from the
+                      // announcement
+                      //
+                      return;
+                  }
+                  link_class_t const link_class(get_link_class(address, false));
+                  sender->set_socket_profile(get_socket_profile(link_class), link_class);
+                  f_communicator->add_connection(sender);
+              });
+    }
+}
+
+
+/** \brief Create a client connection without blocking the event loop.
+ *
+ * The eventdispatcher TCP client connects (and for secure connections
+ * does the TLS handshake) in its constructor, which blocks until the
+ * kernel gives up if the remote computer stops answering. This function
+ * creates the client in one of the commit_queue worker threads and then
+ * calls \p callback from the event loop.
+ *
+ * The callback is not called if the server is stopping.
+ *
+ * \param[in] address  The address to connect to.
+ * \param[in] mode  Whether the connection is plain or secure.
+ * \param[in] callback  The function called with the connected client, or
+ * nullptr and the error message if the connection failed.
+ */
+void server::connect_client(
+      addr::addr const & address
+    , ed::mode_t mode
+    , std::function<void(
+              ed::tcp_bio_client::pointer_t client
+            , std::int64_t latency_usec
+            , std::string const & error)> callback)
+{
+    struct connection_result
+    {
+        ed::tcp_bio_client::pointer_t   f_client = ed::tcp_bio_client::pointer_t();
+        std::int64_t                    f_latency_usec = 0;
+        std::string                     f_error = std::string();
+    };
+    std::shared_ptr<connection_result> result(std::make_shared<connection_result>());
+    commit_job::task_t connect([result, address, mode]()
+        {
+            snapdev::timespec_ex const start(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC));
+            try
+            {
+                result->f_client = std::make_shared<ed::tcp_bio_client>(address, mode);
+            }
+            catch(ed::event_dispatcher_exception const & e)
+            {
+                result->f_error = e.what();
+            }
+            result->f_latency_usec = (snapdev::timespec_ex::gettime(CLOCK_MONOTONIC) - start).to_usec();
+        });
+
+    if(f_commit_queue == nullptr)
+    {
+        connect();
+        callback(result->f_client, result->f_latency_usec, result->f_error);
+        return;
+    }
+
+    f_commit_queue->run_task(
+              connect
+            , [this, result, callback]()
+              {
+                  if(f_file_listener == nullptr)
+                  {
+                      return;
+                  }
+                  callback(result->f_client, result->f_latency_usec, result->f_error);
+              });
+}
+
+
+/** \brief Check whether we want a file being pushed to us.
+ *
+ * The push listener does not authenticate the source, so pushes are only
+ * accepted from an address advertised by a snaprfs of our own cluster
+ * which announced that it pushes files ("push_source" capability). The
+ * files of other clusters must go through secure connections and are
+ * never accepted through a push.
+ *
+ * \param[in] address  The address of the computer pushing the file.
+ * \param[in] filename  The name of the pushed file.
+ * \param[in] mtime  The modification time of the pushed file.
+ * \param[out] temp_path  Where to save the file while receiving it.
+ * \param[out] durability  The durability of that file.
+ *
+ * \return true if the push is accepted.
+ */
+bool server::accept_push(
+      addr::addr const & address
+    , std::string const & filename
+    , snapdev::timespec_ex const & mtime
+    , std::string & temp_path
+    , durability_t & durability)
+{
+    peer_info::pointer_t info(f_peer_directory->find_address(address));
+    if(info == nullptr
+    || info->f_remote_cluster
+    || info->f_capabilities.count("push_source") == 0)
+    {
+        SNAP_LOG_WARNING
+            << "refused push of \""
+            << filename
+            << "\" from \""
+            << address
+            << "\" which is not a known snaprfs pushing files in our cluster."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    if(f_pushes.find(filename) != f_pushes.end()
+    || f_fallbacks.find(filename) != f_fallbacks.end()
+    || f_receive_scheduler->has_request(filename)
+    || !wants_file(filename, mtime))
+    {
+        return false;
+    }
+
+    std::string const path(snapdev::pathinfo::dirname(filename));
+    path_info const * p(f_file_listener->find_path_info(path));
+    temp_path = get_temp_path(path, p);
+    durability = p->get_durability();
+
+    f_pushes[filename].f_mtime = mtime;
+
+    return true;
+}
+
+
+void server::setup_push_receiver(data_receiver::pointer_t receiver)
+{
+    receiver->set_watchdog(
+              f_opts.get_long("transfer-stall-sec") * 1'000'000
+            , f_opts.get_long("transfer-min-rate"));
+}
+
+
+/** \brief A pushed file was received or the push failed.
+ *
+ * If the push failed and the announcement of the file was received in
+ * the meantime, the file gets downloaded. If it succeeded, the
+ * announcement is kept until the commit completes (see commit_failed()).
+ *
+ * \param[in] filename  The name of the pushed file.
+ * \param[in] committed  Whether the file was handed to the commit queue.
+ */
+void server::push_done(std::string const & filename, bool committed)
+{
+    auto const it(f_pushes.find(filename));
+    if(it == f_pushes.end())
+    {
+        return;
+    }
+    pushed_file const push(it->second);
+    f_pushes.erase(it);
+
+    if(push.f_fallback.f_sources.empty())
+    {
+        return;
+    }
+    if(!committed
+    || push.f_fallback.f_mtime > push.f_mtime)
+    {
+        schedule_receive(push.f_fallback);
+        return;
+    }
+    f_fallbacks[filename] = push.f_fallback;
+}
+
+
+/** \brief Check whether files from other clusters come through a gateway.
+ *
+ * When our cluster has a gateway, only the gateway pulls the files from
+ * the other clusters over the WAN. It then announces them as a local
+ * source and the other computers get them over the LAN.
+ *
+ * \return true if this computer is not a gateway and our cluster has one.
+ */
+bool server::relayed_by_gateway() const
+{
+    return !f_gateway
+        && f_peer_directory->has_local_gateway();
+}
+
+
+/** \brief Announce a file received from another cluster.
+ *
+ * The gateway becomes a source for that file within its own cluster.
+ *
+ * \param[in] file  The file the gateway just received.
+ */
+void server::relay_file(shared_file::pointer_t file)
+{
+    if(!file->set_start_sharing())
+    {
+        return;
+    }
+
+    if(f_gossip != nullptr)
+    {
+        f_gossip->add_change(file->get_filename(), file->get_id(), file->get_mtimespec(), false);
+        return;
+    }
+
+    ed::message msg(file_changed_message(file));
+    msg.set_service(snaprfs::g_name_snaprfs_param_service);
+    std::vector<std::string> const servers(f_peer_directory->local_servers(file->get_filename()));
+    for(auto const & name : servers)
+    {
+        msg.set_server(name);
+        f_messenger->send_message(msg);
+    }
+}
+
+
+/** \brief Get the number of copies of a file to maintain.
+ *
+ * \param[in] filename  The full path of the file.
+ *
+ * \return The number of replicas, 0 for all the interested computers.
+ */
+std::size_t server::get_replicas(std::string const & filename) const
+{
+    if(f_file_listener == nullptr)
+    {
+        return 0;
+    }
+    path_info const * p(f_file_listener->find_path_info(snapdev::pathinfo::dirname(filename)));
+    if(p == nullptr)
+    {
+        return 0;
+    }
+    return p->get_replicas();
+}
+
+
+/** \brief Get the speculative transfer interval of a file.
+ *
+ * \param[in] filename  The full path of the file.
+ *
+ * \return The number of seconds between speculative announcements, 0
+ * when the file only gets sent once written.
+ */
+std::int64_t server::get_speculative_sec(std::string const & filename) const
+{
+    if(f_file_listener == nullptr)
+    {
+        return 0;
+    }
+    path_info const * p(f_file_listener->find_path_info(snapdev::pathinfo::dirname(filename)));
+    if(p == nullptr)
+    {
+        return 0;
+    }
+    return p->get_speculative_sec();
+}
+
+
+/** \brief Send our information again and forget about silent peers.
+ *
+ * This is called every minute by the peer_info_timer.
+ */
+void server::peer_heartbeat()
+{
+    send_peer_info(nullptr);
+
+    if(f_peer_directory->expire(peer_directory::EXPIRE_USEC) > 0)
+    {
+        peers_changed();
+    }
+}
+
+
+/** \brief Rebalance the replicated files.
+ *
+ * A computer joined or left the cluster. The holders of each file with
+ * a limited number of replicas are computed again and the computers
+ * which became holders get an RFS_FILE_CHANGED for that file.
+ *
+ * The computers which are not holders anymore keep their copy; it gets
+ * updated again if they become holders later.
+ */
+void server::peers_changed()
+{
+    for(auto const & f : f_files)
+    {
+        shared_file::pointer_t file(f.second);
+        if(file->f_replicas == 0)
+        {
+            continue;
+        }
+
+        std::vector<std::string> holders(f_peer_directory->interested_servers(
+                  file->get_filename()
+                , file->f_replicas));
+
+        ed::message msg;
+        for(auto const & name : holders)
+        {
+            if(std::find(file->f_holders.begin(), file->f_holders.end(), name) != file->f_holders.end())
+            {
+                continue;
+            }
+            if(msg.get_command().empty())
+            {
+                msg = file_changed_message(file);
+                msg.set_service(snaprfs::g_name_snaprfs_param_service);
+            }
+            msg.set_server(name);
+            f_messenger->send_message(msg);
+        }
+
+        file->f_holders.swap(holders);
+    }
+}
+
+
+/** \brief Send an announcement about a file.
+ *
+ * By default (announce=broadcast), the message is sent to all the snaprfs
+ * instances, including older versions which do not send RFS_PEER_INFO.
+ * With announce=subscribers, the announcement is only sent to the
+ * computers which told us (RFS_PEER_INFO) that they accept changes to
+ * that file.
+ *
+ * \param[in,out] msg  The message to send.
+ * \param[in] filename  The file the announcement is about.
+ */
+void server::send_announcement(ed::message & msg, std::string const & filename)
+{
+    msg.set_service(snaprfs::g_name_snaprfs_param_service);
+    if(f_announce == announce_t::ANNOUNCE_BROADCAST)
+    {
+        msg.set_server(communicatord::g_name_communicatord_server_remote);
+        f_messenger->send_message(msg);
+        return;
+    }
+
+    std::vector<std::string> const servers(f_peer_directory->interested_servers(filename));
+    for(auto const & name : servers)
+    {
+        msg.set_server(name);
+        f_messenger->send_message(msg);
+    }
+}
+
+
+/** \brief Schedule the reception of a file.
+ *
+ * The request goes through the receive scheduler which starts the
+ * transfer immediately or queues it if too many transfers are already
+ * running.
+ *
+ * \param[in] request  The file to receive and its possible sources.
+ */
+void server::schedule_receive(receive_request const & request)
+{
+    auto const push(f_pushes.find(request.f_filename));
+    if(push != f_pushes.end())
+    {
+        // the file is being pushed to us; keep the announcement in case
+        // the push fails
+        //
+        push->second.f_fallback = request;
+        return;
+    }
+    if(receive_locally(request))
+    {
+        return;
+    }
+    f_receive_scheduler->add_request(request);
+}
+
+
+/** \brief Receive only the data appended to a file.
+ *
+ * When the announcement says the file only grew since its previous
+ * version and our copy is that exact version (same hash), the transfer
+ * resumes at the end of our copy. Our copy is cloned in a new file (a
+ * reflink whenever possible) and the new data is added to it. Like any
+ * other transfer, the result is verified against the hash of the whole
+ * file and then published atomically.
+ *
+ * When the data of the previous version was received speculatively,
+ * it is still in a staging file which gets completed instead.
+ *
+ * \param[in,out] request  The announced file; on success, its partial
+ * file is set.
+ *
+ * \return true if only the new data has to be received.
+ */
+bool server::prepare_append(receive_request & request)
+{
+    auto const staged(f_staged.find(request.f_filename));
+    if(staged != f_staged.end())
+    {
+        received_file::pointer_t file(staged->second);
+        f_staged.erase(staged);
+        if(file->get_expected_hash().to_string() == request.f_prefix_hash
+        && file->get_size() == request.f_append_offset
+        && wants_file(request.f_filename, request.f_mtime))
+        {
+            file->set_mtime(request.f_mtime);
+            request.f_partial = file;
+            return true;
+        }
+        file->discard();
     }
 
-    ed::message msg;
-    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_file_deleted);
-    msg.set_server(communicatord::g_name_communicatord_server_remote);
-    msg.set_service("snaprfs");
-    msg.add_parameter(snaprfs::g_name_snaprfs_param_filename, fullpath);
-//std::cerr << "--- sending message [" << msg.get_command() << "]\n";
-    f_messenger->send_message(msg);
+    std::string const hash(f_content_index->get_hash(request.f_filename));
+    if(hash.empty()
+    || hash != request.f_prefix_hash
+    || !wants_file(request.f_filename, request.f_mtime))
+    {
+        return false;
+    }
+
+    std::string const path(snapdev::pathinfo::dirname(request.f_filename));
+    path_info const * p(f_file_listener->find_path_info(path));
+    received_file::pointer_t file(std::make_shared<received_file>(
+                  request.f_filename
+                , get_temp_path(path, p)
+                , f_privileged_helper));
+    file->set_durability(p->get_durability());
+    file->set_mtime(request.f_mtime);
+    if(!file->open()
+    || !file->copy_from(request.f_filename)
+    || file->get_size() != request.f_append_offset)
+    {
+        file->discard();
+        return false;
+    }
+
+    SNAP_LOG_VERBOSE
+        << "receiving the data appended to \""
+        << request.f_filename
+        << "\" after offset "
+        << request.f_append_offset
+        << "."
+        << SNAP_LOG_SEND;
+
+    request.f_partial = file;
+    return true;
 }
 
 
-void server::broadcast_file_changed(shared_file::pointer_t file)
+/** \brief Handle the announcement of a file by a peer.
+ *
+ * The sources of the file are the endpoints of that peer as found in the
+ * peer directory. If we do not know that peer yet, the announcement is
+ * kept until we receive its RFS_PEER_INFO, which we request here.
+ *
+ * \param[in,out] request  The file to receive; the sources get added.
+ * \param[in] peer_id  The identifier of the peer which has the file.
+ * \param[in] server_name  The communicatord name of that peer's computer.
+ * \param[in] secure_only  Whether only secure endpoints can be used.
+ */
+void server::file_announced(
+      receive_request & request
+    , std::string const & peer_id
+    , std::string const & server_name
+    , bool secure_only)
 {
-    if(!file->set_start_sharing())
+    peer_info::pointer_t info(f_peer_directory->find(peer_id));
+    if(info == nullptr)
     {
-        // if false, the file is not available anymore
-        //
+        if(secure_only
+        && relayed_by_gateway())
+        {
+            return;
+        }
+        if(f_peer_directory->add_pending(peer_id, request, secure_only)
+        && !server_name.empty())
+        {
+            ed::message get_info;
+            get_info.set_command(snaprfs::g_name_snaprfs_cmd_rfs_get_peer_info);
+            get_info.set_server(server_name);
+            get_info.set_service(snaprfs::g_name_snaprfs_param_service);
+            f_messenger->send_message(get_info);
+        }
         return;
     }
 
-    // broadcast to others about the fact that file was modified so they
-    // can download the file from us
-    //
-    ed::message msg;
-    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_file_changed);
-    msg.set_server(communicatord::g_name_communicatord_server_remote);
-    msg.set_service(snaprfs::g_name_snaprfs_param_service);
-    msg.add_parameter(snaprfs::g_name_snaprfs_param_filename, file->get_filename());
-    msg.add_parameter(snaprfs::g_name_snaprfs_param_id, file->get_id());
-    msg.add_parameter(snaprfs::g_name_snaprfs_param_mtime, file->get_mtime());
-    std::string my_addresses;
-    if(f_data_server != nullptr)
+    if(info->f_remote_cluster)
     {
-        addr::addr const a(f_data_server->get_address());
-        if(!my_addresses.empty())
+        if(relayed_by_gateway())
         {
-            my_addresses += ',';
+            SNAP_LOG_DEBUG
+                << "\""
+                << request.f_filename
+                << "\" comes from another cluster; our gateway will relay it."
+                << SNAP_LOG_SEND;
+            return;
         }
-        my_addresses += snaprfs::g_name_snaprfs_scheme_rfs;
-        my_addresses += "://";
-        my_addresses += a.to_ipv4or6_string(addr::STRING_IP_BRACKET_ADDRESS | addr::STRING_IP_PORT);
-    }
-    if(f_secure_data_server != nullptr)
-    {
-        addr::addr const a(f_secure_data_server->get_address());
-        if(!my_addresses.empty())
+        if(f_gateway)
         {
-            my_addresses += ',';
+            // once received, announce it to the computers of our cluster
+            //
+            f_relay_files.insert(request.f_filename);
         }
-        my_addresses += snaprfs::g_name_snaprfs_scheme_rfss;
-        my_addresses += "://";
-        my_addresses += a.to_ipv4or6_string(addr::STRING_IP_BRACKET_ADDRESS | addr::STRING_IP_PORT);
     }
-    msg.add_parameter(snaprfs::g_name_snaprfs_param_my_addresses, my_addresses);
-//std::cerr << "--- sending message [" << msg.to_string() << "]\n";
-    f_messenger->send_message(msg);
+    if(secure_only
+    || info->f_remote_cluster)
+    {
+        // only the rfss connection checks the login and password
+        //
+        request.f_inline = false;
+        request.f_data.clear();
+    }
+
+    peer_directory::select_sources(*info, secure_only, request);
+    if(request.f_sources.empty())
+    {
+        SNAP_LOG_ERROR
+            << "no valid address found for peer \""
+            << peer_id
+            << "\" to receive \""
+            << request.f_filename
+            << "\"."
+            << SNAP_LOG_SEND;
+        return;
+    }
+
+    // the scheduler ranks the sources (topology, latency, throughput) and
+    // tries them until one connection works
+    //
+    schedule_receive(request);
 }
 
 
-/** \brief Start receiving a file.
- *
- * This function starts a data receiver to receive a file from a remote
- * snaprfs instance.
- *
- * The function returns true if:
- *
- * * The connection was established successfully.
- * * The server detects that the file is not defined.
- * * The file cannot be received.
+/** \brief Check whether we want to receive a file.
  *
- * In other words, true does not mean success. It means there is no need to
- * call the function again with another \p address.
+ * The file has to be in a directory we watch, that directory has to
+ * accept files from other computers, and our copy has to be older than
+ * \p mtime.
  *
  * \param[in] filename  The name of the file that is to be received.
  * \param[in] mtime  The time when the file was last updated on the remote
  * computer.
- * \param[in] id  The identifier of the file, sent by the source. It will
- * have to match on the source snaprfs for the transfer to start.
- * \param[in] address  The IP address of the remote snaprfs sending us a file.
- * \param[in] secure  Whether the connection is expected to be secure.
  *
- * \return true if the transfer is to be ignored (see above) or the
- * connection happened; false if the connection failed and trying with
- * a different IP address may succeed.
+ * \return true if the file should be received.
  */
-bool server::receive_file(
+bool server::wants_file(
       std::string const & filename
-    , snapdev::timespec_ex const & mtime
-    , std::uint32_t id
-    , addr::addr const & address
-    , bool secure)
+    , snapdev::timespec_ex const & mtime)
 {
-    // make sure we can receive this file
-    //
     std::string const & path(snapdev::pathinfo::dirname(filename));
     path_info const * p(f_file_listener->find_path_info(path));
     if(p == nullptr)
@@ -1053,7 +3205,7 @@ bool server::receive_file(
             << filename
             << "\" was not found on this computer. Ignore transfer order."
             << SNAP_LOG_SEND;
-        return true;
+        return false;
     }
     switch(p->get_path_mode())
     {
@@ -1067,7 +3219,7 @@ bool server::receive_file(
             << filename
             << "\" says we cannot receive this file. Ignore transfer order."
             << SNAP_LOG_SEND;
-        return true;
+        return false;
 
     }
 
@@ -1081,9 +3233,28 @@ bool server::receive_file(
             << filename
             << "\" is newer, ignore the RFS_FILE_CHANGED message."
             << SNAP_LOG_SEND;
-        return true;
+        return false;
     }
 
+    return true;
+}
+
+
+/** \brief Get the directory where a file being received is saved.
+ *
+ * The path_part=... of the watched directory is used if defined.
+ * Otherwise we look for one of the temporary directories on the same
+ * mount point so the final link does not require a copy.
+ *
+ * \param[in] path  The directory where the file gets published.
+ * \param[in] p  The path information of that directory.
+ *
+ * \return The temporary directory to use.
+ */
+std::string server::get_temp_path(
+      std::string const & path
+    , path_info const * p)
+{
     std::string temp_path(p->get_path_part());
     if(temp_path.empty())
     {
@@ -1111,43 +3282,369 @@ bool server::receive_file(
         }
     }
 
-    try
+    return temp_path;
+}
+
+
+/** \brief Start receiving a file.
+ *
+ * This function starts a data receiver to receive a file from a remote
+ * snaprfs instance. It gets called by the receive_scheduler once there
+ * is room for one more transfer.
+ *
+ * The function returns RECEIVE_STATUS_IGNORED if:
+ *
+ * * The server detects that the file is not defined.
+ * * The file cannot be received.
+ *
+ * In other words, there is no need to call the function again with
+ * another \p source.
+ *
+ * The connection itself is established in a worker thread. If it fails,
+ * the function tells the receive_scheduler with receive_failed() and
+ * receive_done() so the request gets retried with another source.
+ *
+ * \param[in] filename  The name of the file that is to be received.
+ * \param[in] mtime  The time when the file was last updated on the remote
+ * computer.
+ * \param[in] id  The identifier of the file, sent by the source. It will
+ * have to match on the source snaprfs for the transfer to start.
+ * \param[in] source  The remote snaprfs sending us a file: its address,
+ * whether the connection is expected to be secure, and whether it
+ * understands the extended file request.
+ * \param[in] partial  The data received from a source which stalled, or
+ * nullptr to receive the whole file. Ignored if the source does not
+ * support the extended request.
+ * \param[in] speculative  Whether the file is still being written on the
+ * source, in which case the data gets staged instead of committed.
+ *
+ * \return RECEIVE_STATUS_STARTED if the connection is being established,
+ * RECEIVE_STATUS_IGNORED if the transfer is to be ignored (see above).
+ */
+receive_status_t server::receive_file(
+      std::string const & filename
+    , snapdev::timespec_ex const & mtime
+    , std::uint32_t id
+    , receive_source const & source
+    , received_file::pointer_t partial
+    , bool speculative)
+{
+    addr::addr const & address(source.f_address);
+    bool const secure(source.f_secure);
+
+    // make sure we can receive this file
+    //
+    if(!wants_file(filename, mtime))
     {
-        data_receiver::pointer_t receiver(std::make_shared<data_receiver>(
-              this
-            , filename
-            , id
-            , temp_path
-            , address
-            , secure
-                ? ed::mode_t::MODE_SECURE
-                : ed::mode_t::MODE_PLAIN));
-        if(secure)
-        {
-            receiver->set_login_info(f_login_name, f_password);
-        }
-        if(!f_communicator->add_connection(receiver))
+        return receive_status_t::RECEIVE_STATUS_IGNORED;
+    }
+    std::string const & path(snapdev::pathinfo::dirname(filename));
+    path_info const * p(f_file_listener->find_path_info(path));
+    std::string const temp_path(get_temp_path(path, p));
+
+    // the connect race found an address which answers, still the
+    // eventdispatcher client connects (and for secure connections does
+    // the TLS handshake) in its constructor, which blocks, so that is
+    // done in a worker thread; record how long it takes and whether it
+    // fails in the peer health table
+    //
+    std::string const peer(address.to_ipv4or6_string(addr::STRING_IP_ADDRESS));
+    f_peer_health->connect_started(peer);
+    durability_t const durability(p->get_durability());
+    connect_client(
+          address
+        , secure
+            ? ed::mode_t::MODE_SECURE
+            : ed::mode_t::MODE_PLAIN
+        , [this, filename, id, temp_path, source, address, secure, partial, speculative, durability, peer](
+                  ed::tcp_bio_client::pointer_t client
+                , std::int64_t latency_usec
+                , std::string const & error)
+          {
+              if(client != nullptr)
+              {
+                  if(f_peer_health->connect_succeeded(peer, latency_usec))
+                  {
+                      f_receive_scheduler->peer_recovered(peer);
+                  }
+                  data_receiver::pointer_t receiver(std::make_shared<data_receiver>(
+                        this
+                      , filename
+                      , id
+                      , temp_path
+                      , client));
+                  if(secure)
+                  {
+                      receiver->set_login_info(f_login_name, f_password);
+                  }
+                  receiver->set_durability(durability);
+                  link_class_t const link_class(get_link_class(address, secure));
+                  receiver->set_socket_profile(get_socket_profile(link_class), link_class);
+                  receiver->set_watchdog(
+                            f_opts.get_long("transfer-stall-sec") * 1'000'000
+                          , f_opts.get_long("transfer-min-rate"));
+                  if(!source.f_extended_request)
+                  {
+                      receiver->set_legacy_request();
+                  }
+                  else if(partial != nullptr)
+                  {
+                      receiver->set_resume(partial);
+                  }
+                  receiver->set_speculative(speculative);
+                  if(f_communicator->add_connection(receiver))
+                  {
+                      return;
+                  }
+              }
+              else
+              {
+                  SNAP_LOG_ERROR
+                      << "could not connect to receive file \""
+                      << filename
+                      << "\" from "
+                      << (secure ? "secure" : "plain")
+                      << " \""
+                      << address
+                      << "\" ("
+                      << error
+                      << ")."
+                      << SNAP_LOG_SEND;
+                  f_peer_health->connect_failed(peer);
+              }
+
+              // try again, with another source if there is one
+              //
+              f_receive_scheduler->receive_failed(filename);
+              f_receive_scheduler->receive_done(filename);
+          });
+
+    return receive_status_t::RECEIVE_STATUS_STARTED;
+}
+
+
+/** \brief The source of a file is busy.
+ *
+ * The data_receiver calls this function when the source replies with
+ * a BUSY packet instead of the file. The scheduler retries with another
+ * source or after the requested delay.
+ *
+ * \param[in] filename  The name of the file that was being received.
+ * \param[in] retry_after_msec  The delay requested by the source.
+ */
+void server::receive_busy(
+      std::string const & filename
+    , std::uint32_t retry_after_msec)
+{
+    f_receive_scheduler->receive_busy(filename, retry_after_msec);
+}
+
+
+/** \brief A transfer stalled.
+ *
+ * The data_receiver calls this function when its watchdog aborts a
+ * transfer which is too slow. The scheduler resumes the transfer,
+ * preferably from another source.
+ *
+ * \param[in] filename  The name of the file that was being received.
+ * \param[in] partial  The data received so far, may be nullptr.
+ */
+void server::receive_stalled(
+      std::string const & filename
+    , received_file::pointer_t partial)
+{
+    f_receive_scheduler->receive_stalled(filename, partial);
+}
+
+
+/** \brief A data_receiver is done.
+ *
+ * This function is called once a data_receiver gets removed from the
+ * communicator, whether it succeeded or failed. This gives the scheduler
+ * a chance to start the next transfer.
+ *
+ * \param[in] filename  The name of the file that was being received.
+ */
+void server::receive_done(std::string const & filename)
+{
+    f_receive_scheduler->receive_done(filename);
+}
+
+
+receive_scheduler::pointer_t server::get_receive_scheduler() const
+{
+    return f_receive_scheduler;
+}
+
+
+send_admission::pointer_t server::get_send_admission() const
+{
+    return f_send_admission;
+}
+
+
+commit_queue::pointer_t server::get_commit_queue() const
+{
+    return f_commit_queue;
+}
+
+
+peer_health::pointer_t server::get_peer_health() const
+{
+    return f_peer_health;
+}
+
+
+/** \brief Determine the class of the link to a peer.
+ *
+ * Secure connections are used between clusters so they always use the
+ * WAN profile. Otherwise the address decides: loopback, one of our local
+ * networks, or anything else (reached through a router).
+ *
+ * \param[in] address  The address of the other side of the connection.
+ * \param[in] secure  Whether the connection is encrypted.
+ *
+ * \return The class of the link.
+ */
+link_class_t server::get_link_class(addr::addr const & address, bool secure) const
+{
+    if(secure)
+    {
+        return link_class_t::LINK_CLASS_WAN;
+    }
+    if(address.get_network_type() == addr::network_type_t::NETWORK_TYPE_LOOPBACK)
+    {
+        return link_class_t::LINK_CLASS_LOOPBACK;
+    }
+    if(f_peer_health->is_local_network(
+                  address.to_ipv4or6_string(addr::STRING_IP_ADDRESS)
+                , address))
+    {
+        return link_class_t::LINK_CLASS_LAN;
+    }
+    return link_class_t::LINK_CLASS_WAN;
+}
+
+
+socket_profile const & server::get_socket_profile(link_class_t link_class) const
+{
+    switch(link_class)
+    {
+    case link_class_t::LINK_CLASS_LOOPBACK:
+        return f_loopback_profile;
+
+    case link_class_t::LINK_CLASS_LAN:
+        return f_lan_profile;
+
+    case link_class_t::LINK_CLASS_WAN:
+        break;
+
+    }
+
+    return f_wan_profile;
+}
+
+
+peer_directory::pointer_t server::get_peer_directory() const
+{
+    return f_peer_directory;
+}
+
+
+messenger::pointer_t server::get_messenger() const
+{
+    return f_messenger;
+}
+
+
+gossip::pointer_t server::get_gossip() const
+{
+    return f_gossip;
+}
+
+
+std::string const & server::get_peer_id() const
+{
+    return f_peer_id;
+}
+
+
+/** \brief Send our endpoints, labels, and capabilities.
+ *
+ * The RFS_FILE_CHANGED messages only include our peer identifier. The
+ * other snaprfs instances learn how to connect to us through this
+ * RFS_PEER_INFO message.
+ *
+ * \param[in] request  The RFS_GET_PEER_INFO we are replying to, or
+ * nullptr to broadcast the information to all the remote instances.
+ */
+void server::send_peer_info(ed::message const * request)
+{
+    if(f_endpoints.empty())
+    {
+        // not ready yet
+        //
+        return;
+    }
+
+    ed::message msg;
+    if(request != nullptr)
+    {
+        msg.reply_to(*request);
+    }
+    else
+    {
+        msg.set_server(communicatord::g_name_communicatord_server_remote);
+        msg.set_service(snaprfs::g_name_snaprfs_param_service);
+    }
+    msg.set_command(snaprfs::g_name_snaprfs_cmd_rfs_peer_info);
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_peer, f_peer_id);
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_my_addresses, f_endpoints);
+    std::string capabilities(g_capabilities);
+    if(!f_push_endpoints.empty())
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_push_addresses, f_push_endpoints);
+        capabilities += ",push";
+    }
+    if(f_file_listener != nullptr
+    && f_file_listener->has_push_paths())
+    {
+        // the receivers only accept pushes from peers advertising this
+        //
+        capabilities += ",push_source";
+    }
+    if(f_gateway)
+    {
+        capabilities += ",gateway";
+    }
+    if(f_gossip != nullptr)
+    {
+        capabilities += ",gossip";
+    }
+    msg.add_parameter(snaprfs::g_name_snaprfs_param_capabilities, capabilities);
+    if(f_file_listener != nullptr)
+    {
+        advgetopt::string_list_t const paths(f_file_listener->get_interest_paths());
+        std::string interests;
+        for(auto const & p : paths)
         {
-            return false;
+            if(!interests.empty())
+            {
+                interests += ':';
+            }
+            interests += p;
         }
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_interests, interests);
     }
-    catch(ed::event_dispatcher_exception const & e)
+    if(!f_rack.empty())
     {
-        SNAP_LOG_ERROR
-            << "could not connect to receive file \""
-            << filename
-            << "\" from "
-            << (secure ? "secure" : "plain")
-            << " \""
-            << address
-            << "\" ("
-            << e.what()
-            << ")."
-            << SNAP_LOG_SEND;
-        return false;
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_rack, f_rack);
     }
-
-    return true;
+    if(!f_datacenter.empty())
+    {
+        msg.add_parameter(snaprfs::g_name_snaprfs_param_datacenter, f_datacenter);
+    }
+    f_messenger->send_message(msg);
 }
 
 
@@ -1182,10 +3679,9 @@ void server::delete_local_file(
 
     }
 
-    int const r(unlink(filename.c_str()));
-    if(r != 0 && errno != ENOENT)
+    int const e(f_privileged_helper->unlink(filename));
+    if(e != 0 && e != ENOENT)
     {
-        int const e(errno);
         SNAP_LOG_MINOR
             << "could not delete \""
             << filename
@@ -56,9 +56,20 @@
 
 // self
 //
+#include    "commit_queue.h"
+#include    "content_index.h"
+#include    "data_receiver.h"
 #include    "data_server.h"
+#include    "fanotify_listener.h"
 #include    "file_listener.h"
+#include    "gossip.h"
 #include    "messenger.h"
+#include    "peer_directory.h"
+#include    "peer_health.h"
+#include    "privileged_helper.h"
+#include    "receive_scheduler.h"
+#include    "send_admission.h"
+#include    "socket_profile.h"
 
 
 // eventdispatcher
@@ -97,6 +108,11 @@ public:
     bool                    was_updated() const;
     std::string             get_mtime() const;
     snapdev::timespec_ex    get_mtimespec() const;
+    struct stat const &     get_stat() const;
+    std::string const &     get_snapshot() const;
+    std::string const &     get_source() const;
+    bool                    get_append_prefix(std::uint64_t offset, murmur3::stream & prefix) const;
+    std::uint64_t           get_append_size() const;
 
 private:
     friend class server;
@@ -110,6 +126,43 @@ private:
     snapdev::timespec_ex    f_received = snapdev::timespec_ex();
     snapdev::timespec_ex    f_last_updated = snapdev::timespec_ex();
     snapdev::timespec_ex    f_start_sharing = snapdev::timespec_ex();
+    std::size_t             f_replicas = 0;     // 0 when announced to all the interested computers
+    std::vector<std::string>
+                            f_holders = std::vector<std::string>();
+    std::string             f_content_hash = std::string();
+    struct stat             f_hashed_stat = {};   // f_stat when f_content_hash was computed
+    std::string             f_snapshot = std::string();   // copy shared instead of a file which keeps changing
+    ino_t                   f_append_inode = 0;           // copy_mode=append: hash of the data shared so far
+    std::uint64_t           f_append_size = 0;
+    murmur3::stream         f_append_stream = murmur3::stream(DATA_SEED_H1, DATA_SEED_H2);
+    std::uint64_t           f_append_offset = 0;          // size shared by the previous announcement
+    murmur3::stream         f_append_prefix = murmur3::stream(DATA_SEED_H1, DATA_SEED_H2);
+};
+
+
+struct pushed_file
+{
+    snapdev::timespec_ex    f_mtime = snapdev::timespec_ex();
+    receive_request         f_fallback = receive_request();     // announcement received during the push
+};
+
+
+// files waiting for the connect race to one computer accepting pushes
+//
+struct push_race
+{
+    connect_race::pointer_t f_race = connect_race::pointer_t();
+    addr::addr::vector_t    f_addresses = addr::addr::vector_t();
+    std::vector<shared_file::pointer_t>
+                            f_files = std::vector<shared_file::pointer_t>();
+};
+
+
+enum class announce_t
+{
+    ANNOUNCE_SUBSCRIBERS,       // send to the computers interested in the file
+    ANNOUNCE_BROADCAST,         // send to all the computers (default)
+    ANNOUNCE_GOSSIP,            // exchange change logs with a few random peers
 };
 
 
@@ -126,30 +179,150 @@ public:
 
     shared_file::pointer_t  get_file(std::uint32_t id);
     shared_file::pointer_t  get_file(std::string const & filename);
-    void                    refresh_file(std::string const & filename);
+    void                    refresh_file(
+                                  std::string const & filename
+                                , murmur3::hash const & hash);
+    void                    commit_failed(std::string const & filename);
+    bool                    receive_locally(receive_request const & request);
+    bool                    accept_push(
+                                  addr::addr const & address
+                                , std::string const & filename
+                                , snapdev::timespec_ex const & mtime
+                                , std::string & temp_path
+                                , durability_t & durability);
+    void                    setup_push_receiver(data_receiver::pointer_t receiver);
+    void                    push_done(std::string const & filename, bool committed);
+    void                    commit_file(received_file::pointer_t file);
+    privileged_helper::pointer_t
+                            get_privileged_helper() const;
+    id_cache::pointer_t     get_id_cache() const;
+    std::uint32_t           get_identity_domain() const;
+    std::string const &     get_rack() const;
+    std::string const &     get_datacenter() const;
     void                    updated_file(
                                   std::string const & fullpath
                                 , bool updated);
     void                    deleted_file(std::string const & fullpath);
-    bool                    receive_file(
+    void                    schedule_receive(receive_request const & request);
+    void                    file_announced(
+                                  receive_request & request
+                                , std::string const & peer_id
+                                , std::string const & server_name
+                                , bool secure_only);
+    bool                    wants_file(
+                                  std::string const & filename
+                                , snapdev::timespec_ex const & mtime);
+    receive_status_t        receive_file(
                                   std::string const & filename
                                 , snapdev::timespec_ex const & mtime
                                 , std::uint32_t id
-                                , addr::addr const & address
-                                , bool secure);
+                                , receive_source const & source
+                                , received_file::pointer_t partial = received_file::pointer_t()
+                                , bool speculative = false);
+    void                    receive_busy(
+                                  std::string const & filename
+                                , std::uint32_t retry_after_msec);
+    void                    receive_stalled(
+                                  std::string const & filename
+                                , received_file::pointer_t partial);
+    void                    receive_done(std::string const & filename);
+    receive_scheduler::pointer_t
+                            get_receive_scheduler() const;
+    send_admission::pointer_t
+                            get_send_admission() const;
+    commit_queue::pointer_t get_commit_queue() const;
+    peer_health::pointer_t  get_peer_health() const;
+    link_class_t            get_link_class(addr::addr const & address, bool secure) const;
+    socket_profile const &  get_socket_profile(link_class_t link_class) const;
+    peer_directory::pointer_t
+                            get_peer_directory() const;
+    messenger::pointer_t    get_messenger() const;
+    gossip::pointer_t       get_gossip() const;
+    std::string const &     get_peer_id() const;
+    void                    send_peer_info(ed::message const * request);
+    void                    peer_heartbeat();
+    bool                    relayed_by_gateway() const;
+    void                    peers_changed();
     void                    delete_local_file(
                                   std::string const & filename);
-    void                    broadcast_file_changed(shared_file::pointer_t file);
+    void                    broadcast_file_changed(shared_file::pointer_t file, bool snapshot = false);
+    void                    speculate_file(shared_file::pointer_t file);
+    std::int64_t            get_speculative_sec(std::string const & filename) const;
+    bool                    prepare_append(receive_request & request);
+    void                    stage_file(received_file::pointer_t file);
 
 private:
+    ed::message             file_changed_message(shared_file::pointer_t file, bool speculative = false);
+    std::string             content_hash(shared_file::pointer_t file);
+    std::string             get_temp_path(
+                                  std::string const & path
+                                , path_info const * p);
+    std::size_t             get_replicas(std::string const & filename) const;
+    void                    relay_file(shared_file::pointer_t file);
+    void                    push_file(shared_file::pointer_t file);
+    void                    announce_file(shared_file::pointer_t file);
+    void                    push_race_done(std::string const & name, int index);
+    void                    connect_client(
+                                  addr::addr const & address
+                                , ed::mode_t mode
+                                , std::function<void(
+                                          ed::tcp_bio_client::pointer_t client
+                                        , std::int64_t latency_usec
+                                        , std::string const & error)> callback);
+    std::string             append_prefix_hash(shared_file::pointer_t file, bool speculative);
+    std::string             snapshot_path(shared_file::pointer_t file);
+    void                    drop_snapshot(shared_file::pointer_t file);
+    void                    send_announcement(
+                                  ed::message & msg
+                                , std::string const & filename);
+
     advgetopt::getopt       f_opts;
     ed::communicator::pointer_t
                             f_communicator = ed::communicator::pointer_t();
     messenger::pointer_t    f_messenger = messenger::pointer_t();
     file_listener::pointer_t
                             f_file_listener = file_listener::pointer_t();
+    fanotify_listener::pointer_t
+                            f_fanotify_listener = fanotify_listener::pointer_t();
     data_server::pointer_t  f_data_server = data_server::pointer_t();
     data_server::pointer_t  f_secure_data_server = data_server::pointer_t();
+    data_server::pointer_t  f_push_data_server = data_server::pointer_t();
+    commit_queue::pointer_t f_commit_queue = commit_queue::pointer_t();
+    privileged_helper::pointer_t
+                            f_privileged_helper = privileged_helper::pointer_t();
+    id_cache::pointer_t     f_id_cache = id_cache::pointer_t();
+    receive_scheduler::pointer_t
+                            f_receive_scheduler = receive_scheduler::pointer_t();
+    send_admission::pointer_t
+                            f_send_admission = send_admission::pointer_t();
+    peer_health::pointer_t  f_peer_health = peer_health::pointer_t();
+    peer_directory::pointer_t
+                            f_peer_directory = peer_directory::pointer_t();
+    content_index::pointer_t
+                            f_content_index = content_index::pointer_t();
+    std::int64_t            f_dedup_max_size = 0;
+    std::int64_t            f_inline_max_size = 0;
+    std::map<std::string, receive_request>
+                            f_fallbacks = std::map<std::string, receive_request>();     // download if the commit fails
+    std::map<std::string, pushed_file>
+                            f_pushes = std::map<std::string, pushed_file>();
+    std::map<std::string, push_race>
+                            f_push_races = std::map<std::string, push_race>();     // per server name
+    std::map<std::string, received_file::pointer_t>
+                            f_staged = std::map<std::string, received_file::pointer_t>();  // speculative data not published yet
+    socket_profile          f_loopback_profile = socket_profile();
+    socket_profile          f_lan_profile = socket_profile();
+    socket_profile          f_wan_profile = socket_profile();
+    std::string             f_peer_id = std::string();
+    std::string             f_endpoints = std::string();
+    std::string             f_push_endpoints = std::string();
+    announce_t              f_announce = announce_t::ANNOUNCE_BROADCAST;
+    gossip::pointer_t       f_gossip = gossip::pointer_t();
+    bool                    f_gateway = false;
+    std::set<std::string>   f_relay_files = std::set<std::string>();
+    std::uint32_t           f_identity_domain = 0;
+    std::string             f_rack = std::string();
+    std::string             f_datacenter = std::string();
     std::string             f_login_name = std::string();
     std::string             f_password = std::string();
     bool                    f_force_restart = false;
@@ -0,0 +1,322 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of the socket tuning profiles.
+ *
+ * The best socket options for a transfer between two processes on the
+ * same computer are not the same as the ones for a transfer between two
+ * datacenters. The data connections are therefore classified as:
+ *
+ * \li loopback -- the other side is on this very computer;
+ * \li LAN -- the other side is on one of our local networks;
+ * \li WAN -- the other side is behind a router or the connection is
+ * secure (rfss:// is used between clusters).
+ *
+ * Each class has its own profile defined in the snaprfs.conf file as a
+ * comma separated list of `<name>=<value>`:
+ *
+ * \li `send_buffer` -- SO_SNDBUF in bytes;
+ * \li `receive_buffer` -- SO_RCVBUF in bytes;
+ * \li `notsent_lowat` -- TCP_NOTSENT_LOWAT in bytes;
+ * \li `congestion` -- TCP_CONGESTION algorithm name (i.e. `bbr`);
+ * \li `cork` -- `true` to set TCP_CORK while a file is being sent;
+ * \li `keepalive` -- idle seconds before TCP keepalive probes are sent.
+ *
+ * Options not specified keep the system defaults. The values in effect,
+ * as read back from the kernel, are returned by apply() so they can be
+ * logged along each transfer.
+ */
+
+// self
+//
+#include    "socket_profile.h"
+
+
+// advgetopt
+//
+#include    <advgetopt/utils.h>
+#include    <advgetopt/validator_integer.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <limits>
+#include    <sstream>
+
+
+// C
+//
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    <sys/socket.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+char const * to_string(link_class_t link_class)
+{
+    switch(link_class)
+    {
+    case link_class_t::LINK_CLASS_LOOPBACK:
+        return "loopback";
+
+    case link_class_t::LINK_CLASS_LAN:
+        return "lan";
+
+    case link_class_t::LINK_CLASS_WAN:
+        return "wan";
+
+    }
+
+    return "unknown";
+}
+
+
+
+/** \brief Parse a profile definition.
+ *
+ * \param[in] definition  The comma separated list of `<name>=<value>`.
+ *
+ * \return true if all the options were valid.
+ */
+bool socket_profile::parse(std::string const & definition)
+{
+    advgetopt::string_list_t options;
+    advgetopt::split_string(definition, options, { "," });
+    bool valid(true);
+    for(auto const & o : options)
+    {
+        std::string::size_type const pos(o.find('='));
+        std::string const name(o.substr(0, pos));
+        std::string const value(pos == std::string::npos ? std::string() : o.substr(pos + 1));
+        std::int64_t * number(nullptr);
+        if(name == "send_buffer")
+        {
+            number = &f_send_buffer;
+        }
+        else if(name == "receive_buffer")
+        {
+            number = &f_receive_buffer;
+        }
+        else if(name == "notsent_lowat")
+        {
+            number = &f_notsent_lowat;
+        }
+        else if(name == "keepalive")
+        {
+            number = &f_keepalive_sec;
+        }
+        else if(name == "congestion")
+        {
+            f_congestion = value;
+            continue;
+        }
+        else if(name == "cork")
+        {
+            f_cork = advgetopt::is_true(value);
+            continue;
+        }
+        else
+        {
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "unknown socket profile option \""
+                << name
+                << "\"."
+                << SNAP_LOG_SEND;
+            valid = false;
+            continue;
+        }
+
+        std::int64_t n(0);
+        if(!advgetopt::validator_integer::convert_string(value, n)
+        || n < 0
+        || n > std::numeric_limits<int>::max())
+        {
+            SNAP_LOG_RECOVERABLE_ERROR
+                << "invalid value \""
+                << value
+                << "\" for socket profile option \""
+                << name
+                << "\"."
+                << SNAP_LOG_SEND;
+            valid = false;
+            continue;
+        }
+        *number = n;
+    }
+
+    return valid;
+}
+
+
+/** \brief Apply this profile to a socket.
+ *
+ * Options which the kernel refuses (i.e. an unknown congestion algorithm)
+ * generate a warning and the transfer goes on with the system default.
+ *
+ * The TCP_CORK option is not set here, see set_cork().
+ *
+ * \param[in] socket  The socket to tune.
+ * \param[in] link_class  The class of the link, used in the report.
+ *
+ * \return The values in effect for that socket.
+ */
+std::string socket_profile::apply(int socket, link_class_t link_class) const
+{
+    auto set_int = [socket](int level, int option, int value, char const * name)
+    {
+        if(setsockopt(socket, level, option, &value, sizeof(value)) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_WARNING
+                << "could not set socket option "
+                << name
+                << " to "
+                << value
+                << "; errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << "."
+                << SNAP_LOG_SEND;
+        }
+    };
+    auto get_int = [socket](int level, int option)
+    {
+        int value(0);
+        socklen_t len(sizeof(value));
+        if(getsockopt(socket, level, option, &value, &len) != 0)
+        {
+            return -1;
+        }
+        return value;
+    };
+
+    if(f_send_buffer > 0)
+    {
+        set_int(SOL_SOCKET, SO_SNDBUF, static_cast<int>(f_send_buffer), "SO_SNDBUF");
+    }
+    if(f_receive_buffer > 0)
+    {
+        set_int(SOL_SOCKET, SO_RCVBUF, static_cast<int>(f_receive_buffer), "SO_RCVBUF");
+    }
+    if(f_notsent_lowat > 0)
+    {
+        set_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT, static_cast<int>(f_notsent_lowat), "TCP_NOTSENT_LOWAT");
+    }
+    if(!f_congestion.empty())
+    {
+        if(setsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, f_congestion.c_str(), static_cast<socklen_t>(f_congestion.length())) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_WARNING
+                << "could not set congestion control algorithm to \""
+                << f_congestion
+                << "\" (is the module loaded?); errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << "."
+                << SNAP_LOG_SEND;
+        }
+    }
+    if(f_keepalive_sec > 0)
+    {
+        set_int(SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        set_int(IPPROTO_TCP, TCP_KEEPIDLE, static_cast<int>(f_keepalive_sec), "TCP_KEEPIDLE");
+    }
+
+    char congestion[16] = {};       // TCP_CA_NAME_MAX
+    socklen_t len(sizeof(congestion) - 1);
+    if(getsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, congestion, &len) != 0)
+    {
+        congestion[0] = '\0';
+    }
+
+    std::stringstream ss;
+    ss << "profile=" << to_string(link_class)
+       << " send_buffer=" << get_int(SOL_SOCKET, SO_SNDBUF)
+       << " receive_buffer=" << get_int(SOL_SOCKET, SO_RCVBUF)
+       << " notsent_lowat=" << get_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT)
+       << " congestion=" << congestion
+       << " cork=" << std::boolalpha << f_cork
+       << " keepalive=";
+    if(get_int(SOL_SOCKET, SO_KEEPALIVE) > 0)
+    {
+        ss << get_int(IPPROTO_TCP, TCP_KEEPIDLE);
+    }
+    else
+    {
+        ss << "off";
+    }
+    return ss.str();
+}
+
+
+bool socket_profile::get_cork() const
+{
+    return f_cork;
+}
+
+
+/** \brief Set or clear the TCP_CORK option.
+ *
+ * While corked, the kernel only sends full segments. The data_sender
+ * corks its socket before the header and removes the cork once the
+ * footer was written, which flushes the last partial segment.
+ *
+ * \param[in] socket  The socket to cork or uncork.
+ * \param[in] cork  Whether to set or clear the option.
+ */
+void socket_profile::set_cork(int socket, bool cork)
+{
+    int const value(cork ? 1 : 0);
+    if(setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_WARNING
+            << "could not "
+            << (cork ? "set" : "clear")
+            << " TCP_CORK; errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << "."
+            << SNAP_LOG_SEND;
+    }
+}
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,70 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+/** \file
+ * \brief The declaration of the socket_profile class.
+ *
+ * A socket profile defines the TCP options applied to the data
+ * connections of one class of link (loopback, LAN, WAN).
+ */
+
+// C++
+//
+#include    <cstdint>
+#include    <string>
+
+
+
+namespace rfs_daemon
+{
+
+
+
+enum class link_class_t
+{
+    LINK_CLASS_LOOPBACK,
+    LINK_CLASS_LAN,
+    LINK_CLASS_WAN,
+};
+
+
+char const *            to_string(link_class_t link_class);
+
+
+class socket_profile
+{
+public:
+    bool                parse(std::string const & definition);
+    std::string         apply(int socket, link_class_t link_class) const;
+    bool                get_cork() const;
+    static void         set_cork(int socket, bool cork);
+
+private:
+    std::int64_t        f_send_buffer = 0;              // SO_SNDBUF, 0 = system default
+    std::int64_t        f_receive_buffer = 0;           // SO_RCVBUF, 0 = system default
+    std::int64_t        f_notsent_lowat = 0;            // TCP_NOTSENT_LOWAT, 0 = system default
+    std::string         f_congestion = std::string();   // TCP_CONGESTION, empty = system default
+    bool                f_cork = false;                 // TCP_CORK while sending a file
+    std::int64_t        f_keepalive_sec = 0;            // TCP_KEEPIDLE, 0 = no keepalive
+};
+
+
+
+} // namespace rfs_daemon
+// vim: ts=4 sw=4 et
@@ -0,0 +1,137 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/base64.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+
+CATCH_TEST_CASE("base64", "[base64]")
+{
+    CATCH_START_SECTION("base64: RFC 4648 test vectors")
+    {
+        std::pair<std::string, std::string> const vectors[] =
+        {
+            { "",       ""         },
+            { "f",      "Zg=="     },
+            { "fo",     "Zm8="     },
+            { "foo",    "Zm9v"     },
+            { "foob",   "Zm9vYg==" },
+            { "fooba",  "Zm9vYmE=" },
+            { "foobar", "Zm9vYmFy" },
+        };
+
+        for(auto const & v : vectors)
+        {
+            CATCH_REQUIRE(rfs_daemon::base64_encode(v.first) == v.second);
+
+            std::string data("garbage");
+            CATCH_REQUIRE(rfs_daemon::base64_decode(v.second, data));
+            CATCH_REQUIRE(data == v.first);
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("base64: round trip of binary data")
+    {
+        std::string data;
+        for(std::size_t size(0); size < 300; ++size)
+        {
+            std::string const encoded(rfs_daemon::base64_encode(data));
+            CATCH_REQUIRE(encoded.length() == (size + 2) / 3 * 4);
+
+            std::string decoded;
+            CATCH_REQUIRE(rfs_daemon::base64_decode(encoded, decoded));
+            CATCH_REQUIRE(decoded == data);
+
+            // all the byte values, including '\0' and bytes over 0x7F
+            //
+            data += static_cast<char>((size * 97 + 13) & 0xFF);
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("base64: the '+' and '/' characters")
+    {
+        std::string const data("\xFB\xEF\xBE\xFF\xFF\xFF", 6);
+        CATCH_REQUIRE(rfs_daemon::base64_encode(data) == "++++////");
+
+        std::string decoded;
+        CATCH_REQUIRE(rfs_daemon::base64_decode("++++////", decoded));
+        CATCH_REQUIRE(decoded == data);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("base64: invalid padding")
+    {
+        std::string const invalid[] =
+        {
+            "Zg",           // padding is required
+            "Zg=",
+            "Zm9vYg",
+            "Zm9vYg=",
+            "Zm9vY",
+            "Z===",         // at most two padding characters
+            "====",
+            "=Zg=",
+            "Zg=A",         // nothing after the padding
+            "Zg==Zm9v",     // padding only in the last group
+            "Zm8=Zm9v",
+            "Zm9vYg==Zg==",
+        };
+
+        for(auto const & e : invalid)
+        {
+            std::string data("garbage");
+            CATCH_REQUIRE_FALSE(rfs_daemon::base64_decode(e, data));
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("base64: invalid characters")
+    {
+        std::string const invalid[] =
+        {
+            "Zm9v Ymf",
+            "Zm9v\nYmF",
+            "Zm9v-mFy",     // the URL alphabet is not accepted
+            "Zm9v_mFy",
+            "Zm9.",
+            "Zm\xC3\xA9",
+            std::string("Zm\0v", 4),
+        };
+
+        for(auto const & e : invalid)
+        {
+            std::string data;
+            CATCH_REQUIRE_FALSE(rfs_daemon::base64_decode(e, data));
+        }
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,198 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/deadline_queue.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+
+namespace
+{
+
+
+// the queue never reads a clock, so the tests drive time by hand
+//
+class fake_clock
+{
+public:
+    snapdev::timespec_ex const & now() const
+    {
+        return f_now;
+    }
+
+    void advance(std::int64_t usec)
+    {
+        f_now += snapdev::timespec_ex(usec / 1'000'000, (usec % 1'000'000) * 1'000);
+    }
+
+private:
+    snapdev::timespec_ex    f_now = snapdev::timespec_ex(1'000'000, 0);
+};
+
+
+snapdev::timespec_ex after(fake_clock const & clock, std::int64_t usec)
+{
+    return clock.now() + snapdev::timespec_ex(usec / 1'000'000, (usec % 1'000'000) * 1'000);
+}
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("deadline_queue", "[deadline_queue]")
+{
+    CATCH_START_SECTION("deadline_queue: empty queue")
+    {
+        fake_clock clock;
+        rfs_daemon::deadline_queue<std::string> q;
+
+        CATCH_REQUIRE(q.empty());
+        CATCH_REQUIRE(q.size() == 0);
+        CATCH_REQUIRE(q.next_deadline() == snapdev::timespec_ex());
+        CATCH_REQUIRE(q.pop_expired(clock.now()).empty());
+        CATCH_REQUIRE_FALSE(q.erase("missing"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("deadline_queue: items expire in deadline order")
+    {
+        fake_clock clock;
+        rfs_daemon::deadline_queue<std::string> q;
+
+        q.set("c", after(clock, 3'000'000));
+        q.set("a", after(clock, 1'000'000));
+        q.set("b", after(clock, 2'000'000));
+
+        CATCH_REQUIRE(q.size() == 3);
+        CATCH_REQUIRE(q.next_deadline() == after(clock, 1'000'000));
+
+        clock.advance(999'999);
+        CATCH_REQUIRE(q.pop_expired(clock.now()).empty());
+
+        clock.advance(1);
+        rfs_daemon::deadline_queue<std::string>::items_t expired(q.pop_expired(clock.now()));
+        CATCH_REQUIRE(expired.size() == 1);
+        CATCH_REQUIRE(expired[0] == "a");
+        CATCH_REQUIRE_FALSE(q.contains("a"));
+
+        clock.advance(5'000'000);
+        expired = q.pop_expired(clock.now());
+        CATCH_REQUIRE(expired.size() == 2);
+        CATCH_REQUIRE(expired[0] == "b");
+        CATCH_REQUIRE(expired[1] == "c");
+        CATCH_REQUIRE(q.empty());
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("deadline_queue: sub-second deadlines")
+    {
+        fake_clock clock;
+        rfs_daemon::deadline_queue<int> q;
+
+        for(int i(9); i >= 0; --i)
+        {
+            q.set(i, after(clock, (i + 1) * 100'000));
+        }
+        CATCH_REQUIRE(q.next_deadline() == after(clock, 100'000));
+
+        for(int i(0); i < 10; ++i)
+        {
+            clock.advance(100'000);
+            rfs_daemon::deadline_queue<int>::items_t const expired(q.pop_expired(clock.now()));
+            CATCH_REQUIRE(expired.size() == 1);
+            CATCH_REQUIRE(expired[0] == i);
+        }
+        CATCH_REQUIRE(q.empty());
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("deadline_queue: moving a deadline (debouncing)")
+    {
+        fake_clock clock;
+        rfs_daemon::deadline_queue<std::string> q;
+
+        // a file written every 500ms must not expire while it keeps changing
+        //
+        q.set("busy", after(clock, 3'000'000));
+        q.set("idle", after(clock, 3'000'000));
+        for(int i(0); i < 10; ++i)
+        {
+            clock.advance(500'000);
+            q.set("busy", after(clock, 3'000'000));
+            rfs_daemon::deadline_queue<std::string>::items_t const expired(q.pop_expired(clock.now()));
+            if(i == 5)
+            {
+                CATCH_REQUIRE(expired.size() == 1);
+                CATCH_REQUIRE(expired[0] == "idle");
+            }
+            else
+            {
+                CATCH_REQUIRE(expired.empty());
+            }
+        }
+        CATCH_REQUIRE(q.size() == 1);
+        CATCH_REQUIRE(q.next_deadline() == after(clock, 3'000'000));
+
+        // moving a deadline earlier works too
+        //
+        q.set("busy", clock.now());
+        CATCH_REQUIRE(q.size() == 1);
+        rfs_daemon::deadline_queue<std::string>::items_t const expired(q.pop_expired(clock.now()));
+        CATCH_REQUIRE(expired.size() == 1);
+        CATCH_REQUIRE(expired[0] == "busy");
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("deadline_queue: erase and clear")
+    {
+        fake_clock clock;
+        rfs_daemon::deadline_queue<std::string> q;
+
+        q.set("a", after(clock, 1'000));
+        q.set("b", after(clock, 2'000));
+        q.set("c", after(clock, 2'000));
+
+        CATCH_REQUIRE(q.erase("a"));
+        CATCH_REQUIRE_FALSE(q.erase("a"));
+        CATCH_REQUIRE(q.next_deadline() == after(clock, 2'000));
+
+        // same deadline, both items are kept
+        //
+        clock.advance(2'000);
+        CATCH_REQUIRE(q.pop_expired(clock.now()).size() == 2);
+
+        q.set("d", after(clock, 1'000));
+        q.clear();
+        CATCH_REQUIRE(q.empty());
+        CATCH_REQUIRE_FALSE(q.contains("d"));
+        clock.advance(1'000);
+        CATCH_REQUIRE(q.pop_expired(clock.now()).empty());
+    }
+    CATCH_END_SECTION()
+}
+
+
+// vim: ts=4 sw=4 et
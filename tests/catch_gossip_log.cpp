@@ -0,0 +1,309 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/gossip_log.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+
+namespace
+{
+
+
+rfs_daemon::gossip_change change(
+      std::string const & origin
+    , std::uint64_t sequence
+    , std::string const & filename)
+{
+    rfs_daemon::gossip_change c;
+    c.f_origin = origin;
+    c.f_server_name = "server-" + origin;
+    c.f_sequence = sequence;
+    c.f_id = static_cast<std::uint32_t>(sequence * 10);
+    c.f_mtime = snapdev::timespec_ex(1700000000, 123456789);
+    c.f_filename = filename;
+    return c;
+}
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("gossip_change", "[gossip]")
+{
+    CATCH_START_SECTION("gossip_change: round trip")
+    {
+        rfs_daemon::gossip_change c(change("peer-a", 17, "/var/lib/app/data.db"));
+        c.f_deleted = true;
+
+        rfs_daemon::gossip_change d;
+        CATCH_REQUIRE(d.from_string(c.to_string()));
+        CATCH_REQUIRE(d.f_origin == "peer-a");
+        CATCH_REQUIRE(d.f_server_name == "server-peer-a");
+        CATCH_REQUIRE(d.f_sequence == 17);
+        CATCH_REQUIRE(d.f_id == 170);
+        CATCH_REQUIRE(d.f_mtime == c.f_mtime);
+        CATCH_REQUIRE(d.f_deleted);
+        CATCH_REQUIRE(d.f_filename == "/var/lib/app/data.db");
+        CATCH_REQUIRE(d.to_string() == c.to_string());
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_change: colons in the filename")
+    {
+        std::string const filenames[] =
+        {
+            "/var/lib/app/12:30:00.log",
+            "/srv/a:b/c:d",
+            "/:",
+            "/var/lib/app/data.db:",
+            "/::::::::",
+        };
+
+        for(auto const & f : filenames)
+        {
+            rfs_daemon::gossip_change const c(change("peer-a", 3, f));
+            rfs_daemon::gossip_change d;
+            CATCH_REQUIRE(d.from_string(c.to_string()));
+            CATCH_REQUIRE(d.f_origin == "peer-a");
+            CATCH_REQUIRE(d.f_sequence == 3);
+            CATCH_REQUIRE_FALSE(d.f_deleted);
+            CATCH_REQUIRE(d.f_filename == f);
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_change: invalid strings")
+    {
+        std::string const invalid[] =
+        {
+            "",
+            "peer-a",
+            "peer-a:1:2:0:0:server",
+            "peer-a:1:2:0:0:server:",
+            "peer-a:1:2:0:0:server:relative/path",
+            ":1:2:0:0:server:/a",
+            "peer-a:0:2:0:0:server:/a",
+            "peer-a:-5:2:0:0:server:/a",
+            "peer-a:one:2:0:0:server:/a",
+            "peer-a::2:0:0:server:/a",
+            "peer-a:1:two:0:0:server:/a",
+            "peer-a:1:2:0:2:server:/a",
+            "peer-a:1:2:0:yes:server:/a",
+            "peer-a:1:2:0::server:/a",
+        };
+
+        for(auto const & s : invalid)
+        {
+            rfs_daemon::gossip_change d;
+            CATCH_REQUIRE_FALSE(d.from_string(s));
+        }
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+CATCH_TEST_CASE("gossip_log", "[gossip]")
+{
+    CATCH_START_SECTION("gossip_log: version vector")
+    {
+        rfs_daemon::gossip_log log;
+        CATCH_REQUIRE(log.encode_vector().empty());
+
+        log.add_change("a", "/a", 1, snapdev::timespec_ex(), false, 0);
+        log.add_change("a", "/b", 2, snapdev::timespec_ex(), false, 0);
+        CATCH_REQUIRE(log.merge(change("b", 5, "/c"), 0));
+        CATCH_REQUIRE(log.encode_vector() == "a:2,b:5");
+
+        rfs_daemon::gossip_log::version_vector_t const v(
+                rfs_daemon::gossip_log::decode_vector(log.encode_vector()));
+        CATCH_REQUIRE(v.size() == 2);
+        CATCH_REQUIRE(v.at("a") == 2);
+        CATCH_REQUIRE(v.at("b") == 5);
+
+        // invalid entries are ignored
+        //
+        rfs_daemon::gossip_log::version_vector_t const w(
+                rfs_daemon::gossip_log::decode_vector("a:3,:4,b,c:x,d:-1,e:0"));
+        CATCH_REQUIRE(w.size() == 2);
+        CATCH_REQUIRE(w.at("a") == 3);
+        CATCH_REQUIRE(w.at("e") == 0);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: merge ignores known changes")
+    {
+        rfs_daemon::gossip_log log;
+
+        CATCH_REQUIRE(log.merge(change("b", 5, "/c"), 0));
+        CATCH_REQUIRE_FALSE(log.merge(change("b", 5, "/c"), 0));
+        CATCH_REQUIRE_FALSE(log.merge(change("b", 4, "/d"), 0));
+        CATCH_REQUIRE(log.merge(change("b", 6, "/d"), 0));
+
+        rfs_daemon::gossip_change::vector_t const changes(log.missing_changes({}));
+        CATCH_REQUIRE(changes.size() == 2);
+        CATCH_REQUIRE(changes[0].f_filename == "/c");
+        CATCH_REQUIRE(changes[1].f_filename == "/d");
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: missing changes are sorted by sequence")
+    {
+        rfs_daemon::gossip_log log;
+
+        // the files are saved by name, make sure the order of the
+        // names differs from the order of the changes
+        //
+        log.add_change("a", "/z", 1, snapdev::timespec_ex(), false, 0);
+        log.add_change("a", "/m", 2, snapdev::timespec_ex(), false, 0);
+        log.add_change("a", "/b", 3, snapdev::timespec_ex(), true, 0);
+        log.add_change("a", "/y", 4, snapdev::timespec_ex(), false, 0);
+
+        // "/z" changes again, only its latest change is sent
+        //
+        log.add_change("a", "/z", 5, snapdev::timespec_ex(), false, 0);
+
+        rfs_daemon::gossip_change::vector_t const changes(log.missing_changes({}));
+        CATCH_REQUIRE(changes.size() == 4);
+        CATCH_REQUIRE(changes[0].f_filename == "/m");
+        CATCH_REQUIRE(changes[0].f_sequence == 2);
+        CATCH_REQUIRE(changes[1].f_filename == "/b");
+        CATCH_REQUIRE(changes[1].f_deleted);
+        CATCH_REQUIRE(changes[2].f_filename == "/y");
+        CATCH_REQUIRE(changes[3].f_filename == "/z");
+        CATCH_REQUIRE(changes[3].f_sequence == 5);
+        CATCH_REQUIRE(changes[3].f_id == 5);
+
+        // the remote computer already has changes up to 3
+        //
+        rfs_daemon::gossip_change::vector_t const newer(log.missing_changes({ { "a", 3 } }));
+        CATCH_REQUIRE(newer.size() == 2);
+        CATCH_REQUIRE(newer[0].f_filename == "/y");
+        CATCH_REQUIRE(newer[1].f_filename == "/z");
+
+        CATCH_REQUIRE(log.missing_changes({ { "a", 5 } }).empty());
+        CATCH_REQUIRE(log.missing_changes({ { "a", 6 } }).empty());
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: missing changes are truncated")
+    {
+        rfs_daemon::gossip_log log;
+
+        std::size_t const count(rfs_daemon::gossip_log::MAX_BATCH + 50);
+        for(std::size_t idx(0); idx < count; ++idx)
+        {
+            // names in reverse order of the sequence
+            //
+            log.add_change(
+                      "a"
+                    , "/f" + std::to_string(1'000'000 - idx)
+                    , static_cast<std::uint32_t>(idx)
+                    , snapdev::timespec_ex()
+                    , false
+                    , 0);
+        }
+
+        rfs_daemon::gossip_change::vector_t const changes(log.missing_changes({}));
+        CATCH_REQUIRE(changes.size() == rfs_daemon::gossip_log::MAX_BATCH);
+        for(std::size_t idx(0); idx < changes.size(); ++idx)
+        {
+            CATCH_REQUIRE(changes[idx].f_sequence == idx + 1);
+        }
+
+        // the remote computer applies the batch and asks for the rest
+        //
+        rfs_daemon::gossip_change::vector_t const rest(
+                log.missing_changes({ { "a", changes.back().f_sequence } }));
+        CATCH_REQUIRE(rest.size() == 50);
+        CATCH_REQUIRE(rest.front().f_sequence == rfs_daemon::gossip_log::MAX_BATCH + 1);
+        CATCH_REQUIRE(rest.back().f_sequence == count);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: truncation keeps each origin in order")
+    {
+        rfs_daemon::gossip_log log;
+
+        for(std::uint64_t idx(1); idx <= 60; ++idx)
+        {
+            CATCH_REQUIRE(log.merge(change("b", idx, "/b" + std::to_string(100 - idx)), 0));
+            CATCH_REQUIRE(log.merge(change("a", idx, "/a" + std::to_string(100 - idx)), 0));
+        }
+
+        rfs_daemon::gossip_change::vector_t const changes(log.missing_changes({}));
+        CATCH_REQUIRE(changes.size() == rfs_daemon::gossip_log::MAX_BATCH);
+
+        std::map<std::string, std::uint64_t> last;
+        for(auto const & c : changes)
+        {
+            CATCH_REQUIRE(c.f_sequence == last[c.f_origin] + 1);
+            last[c.f_origin] = c.f_sequence;
+        }
+        CATCH_REQUIRE(last["a"] == 60);
+        CATCH_REQUIRE(last["b"] == 40);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: lacks changes")
+    {
+        rfs_daemon::gossip_log log;
+        CATCH_REQUIRE_FALSE(log.lacks_changes({}));
+
+        log.add_change("a", "/a", 1, snapdev::timespec_ex(), false, 0);
+        log.add_change("a", "/b", 2, snapdev::timespec_ex(), false, 0);
+        CATCH_REQUIRE(log.merge(change("b", 5, "/c"), 0));
+
+        CATCH_REQUIRE(log.lacks_changes({}));
+        CATCH_REQUIRE(log.lacks_changes({ { "a", 2 } }));
+        CATCH_REQUIRE(log.lacks_changes({ { "a", 1 }, { "b", 5 } }));
+        CATCH_REQUIRE_FALSE(log.lacks_changes({ { "a", 2 }, { "b", 5 } }));
+        CATCH_REQUIRE_FALSE(log.lacks_changes({ { "a", 3 }, { "b", 5 }, { "c", 1 } }));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("gossip_log: idle origins")
+    {
+        rfs_daemon::gossip_log log;
+
+        log.add_change("a", "/a", 1, snapdev::timespec_ex(), false, 1'000);
+        CATCH_REQUIRE(log.merge(change("b", 1, "/b"), 5'000));
+
+        CATCH_REQUIRE(log.idle_origins(5'000, 4'000).empty());
+        CATCH_REQUIRE(log.idle_origins(5'001, 4'000) == std::vector<std::string>{ "a" });
+        CATCH_REQUIRE(log.idle_origins(9'001, 4'000) == (std::vector<std::string>{ "a", "b" }));
+
+        log.erase_origin("a");
+        CATCH_REQUIRE(log.encode_vector() == "b:1");
+        CATCH_REQUIRE(log.idle_origins(9'001, 4'000) == std::vector<std::string>{ "b" });
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+// vim: ts=4 sw=4 et
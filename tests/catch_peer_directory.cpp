@@ -0,0 +1,327 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/peer_directory.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+
+namespace
+{
+
+
+rfs_daemon::peer_info interests(std::vector<std::string> const & paths)
+{
+    rfs_daemon::peer_info info;
+    info.f_has_interests = true;
+    info.f_interests = paths;
+    return info;
+}
+
+
+void add_peer(rfs_daemon::peer_directory & directory, std::string const & server_name)
+{
+    rfs_daemon::peer_info::pointer_t info(std::make_shared<rfs_daemon::peer_info>());
+    info->f_peer_id = "id-" + server_name;
+    info->f_server_name = server_name;
+    directory.update(info);
+}
+
+
+std::set<std::string> placed(
+      rfs_daemon::peer_directory const & directory
+    , std::string const & filename
+    , std::size_t replicas)
+{
+    std::vector<std::string> const servers(directory.interested_servers(filename, replicas));
+    return std::set<std::string>(servers.begin(), servers.end());
+}
+
+
+std::vector<std::string> const g_files =
+{
+    "/var/lib/app/a.db",
+    "/var/lib/app/b.db",
+    "/var/lib/app/c.db",
+    "/var/lib/app/sub/d.db",
+    "/etc/app/app.conf",
+    "/etc/hosts",
+    "/srv/www/index.html",
+    "/srv/www/style.css",
+};
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("peer_info_is_interested", "[peer_directory]")
+{
+    CATCH_START_SECTION("peer_info_is_interested: no interests means everything")
+    {
+        rfs_daemon::peer_info info;
+
+        CATCH_REQUIRE(info.is_interested("/etc/snaprfs/snaprfs.conf"));
+        CATCH_REQUIRE(info.is_interested("/a"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: empty list of interests means nothing")
+    {
+        rfs_daemon::peer_info const info(interests({}));
+
+        CATCH_REQUIRE_FALSE(info.is_interested("/etc/snaprfs/snaprfs.conf"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/a"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: files in the path and its sub-directories")
+    {
+        rfs_daemon::peer_info const info(interests({ "/var/lib/app" }));
+
+        CATCH_REQUIRE(info.is_interested("/var/lib/app/data.db"));
+        CATCH_REQUIRE(info.is_interested("/var/lib/app/sub/dir/data.db"));
+        CATCH_REQUIRE(info.is_interested("/var/lib/app/"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: prefix is not a path")
+    {
+        rfs_daemon::peer_info const info(interests({ "/var/lib/app" }));
+
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/app"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/application/data.db"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/ap"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/other/data.db"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/App/data.db"));
+        CATCH_REQUIRE_FALSE(info.is_interested(""));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: path with a trailing slash")
+    {
+        rfs_daemon::peer_info const info(interests({ "/etc/" }));
+
+        CATCH_REQUIRE(info.is_interested("/etc/hosts"));
+        CATCH_REQUIRE(info.is_interested("/etc/snaprfs/snaprfs.conf"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/etc/"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/etc"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/etcetera/hosts"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: root")
+    {
+        rfs_daemon::peer_info const info(interests({ "/" }));
+
+        CATCH_REQUIRE(info.is_interested("/a"));
+        CATCH_REQUIRE(info.is_interested("/var/lib/app/data.db"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_info_is_interested: several paths")
+    {
+        rfs_daemon::peer_info const info(interests({ "/var/lib/app", "/etc/app/" }));
+
+        CATCH_REQUIRE(info.is_interested("/var/lib/app/data.db"));
+        CATCH_REQUIRE(info.is_interested("/etc/app/app.conf"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/etc/hosts"));
+        CATCH_REQUIRE_FALSE(info.is_interested("/var/lib/other/data.db"));
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+CATCH_TEST_CASE("peer_directory_interested_servers", "[peer_directory]")
+{
+    CATCH_START_SECTION("peer_directory_interested_servers: no replicas means all the interested peers")
+    {
+        rfs_daemon::peer_directory directory;
+        for(int idx(0); idx < 5; ++idx)
+        {
+            add_peer(directory, "s" + std::to_string(idx));
+        }
+
+        rfs_daemon::peer_info::pointer_t info(std::make_shared<rfs_daemon::peer_info>(interests({ "/etc/" })));
+        info->f_peer_id = "id-etc";
+        info->f_server_name = "etc";
+        directory.update(info);
+
+        // a peer without a communicatord name cannot be sent anything
+        //
+        info = std::make_shared<rfs_daemon::peer_info>();
+        info->f_peer_id = "id-unnamed";
+        directory.update(info);
+
+        CATCH_REQUIRE(placed(directory, "/var/lib/app/a.db", 0).size() == 5);
+        CATCH_REQUIRE(placed(directory, "/etc/hosts", 0).size() == 6);
+        CATCH_REQUIRE(placed(directory, "/etc/hosts", 0).contains("etc"));
+
+        // asking for more replicas than there are peers returns them all
+        //
+        CATCH_REQUIRE(placed(directory, "/var/lib/app/a.db", 5).size() == 5);
+        CATCH_REQUIRE(placed(directory, "/var/lib/app/a.db", 100).size() == 5);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_directory_interested_servers: placement is stable")
+    {
+        rfs_daemon::peer_directory directory;
+        rfs_daemon::peer_directory reversed;
+        for(int idx(0); idx < 10; ++idx)
+        {
+            add_peer(directory, "s" + std::to_string(idx));
+            add_peer(reversed, "s" + std::to_string(9 - idx));
+        }
+
+        for(auto const & f : g_files)
+        {
+            std::set<std::string> const servers(placed(directory, f, 3));
+            CATCH_REQUIRE(servers.size() == 3);
+            CATCH_REQUIRE(placed(directory, f, 3) == servers);
+            CATCH_REQUIRE(placed(reversed, f, 3) == servers);
+
+            // the computers holding 2 replicas also hold 3
+            //
+            for(auto const & s : placed(directory, f, 2))
+            {
+                CATCH_REQUIRE(servers.contains(s));
+            }
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_directory_interested_servers: a peer joins")
+    {
+        rfs_daemon::peer_directory directory;
+        for(int idx(0); idx < 10; ++idx)
+        {
+            add_peer(directory, "s" + std::to_string(idx));
+        }
+        std::map<std::string, std::set<std::string>> before;
+        for(auto const & f : g_files)
+        {
+            before[f] = placed(directory, f, 3);
+        }
+
+        add_peer(directory, "new");
+
+        // either nothing moves or the new peer takes the place of
+        // exactly one of the previous holders
+        //
+        for(auto const & f : g_files)
+        {
+            std::set<std::string> const after(placed(directory, f, 3));
+            CATCH_REQUIRE(after.size() == 3);
+            if(after.contains("new"))
+            {
+                std::size_t kept(0);
+                for(auto const & s : before[f])
+                {
+                    kept += after.contains(s) ? 1 : 0;
+                }
+                CATCH_REQUIRE(kept == 2);
+            }
+            else
+            {
+                CATCH_REQUIRE(after == before[f]);
+            }
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_directory_interested_servers: a peer leaves")
+    {
+        rfs_daemon::peer_directory with;
+        rfs_daemon::peer_directory without;
+        for(int idx(0); idx < 10; ++idx)
+        {
+            add_peer(with, "s" + std::to_string(idx));
+            if(idx != 4)
+            {
+                add_peer(without, "s" + std::to_string(idx));
+            }
+        }
+
+        // the holders which remain keep their replica and only the
+        // replica of the peer which left moves
+        //
+        for(auto const & f : g_files)
+        {
+            std::set<std::string> const before(placed(with, f, 3));
+            std::set<std::string> const after(placed(without, f, 3));
+            CATCH_REQUIRE(after.size() == 3);
+            CATCH_REQUIRE_FALSE(after.contains("s4"));
+            for(auto const & s : before)
+            {
+                if(s != "s4")
+                {
+                    CATCH_REQUIRE(after.contains(s));
+                }
+            }
+            if(!before.contains("s4"))
+            {
+                CATCH_REQUIRE(after == before);
+            }
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("peer_directory_interested_servers: only interested peers get a replica")
+    {
+        rfs_daemon::peer_directory directory;
+        for(int idx(0); idx < 4; ++idx)
+        {
+            rfs_daemon::peer_info::pointer_t info(std::make_shared<rfs_daemon::peer_info>(interests({ "/srv/www" })));
+            info->f_peer_id = "id-www" + std::to_string(idx);
+            info->f_server_name = "www" + std::to_string(idx);
+            directory.update(info);
+        }
+        for(int idx(0); idx < 4; ++idx)
+        {
+            rfs_daemon::peer_info::pointer_t info(std::make_shared<rfs_daemon::peer_info>(interests({ "/var/lib/app" })));
+            info->f_peer_id = "id-app" + std::to_string(idx);
+            info->f_server_name = "app" + std::to_string(idx);
+            directory.update(info);
+        }
+
+        for(auto const & s : placed(directory, "/srv/www/index.html", 2))
+        {
+            CATCH_REQUIRE(s.substr(0, 3) == "www");
+        }
+        for(auto const & s : placed(directory, "/var/lib/app/a.db", 2))
+        {
+            CATCH_REQUIRE(s.substr(0, 3) == "app");
+        }
+        CATCH_REQUIRE(placed(directory, "/etc/hosts", 2).empty());
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+// vim: ts=4 sw=4 et
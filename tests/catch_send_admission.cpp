@@ -0,0 +1,172 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/send_admission.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+
+// the waiting peers expire after twice their retry delay (at least
+// 200ms here), these tests do not wait that long
+//
+CATCH_TEST_CASE("send_admission", "[send_admission]")
+{
+    CATCH_START_SECTION("send_admission: free slots go to the peers turned away first")
+    {
+        rfs_daemon::send_admission admission(2, 4, 100);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("a", retry));
+        CATCH_REQUIRE(admission.admit("b", retry));
+        CATCH_REQUIRE(admission.get_active() == 2);
+
+        CATCH_REQUIRE_FALSE(admission.admit("c", retry));
+        CATCH_REQUIRE(retry == 100);
+        CATCH_REQUIRE_FALSE(admission.admit("d", retry));
+        CATCH_REQUIRE(admission.get_waiting() == 2);
+
+        // one slot frees up, it is reserved for "c"
+        //
+        admission.release("a");
+        CATCH_REQUIRE(admission.get_active() == 1);
+        CATCH_REQUIRE_FALSE(admission.admit("d", retry));
+        CATCH_REQUIRE_FALSE(admission.admit("e", retry));
+        CATCH_REQUIRE(admission.get_waiting() == 3);
+
+        CATCH_REQUIRE(admission.admit("c", retry));
+        CATCH_REQUIRE(admission.get_waiting() == 2);
+
+        // next in line is "d", not "e"
+        //
+        admission.release("b");
+        CATCH_REQUIRE_FALSE(admission.admit("e", retry));
+        CATCH_REQUIRE(admission.admit("d", retry));
+        CATCH_REQUIRE(admission.get_waiting() == 1);
+
+        admission.release("c");
+        CATCH_REQUIRE(admission.admit("e", retry));
+        CATCH_REQUIRE(admission.get_waiting() == 0);
+        CATCH_REQUIRE(admission.get_active() == 2);
+
+        CATCH_REQUIRE(admission.get_statistics().f_admitted == 5);
+        CATCH_REQUIRE(admission.get_statistics().f_rejected == 5);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("send_admission: per peer limit")
+    {
+        rfs_daemon::send_admission admission(10, 2, 300);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("a", retry));
+        CATCH_REQUIRE(admission.admit("a", retry));
+        CATCH_REQUIRE_FALSE(admission.admit("a", retry));
+        CATCH_REQUIRE(retry == 300);
+
+        // a peer over its own limit does not reserve a global slot
+        //
+        CATCH_REQUIRE(admission.get_waiting() == 0);
+        CATCH_REQUIRE(admission.admit("b", retry));
+
+        admission.release("a");
+        CATCH_REQUIRE(admission.admit("a", retry));
+        CATCH_REQUIRE(admission.get_active() == 3);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("send_admission: retry delay grows with the position")
+    {
+        rfs_daemon::send_admission admission(1, 1, 100);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("busy", retry));
+
+        for(std::uint32_t idx(0); idx < 5; ++idx)
+        {
+            CATCH_REQUIRE_FALSE(admission.admit("p" + std::to_string(idx), retry));
+            CATCH_REQUIRE(retry == (idx + 1) * 100);
+        }
+        CATCH_REQUIRE(admission.get_waiting() == 5);
+
+        // a peer coming back keeps its place
+        //
+        CATCH_REQUIRE_FALSE(admission.admit("p2", retry));
+        CATCH_REQUIRE(retry == 300);
+        CATCH_REQUIRE(admission.get_waiting() == 5);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("send_admission: retry delay is capped")
+    {
+        rfs_daemon::send_admission admission(1, 1, 10'000);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("busy", retry));
+
+        std::uint32_t const expected[] = { 10'000, 20'000, 30'000, 30'000 };
+        for(std::size_t idx(0); idx < std::size(expected); ++idx)
+        {
+            CATCH_REQUIRE_FALSE(admission.admit("p" + std::to_string(idx), retry));
+            CATCH_REQUIRE(retry == expected[idx]);
+        }
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("send_admission: parameters are clamped")
+    {
+        rfs_daemon::send_admission admission(0, 0, 0);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("a", retry));
+        CATCH_REQUIRE_FALSE(admission.admit("b", retry));
+        CATCH_REQUIRE(retry == 1);
+
+        rfs_daemon::send_admission large(1, 1, 100'000);
+        CATCH_REQUIRE(large.admit("a", retry));
+        CATCH_REQUIRE_FALSE(large.admit("b", retry));
+        CATCH_REQUIRE(retry == rfs_daemon::send_admission::MAX_RETRY_AFTER_MSEC);
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("send_admission: release of an unknown peer")
+    {
+        rfs_daemon::send_admission admission(1, 1, 100);
+        std::uint32_t retry(0);
+
+        CATCH_REQUIRE(admission.admit("a", retry));
+        admission.release("b");
+        CATCH_REQUIRE(admission.get_active() == 1);
+        CATCH_REQUIRE_FALSE(admission.admit("b", retry));
+
+        admission.release("a");
+        admission.release("a");
+        CATCH_REQUIRE(admission.get_active() == 0);
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+// vim: ts=4 sw=4 et
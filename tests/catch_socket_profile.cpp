@@ -0,0 +1,145 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// daemon
+//
+#include    <daemon/socket_profile.h>
+
+
+// self
+//
+#include    "catch_main.h"
+
+
+// C
+//
+#include    <sys/socket.h>
+#include    <unistd.h>
+
+
+
+namespace
+{
+
+
+/** \brief Apply the profile to a new TCP socket.
+ *
+ * The profile fields are private, the report returned by apply()
+ * shows the values which were applied.
+ */
+std::string report(rfs_daemon::socket_profile const & profile)
+{
+    int const s(socket(AF_INET, SOCK_STREAM, 0));
+    CATCH_REQUIRE(s != -1);
+    std::string const result(profile.apply(s, rfs_daemon::link_class_t::LINK_CLASS_LAN));
+    close(s);
+    return result;
+}
+
+
+bool has(std::string const & report, std::string const & value)
+{
+    return (" " + report + " ").find(" " + value + " ") != std::string::npos;
+}
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("socket_profile_parse", "[socket_profile]")
+{
+    CATCH_START_SECTION("socket_profile_parse: valid definitions")
+    {
+        rfs_daemon::socket_profile profile;
+        CATCH_REQUIRE(profile.parse(""));
+        CATCH_REQUIRE_FALSE(profile.get_cork());
+
+        CATCH_REQUIRE(profile.parse("notsent_lowat=16384,keepalive=30,cork=true"));
+        CATCH_REQUIRE(profile.get_cork());
+
+        std::string const r(report(profile));
+        CATCH_REQUIRE(has(r, "profile=lan"));
+        CATCH_REQUIRE(has(r, "notsent_lowat=16384"));
+        CATCH_REQUIRE(has(r, "keepalive=30"));
+        CATCH_REQUIRE(has(r, "cork=true"));
+
+        CATCH_REQUIRE(profile.parse("cork=false"));
+        CATCH_REQUIRE_FALSE(profile.get_cork());
+
+        // zero means "system default"
+        //
+        CATCH_REQUIRE(profile.parse("send_buffer=0,receive_buffer=0,keepalive=0"));
+        CATCH_REQUIRE(has(report(profile), "keepalive=off"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("socket_profile_parse: unknown options")
+    {
+        rfs_daemon::socket_profile profile;
+        CATCH_REQUIRE_FALSE(profile.parse("sendbuffer=1024"));
+        CATCH_REQUIRE_FALSE(profile.parse("=1024"));
+        CATCH_REQUIRE_FALSE(profile.parse("Keepalive=30"));
+
+        // the valid options of the list are still applied
+        //
+        CATCH_REQUIRE_FALSE(profile.parse("keepalive=45,unknown=1,cork=true"));
+        CATCH_REQUIRE(profile.get_cork());
+        CATCH_REQUIRE(has(report(profile), "keepalive=45"));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("socket_profile_parse: invalid numbers")
+    {
+        std::string const invalid[] =
+        {
+            "send_buffer",
+            "send_buffer=",
+            "receive_buffer=-1",
+            "notsent_lowat=abc",
+            "notsent_lowat=12k",
+            "notsent_lowat=1.5",
+            "keepalive=2147483648",
+            "keepalive=99999999999999999999",
+        };
+
+        for(auto const & definition : invalid)
+        {
+            rfs_daemon::socket_profile profile;
+            CATCH_REQUIRE(profile.parse("notsent_lowat=8192,keepalive=20"));
+            CATCH_REQUIRE_FALSE(profile.parse(definition));
+
+            // an invalid value does not change the previous one
+            //
+            std::string const r(report(profile));
+            CATCH_REQUIRE(has(r, "notsent_lowat=8192"));
+            CATCH_REQUIRE(has(r, "keepalive=20"));
+        }
+
+        // the largest accepted value
+        //
+        rfs_daemon::socket_profile profile;
+        CATCH_REQUIRE(profile.parse("keepalive=2147483647"));
+    }
+    CATCH_END_SECTION()
+}
+
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,453 @@
+// Copyright (c) 2019-2024  Made to Order Software Corp.  All Rights Reserved
+//
+// https://snapwebsites.org/project/snaprfs
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Measure the cost of committing small files.
+ *
+ * The daemon commits each received file with the system calls required
+ * by the durability of its path (see commit_queue.cpp). This tool writes
+ * N small files in a directory with each of those durability modes and
+ * prints the cost per file, which helps choose the durability and the
+ * group_commit_ms parameters on a given filesystem.
+ *
+ * The modes are:
+ *
+ * * none -- write and rename, no sync.
+ * * data -- fdatasync(2) each file before the rename.
+ * * full -- fsync(2) each file and its directory after the rename.
+ * * syncfs -- one syncfs(2) per batch of files, as the daemon does when
+ *   a group commit includes SYNCFS_THRESHOLD files or more.
+ */
+
+// snaprfs
+//
+#include    <snaprfs/version.h>
+
+
+// advgetopt
+//
+#include    <advgetopt/advgetopt.h>
+#include    <advgetopt/exception.h>
+#include    <advgetopt/options.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+#include    <snapdev/stringize.h>
+#include    <snapdev/timespec_ex.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <iostream>
+#include    <vector>
+
+
+// C
+//
+#include    <fcntl.h>
+#include    <string.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+namespace
+{
+
+
+advgetopt::option const g_options[] =
+{
+    advgetopt::define_option(
+          advgetopt::Name("batch")
+        , advgetopt::ShortName('b')
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+                    , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of files committed with one syncfs() call in the \"syncfs\" mode.")
+        , advgetopt::DefaultValue("64")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("count")
+        , advgetopt::ShortName('n')
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+                    , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("number of files to commit with each mode.")
+        , advgetopt::DefaultValue("1000")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("size")
+        , advgetopt::ShortName('s')
+        , advgetopt::Flags(advgetopt::all_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_OPTIONS
+                    , advgetopt::GETOPT_FLAG_REQUIRED>())
+        , advgetopt::Help("size of each file in bytes.")
+        , advgetopt::DefaultValue("1024")
+    ),
+    advgetopt::define_option(
+          advgetopt::Name("--")
+        , advgetopt::Flags(advgetopt::command_flags<
+                      advgetopt::GETOPT_FLAG_GROUP_COMMANDS
+                    , advgetopt::GETOPT_FLAG_DEFAULT_OPTION>())
+    ),
+    advgetopt::end_options()
+};
+
+advgetopt::group_description const g_group_descriptions[] =
+{
+    advgetopt::define_group(
+          advgetopt::GroupNumber(advgetopt::GETOPT_FLAG_GROUP_COMMANDS)
+        , advgetopt::GroupName("command")
+        , advgetopt::GroupDescription("Commands:")
+    ),
+    advgetopt::define_group(
+          advgetopt::GroupNumber(advgetopt::GETOPT_FLAG_GROUP_OPTIONS)
+        , advgetopt::GroupName("option")
+        , advgetopt::GroupDescription("Options:")
+    ),
+    advgetopt::end_groups()
+};
+
+// until we have C++20, remove warnings this way
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+advgetopt::options_environment const g_options_environment =
+{
+    .f_project_name = "snaprfs",
+    .f_group_name = nullptr,
+    .f_options = g_options,
+    .f_options_files_directory = nullptr,
+    .f_environment_variable_name = nullptr,
+    .f_environment_variable_intro = nullptr,
+    .f_section_variables_name = nullptr,
+    .f_configuration_files = nullptr,
+    .f_configuration_filename = nullptr,
+    .f_configuration_directories = nullptr,
+    .f_environment_flags = 0,
+    .f_help_header = "Usage: %p [--<opt>] <directory>\n"
+                     "Commit small files in <directory> with each durability mode and\n"
+                     "print the cost per file.\n"
+                     "\n"
+                     "where --<opt> is one or more of:",
+    .f_help_footer = "%c",
+    .f_version = SNAPRFS_VERSION_STRING,
+    .f_license = "GNU GPL v2",
+    .f_copyright = "Copyright (c) 2020-"
+                   SNAPDEV_STRINGIZE(UTC_BUILD_YEAR)
+                   " by Made to Order Software Corporation -- All Rights Reserved",
+    .f_build_date = UTC_BUILD_DATE,
+    .f_build_time = UTC_BUILD_TIME,
+    .f_groups = g_group_descriptions
+};
+#pragma GCC diagnostic pop
+
+
+
+enum class bench_mode_t
+{
+    BENCH_MODE_NONE,
+    BENCH_MODE_DATA,
+    BENCH_MODE_FULL,
+    BENCH_MODE_SYNCFS,
+};
+
+
+struct pending_file
+{
+    snapdev::raii_fd_t  f_fd = snapdev::raii_fd_t();
+    std::string         f_temp = std::string();
+    std::string         f_final = std::string();
+};
+
+
+class commit_bench
+{
+public:
+                        commit_bench(int argc, char * argv[]);
+
+    int                 run();
+
+private:
+    bool                bench(char const * name, bench_mode_t mode);
+    bool                write_file(std::string const & dir, std::size_t idx, pending_file & file);
+    bool                publish(pending_file & file, int dir_fd, bench_mode_t mode);
+    void                cleanup(std::string const & dir);
+    bool                failed(char const * what, std::string const & filename);
+
+    advgetopt::getopt   f_opts;
+    std::string         f_directory = std::string();
+    std::size_t         f_count = 0;
+    std::size_t         f_batch = 0;
+    std::vector<char>   f_data = std::vector<char>();
+};
+
+
+commit_bench::commit_bench(int argc, char * argv[])
+    : f_opts(g_options_environment)
+{
+    f_opts.finish_parsing(argc, argv);
+}
+
+
+int commit_bench::run()
+{
+    if(!f_opts.is_defined("--"))
+    {
+        std::cerr << "error: the <directory> parameter is missing; try --help for more info."
+                  << std::endl;
+        return 1;
+    }
+    f_directory = f_opts.get_string("--");
+    f_count = static_cast<std::size_t>(std::max(1L, f_opts.get_long("count")));
+    f_batch = static_cast<std::size_t>(std::max(1L, f_opts.get_long("batch")));
+    f_data.resize(static_cast<std::size_t>(std::max(0L, f_opts.get_long("size"))), 'x');
+
+    if(!bench("none", bench_mode_t::BENCH_MODE_NONE)
+    || !bench("data", bench_mode_t::BENCH_MODE_DATA)
+    || !bench("full", bench_mode_t::BENCH_MODE_FULL)
+    || !bench("syncfs", bench_mode_t::BENCH_MODE_SYNCFS))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/** \brief Commit f_count files with one durability mode.
+ *
+ * The files are written in a sub-directory of the specified directory
+ * which gets removed once done.
+ *
+ * \param[in] name  The name of the mode, used to name the sub-directory
+ * and in the output.
+ * \param[in] mode  The durability mode to test.
+ *
+ * \return true if all the files were committed.
+ */
+bool commit_bench::bench(char const * name, bench_mode_t mode)
+{
+    std::string const dir(f_directory + "/commit-bench-" + name);
+    if(mkdir(dir.c_str(), 0755) != 0
+    && errno != EEXIST)
+    {
+        return failed("create directory", dir);
+    }
+    snapdev::raii_fd_t dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(dir_fd == nullptr)
+    {
+        return failed("open directory", dir);
+    }
+
+    bool result(true);
+    std::uint64_t sync_calls(0);
+    snapdev::timespec_ex const start(snapdev::timespec_ex::gettime(CLOCK_MONOTONIC));
+    std::vector<pending_file> batch;
+    for(std::size_t idx(0); idx < f_count && result; ++idx)
+    {
+        pending_file file;
+        if(!write_file(dir, idx, file))
+        {
+            result = false;
+            break;
+        }
+
+        if(mode != bench_mode_t::BENCH_MODE_SYNCFS)
+        {
+            if(mode != bench_mode_t::BENCH_MODE_NONE)
+            {
+                sync_calls += mode == bench_mode_t::BENCH_MODE_FULL ? 2 : 1;
+            }
+            result = publish(file, dir_fd.get(), mode);
+            continue;
+        }
+
+        batch.push_back(std::move(file));
+        if(batch.size() >= f_batch
+        || idx + 1 == f_count)
+        {
+            ++sync_calls;
+            if(syncfs(batch[0].f_fd.get()) != 0)
+            {
+                result = failed("syncfs", batch[0].f_temp);
+                break;
+            }
+            for(auto & f : batch)
+            {
+                if(!publish(f, dir_fd.get(), mode))
+                {
+                    result = false;
+                    break;
+                }
+            }
+            batch.clear();
+        }
+    }
+    std::int64_t const duration((snapdev::timespec_ex::gettime(CLOCK_MONOTONIC) - start).to_usec());
+
+    cleanup(dir);
+
+    if(result)
+    {
+        std::cout << name
+                  << ": "
+                  << f_count
+                  << " files of "
+                  << f_data.size()
+                  << " bytes with "
+                  << sync_calls
+                  << " sync calls in "
+                  << duration
+                  << " usec ("
+                  << duration / static_cast<std::int64_t>(f_count)
+                  << " usec per file)."
+                  << std::endl;
+    }
+
+    return result;
+}
+
+
+bool commit_bench::write_file(std::string const & dir, std::size_t idx, pending_file & file)
+{
+    file.f_final = dir + "/file-" + std::to_string(idx);
+    file.f_temp = file.f_final + ".part";
+    file.f_fd.reset(open(file.f_temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if(file.f_fd == nullptr)
+    {
+        return failed("create", file.f_temp);
+    }
+    if(!f_data.empty()
+    && write(file.f_fd.get(), f_data.data(), f_data.size()) != static_cast<ssize_t>(f_data.size()))
+    {
+        return failed("write", file.f_temp);
+    }
+    return true;
+}
+
+
+/** \brief Sync (if required by \p mode) and rename the file in place.
+ *
+ * \param[in] file  The file to publish.
+ * \param[in] dir_fd  The directory holding the file.
+ * \param[in] mode  The durability mode being tested.
+ *
+ * \return true if the file was published.
+ */
+bool commit_bench::publish(pending_file & file, int dir_fd, bench_mode_t mode)
+{
+    switch(mode)
+    {
+    case bench_mode_t::BENCH_MODE_DATA:
+        if(fdatasync(file.f_fd.get()) != 0)
+        {
+            return failed("fdatasync", file.f_temp);
+        }
+        break;
+
+    case bench_mode_t::BENCH_MODE_FULL:
+        if(fsync(file.f_fd.get()) != 0)
+        {
+            return failed("fsync", file.f_temp);
+        }
+        break;
+
+    case bench_mode_t::BENCH_MODE_NONE:
+    case bench_mode_t::BENCH_MODE_SYNCFS:
+        break;
+
+    }
+
+    file.f_fd.reset();
+    if(rename(file.f_temp.c_str(), file.f_final.c_str()) != 0)
+    {
+        return failed("rename", file.f_temp);
+    }
+
+    if(mode == bench_mode_t::BENCH_MODE_FULL
+    && fsync(dir_fd) != 0)
+    {
+        return failed("fsync directory of", file.f_final);
+    }
+
+    return true;
+}
+
+
+void commit_bench::cleanup(std::string const & dir)
+{
+    for(std::size_t idx(0); idx < f_count; ++idx)
+    {
+        std::string const filename(dir + "/file-" + std::to_string(idx));
+        unlink(filename.c_str());
+        unlink((filename + ".part").c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+
+bool commit_bench::failed(char const * what, std::string const & filename)
+{
+    int const e(errno);
+    std::cerr << "error: could not "
+              << what
+              << " \""
+              << filename
+              << "\" (errno: "
+              << e
+              << ", "
+              << strerror(e)
+              << ")."
+              << std::endl;
+    return false;
+}
+
+
+
+
+}
+// no name namespace
+
+
+int main(int argc, char * argv[])
+{
+    try
+    {
+        commit_bench bench(argc, argv);
+        return bench.run();
+    }
+    catch(advgetopt::getopt_exit const &)
+    {
+        return 1;
+    }
+    catch(std::exception const & e)
+    {
+        std::cerr << "error: an exception occurred: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+// vim: ts=4 sw=4 et